@@ -1,115 +1,25 @@
 #include "MathParser.h"
+#include "MathParserFunctions.h"
+#include "MathParserInstrument.h"
+#include "MathParserLexer.h"
+#include "MathParserOperators.h"
+#include "MathParserSpecialized.h"
 
 #include "common/math.h" // common::math::degrees_to_radians
-#include "common/utils.h" // IMPLEMENT_STD_HASH_FOR_ENUM_CLASS
 
-#include <algorithm> // transform
+#include <algorithm> // std::max
 #include <cassert>
 #include <cmath> // std::isnan, std::cos/sin/tan/etc.
+#include <clocale> // std::localeconv
 #include <cstdio>
-#include <locale>
-#include <regex>
-#include <stack>
-#include <unordered_map>
+#include <cstdlib> // std::strtod
+#include <vector>
 
-namespace MathParser {
-
-  struct Operator {
-    enum class Associativity {
-      NONE = 0,
-      LEFT,
-      RIGHT,
-    };
-
-    enum class Type {
-      NONE = 0,
-      ADD,
-      COSINE,
-      COSECANT,
-      COTANGENT,
-      DIVIDE,
-      E,
-      EXPONENT,
-      MULTIPLY,
-      PAREN_L,
-      PAREN_R,
-      PERCENTAGE,
-      PI,
-      SECANT,
-      SINE,
-      SUBTRACT,
-      TANGENT,
-      TAU,
-      TIMES,
-      UNARY_MINUS,
-      UNARY_PLUS,
-    };
-
-    static const Operator &from_type(Operator::Type type);
-    EvaluationErrorType eval(std::stack<double> &values, Config config, double current_value = std::numeric_limits<double>::quiet_NaN()) const;
-    static const Operator &null_operator();
-
-    Type type;
-    Associativity associativity;
-    int precedence;
-    int degree;
-    const char *name;
-
-  private:
-    EvaluationErrorType evalBinary(const double &a, const double &b, double &result) const;
-  };
-
-  struct Token {
-    enum class Type {
-      NONE = 0,
-      NUMBER,
-      OPERATOR,
-    };
-
-    enum class Id {
-      NONE = 0,
-      ASTERISK,
-      CARET,
-      COS,
-      COT,
-      CSC,
-      E,
-      MINUS,
-      PAREN_L,
-      PAREN_R,
-      PERCENT,
-      PI,
-      PLUS,
-      SEC,
-      SIN,
-      SLASH,
-      TAN,
-      TAU,
-      X,
-    };
-
-    Token(const std::string &string, bool left_is_edge = false);
-    static const Token &null_token();
-
-    std::string string;
-    size_t position = 0;
-    Id id = {};
-    Type type = {};
-    const Operator &op;
-    double value = NAN;
-
-  private:
-    static const Id string_to_id(const std::string &string);
-    static const Operator &id_to_operator(Id id, bool left_is_edge = false);
-    static const Type id_to_type(Id);
-    Token();
-  };
-
-} // namespace MathParser
-
-
-IMPLEMENT_STD_HASH_FOR_ENUM_CLASS(MathParser::Operator::Type);
-IMPLEMENT_STD_HASH_FOR_ENUM_CLASS(MathParser::Token::Id);
+#if defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv> // std::from_chars
+#endif
+#endif
 
 namespace MathParser {
 
@@ -119,89 +29,70 @@ namespace MathParser {
   double csc(double d) { return 1.0 / std::sin(d); }
   double sec(double d) { return 1.0 / std::cos(d); }
 
+  // Trigonometric functions indexed by Operator::Type, null for every other operator.
+  static constexpr unary_function_pointer UNARY_FUNCTIONS[] = {
+    nullptr,   // NONE
+    nullptr,   // ADD
+    &std::cos, // COSINE
+    &csc,      // COSECANT
+    &cot,      // COTANGENT
+    nullptr,   // DIVIDE
+    nullptr,   // E
+    nullptr,   // EXPONENT
+    nullptr,   // MULTIPLY
+    nullptr,   // NUMBER
+    nullptr,   // PAREN_L
+    nullptr,   // PAREN_R
+    nullptr,   // PERCENTAGE
+    nullptr,   // PI
+    &sec,      // SECANT
+    &std::sin, // SINE
+    nullptr,   // SUBTRACT
+    &std::tan, // TANGENT
+    nullptr,   // TAU
+    nullptr,   // TIMES
+    nullptr,   // UNARY_MINUS
+    nullptr,   // UNARY_PLUS
+    nullptr,   // VARIABLE
+    nullptr,   // FUNCTION
+  };
+
+  static_assert(sizeof(UNARY_FUNCTIONS) / sizeof(UNARY_FUNCTIONS[0]) == OPERATOR_COUNT, "UNARY_FUNCTIONS must cover every Operator::Type");
+
   static unary_function_pointer unary_operator_function(Operator::Type type) {
-    static std::unordered_map<Operator::Type, unary_function_pointer> unary_functions = {
-      { Operator::Type::COSECANT, &csc },
-      { Operator::Type::COSINE, &cos },
-      { Operator::Type::COTANGENT, &cot },
-      { Operator::Type::SECANT, &sec },
-      { Operator::Type::SINE, &sin },
-      { Operator::Type::TANGENT, &tan },
-    };
-    return unary_functions[type];
+    return UNARY_FUNCTIONS[static_cast<size_t>(type)];
   }
 
   const Operator &Operator::null_operator() {
-    static Operator NULL_OPERATOR = { Operator::Type::NONE, Operator::Associativity::NONE, -1 };
-    return NULL_OPERATOR;
-  }
-
-  static std::unordered_map<Operator::Type, const Operator> &init_operator_map() {
-    static std::unordered_map<Operator::Type, const Operator> map;
-    static bool initialized;
-    if (!initialized) {
-      initialized = true;
-      static std::vector<Operator> operators = {
-        { Operator::Type::PAREN_L,     Operator::Associativity::NONE,    0, 0, "("   },
-        { Operator::Type::PAREN_R,     Operator::Associativity::NONE,    0, 0, ")"   },
-
-        { Operator::Type::ADD,         Operator::Associativity::LEFT,   10, 2, "add" },
-        { Operator::Type::SUBTRACT,    Operator::Associativity::LEFT,   10, 2, "sub" },
-
-        { Operator::Type::DIVIDE,      Operator::Associativity::LEFT,   20, 2, "div" },
-        { Operator::Type::MULTIPLY,    Operator::Associativity::LEFT,   20, 2, "mul" },
-
-        { Operator::Type::PERCENTAGE,  Operator::Associativity::LEFT,   30, 1, "%" },
-        { Operator::Type::TIMES,       Operator::Associativity::LEFT,   30, 1, "x" },
-
-        { Operator::Type::COSECANT,    Operator::Associativity::RIGHT,  40, 1, "csc" },
-        { Operator::Type::COSINE,      Operator::Associativity::RIGHT,  40, 1, "cos" },
-        { Operator::Type::COTANGENT,   Operator::Associativity::RIGHT,  40, 1, "cot" },
-        { Operator::Type::SECANT,      Operator::Associativity::RIGHT,  40, 1, "sec" },
-        { Operator::Type::SINE,        Operator::Associativity::RIGHT,  40, 1, "sin" },
-        { Operator::Type::TANGENT,     Operator::Associativity::RIGHT,  40, 1, "tan" },
-
-        { Operator::Type::EXPONENT,    Operator::Associativity::RIGHT,  90, 2, "exp" },
-
-        { Operator::Type::UNARY_MINUS, Operator::Associativity::RIGHT, 100, 1, "neg" },
-        { Operator::Type::UNARY_PLUS,  Operator::Associativity::RIGHT, 100, 1, "pos" },
-
-        { Operator::Type::E,           Operator::Associativity::LEFT,  200, 0, "e"   },
-        { Operator::Type::PI,          Operator::Associativity::LEFT,  200, 0, "pi"  },
-        { Operator::Type::TAU,         Operator::Associativity::LEFT,  200, 0, "tau"  },
-      };
-      for (const Operator &op : operators) {
-        map.insert(std::make_pair(op.type, op));
-      }
-    }
-    return map;
+    return OPERATORS[static_cast<size_t>(Operator::Type::NONE)];
   }
 
   const Operator &Operator::from_type(Operator::Type type) {
-    static std::unordered_map<Operator::Type, const Operator> _operator_map = init_operator_map();
-    auto it = _operator_map.find(type);
-    return it == _operator_map.end() ? null_operator() : it->second;
+    size_t index = static_cast<size_t>(type);
+    return index < OPERATOR_COUNT ? OPERATORS[index] : null_operator();
   }
 
-  EvaluationErrorType Operator::eval(std::stack<double> &values, Config config, double current_value) const {
+  EvaluationErrorType Operator::eval(double *values, size_t &size, const Config &config, double current_value) const {
     // Check if we have enough arguments for the operator type.
-    if (values.size() < degree) {
+    if (size < static_cast<size_t>(degree)) {
       return EvaluationErrorType::EXPECTED_MORE_ARGUMENTS;
     }
 
-    static const double DEG_TO_RAD = common::math::degrees_to_radians<double>();
+    static constexpr double DEG_TO_RAD = common::math::degrees_to_radians<double>();
 
     switch (type) {
+      case Type::FUNCTION: // Calls go through the program's FunctionRegistry.
       case Type::NONE:
+      case Type::NUMBER: // Literals and variables are pushed by the program, not evaluated.
       case Type::PAREN_L:
       case Type::PAREN_R:
+      case Type::VARIABLE:
         return EvaluationErrorType::UNEXPECTED_TOKEN;
 
         // Handle constants.
-      case Type::E: values.push(common::math::e<double>()); break;
-      case Type::PI: values.push(common::math::pi<double>()); break;
-      case Type::TAU: values.push(common::math::tau<double>()); break;
-        break;
+      case Type::E: values[size++] = common::math::e<double>(); break;
+      case Type::PI: values[size++] = common::math::pi<double>(); break;
+      case Type::TAU: values[size++] = common::math::tau<double>(); break;
 
 
       case Type::COSECANT:
@@ -215,8 +106,7 @@ namespace MathParser {
       case Type::UNARY_MINUS:
       case Type::UNARY_PLUS: {
         // Handle unary operators.
-        double value = values.top();
-        values.pop();
+        double value = values[size - 1];
         switch(type) {
           default:
             return EvaluationErrorType::UNEXPECTED_TOKEN;
@@ -250,96 +140,152 @@ namespace MathParser {
           case Type::UNARY_MINUS: value *= -1.0; break;
           case Type::UNARY_PLUS:  /* no-op */    break;
         }
-        values.push(value);
+        values[size - 1] = value;
         break;
       }
 
       case Type::ADD:
       case Type::DIVIDE:
       case Type::EXPONENT:
-      case Type::MULTIPLY:       case Type::SUBTRACT: {
+      case Type::MULTIPLY:
+      case Type::SUBTRACT: {
         // Handle binary operators.
-        double b = std::move(values.top());
-        values.pop();
-        double a = std::move(values.top());
-        values.pop();
+        double b = values[size - 1];
+        double a = values[size - 2];
+        double &result = values[size - 2];
         switch(type) {
           default:
             return EvaluationErrorType::UNEXPECTED_TOKEN;
-          case Type::ADD:      values.push(a + b); break;
-          case Type::SUBTRACT: values.push(a - b); break;
+          case Type::ADD:      result = a + b; break;
+          case Type::SUBTRACT: result = a - b; break;
           case Type::DIVIDE:
             if (b == 0.0) {
               return EvaluationErrorType::DIVIDE_BY_ZERO;
             }
-            values.push(a / b);
+            result = a / b;
             break;
-          case Type::MULTIPLY: values.push(a * b); break;
+          case Type::MULTIPLY: result = a * b; break;
           case Type::EXPONENT: {
             double d;
             if (a < 0 && std::modf(b, &d) > 0) {
               return EvaluationErrorType::IMAGINARY_NUMBER;
             } else {
-              values.push(std::pow(a, b));
+              result = std::pow(a, b);
             }
             break;
           }
         }
+        --size;
       }
     }
     return EvaluationErrorType::NONE;
   }
 
-  const Token &Token::null_token() {
-    static Token NULL_TOKEN = { };
-    return NULL_TOKEN;
+  // Powers of ten that are exact doubles.
+  static const double EXACT_POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+
+  // Converts a number slice matched by the scanner, \d*[.]?\d+(e[+\-]?\d+)?, in place and regardless of the C locale.
+  // Most literals have a significand below 2^53 and a decimal exponent within 22, which converts exactly with one
+  // multiplication or division (Clinger's fast path). The rest go through std::from_chars where the library has it.
+  static double parse_number(const char *string, size_t length) {
+    const char *end = string + length;
+    const char *p = string;
+    uint64_t significand = 0;
+    int digits = 0; // Significant digits, which are exact in significand up to 19.
+    int exponent = 0;
+    for (; p < end && is_digit(*p); ++p) {
+      if (significand == 0 && *p == '0') continue;
+      if (digits < 19) significand = significand * 10 + static_cast<uint64_t>(*p - '0'); else ++exponent;
+      ++digits;
+    }
+    if (p < end && *p == '.') {
+      for (++p; p < end && is_digit(*p); ++p) {
+        if (significand == 0 && *p == '0') {
+          --exponent;
+          continue;
+        }
+        if (digits < 19) {
+          significand = significand * 10 + static_cast<uint64_t>(*p - '0');
+          --exponent;
+        }
+        ++digits;
+      }
+    }
+    int written = 0;
+    bool negative = false;
+    if (p < end) {
+      ++p; // 'e' or 'E'
+      negative = *p == '-';
+      if (*p == '+' || *p == '-') ++p;
+      for (; p < end; ++p) {
+        if (written < 100000) written = written * 10 + (*p - '0');
+      }
+    }
+    exponent += negative ? -written : written;
+
+    if (significand == 0) {
+      return 0.0;
+    }
+    if (digits <= 19 && significand <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+      const double value = static_cast<double>(significand);
+      return exponent < 0 ? value / EXACT_POWERS_OF_TEN[-exponent] : value * EXACT_POWERS_OF_TEN[exponent];
+    }
+
+#if defined(__cpp_lib_to_chars)
+    double value = 0.0;
+    const std::from_chars_result result = std::from_chars(string, end, value);
+    if (result.ec == std::errc::result_out_of_range) {
+      // Left unset on overflow and underflow, where atof gives infinity or zero.
+      return exponent + digits > 0 ? HUGE_VAL : 0.0;
+    }
+    return value;
+#else
+    // strtod reads the decimal point of the C locale, so the literal is copied with that point.
+    char buffer[64];
+    std::string long_literal;
+    char *copy = buffer;
+    if (length >= sizeof(buffer)) {
+      long_literal.resize(length + 8);
+      copy = &long_literal[0];
+    }
+    const char *point = std::localeconv()->decimal_point;
+    size_t size = 0;
+    for (const char *c = string; c < end; ++c) {
+      if (*c == '.') {
+        for (const char *d = point; *d; ++d) copy[size++] = *d;
+      } else {
+        copy[size++] = *c;
+      }
+    }
+    copy[size] = '\0';
+    return std::strtod(copy, nullptr);
+#endif
   }
 
-  Token::Token(const std::string &string_, bool left_is_edge)
-  : string(string_)
-  , id(string_to_id(string_))
-  , type(id == Id::NONE ? Type::NUMBER : Type::OPERATOR)
-  , op(id_to_operator(id, left_is_edge))
+  Token::Token(const char *string_, size_t length_, Id id_, uint32_t slot_, bool left_is_edge, const FunctionRegistry *functions)
+  : length(length_)
+  , id(id_)
+  , type(id == Id::NONE ? Type::NUMBER : id == Id::VARIABLE ? Type::VARIABLE : id == Id::COMMA ? Type::SEPARATOR : Type::OPERATOR)
+  , op(id == Id::FUNCTION && functions ? (*functions)[slot_].op : id_to_operator(id, left_is_edge))
+  , slot(slot_)
   {
-    if (type == Type::NUMBER) value = atof(string.c_str());
-  }
-
-  Token::Token() : string(""), id(Id::NONE), type(Type::NONE), op(Operator::null_operator()) { }
-
-  const Token::Id Token::string_to_id(const std::string &string) {
-    static const std::unordered_map<std::string, Token::Id> map = {
-      { "%",   Token::Id::PERCENT },
-      { "(",   Token::Id::PAREN_L },
-      { ")",   Token::Id::PAREN_R },
-      { "*",   Token::Id::ASTERISK },
-      { "+",   Token::Id::PLUS },
-      { "-",   Token::Id::MINUS },
-      { "/",   Token::Id::SLASH },
-      { "^",   Token::Id::CARET },
-      { "cos", Token::Id::COS },
-      { "cot", Token::Id::COT },
-      { "csc", Token::Id::CSC },
-      { "e",   Token::Id::E },
-      { "pi",  Token::Id::PI },
-      { "sec", Token::Id::SEC },
-      { "sin", Token::Id::SIN },
-      { "tan", Token::Id::TAN },
-      { "tau", Token::Id::TAU },
-      { "x",   Token::Id::X },
-    };
-    auto it = map.find(string);
-    return (it == map.end()) ? Token::Id::NONE : it->second;
+    if (type == Type::NUMBER) value = parse_number(string_, length_);
   }
 
   const Operator &Token::id_to_operator(Id id, bool left_is_edge) {
-    Operator::Type type;
+    Operator::Type type = Operator::Type::NONE;
     switch(id) {
       case Id::ASTERISK: type = Operator::Type::MULTIPLY;   break;
       case Id::CARET:    type = Operator::Type::EXPONENT;   break;
+      case Id::COMMA:    type = Operator::Type::NONE;       break;
       case Id::CSC:      type = Operator::Type::COSECANT;   break;
       case Id::COS:      type = Operator::Type::COSINE;     break;
       case Id::COT:      type = Operator::Type::COTANGENT;  break;
       case Id::E:        type = Operator::Type::E;          break;
+      case Id::FUNCTION: type = Operator::Type::FUNCTION;   break;
       case Id::NONE:     type = Operator::Type::NONE;       break;
       case Id::PAREN_L:  type = Operator::Type::PAREN_L;    break;
       case Id::PAREN_R:  type = Operator::Type::PAREN_R;    break;
@@ -350,6 +296,7 @@ namespace MathParser {
       case Id::SLASH:    type = Operator::Type::DIVIDE;     break;
       case Id::TAN:      type = Operator::Type::TANGENT;    break;
       case Id::TAU:      type = Operator::Type::TAU;        break;
+      case Id::VARIABLE: type = Operator::Type::VARIABLE;   break;
       case Id::X:        type = Operator::Type::TIMES;      break;
 
         // Differentiate between unary and binary operators.
@@ -363,7 +310,7 @@ namespace MathParser {
   : status(Status::PARSING_ERROR)
   , parsing_error(parsing_error_)
   , evaluation_error(EvaluationErrorType::NONE)
-  , filtered_expression(filtered_expression_)
+  , filtered_expression(std::move(filtered_expression_))
   , error_position(error_position_)
   , error_length(error_length_)
   {
@@ -373,7 +320,7 @@ namespace MathParser {
   : status(Status::EVALUATION_ERROR)
   , parsing_error(ParsingErrorType::NONE)
   , evaluation_error(evaluation_error_)
-  , filtered_expression(filtered_expression_)
+  , filtered_expression(std::move(filtered_expression_))
   , error_position(error_position_)
   , error_length(error_length_)
   {
@@ -390,60 +337,314 @@ namespace MathParser {
   {
   }
 
+  // Single-pass scanner over the raw expression.
+  // Compresses whitespace, converts to lower case, and splits the input into tokens in one linear walk.
+  // Accepts the same grammar as the previous regular expression based validation:
+  //   (?:\d*[.]?\d+)(?:e[+\-]?\d+)?|[()+\-*\/^%x,]|cos|sin|tan|cot|csc|sec|e|pi|tau|\s+
+  // plus the names of the configured variables and functions. Positions are offsets into the filtered (compressed, lower case) expression.
+  struct Lexeme {
+    size_t position;
+    size_t length;
+    Token::Id id;  // NONE for numbers.
+    uint32_t slot; // Index into Config::variables, for Token::Id::VARIABLE, or Config::functions, for Token::Id::FUNCTION.
+  };
+
+  // Returns the slot of the variable named by the identifier [s, s + length), or -1. Compares case insensitively.
+  static int32_t find_variable(const char *s, size_t length, const std::vector<std::string> &variables) {
+    for (size_t slot = 0; slot < variables.size(); ++slot) {
+      const std::string &name = variables[slot];
+      if (name.size() != length) continue;
+      size_t i = 0;
+      while (i < length && to_lower(name[i]) == to_lower(s[i])) ++i;
+      if (i == length) return static_cast<int32_t>(slot);
+    }
+    return -1;
+  }
+
+  size_t match_token(const char *s, size_t size, size_t index, const std::vector<std::string> &variables, const FunctionRegistry *functions, Token::Id &id, uint32_t &slot) {
+    auto at = [&](size_t i) { return i < size ? to_lower(s[i]) : '\0'; };
+    // Matches the rest of a keyword whose first character has already been checked.
+    auto keyword = [&](const char *rest, size_t length, Token::Id keyword_id) -> size_t {
+      for (size_t i = 0; i < length; ++i) {
+        if (at(index + 1 + i) != rest[i]) return 0;
+      }
+      id = keyword_id;
+      return length + 1;
+    };
+
+    // Number: \d*[.]?\d+ followed by optional exponent e[+\-]?\d+
+    char c = at(index);
+    if (is_digit(c) || (c == '.' && is_digit(at(index + 1)))) {
+      size_t i = index;
+      while (is_digit(at(i))) ++i;
+      if (at(i) == '.' && is_digit(at(i + 1))) {
+        ++i;
+        while (is_digit(at(i))) ++i;
+      }
+      if (at(i) == 'e') {
+        size_t j = i + 1;
+        if (at(j) == '+' || at(j) == '-') ++j;
+        if (is_digit(at(j))) {
+          while (is_digit(at(j))) ++j;
+          i = j;
+        }
+      }
+      id = Token::Id::NONE;
+      return i - index;
+    }
+
+    // Variables and functions are whole identifiers, so with a variable named "a", neither "ab" nor "sina" contains it.
+    if ((!variables.empty() || functions) && ((c >= 'a' && c <= 'z') || c == '_') && (index == 0 || !is_identifier(at(index - 1)))) {
+      size_t length = 1;
+      while (is_identifier(at(index + length))) ++length;
+      int32_t found = find_variable(s + index, length, variables);
+      if (found >= 0) {
+        id = Token::Id::VARIABLE;
+        slot = static_cast<uint32_t>(found);
+        return length;
+      }
+      const uint32_t function = functions ? functions->find(s + index, length) : FunctionRegistry::NO_FUNCTION;
+      if (function != FunctionRegistry::NO_FUNCTION) {
+        id = Token::Id::FUNCTION;
+        slot = function;
+        return length;
+      }
+    }
+
+    switch (c) {
+      case '%': id = Token::Id::PERCENT;  return 1;
+      case '(': id = Token::Id::PAREN_L;  return 1;
+      case ')': id = Token::Id::PAREN_R;  return 1;
+      case '*': id = Token::Id::ASTERISK; return 1;
+      case '+': id = Token::Id::PLUS;     return 1;
+      case ',': id = Token::Id::COMMA;    return functions ? 1 : 0; // Only separates arguments of calls.
+      case '-': id = Token::Id::MINUS;    return 1;
+      case '/': id = Token::Id::SLASH;    return 1;
+      case '^': id = Token::Id::CARET;    return 1;
+      case 'e': id = Token::Id::E;        return 1;
+      case 'x': id = Token::Id::X;        return 1;
+
+      case 'c':
+        if (at(index + 1) == 's') return keyword("sc", 2, Token::Id::CSC);
+        if (at(index + 2) == 's') return keyword("os", 2, Token::Id::COS);
+        return keyword("ot", 2, Token::Id::COT);
+      case 'p':
+        return keyword("i", 1, Token::Id::PI);
+      case 's':
+        if (at(index + 1) == 'i') return keyword("in", 2, Token::Id::SIN);
+        return keyword("ec", 2, Token::Id::SEC);
+      case 't':
+        if (at(index + 2) == 'n') return keyword("an", 2, Token::Id::TAN);
+        return keyword("au", 2, Token::Id::TAU);
+
+      default:
+        return 0;
+    }
+  }
+
+  // Returns false if an unrecognized run of characters is found, reporting the first such run.
+  // The filtered expression is always fully populated so it can be returned with any error.
+  // Filters the whole expression first, a block at a time, then matches tokens over the filtered text, where every
+  // run of whitespace is a single space. Tokens never contain whitespace, so they are the same as over the raw text.
+  static bool scan(const char *expression, size_t size, const Config &config, std::string &filtered, std::vector<Lexeme> &lexemes, size_t &error_position, size_t &error_length) {
+    lexemes.clear();
+    // With an invalid byte the expression is an error, so tokens only need matching up to the first failure.
+    const bool has_invalid = filter_expression(expression, size, filtered) != std::string::npos;
+
+    const char *text = filtered.data();
+    const size_t length = filtered.size();
+    size_t i = 0;
+    while (i < length) {
+      if (text[i] == ' ') {
+        ++i;
+        continue;
+      }
+
+      Token::Id id = Token::Id::NONE;
+      uint32_t slot = 0;
+      const size_t matched = match_token(text, length, i, config.variables, config.functions.get(), id, slot);
+      if (matched == 0) {
+        // The error runs until whitespace or a character that starts a token.
+        error_position = i;
+        error_length = 1;
+        while (i + error_length < length && text[i + error_length] != ' ' && match_token(text, length, i + error_length, config.variables, config.functions.get(), id, slot) == 0) {
+          ++error_length;
+        }
+        return false;
+      }
+      if (!has_invalid) lexemes.push_back({ i, matched, id, slot });
+      i += matched;
+    }
+    return true;
+  }
+
+  void normalize_expression(const std::string &expression, std::string &normalized) {
+    filter_expression(expression.data(), expression.size(), normalized);
+  }
+
+  Program::Program()
+  : _compile_result(ParsingErrorType::EMPTY)
+  {
+  }
+
+  bool Program::uses_current_value() const {
+    for (const Instruction &instruction : _instructions) {
+      if (instruction.type == Operator::Type::PERCENTAGE || instruction.type == Operator::Type::TIMES) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Program::uses_variables() const {
+    for (const Instruction &instruction : _instructions) {
+      if (instruction.type == Operator::Type::VARIABLE) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Program::uses_functions() const {
+    for (const Instruction &instruction : _instructions) {
+      if (instruction.type == Operator::Type::FUNCTION) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Program::is_specialized() const {
+    return _specialization && _specialization->ready.load(std::memory_order_acquire) != nullptr;
+  }
+
+  // Buffers reused across compilations so steady state parsing does not allocate.
+  // Value produced by the instructions starting at begin, tracked while optimizing.
+  struct Operand {
+    size_t begin;
+    bool constant; // Folded into a single NUMBER instruction.
+  };
+
+  // Paren group open while parsing. The parens right after a function hold its arguments, separated by commas.
+  struct Group {
+    size_t depth;     // Depth of the value stack at the open paren.
+    size_t arity;     // Arguments of the call, or 0 for parens that are not a call.
+    size_t arguments; // Arguments ended by a comma so far.
+  };
+
+  struct CompileStorage {
+    std::vector<Lexeme> lexemes;
+    std::vector<Token> operators;
+    std::vector<Group> groups;
+    std::vector<Operand> operands;
+  };
+
+  struct Compiler {
+    static void compile(const char *expression, size_t size, const Config &config, Program &program, CompileStorage &storage, bool copy_filtered);
+    static void parse(const char *expression, size_t size, const Config &config, Program &program, CompileStorage &storage, bool copy_filtered);
+    static void optimize(Program &program, CompileStorage &storage);
+    static void enable_specialization(Program &program) {
+      if (program.is_valid()) program._specialization = std::make_shared<Program::Specialization>();
+    }
+  };
+
   // Uses Edsger Dijkstra's "shunting-yard" algorithm to parse math expression.
   // https://en.wikipedia.org/wiki/Shunting-yard_algorithm
   // Expects expression to be formatted with infix notation.
-  // Converts into postfix notation and evaluates in place.
-  Result evaluate_expression(const std::string &expression, double current_value, Config config) {
-    static const std::regex pattern_number_or_operator_or_spaces(R"((?:\d*[.]?\d+)(?:e[+\-]?\d+)?|(?:[()+\-*\/^%x])|(?:(?:cos)|(?:sin)|(?:tan))|(?:cot)|(?:csc)|(?:sec)|e|(?:pi)|(?:tau)|(?:\s+))");
-    static const std::regex pattern_number_or_operator          (R"((?:\d*[.]?\d+)(?:e[+\-]?\d+)?|(?:[()+\-*\/^%x])|(?:(?:cos)|(?:sin)|(?:tan))|(?:cot)|(?:csc)|(?:sec)|e|(?:pi)|(?:tau))");
-    static const std::regex spaces(R"(\s+)");
+  // Converts into postfix notation, tracking stack depth so operator arity is verified without evaluating.
+  // Reuses the program's buffers. Errors only carry a copy of the filtered expression if copy_filtered is set.
+  void Compiler::parse(const char *expression, size_t size, const Config &config, Program &program, CompileStorage &storage, bool copy_filtered) {
+    program._config = config;
+    program._compile_result = { NAN };
+    program._max_stack_depth = 0;
+    program._specialization.reset();
+
+    std::string &input = program._filtered_expression;
+    std::vector<Lexeme> &lexemes = storage.lexemes;
+    size_t error_position = 0;
+    size_t error_length = 0;
+    bool valid = false;
+    {
+      MATH_PARSER_TIME_STAGE(scan_timer, Stage::SCAN);
+      valid = scan(expression, size, config, input, lexemes, error_position, error_length);
+    }
+    MATH_PARSER_TIME_STAGE(parse_timer, Stage::PARSE);
+
+    auto filtered = [&]() { return copy_filtered ? std::string(input) : std::string(); };
 
-    // Compress whitespace.
-    std::string input = std::regex_replace(expression, spaces, " ");
+    std::vector<Program::Instruction> &instructions = program._instructions;
+    std::vector<Program::Location> &locations = program._locations;
+    instructions.clear();
+    locations.clear();
+    if (!valid) {
+      program._compile_result = { ParsingErrorType::SYNTAX_ERROR, filtered(), error_position, error_length };
+      return;
+    }
+    instructions.reserve(lexemes.size());
+    locations.reserve(lexemes.size());
 
-    // Convert to lower case.
-    std::string lower_case(input);
-    std::transform(lower_case.begin(), lower_case.end(), lower_case.begin(), ::tolower);
-    input = std::move(lower_case);
+    // Depth of the value stack at this point in the program.
+    size_t depth = 0;
 
-    // Verify input by matching against valid operators, numbers, or spaces.
-    std::sregex_token_iterator it(input.begin(), input.end(), pattern_number_or_operator_or_spaces, -1), end;
-    while (it != end) {
-      size_t length = it->length();
-      if (length > 0) {
-        size_t position = &(*it->first) - input.c_str();
-        return { ParsingErrorType::SYNTAX_ERROR, std::move(input), position, length };
+    // Appends an instruction, reporting errors at the location of the token that caused it to be emitted.
+    auto emit = [&](const Operator &op, double value, size_t position, size_t length, uint32_t slot = 0) {
+      if (depth < static_cast<size_t>(op.degree)) {
+        program._compile_result = { EvaluationErrorType::EXPECTED_MORE_ARGUMENTS, filtered(), position, length };
+        return false;
       }
-      ++it;
-    }
+      depth = depth - op.degree + 1;
+      program._max_stack_depth = std::max(program._max_stack_depth, depth);
+      instructions.push_back({ op.type, slot, value });
+      locations.push_back({ position, length });
+      return true;
+    };
+
+    auto fail = [&](ParsingErrorType error, size_t position, size_t length = 0) {
+      program._compile_result = { error, filtered(), position, length };
+    };
 
     // Info about prior token to disambiguate unary vs binary operators.
     // If the token to the left is the edge of a statement (i.e. left paren, operator, or no token).
     bool left_is_edge = true;
 
-    // Output value stack.
-    std::stack<double> output;
-
     // Operator stack.
-    std::stack<Token> stack;
+    std::vector<Token> &stack = storage.operators;
+    stack.clear();
 
-    // Tokenize into operators and numbers.
-    it = std::sregex_token_iterator(input.begin(), input.end(), pattern_number_or_operator, 0);
+    // Open parens, innermost last.
+    std::vector<Group> &groups = storage.groups;
+    groups.clear();
+
+    // Arity of the function just before the token, or 0. Calls of more than one argument must be followed by parens.
+    size_t call_arity = 0;
+    size_t call_position = 0;
+    size_t call_length = 0;
 
     // Algorithm starts.
     // https://en.wikipedia.org/wiki/Shunting-yard_algorithm#The_algorithm_in_detail
-    while(it != end) {
-      Token token(it->str(), left_is_edge);
-      size_t position = &(*it->first) - input.c_str();
+    for (const Lexeme &lexeme : lexemes) {
+      Token token(input.data() + lexeme.position, lexeme.length, lexeme.id, lexeme.slot, left_is_edge, config.functions.get());
+      size_t position = lexeme.position;
       token.position = position;
-      ++it;
 
-      left_is_edge = token.type == Token::Type::NONE || (token.type == Token::Type::OPERATOR && token.op.type != Operator::Type::PAREN_R);
+      left_is_edge = token.type == Token::Type::NONE || token.type == Token::Type::SEPARATOR || (token.type == Token::Type::OPERATOR && token.op.type != Operator::Type::PAREN_R);
+
+      const size_t arity = call_arity;
+      if (arity > 1 && token.op.type != Operator::Type::PAREN_L) {
+        return fail(ParsingErrorType::SYNTAX_ERROR, call_position, call_length);
+      }
+      call_arity = token.id == Token::Id::FUNCTION ? static_cast<size_t>(token.op.degree) : 0;
+      call_position = position;
+      call_length = token.length;
 
       switch(token.type) {
         case Token::Type::NUMBER: {
-          output.push(token.value);
+          emit(Operator::from_type(Operator::Type::NUMBER), token.value, position, token.length);
+          break;
+        }
+
+        case Token::Type::VARIABLE: {
+          emit(Operator::from_type(Operator::Type::VARIABLE), NAN, position, token.length, token.slot);
           break;
         }
 
@@ -451,44 +652,51 @@ namespace MathParser {
           switch(token.op.type) {
             default:
               while(!stack.empty()) {
-                Token &t = stack.top();
+                Token &t = stack.back();
                 assert(token.op.associativity != Operator::Associativity::NONE);
                 if ((token.op.associativity == Operator::Associativity::LEFT && token.op.precedence <= t.op.precedence) ||
                     (token.op.associativity == Operator::Associativity::RIGHT && token.op.precedence < t.op.precedence)) {
-                  EvaluationErrorType eval_error = stack.top().op.eval(output, config, current_value);
-                  if (eval_error != EvaluationErrorType::NONE) {
-                    return { eval_error, std::move(input), token.position, token.string.length() };
+                  if (!emit(t.op, NAN, token.position, token.length, t.slot)) {
+                    return;
                   }
-                  stack.pop();
+                  stack.pop_back();
                 }
                 else {
                   break;
                 }
               }
 
-              stack.push(std::move(token));
+              stack.push_back(token);
               break;
 
-            case Operator::Type::PAREN_L: stack.push(std::move(token)); break;
+            case Operator::Type::PAREN_L:
+              stack.push_back(token);
+              groups.push_back({ depth, arity, 0 });
+              break;
 
             case Operator::Type::PAREN_R:
               if (stack.empty()) {
-                return { ParsingErrorType::MISMATCHED_PARENS, std::move(input), position };
+                return fail(ParsingErrorType::MISMATCHED_PARENS, position);
               }
               while(!stack.empty()) {
-                if (stack.top().op.type == Operator::Type::PAREN_L) {
-                  stack.pop();
+                if (stack.back().op.type == Operator::Type::PAREN_L) {
+                  // A call's parens hold exactly its arguments, each one value.
+                  const Group &group = groups.back();
+                  if (group.arity > 0 && (group.arguments + 1 != group.arity || depth != group.depth + group.arity)) {
+                    return fail(ParsingErrorType::SYNTAX_ERROR, position);
+                  }
+                  groups.pop_back();
+                  stack.pop_back();
                   break;
                 } else {
-                  EvaluationErrorType eval_error = stack.top().op.eval(output, config, current_value);
-                  if (eval_error != EvaluationErrorType::NONE) {
-                    return { eval_error, std::move(input), token.position, token.string.length() };
+                  if (!emit(stack.back().op, NAN, token.position, token.length, stack.back().slot)) {
+                    return;
                   }
-                  stack.pop();
+                  stack.pop_back();
                 }
 
                 if (stack.empty()) {
-                  return { ParsingErrorType::MISMATCHED_PARENS, std::move(input), position };
+                  return fail(ParsingErrorType::MISMATCHED_PARENS, position);
                 }
               }
               break;
@@ -496,35 +704,450 @@ namespace MathParser {
           break;
         }
 
+        case Token::Type::SEPARATOR: {
+          // Ends an argument of a call, applying the operators in it, which must leave one more value on the stack.
+          while (!stack.empty() && stack.back().op.type != Operator::Type::PAREN_L) {
+            if (!emit(stack.back().op, NAN, token.position, token.length, stack.back().slot)) {
+              return;
+            }
+            stack.pop_back();
+          }
+          if (groups.empty() || ++groups.back().arguments >= groups.back().arity || depth != groups.back().depth + groups.back().arguments) {
+            return fail(ParsingErrorType::SYNTAX_ERROR, position, token.length);
+          }
+          break;
+        }
+
         case Token::Type::NONE:
-          // Should not get here since tokens have already been verified via regular expression.
-          return { EvaluationErrorType::UNEXPECTED_TOKEN, std::move(input), position };
+          // Should not get here since tokens have already been verified by the scanner.
+          program._compile_result = { EvaluationErrorType::UNEXPECTED_TOKEN, filtered(), position };
+          return;
       }
     }
 
+    if (call_arity > 1) {
+      return fail(ParsingErrorType::SYNTAX_ERROR, call_position, call_length);
+    }
+
     while (!stack.empty()) {
-      Token &token = stack.top();
-      if (token.op.type == Operator::Type::PAREN_L || token.op.type == Operator::Type::PAREN_L) {
-        return { ParsingErrorType::MISMATCHED_PARENS, std::move(input), 0 };
+      Token &token = stack.back();
+      if (token.op.type == Operator::Type::PAREN_L) {
+        return fail(ParsingErrorType::MISMATCHED_PARENS, 0);
       }
-      EvaluationErrorType eval_error = token.op.eval(output, config, current_value);
-      if (eval_error != EvaluationErrorType::NONE) {
-        return { eval_error, std::move(input), token.position, token.string.length() };
+      if (!emit(token.op, NAN, token.position, token.length, token.slot)) {
+        return;
       }
-      stack.pop();
+      stack.pop_back();
     }
 
-    if (output.size() == 0) {
+    if (depth == 0) {
+      program._compile_result = { ParsingErrorType::EMPTY };
+    } else if (depth > 1) {
+      program._compile_result = { ParsingErrorType::SYNTAX_ERROR };
+    }
+  }
+
+  void Compiler::compile(const char *expression, size_t size, const Config &config, Program &program, CompileStorage &storage, bool copy_filtered) {
+    parse(expression, size, config, program, storage, copy_filtered);
+    if (config.optimize && program.is_valid()) {
+      MATH_PARSER_TIME_STAGE(optimize_timer, Stage::OPTIMIZE);
+      optimize(program, storage);
+    }
+    MATH_PARSER_REPORT(compiled(storage.lexemes.size(), program._max_stack_depth, program._compile_result));
+  }
+
+  // Rewrites a valid program in place:
+  // - Operators whose operands are all constant are evaluated with Operator::eval and replaced by their result,
+  //   unless they fail, in which case they are kept so the error is still reported at run time at the same location.
+  //   Calls of pure functions with constant arguments are folded the same way.
+  // - Unary plus is dropped and pairs of unary minus cancel.
+  // Operations are never reordered, so results are bit for bit the same as the unoptimized program.
+  void Compiler::optimize(Program &program, CompileStorage &storage) {
+    std::vector<Program::Instruction> &instructions = program._instructions;
+    std::vector<Program::Location> &locations = program._locations;
+    std::vector<Operand> &operands = storage.operands;
+    operands.clear();
+
+    size_t out = 0;
+    auto write = [&](const Program::Instruction &instruction, const Program::Location &location) {
+      instructions[out] = instruction;
+      locations[out] = location;
+      ++out;
+    };
+
+    for (size_t i = 0, count = instructions.size(); i < count; ++i) {
+      const Program::Instruction instruction = instructions[i];
+      const Program::Location location = locations[i];
+      const Operator &op = instruction_operator(instruction, program._config);
+      const size_t degree = static_cast<size_t>(op.degree);
+      Operand *arguments = operands.data() + operands.size() - degree;
+
+      if (instruction.type == Operator::Type::NUMBER) {
+        write(instruction, location);
+        operands.push_back({ out - 1, true });
+        continue;
+      }
+
+      if (instruction.type == Operator::Type::UNARY_PLUS) {
+        continue;
+      }
+
+      if (instruction.type == Operator::Type::UNARY_MINUS && !arguments[0].constant && instructions[out - 1].type == Operator::Type::UNARY_MINUS) {
+        --out;
+        continue;
+      }
+
+      bool constant = instruction.type != Operator::Type::PERCENTAGE && instruction.type != Operator::Type::TIMES && instruction.type != Operator::Type::VARIABLE &&
+                      (instruction.type != Operator::Type::FUNCTION || (*program._config.functions)[instruction.slot].pure);
+      for (size_t j = 0; j < degree; ++j) {
+        constant = constant && arguments[j].constant;
+      }
+
+      size_t begin = degree > 0 ? arguments[0].begin : out;
+      if (constant) {
+        double values[FunctionRegistry::MAX_ARITY];
+        size_t size = degree;
+        for (size_t j = 0; j < degree; ++j) {
+          values[j] = instructions[arguments[j].begin].value;
+        }
+        const EvaluationErrorType error = instruction.type == Operator::Type::FUNCTION ? program._config.functions->call(instruction.slot, values, size)
+                                                                                      : op.eval(values, size, program._config);
+        if (error == EvaluationErrorType::NONE) {
+          out = begin;
+          operands.resize(operands.size() - degree);
+          write({ Operator::Type::NUMBER, 0, values[0] }, location);
+          operands.push_back({ begin, true });
+          continue;
+        }
+      }
+
+      write(instruction, location);
+      operands.resize(operands.size() - degree);
+      operands.push_back({ begin, false });
+    }
+    instructions.resize(out);
+    locations.resize(out);
+
+    // Folding only ever lowers the stack depth.
+    size_t depth = 0;
+    program._max_stack_depth = 0;
+    for (const Program::Instruction &instruction : instructions) {
+      depth = depth - instruction_operator(instruction, program._config).degree + 1;
+      program._max_stack_depth = std::max(program._max_stack_depth, depth);
+    }
+  }
+
+  Program compile(const std::string &expression, Config config) {
+    Program program;
+    CompileStorage storage;
+    Compiler::compile(expression.data(), expression.size(), config, program, storage, true);
+    Compiler::enable_specialization(program);
+    return program;
+  }
+
+  // Stack held inline up to Program::INLINE_STACK_DEPTH entries, moving to the heap past that.
+  template<typename T>
+  class InlineStack {
+  public:
+    void push(const T &value) {
+      if (_size == _capacity) {
+        if (_heap.empty()) _heap.assign(_inline, _inline + _size);
+        _capacity *= 2;
+        _heap.resize(_capacity);
+        _data = _heap.data();
+      }
+      _data[_size++] = value;
+    }
+    void pop() { --_size; }
+    T &back() { return _data[_size - 1]; }
+    bool empty() const { return _size == 0; }
+
+  private:
+    T _inline[Program::INLINE_STACK_DEPTH];
+    std::vector<T> _heap;
+    T *_data = _inline;
+    size_t _capacity = Program::INLINE_STACK_DEPTH;
+    size_t _size = 0;
+  };
+
+  // Open paren of a call, told apart from other parens on the operator stack so only calls need a Group.
+  static constexpr Operator CALL_PAREN = { Operator::Type::PAREN_L, Operator::Associativity::NONE, 0, 0, "(" };
+
+  // Mirrors Compiler::parse() in one pass over the raw expression, keeping only the operator stack, the open calls and
+  // the depth of the value stack. Scan errors anywhere take precedence over parse errors, as they do in compile(), so
+  // once parsing fails the rest of the input is only scanned.
+  CompactResult validate(const char *expression, size_t size, const Config &config) {
+    const Operator *inline_stack[Program::INLINE_STACK_DEPTH];
+    std::vector<const Operator *> heap_stack;
+    const Operator **stack = inline_stack;
+    size_t capacity = Program::INLINE_STACK_DEPTH;
+    size_t top = 0;
+    auto push = [&](const Operator &op) {
+      if (top == capacity) {
+        if (heap_stack.empty()) heap_stack.assign(inline_stack, inline_stack + top);
+        capacity *= 2;
+        heap_stack.resize(capacity);
+        stack = heap_stack.data();
+      }
+      stack[top++] = &op;
+    };
+    InlineStack<Group> calls;
+
+    CompactResult error(NAN);
+    size_t depth = 0;
+    auto emit = [&](const Operator &op) {
+      if (depth < static_cast<size_t>(op.degree)) {
+        error = { EvaluationErrorType::EXPECTED_MORE_ARGUMENTS, CompactResult::COMPILE_ERROR };
+        return false;
+      }
+      depth = depth - op.degree + 1;
+      return true;
+    };
+    auto syntax_error = [&]() {
+      error = { ParsingErrorType::SYNTAX_ERROR };
+      return false;
+    };
+
+    // Returns false once the expression is known to be invalid.
+    bool left_is_edge = true;
+    size_t call_arity = 0;
+    auto parse = [&](Token::Id id, uint32_t slot) {
+      const size_t arity = call_arity;
+      call_arity = 0;
+      if (arity > 1 && id != Token::Id::PAREN_L) {
+        return syntax_error();
+      }
+      if (id == Token::Id::NONE || id == Token::Id::VARIABLE) {
+        left_is_edge = false;
+        return emit(Operator::from_type(id == Token::Id::NONE ? Operator::Type::NUMBER : Operator::Type::VARIABLE));
+      }
+      if (id == Token::Id::COMMA) {
+        left_is_edge = true;
+        while (top > 0 && stack[top - 1]->type != Operator::Type::PAREN_L) {
+          if (!emit(*stack[top - 1])) return false;
+          --top;
+        }
+        if (top == 0 || stack[top - 1] != &CALL_PAREN || ++calls.back().arguments >= calls.back().arity || depth != calls.back().depth + calls.back().arguments) {
+          return syntax_error();
+        }
+        return true;
+      }
+      const Operator &op = id == Token::Id::FUNCTION ? (*config.functions)[slot].op : Token::id_to_operator(id, left_is_edge);
+      left_is_edge = op.type != Operator::Type::PAREN_R;
+      if (id == Token::Id::FUNCTION) {
+        call_arity = static_cast<size_t>(op.degree);
+      }
+      switch (op.type) {
+        default:
+          while (top > 0) {
+            const Operator &t = *stack[top - 1];
+            if ((op.associativity == Operator::Associativity::LEFT && op.precedence <= t.precedence) ||
+                (op.associativity == Operator::Associativity::RIGHT && op.precedence < t.precedence)) {
+              if (!emit(t)) return false;
+              --top;
+            } else {
+              break;
+            }
+          }
+          push(op);
+          return true;
+
+        case Operator::Type::PAREN_L:
+          if (arity > 0) {
+            push(CALL_PAREN);
+            calls.push({ depth, arity, 0 });
+          } else {
+            push(op);
+          }
+          return true;
+
+        case Operator::Type::PAREN_R:
+          while (top > 0 && stack[top - 1]->type != Operator::Type::PAREN_L) {
+            if (!emit(*stack[top - 1])) return false;
+            --top;
+          }
+          if (top == 0) {
+            error = { ParsingErrorType::MISMATCHED_PARENS };
+            return false;
+          }
+          if (stack[top - 1] == &CALL_PAREN) {
+            if (calls.back().arguments + 1 != calls.back().arity || depth != calls.back().depth + calls.back().arity) {
+              return syntax_error();
+            }
+            calls.pop();
+          }
+          --top;
+          return true;
+      }
+    };
+
+    // Bytes outside the grammar make any expression a syntax error, found a block at a time in long expressions.
+    if (size >= CLASSIFY_BLOCK && find_invalid(expression, size) != std::string::npos) {
+      return { ParsingErrorType::SYNTAX_ERROR };
+    }
+
+    bool parsing = true;
+    size_t i = 0;
+    while (i < size) {
+      if (is_space(expression[i])) {
+        ++i;
+        continue;
+      }
+      Token::Id id = Token::Id::NONE;
+      uint32_t slot = 0;
+      const size_t length = match_token(expression, size, i, config.variables, config.functions.get(), id, slot);
+      if (length == 0) {
+        return { ParsingErrorType::SYNTAX_ERROR };
+      }
+      if (parsing) parsing = parse(id, slot);
+      i += length;
+    }
+    if (!parsing) {
+      return error;
+    }
+    if (call_arity > 1) {
+      return { ParsingErrorType::SYNTAX_ERROR };
+    }
+
+    for (; top > 0; --top) {
+      if (stack[top - 1]->type == Operator::Type::PAREN_L) {
+        return { ParsingErrorType::MISMATCHED_PARENS };
+      }
+      if (!emit(*stack[top - 1])) {
+        return error;
+      }
+    }
+
+    if (depth == 0) {
       return { ParsingErrorType::EMPTY };
-    } else if (output.size() == 1) {
-      return { output.top() };
-    } else {
+    } else if (depth > 1) {
       return { ParsingErrorType::SYNTAX_ERROR };
     }
+    return error;
+  }
+
+  CompactResult validate(const std::string &expression, const Config &config) {
+    return validate(expression.data(), expression.size(), config);
+  }
+
+  Result Program::evaluate(double current_value) const {
+    return evaluate(nullptr, current_value);
+  }
+
+  Result Program::evaluate(const double *variables, double current_value) const {
+    return diagnose(evaluate_compact(variables, current_value));
+  }
+
+  CompactResult Program::evaluate_compact(double current_value) const {
+    return evaluate_compact(nullptr, current_value);
+  }
+
+  CompactResult Program::evaluate_compact(const double *variables, double current_value) const {
+    if (_max_stack_depth <= INLINE_STACK_DEPTH) {
+      double stack[INLINE_STACK_DEPTH];
+      return evaluate_compact(stack, variables, current_value);
+    }
+    std::vector<double> stack(_max_stack_depth);
+    return evaluate_compact(stack.data(), variables, current_value);
+  }
+
+  CompactResult Program::evaluate_compact(double *stack, const double *variables, double current_value) const {
+    MATH_PARSER_TIME_STAGE(evaluate_timer, Stage::EVALUATE);
+    if (!is_valid()) {
+      if (_compile_result.status == Status::PARSING_ERROR) {
+        return { _compile_result.parsing_error };
+      }
+      return { _compile_result.evaluation_error, CompactResult::COMPILE_ERROR };
+    }
+
+    size_t size = 0;
+    for (size_t i = 0, count = _instructions.size(); i < count; ++i) {
+      const Instruction &instruction = _instructions[i];
+      if (instruction.type == Operator::Type::NUMBER) {
+        stack[size++] = instruction.value;
+        continue;
+      }
+      EvaluationErrorType eval_error = EvaluationErrorType::NONE;
+      if (instruction.type == Operator::Type::VARIABLE) {
+        if (variables) {
+          stack[size++] = variables[instruction.slot];
+          continue;
+        }
+        eval_error = EvaluationErrorType::EXPECTED_VARIABLE;
+      } else if (instruction.type == Operator::Type::FUNCTION) {
+        eval_error = _config.functions->call(instruction.slot, stack, size);
+      } else {
+        eval_error = Operator::from_type(instruction.type).eval(stack, size, _config, current_value);
+      }
+      if (eval_error != EvaluationErrorType::NONE) {
+        MATH_PARSER_REPORT(evaluation_failed(eval_error));
+        return { eval_error, static_cast<uint32_t>(i) };
+      }
+    }
+    return { stack[0] };
+  }
+
+  Result Program::diagnose(const CompactResult &result, bool copy_filtered) const {
+    if (result.ok()) {
+      return { result.value };
+    }
+    if (result.instruction() >= _locations.size()) {
+      return _compile_result;
+    }
+    const Location &location = _locations[result.instruction()];
+    return { result.evaluation_error(), copy_filtered ? std::string(_filtered_expression) : std::string(), location.position, location.length };
+  }
+
+  struct Scratch::Storage {
+    Program program;
+    CompileStorage compile;
+    std::vector<double> values;
+  };
+
+  Scratch::Scratch() : _storage(new Storage()) { }
+
+  Scratch::~Scratch() { }
+
+  const std::string &Scratch::filtered_expression() const {
+    return _storage->program.filtered_expression();
+  }
+
+  const Program &Scratch::program() const {
+    return _storage->program;
+  }
+
+  Result evaluate_expression(const std::string &expression, Scratch &scratch, double current_value, const Config &config) {
+    return evaluate_expression(expression.data(), expression.size(), scratch, current_value, config);
+  }
+
+  Result evaluate_expression(const char *expression, size_t length, Scratch &scratch, double current_value, const Config &config) {
+    CompactResult result = evaluate_compact(expression, length, scratch, current_value, config);
+    return scratch._storage->program.diagnose(result, false);
+  }
+
+  CompactResult evaluate_compact(const std::string &expression, Scratch &scratch, double current_value, const Config &config) {
+    return evaluate_compact(expression.data(), expression.size(), scratch, current_value, config);
+  }
+
+  CompactResult evaluate_compact(const char *expression, size_t length, Scratch &scratch, double current_value, const Config &config) {
+    Scratch::Storage &storage = *scratch._storage;
+    Compiler::compile(expression, length, config, storage.program, storage.compile, false);
+    if (storage.values.size() < storage.program.max_stack_depth()) {
+      storage.values.resize(storage.program.max_stack_depth());
+    }
+    return storage.program.evaluate_compact(storage.values.data(), nullptr, current_value);
+  }
+
+  Result evaluate_expression(const std::string &expression, double current_value, Config config) {
+    // Evaluated once and thrown away, so the program is never batched and needs no Specialization.
+    Program program;
+    CompileStorage storage;
+    Compiler::compile(expression.data(), expression.size(), config, program, storage, true);
+    return program.evaluate(current_value);
   }
-  
+
   Result evaluate_expression(const std::string &expression, Config config, double current_value) {
     return evaluate_expression(expression, current_value, config);
   }
-  
+
 } // namespace MathParser
@@ -2,9 +2,15 @@
 #ifndef MATH_PARSER_H_
 #define MATH_PARSER_H_
 
-#include <climits> // std::numerical_limis::quiet_NaN()
+#include <cstdint>
+#include <limits> // std::numeric_limits::quiet_NaN()
+#include <memory>
 #include <string>
+#include <vector>
 
+// Thread safety: compile(), evaluate_expression(), evaluate_batch() and Program::evaluate() may be called from any
+// number of threads at once. The operator and function tables they share are constant initialized and never written,
+// so concurrent callers neither race nor contend on shared cache lines. Only Scratch is per thread.
 namespace MathParser {
 
   enum class Status {
@@ -20,6 +26,7 @@ namespace MathParser {
     SYNTAX_ERROR,
   };
 
+  // Values are stored by ProgramArchive and index InstrumentationStats, so new types go at the end.
   enum class EvaluationErrorType {
     NONE = 0,
     DIVIDE_BY_ZERO,
@@ -27,11 +34,43 @@ namespace MathParser {
     EXPECTED_MORE_ARGUMENTS,
     IMAGINARY_NUMBER,
     UNEXPECTED_TOKEN,
+    EXPECTED_VARIABLE,
+    CIRCULAR_REFERENCE,
+  };
+
+  class FunctionRegistry;
+
+  // Arithmetic of evaluate_batch() over float columns.
+  enum class Precision {
+    DOUBLE = 0, // Lanes are widened and evaluated as doubles, then rounded once: float storage, double accuracy.
+    SINGLE,     // Lanes are evaluated in float throughout, with twice the lanes per vector and half the memory traffic.
   };
 
   struct Config {
     bool use_degrees = true;
-    Config(bool use_degrees_ = true) : use_degrees(use_degrees_) { }
+    bool optimize = true; // Fold constant subexpressions and redundant signs when compiling.
+
+    // Batch evaluation computes trig functions with the C library, bit for bit what Program::evaluate() returns.
+    // When false, evaluate_batch() uses the vectorized kernels of MathParserTrig.h instead, which are several times
+    // faster and within a few ulp (see there for the bounds). Scalar evaluation and constant folding always use the
+    // C library.
+    bool strict_trig = true;
+
+    // Precision of evaluate_batch() on float columns. Evaluation over doubles, scalar or batch, is unaffected.
+    Precision precision = Precision::DOUBLE;
+
+    // Names the expression may use as inputs besides x, bound to slots in order: name i reads variables[i] of the
+    // frame passed to Program::evaluate() and column i of evaluate_batch(). Names are identifiers ([a-z_][a-z0-9_]*),
+    // matched case insensitively against whole words, and take precedence over the built in keywords and constants.
+    // A word starts at the beginning of the expression or after a character outside [a-z0-9_]: with a variable named
+    // a, "a", "2 * a" and "(a)" read it, while "ab", "sina" and "2a" do not.
+    std::vector<std::string> variables;
+
+    // Functions the expression may call besides the built in ones, e.g. log or clamp; see MathParserFunctions.h.
+    // Function names are matched like variable names, after them and before the built in keywords.
+    std::shared_ptr<const FunctionRegistry> functions;
+
+    Config(bool use_degrees_ = true, bool optimize_ = true) : use_degrees(use_degrees_), optimize(optimize_) { }
   };
 
   struct Result {
@@ -48,6 +87,243 @@ namespace MathParser {
     Result(EvaluationErrorType, std::string &&filtered_expression = "", size_t error_position = 0, size_t error_length = 0);
   };
 
+  // Result of the fast path: the value or the kind of error, in 16 bytes and without touching the heap.
+  // Where an error happened is left to Program::diagnose(), which builds the full Result only when asked.
+  class CompactResult {
+  public:
+    // Instruction of an evaluation error found while compiling instead of while running.
+    static const uint32_t COMPILE_ERROR = 0xffffffffu;
+
+    CompactResult(double value_) : value(value_), _status(static_cast<uint8_t>(Status::SUCCESS)), _error(0), _instruction(0) { }
+    CompactResult(ParsingErrorType error)
+    : value(std::numeric_limits<double>::quiet_NaN()), _status(static_cast<uint8_t>(Status::PARSING_ERROR)), _error(static_cast<uint8_t>(error)), _instruction(COMPILE_ERROR) { }
+    CompactResult(EvaluationErrorType error, uint32_t instruction)
+    : value(std::numeric_limits<double>::quiet_NaN()), _status(static_cast<uint8_t>(Status::EVALUATION_ERROR)), _error(static_cast<uint8_t>(error)), _instruction(instruction) { }
+
+    double value; // NaN unless status() is Status::SUCCESS.
+
+    Status status() const { return static_cast<Status>(_status); }
+    bool ok() const { return status() == Status::SUCCESS; }
+    ParsingErrorType parsing_error() const { return status() == Status::PARSING_ERROR ? static_cast<ParsingErrorType>(_error) : ParsingErrorType::NONE; }
+    EvaluationErrorType evaluation_error() const { return status() == Status::EVALUATION_ERROR ? static_cast<EvaluationErrorType>(_error) : EvaluationErrorType::NONE; }
+
+    // Index of the failing instruction, or COMPILE_ERROR.
+    uint32_t instruction() const { return _instruction; }
+
+  private:
+    uint8_t _status;
+    uint8_t _error;
+    uint32_t _instruction;
+  };
+
+  static_assert(sizeof(CompactResult) == 16, "CompactResult must stay two words");
+
+  struct Operator {
+    enum class Associativity {
+      NONE = 0,
+      LEFT,
+      RIGHT,
+    };
+
+    enum class Type {
+      NONE = 0,
+      ADD,
+      COSINE,
+      COSECANT,
+      COTANGENT,
+      DIVIDE,
+      E,
+      EXPONENT,
+      MULTIPLY,
+      NUMBER,
+      PAREN_L,
+      PAREN_R,
+      PERCENTAGE,
+      PI,
+      SECANT,
+      SINE,
+      SUBTRACT,
+      TANGENT,
+      TAU,
+      TIMES,
+      UNARY_MINUS,
+      UNARY_PLUS,
+      VARIABLE,
+      FUNCTION, // Call of a registered function, whose own Operator gives its arity and precedence.
+    };
+
+    static const Operator &from_type(Operator::Type type);
+    static const Operator &null_operator();
+
+    // Applies the operator to the top of the value stack, which holds size values, in place.
+    EvaluationErrorType eval(double *values, size_t &size, const Config &config, double current_value = std::numeric_limits<double>::quiet_NaN()) const;
+
+    Type type;
+    Associativity associativity;
+    int precedence;
+    int degree;
+    const char *name;
+  };
+
+  class Scratch;
+  struct Compiler;
+
+  // Expression compiled into postfix (reverse Polish) notation.
+  // Immutable once built by compile(), so a single program can be evaluated repeatedly and from multiple threads.
+  class Program {
+  public:
+    struct Instruction {
+      Operator::Type type;
+      uint32_t slot; // Variable pushed by Operator::Type::VARIABLE, or function called by Operator::Type::FUNCTION.
+      double value;  // Literal pushed by Operator::Type::NUMBER.
+    };
+
+    // Span of the filtered expression reported when an instruction fails.
+    struct Location {
+      size_t position;
+      size_t length;
+    };
+
+    // Programs deeper than this fall back to a heap allocated value stack when evaluated.
+    static const size_t INLINE_STACK_DEPTH = 64;
+
+    Program();
+
+    // Evaluates the program. Does not allocate on success unless max_stack_depth() exceeds INLINE_STACK_DEPTH.
+    Result evaluate(double current_value = std::numeric_limits<double>::quiet_NaN()) const;
+
+    // Evaluates the program reading variables from the frame, which holds variable_count() values indexed by slot.
+    // Programs that use variables fail with EvaluationErrorType::EXPECTED_VARIABLE when the frame is null.
+    Result evaluate(const double *variables, double current_value = std::numeric_limits<double>::quiet_NaN()) const;
+
+    // Fast path of evaluate(): same value and error kind, without building diagnostics.
+    CompactResult evaluate_compact(double current_value = std::numeric_limits<double>::quiet_NaN()) const;
+    CompactResult evaluate_compact(const double *variables, double current_value = std::numeric_limits<double>::quiet_NaN()) const;
+
+    // Full Result for a CompactResult returned by this program, with the error position, length and filtered expression
+    // evaluate() would have reported. Leaves the filtered expression empty unless copy_filtered is set, in which case errors allocate.
+    Result diagnose(const CompactResult &result, bool copy_filtered = true) const;
+
+    // Parsing or structural evaluation error found while compiling, or Status::SUCCESS.
+    const Result &compile_result() const { return _compile_result; }
+    bool is_valid() const { return _compile_result.status == Status::SUCCESS; }
+
+    const Config &config() const { return _config; }
+    const std::string &filtered_expression() const { return _filtered_expression; }
+    const std::vector<Instruction> &instructions() const { return _instructions; }
+    const std::vector<Location> &locations() const { return _locations; }
+    size_t max_stack_depth() const { return _max_stack_depth; }
+
+    // True if any instruction reads the current value (i.e. the expression uses x or %).
+    bool uses_current_value() const;
+
+    // Number of variable slots the frame must hold, i.e. config().variables.size().
+    size_t variable_count() const { return _config.variables.size(); }
+
+    // True if any instruction reads a variable.
+    bool uses_variables() const;
+
+    // True if any instruction calls a registered function.
+    bool uses_functions() const;
+
+    // True once evaluate_batch() has run enough lanes of this program to switch it to a SpecializedProgram.
+    // Only programs returned by compile() are specialized; copies share the switch.
+    bool is_specialized() const;
+
+  private:
+    friend struct Compiler;
+    friend class ArchivedProgram;
+    friend CompactResult evaluate_compact(const char *expression, size_t length, Scratch &scratch, double current_value, const Config &config);
+    friend Result evaluate_expression(const char *expression, size_t length, Scratch &scratch, double current_value, const Config &config);
+    friend size_t evaluate_batch(const Program &program, const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors);
+    friend size_t evaluate_batch(const Program &program, const float *const *variables, const float *in, float *out, size_t n, EvaluationErrorType *errors);
+
+    // Evaluation count and lazily built SpecializedProgram; see MathParserSpecialized.h.
+    struct Specialization;
+
+    CompactResult evaluate_compact(double *stack, const double *variables, double current_value) const;
+
+    Config _config;
+    Result _compile_result;
+    std::string _filtered_expression;
+    std::vector<Instruction> _instructions;
+    std::vector<Location> _locations;
+    std::shared_ptr<Specialization> _specialization;
+    size_t _max_stack_depth = 0;
+  };
+
+  // Compresses whitespace and converts to lower case, producing the filtered expression that compile() parses
+  // and that error positions refer to. Does not validate the expression.
+  void normalize_expression(const std::string &expression, std::string &normalized);
+
+  // Parses the expression once into a program that can be evaluated many times.
+  // Syntax, paren and operator arity errors are reported by Program::compile_result().
+  Program compile(const std::string &expression, Config config = { });
+
+  // Checks the expression the way compile() does, without building a program: the same tokens, paren matching and
+  // operator arity. Returns the status and error kind of compile(expression, config).compile_result(), with a NaN value
+  // on success. Error positions are left to compile(). Does not allocate unless parens nest deeper than
+  // Program::INLINE_STACK_DEPTH.
+  CompactResult validate(const char *expression, size_t length, const Config &config = { });
+  CompactResult validate(const std::string &expression, const Config &config = { });
+
+  // Caller owned storage for evaluating expressions without heap allocation.
+  // Buffers grow to fit the largest expression seen and are then reused, so steady state evaluations do not allocate.
+  // Not thread safe; use one per thread.
+  class Scratch {
+  public:
+    Scratch();
+    ~Scratch();
+
+    // Results from the scratch path do not copy the filtered expression; it is available here until the next evaluation.
+    const std::string &filtered_expression() const;
+
+    // Program compiled by the most recent evaluation.
+    const Program &program() const;
+
+  private:
+    friend CompactResult evaluate_compact(const char *expression, size_t length, Scratch &scratch, double current_value, const Config &config);
+    friend Result evaluate_expression(const char *expression, size_t length, Scratch &scratch, double current_value, const Config &config);
+
+    struct Storage;
+    std::unique_ptr<Storage> _storage;
+  };
+
+  // Evaluates the expression using scratch for all intermediate storage.
+  // Same results as evaluate_expression() except Result::filtered_expression is left empty; see Scratch::filtered_expression().
+  Result evaluate_expression(const std::string &expression, Scratch &scratch, double current_value = std::numeric_limits<double>::quiet_NaN(), const Config &config = { });
+
+  // Same as above for the expression [expression, expression + length), which need not be NUL terminated, so callers
+  // holding text in larger buffers (e.g. a line of a memory mapped file) need not copy it into a std::string.
+  Result evaluate_expression(const char *expression, size_t length, Scratch &scratch, double current_value = std::numeric_limits<double>::quiet_NaN(), const Config &config = { });
+
+  // Fast path of the Scratch overloads of evaluate_expression(). Until the next evaluation with scratch,
+  // scratch.program().diagnose(result) gives the Result evaluate_expression() would have returned.
+  CompactResult evaluate_compact(const std::string &expression, Scratch &scratch, double current_value = std::numeric_limits<double>::quiet_NaN(), const Config &config = { });
+  CompactResult evaluate_compact(const char *expression, size_t length, Scratch &scratch, double current_value = std::numeric_limits<double>::quiet_NaN(), const Config &config = { });
+
+  // Evaluates the program once per element of in, using each element as the current value, writing n results to out.
+  // Lanes that fail are set to NaN and, if errors is not null, report the same error the scalar evaluator would.
+  // Every lane of an invalid program fails. Returns the number of failed lanes.
+  // Hot programs are evaluated by a SpecializedProgram once they pass a lane threshold, with identical results.
+  size_t evaluate_batch(const Program &program, const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr);
+
+  // evaluate_batch() for programs with variables. variables holds program.variable_count() columns of n values each,
+  // one per slot, so lane i reads variables[slot][i]. Lanes reading a variable fail with EXPECTED_VARIABLE if it is null.
+  size_t evaluate_batch(const Program &program, const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr);
+
+  // evaluate_batch() over float columns, in the arithmetic of the program's Config::precision. With Precision::DOUBLE
+  // results are those of the double overloads rounded to float. With Precision::SINGLE literals are rounded to float
+  // and every operation is done in float by the interpreter, including trig with the float C library functions,
+  // so results can differ from the double ones by the float rounding of each step and overflow sooner.
+  // Errors are reported as by the double overloads.
+  size_t evaluate_batch(const Program &program, const float *in, float *out, size_t n, EvaluationErrorType *errors = nullptr);
+  size_t evaluate_batch(const Program &program, const float *const *variables, const float *in, float *out, size_t n, EvaluationErrorType *errors = nullptr);
+
+  // evaluate_batch() that always uses the interpreter. Reference for the specialized backend.
+  size_t evaluate_batch_interpreted(const Program &program, const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr);
+  size_t evaluate_batch_interpreted(const Program &program, const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr);
+
   Result evaluate_expression(const std::string &expression, Config config = { }, double current_value = std::numeric_limits<double>::quiet_NaN());
   Result evaluate_expression(const std::string &expression, double current_value, Config config = { });
 
@@ -0,0 +1,501 @@
+#include "MathParserArchive.h"
+
+#include "MathParserInstrument.h"
+#include "MathParserSpecialized.h" // Program::Specialization
+
+#include <algorithm> // std::max
+#include <cerrno>
+#include <cmath>   // NAN
+#include <cstdio>
+#include <cstring> // std::memcpy, std::memcmp, std::memchr
+#include <unordered_map>
+#include <utility>
+
+#if MATH_PARSER_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace MathParser {
+
+  static const char MAGIC[8] = { 'M', 'P', 'A', 'R', 'C', 'H', 'I', 'V' };
+  // Reads as 0x01020304 only in the byte order that wrote it.
+  static const uint32_t ENDIAN_MARKER = 0x01020304u;
+
+  struct ArchiveHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t program_count; // Followed by as many uint64_t offsets of the records, from the start of the archive.
+    uint64_t size;          // Of the whole archive, in bytes.
+  };
+
+  // Followed by the constants, instructions, locations, filtered expression and variable names, then padding to 8 bytes.
+  struct RecordHeader {
+    uint32_t instruction_count;
+    uint32_t constant_count;
+    uint32_t variable_count;
+    uint32_t max_stack_depth;
+    uint32_t filtered_length;
+    uint32_t names_length;
+    uint32_t error_position;
+    uint32_t error_length;
+    uint8_t status;
+    uint8_t parsing_error;
+    uint8_t evaluation_error;
+    uint8_t flags;
+    uint32_t reserved;
+  };
+
+  static_assert(sizeof(ArchiveHeader) == 32 && sizeof(RecordHeader) == 40, "archive headers must not be padded");
+
+  enum : uint8_t {
+    USE_DEGREES = 1 << 0,
+    OPTIMIZE = 1 << 1,
+    STRICT_TRIG = 1 << 2,
+    ERROR_FILTERED = 1 << 3, // The compile result carries the filtered expression.
+    SINGLE_PRECISION = 1 << 4,
+    KNOWN_FLAGS = (1 << 5) - 1,
+  };
+
+  static size_t padded(size_t size) {
+    return (size + 7) & ~size_t(7);
+  }
+
+  static void append(std::string &out, const void *data, size_t size) {
+    out.append(static_cast<const char *>(data), size);
+  }
+
+  // ProgramArchiveWriter.
+
+  bool ProgramArchiveWriter::add(const Program &program) {
+    const Result &compiled = program.compile_result();
+    const std::string &filtered = program.filtered_expression();
+    const std::vector<std::string> &variables = program.config().variables;
+    std::string names;
+    for (const std::string &name : variables) {
+      names += name;
+      names += '\0';
+    }
+    if (filtered.size() > UINT32_MAX || names.size() > UINT32_MAX || program.instructions().size() > UINT32_MAX || program.uses_functions()) {
+      return false;
+    }
+
+    // Only a valid program's instructions are ever run.
+    const bool valid = program.is_valid();
+    std::vector<double> constants;
+    std::vector<ArchivedProgram::Instruction> instructions;
+    std::vector<ArchivedProgram::Location> locations;
+    if (valid) {
+      std::unordered_map<uint64_t, uint32_t> pool; // Constant index by bit pattern, which keeps -0 and 0 apart.
+      for (const Program::Instruction &instruction : program.instructions()) {
+        ArchivedProgram::Instruction out = { static_cast<uint8_t>(instruction.type), { }, 0 };
+        if (instruction.type == Operator::Type::NUMBER) {
+          uint64_t bits;
+          std::memcpy(&bits, &instruction.value, sizeof(bits));
+          auto inserted = pool.emplace(bits, static_cast<uint32_t>(constants.size()));
+          if (inserted.second) constants.push_back(instruction.value);
+          out.operand = inserted.first->second;
+        } else if (instruction.type == Operator::Type::VARIABLE) {
+          out.operand = instruction.slot;
+        }
+        instructions.push_back(out);
+      }
+      for (const Program::Location &location : program.locations()) {
+        locations.push_back({ static_cast<uint32_t>(location.position), static_cast<uint32_t>(location.length) });
+      }
+    }
+
+    RecordHeader header = { };
+    header.instruction_count = static_cast<uint32_t>(instructions.size());
+    header.constant_count = static_cast<uint32_t>(constants.size());
+    header.variable_count = static_cast<uint32_t>(variables.size());
+    header.max_stack_depth = valid ? static_cast<uint32_t>(program.max_stack_depth()) : 0;
+    header.filtered_length = static_cast<uint32_t>(filtered.size());
+    header.names_length = static_cast<uint32_t>(names.size());
+    header.status = static_cast<uint8_t>(compiled.status);
+    header.parsing_error = static_cast<uint8_t>(compiled.parsing_error);
+    header.evaluation_error = static_cast<uint8_t>(compiled.evaluation_error);
+    const Config &config = program.config();
+    header.flags = (config.use_degrees ? USE_DEGREES : 0) | (config.optimize ? OPTIMIZE : 0) | (config.strict_trig ? STRICT_TRIG : 0)
+      | (config.precision == Precision::SINGLE ? SINGLE_PRECISION : 0);
+    if (!valid) {
+      header.error_position = static_cast<uint32_t>(compiled.error_position);
+      header.error_length = static_cast<uint32_t>(compiled.error_length);
+      if (!compiled.filtered_expression.empty()) header.flags |= ERROR_FILTERED;
+    }
+
+    _offsets.push_back(_records.size());
+    append(_records, &header, sizeof(header));
+    append(_records, constants.data(), constants.size() * sizeof(double));
+    append(_records, instructions.data(), instructions.size() * sizeof(ArchivedProgram::Instruction));
+    append(_records, locations.data(), locations.size() * sizeof(ArchivedProgram::Location));
+    _records += filtered;
+    _records += names;
+    _records.resize(padded(_records.size()), '\0');
+    return true;
+  }
+
+  std::string ProgramArchiveWriter::data() const {
+    const size_t records = sizeof(ArchiveHeader) + _offsets.size() * sizeof(uint64_t);
+    ArchiveHeader header = { };
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = archive::VERSION;
+    header.byte_order = ENDIAN_MARKER;
+    header.program_count = _offsets.size();
+    header.size = records + _records.size();
+
+    std::string out;
+    out.reserve(header.size);
+    append(out, &header, sizeof(header));
+    for (uint64_t offset : _offsets) {
+      offset += records;
+      append(out, &offset, sizeof(offset));
+    }
+    out += _records;
+    return out;
+  }
+
+  bool ProgramArchiveWriter::write(const char *path) const {
+    std::FILE *output = std::fopen(path, "wb");
+    if (!output) {
+      return false;
+    }
+    const std::string encoded = data();
+    bool success = std::fwrite(encoded.data(), 1, encoded.size(), output) == encoded.size();
+    if (std::fclose(output) != 0) success = false;
+    return success;
+  }
+
+  // ArchivedProgram.
+
+  Config ArchivedProgram::config() const {
+    Config config(_use_degrees, _optimize);
+    config.strict_trig = _strict_trig;
+    config.precision = (_flags & SINGLE_PRECISION) ? Precision::SINGLE : Precision::DOUBLE;
+    return config;
+  }
+
+  std::string ArchivedProgram::variable_name(size_t slot) const {
+    const char *name = _names;
+    for (size_t i = 0; i < slot; ++i) name += std::strlen(name) + 1;
+    return name;
+  }
+
+  Result ArchivedProgram::evaluate(const double *variables, double current_value) const {
+    return diagnose(evaluate_compact(variables, current_value));
+  }
+
+  // Same loop as Program::evaluate_compact(), reading the archive's encoding.
+  CompactResult ArchivedProgram::evaluate_compact(const double *variables, double current_value) const {
+    MATH_PARSER_TIME_STAGE(evaluate_timer, Stage::EVALUATE);
+    if (!is_valid()) {
+      if (_status == Status::PARSING_ERROR) {
+        return { _parsing_error };
+      }
+      return { _evaluation_error, CompactResult::COMPILE_ERROR };
+    }
+
+    double inline_stack[Program::INLINE_STACK_DEPTH];
+    std::vector<double> heap_stack;
+    double *stack = inline_stack;
+    if (_max_stack_depth > Program::INLINE_STACK_DEPTH) {
+      heap_stack.resize(_max_stack_depth);
+      stack = heap_stack.data();
+    }
+    const Config config = this->config();
+
+    size_t size = 0;
+    for (uint32_t i = 0; i < _instruction_count; ++i) {
+      const Instruction &instruction = _instructions[i];
+      const Operator::Type type = static_cast<Operator::Type>(instruction.type);
+      if (type == Operator::Type::NUMBER) {
+        stack[size++] = _constants[instruction.operand];
+        continue;
+      }
+      EvaluationErrorType eval_error = EvaluationErrorType::NONE;
+      if (type == Operator::Type::VARIABLE) {
+        if (variables) {
+          stack[size++] = variables[instruction.operand];
+          continue;
+        }
+        eval_error = EvaluationErrorType::EXPECTED_VARIABLE;
+      } else {
+        eval_error = Operator::from_type(type).eval(stack, size, config, current_value);
+      }
+      if (eval_error != EvaluationErrorType::NONE) {
+        MATH_PARSER_REPORT(evaluation_failed(eval_error));
+        return { eval_error, i };
+      }
+    }
+    return { stack[0] };
+  }
+
+  Result ArchivedProgram::diagnose(const CompactResult &result, bool copy_filtered) const {
+    if (result.ok()) {
+      return { result.value };
+    }
+    if (result.instruction() >= _instruction_count) {
+      // Error found while compiling, as Program::compile_result() has it.
+      std::string filtered = copy_filtered && (_flags & ERROR_FILTERED) ? std::string(_filtered, _filtered_length) : std::string();
+      if (_status == Status::PARSING_ERROR) {
+        return { _parsing_error, std::move(filtered), _error_position, _error_length };
+      }
+      return { _evaluation_error, std::move(filtered), _error_position, _error_length };
+    }
+    const Location &location = _locations[result.instruction()];
+    return { result.evaluation_error(), copy_filtered ? std::string(_filtered, _filtered_length) : std::string(), location.position, location.length };
+  }
+
+  Program ArchivedProgram::to_program() const {
+    Program program;
+    program._config = config();
+    for (size_t slot = 0; slot < _variable_count; ++slot) program._config.variables.push_back(variable_name(slot));
+    program._filtered_expression.assign(_filtered, _filtered_length);
+    program._compile_result = is_valid() ? Result(NAN) : diagnose(evaluate_compact());
+    program._max_stack_depth = _max_stack_depth;
+    for (uint32_t i = 0; i < _instruction_count; ++i) {
+      const Instruction &instruction = _instructions[i];
+      Program::Instruction out = { static_cast<Operator::Type>(instruction.type), 0, NAN };
+      if (out.type == Operator::Type::NUMBER) out.value = _constants[instruction.operand];
+      if (out.type == Operator::Type::VARIABLE) out.slot = instruction.operand;
+      program._instructions.push_back(out);
+      program._locations.push_back({ _locations[i].position, _locations[i].length });
+    }
+    if (is_valid()) program._specialization = std::make_shared<Program::Specialization>();
+    return program;
+  }
+
+  // ProgramArchive.
+
+  ProgramArchive::~ProgramArchive() {
+    release();
+  }
+
+  ProgramArchive::ProgramArchive(ProgramArchive &&other) {
+    *this = std::move(other);
+  }
+
+  ProgramArchive &ProgramArchive::operator=(ProgramArchive &&other) {
+    if (this != &other) {
+      release();
+      _data = other._data;
+      _size = other._size;
+      _count = other._count;
+      _offsets = other._offsets;
+      _mapping = other._mapping;
+      _buffer = std::move(other._buffer);
+      other._data = nullptr;
+      other._size = 0;
+      other._count = 0;
+      other._offsets = nullptr;
+      other._mapping = nullptr;
+    }
+    return *this;
+  }
+
+  void ProgramArchive::release() {
+#if MATH_PARSER_USE_MMAP
+    if (_mapping) munmap(_mapping, _size);
+#endif
+    _mapping = nullptr;
+    _buffer.clear();
+    _data = nullptr;
+    _size = 0;
+    _count = 0;
+    _offsets = nullptr;
+  }
+
+  bool ProgramArchive::load(const void *data, size_t size) {
+    release();
+    if (reinterpret_cast<uintptr_t>(data) % 8 != 0) {
+      return false;
+    }
+    _data = static_cast<const unsigned char *>(data);
+    _size = size;
+    if (!validate()) {
+      release();
+      return false;
+    }
+    return true;
+  }
+
+  bool ProgramArchive::open(const char *path) {
+    release();
+#if MATH_PARSER_USE_MMAP
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      ::close(fd);
+      return false;
+    }
+    const size_t size = static_cast<size_t>(info.st_size);
+    if (!S_ISREG(info.st_mode) || size < sizeof(ArchiveHeader)) {
+      ::close(fd);
+      errno = EINVAL;
+      return false;
+    }
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int map_error = errno;
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+      errno = map_error;
+      return false;
+    }
+    _mapping = mapping;
+    _data = static_cast<const unsigned char *>(mapping);
+    _size = size;
+#else
+    std::FILE *input = std::fopen(path, "rb");
+    if (!input) {
+      return false;
+    }
+    std::string bytes;
+    char block[65536];
+    size_t read;
+    while ((read = std::fread(block, 1, sizeof(block), input)) > 0) bytes.append(block, read);
+    const bool failed = std::ferror(input) != 0;
+    std::fclose(input);
+    if (failed) {
+      errno = EIO;
+      return false;
+    }
+    // Copied into 64 bit words so the sections are aligned.
+    _buffer.resize((bytes.size() + 7) / 8);
+    std::memcpy(_buffer.data(), bytes.data(), bytes.size());
+    _data = reinterpret_cast<const unsigned char *>(_buffer.data());
+    _size = bytes.size();
+#endif
+    if (!validate()) {
+      release();
+      errno = EINVAL;
+      return false;
+    }
+    return true;
+  }
+
+  // Checks everything evaluating a program relies on, so a corrupt archive is rejected here instead of misbehaving later:
+  // the headers, that each record lies inside the archive, that instructions are operators the compiler emits with
+  // operands in range, and that running them never underflows the stack and grows it to exactly max_stack_depth.
+  bool ProgramArchive::validate() {
+    if (_size < sizeof(ArchiveHeader)) {
+      return false;
+    }
+    ArchiveHeader header;
+    std::memcpy(&header, _data, sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != archive::VERSION || header.byte_order != ENDIAN_MARKER) {
+      return false;
+    }
+    if (header.size != _size || header.program_count > (_size - sizeof(ArchiveHeader)) / sizeof(uint64_t)) {
+      return false;
+    }
+    _count = static_cast<size_t>(header.program_count);
+    _offsets = reinterpret_cast<const uint64_t *>(_data + sizeof(ArchiveHeader));
+
+    const uint64_t first = sizeof(ArchiveHeader) + header.program_count * sizeof(uint64_t);
+    for (size_t index = 0; index < _count; ++index) {
+      const uint64_t offset = _offsets[index];
+      if (offset < first || offset % 8 != 0 || offset > _size - sizeof(RecordHeader)) {
+        return false;
+      }
+      RecordHeader record;
+      std::memcpy(&record, _data + offset, sizeof(record));
+      // 64 bit sums of 32 bit counts cannot overflow.
+      const uint64_t length = sizeof(RecordHeader)
+        + (uint64_t(record.constant_count) + record.instruction_count + record.instruction_count) * 8
+        + record.filtered_length + record.names_length;
+      if (length > _size - offset) {
+        return false;
+      }
+      if (record.status > static_cast<uint8_t>(Status::EVALUATION_ERROR)
+          || record.parsing_error >= PARSING_ERROR_TYPE_COUNT
+          || record.evaluation_error >= EVALUATION_ERROR_TYPE_COUNT
+          || (record.flags & ~KNOWN_FLAGS) != 0) {
+        return false;
+      }
+      const bool valid = record.status == static_cast<uint8_t>(Status::SUCCESS);
+      if (valid ? record.instruction_count == 0 : record.instruction_count != 0) {
+        return false;
+      }
+
+      const unsigned char *cursor = _data + offset + sizeof(RecordHeader) + uint64_t(record.constant_count) * 8;
+      const ArchivedProgram::Instruction *instructions = reinterpret_cast<const ArchivedProgram::Instruction *>(cursor);
+      const ArchivedProgram::Location *locations = reinterpret_cast<const ArchivedProgram::Location *>(cursor + uint64_t(record.instruction_count) * 8);
+      size_t depth = 0;
+      size_t max_depth = 0;
+      for (uint32_t i = 0; i < record.instruction_count; ++i) {
+        const ArchivedProgram::Instruction &instruction = instructions[i];
+        const Operator::Type type = static_cast<Operator::Type>(instruction.type);
+        if (instruction.type == 0 || instruction.type > static_cast<uint8_t>(Operator::Type::VARIABLE)
+            || type == Operator::Type::PAREN_L || type == Operator::Type::PAREN_R) {
+          return false;
+        }
+        if ((type == Operator::Type::NUMBER && instruction.operand >= record.constant_count)
+            || (type == Operator::Type::VARIABLE && instruction.operand >= record.variable_count)) {
+          return false;
+        }
+        const size_t degree = static_cast<size_t>(Operator::from_type(type).degree);
+        if (depth < degree) {
+          return false;
+        }
+        depth = depth - degree + 1;
+        max_depth = std::max(max_depth, depth);
+        const ArchivedProgram::Location &location = locations[i];
+        if (location.position > record.filtered_length || location.length > record.filtered_length - location.position) {
+          return false;
+        }
+      }
+      // The depth is exact, which also bounds the stack evaluating allocates by the size of the record.
+      if (max_depth != record.max_stack_depth || (valid && depth != 1)) {
+        return false;
+      }
+
+      // Each variable name ends in '\0', and nothing follows the last.
+      const char *names = reinterpret_cast<const char *>(cursor + uint64_t(record.instruction_count) * 16 + record.filtered_length);
+      size_t terminators = 0;
+      for (uint32_t i = 0; i < record.names_length; ++i) terminators += names[i] == '\0';
+      if (terminators != record.variable_count || (record.names_length != 0 && names[record.names_length - 1] != '\0')) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  ArchivedProgram ProgramArchive::operator[](size_t index) const {
+    const unsigned char *base = _data + _offsets[index];
+    RecordHeader record;
+    std::memcpy(&record, base, sizeof(record));
+
+    ArchivedProgram program;
+    program._status = static_cast<Status>(record.status);
+    program._parsing_error = static_cast<ParsingErrorType>(record.parsing_error);
+    program._evaluation_error = static_cast<EvaluationErrorType>(record.evaluation_error);
+    program._flags = record.flags;
+    program._use_degrees = (record.flags & USE_DEGREES) != 0;
+    program._optimize = (record.flags & OPTIMIZE) != 0;
+    program._strict_trig = (record.flags & STRICT_TRIG) != 0;
+    program._error_position = record.error_position;
+    program._error_length = record.error_length;
+    program._max_stack_depth = record.max_stack_depth;
+    program._instruction_count = record.instruction_count;
+    program._variable_count = record.variable_count;
+    program._filtered_length = record.filtered_length;
+
+    const unsigned char *cursor = base + sizeof(RecordHeader);
+    program._constants = reinterpret_cast<const double *>(cursor);
+    cursor += size_t(record.constant_count) * sizeof(double);
+    program._instructions = reinterpret_cast<const ArchivedProgram::Instruction *>(cursor);
+    cursor += size_t(record.instruction_count) * sizeof(ArchivedProgram::Instruction);
+    program._locations = reinterpret_cast<const ArchivedProgram::Location *>(cursor);
+    cursor += size_t(record.instruction_count) * sizeof(ArchivedProgram::Location);
+    program._filtered = reinterpret_cast<const char *>(cursor);
+    program._names = program._filtered + record.filtered_length;
+    return program;
+  }
+
+} // namespace MathParser
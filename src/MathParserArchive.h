@@ -0,0 +1,143 @@
+#pragma once
+#ifndef MATH_PARSER_ARCHIVE_H_
+#define MATH_PARSER_ARCHIVE_H_
+
+#include "MathParser.h"
+#include "MathParserStream.h" // MATH_PARSER_USE_MMAP
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace MathParser {
+
+  // Binary encoding of compiled programs, written once and loaded without parsing.
+  //
+  // An archive is a header, a table of record offsets and one record per program. Each record holds the program's
+  // compile result and flags, its constant pool, its opcode stream (one byte of Operator::Type and a four byte operand
+  // indexing the constant pool or the variable frame), the error locations and filtered expression used for
+  // diagnostics, and the names of its variable slots. Sections are 8 byte aligned and stored in host byte order;
+  // loading rejects archives of another version or byte order.
+  //
+  // Invalid programs keep only their compile result, which is all evaluating them reports.
+  namespace archive {
+    static const uint32_t VERSION = 1;
+  }
+
+  // Collects programs and encodes them into an archive.
+  class ProgramArchiveWriter {
+  public:
+    // Appends the program as the next index of the archive. Returns false, adding nothing, if it is too large to encode
+    // (4 GiB of expression or variable names) or calls registered functions, whose code an archive cannot hold.
+    bool add(const Program &program);
+
+    size_t size() const { return _offsets.size(); }
+
+    // Encoded archive of the programs added so far.
+    std::string data() const;
+
+    // Writes data() to the file at path. Returns false on I/O errors, with errno set.
+    bool write(const char *path) const;
+
+  private:
+    std::string _records;
+    std::vector<uint64_t> _offsets; // Into _records.
+  };
+
+  // Program stored in a ProgramArchive, evaluated in place from the archive's memory. Cheap to copy, and valid as long
+  // as the archive is. Results are bit for bit those of the Program it was written from.
+  class ArchivedProgram {
+  public:
+    // Same contracts as the Program methods of the same names.
+    Result evaluate(const double *variables = nullptr, double current_value = std::numeric_limits<double>::quiet_NaN()) const;
+    CompactResult evaluate_compact(const double *variables = nullptr, double current_value = std::numeric_limits<double>::quiet_NaN()) const;
+    Result diagnose(const CompactResult &result, bool copy_filtered = true) const;
+
+    bool is_valid() const { return _status == Status::SUCCESS; }
+    size_t variable_count() const { return _variable_count; }
+
+    // Name of a variable slot, as it was in Config::variables.
+    std::string variable_name(size_t slot) const;
+
+    // Copies the program out of the archive, for uses that need a Program such as evaluate_batch().
+    Program to_program() const;
+
+  private:
+    friend class ProgramArchive;
+    friend class ProgramArchiveWriter;
+
+    struct Instruction {
+      uint8_t type; // Operator::Type.
+      uint8_t reserved[3];
+      uint32_t operand; // Constant of Operator::Type::NUMBER or slot of Operator::Type::VARIABLE.
+    };
+
+    struct Location {
+      uint32_t position;
+      uint32_t length;
+    };
+
+    static_assert(sizeof(Instruction) == 8 && sizeof(Location) == 8, "archive entries must not be padded");
+
+    Config config() const;
+
+    Status _status = Status::SUCCESS;
+    ParsingErrorType _parsing_error = ParsingErrorType::NONE;
+    EvaluationErrorType _evaluation_error = EvaluationErrorType::NONE;
+    bool _use_degrees = true;
+    bool _optimize = true;
+    bool _strict_trig = true;
+    uint8_t _flags = 0;
+    uint32_t _error_position = 0;
+    uint32_t _error_length = 0;
+    uint32_t _max_stack_depth = 0;
+    uint32_t _instruction_count = 0;
+    uint32_t _variable_count = 0;
+    uint32_t _filtered_length = 0;
+    const double *_constants = nullptr;
+    const Instruction *_instructions = nullptr;
+    const Location *_locations = nullptr;
+    const char *_filtered = nullptr;
+    const char *_names = nullptr; // variable_count() names, each ending in '\0'.
+  };
+
+  // Read only view of an archive. Files are memory mapped, so opening one costs a single pass over it to validate the
+  // records, and neither opening nor evaluating allocates per program. After validation, evaluating a program cannot
+  // read outside its record, whatever the file held.
+  // Thread safe once opened.
+  class ProgramArchive {
+  public:
+    ProgramArchive() { }
+    ~ProgramArchive();
+    ProgramArchive(ProgramArchive &&other);
+    ProgramArchive &operator=(ProgramArchive &&other);
+    ProgramArchive(const ProgramArchive &) = delete;
+    ProgramArchive &operator=(const ProgramArchive &) = delete;
+
+    // Maps the archive at path, replacing any archive held. Returns false on I/O errors, with errno set, and for files
+    // that are not valid archives of this version, with errno set to EINVAL.
+    bool open(const char *path);
+
+    // Uses the archive at [data, data + size), which must be 8 byte aligned and outlive this object. Returns false if
+    // it is not a valid archive.
+    bool load(const void *data, size_t size);
+
+    size_t size() const { return _count; }
+    ArchivedProgram operator[](size_t index) const;
+
+  private:
+    void release();
+    bool validate();
+
+    const unsigned char *_data = nullptr;
+    size_t _size = 0;
+    size_t _count = 0;
+    const uint64_t *_offsets = nullptr;
+    void *_mapping = nullptr;       // Owned memory map, if opened from a file.
+    std::vector<uint64_t> _buffer;  // Owned copy, if opened from a file without MATH_PARSER_USE_MMAP.
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_ARCHIVE_H_
@@ -0,0 +1,150 @@
+#include "MathParserAsync.h"
+
+#include <algorithm> // std::min
+
+namespace MathParser {
+
+  AsyncEvaluator::AsyncEvaluator(ThreadPool *pool, const AsyncOptions &options)
+  : _options(options)
+  , _cache(options.cache_capacity)
+  , _own_pool(pool ? nullptr : new StdThreadPool())
+  , _pool(pool ? pool : _own_pool.get())
+  {
+    _options.max_batch = std::max<size_t>(1, _options.max_batch);
+    _flusher = std::thread(&AsyncEvaluator::flusher, this);
+  }
+
+  AsyncEvaluator::~AsyncEvaluator() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _changed.notify_all();
+    _flusher.join();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _finished.wait(lock, [&] { return _running == 0; });
+  }
+
+  void AsyncEvaluator::submit(const std::string &expression, double current_value, const Config &config, Completion completion) {
+    std::shared_ptr<const Program> program = _cache.compile(expression, config);
+    if (!program->is_valid()) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_stats.requests;
+      }
+      completion(program->compile_result());
+      return;
+    }
+
+    Batch full;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      ++_stats.requests;
+      auto inserted = _pending.emplace(program.get(), Batch());
+      Batch &batch = inserted.first->second;
+      if (inserted.second) {
+        batch.program = program;
+        batch.deadline = Clock::now() + _options.max_delay;
+      }
+      batch.in.push_back(current_value);
+      batch.completions.push_back(std::move(completion));
+      if (batch.in.size() < _options.max_batch) {
+        if (inserted.second) _changed.notify_one();
+        return;
+      }
+      full = std::move(batch);
+      _pending.erase(inserted.first);
+      ++_stats.full_flushes;
+    }
+    dispatch(std::move(full));
+  }
+
+  std::future<Result> AsyncEvaluator::submit(const std::string &expression, double current_value, const Config &config) {
+    std::shared_ptr<std::promise<Result>> promise = std::make_shared<std::promise<Result>>();
+    std::future<Result> future = promise->get_future();
+    submit(expression, current_value, config, [promise](Result result) { promise->set_value(std::move(result)); });
+    return future;
+  }
+
+  void AsyncEvaluator::flush() {
+    std::vector<Batch> batches;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (auto &pending : _pending) batches.push_back(std::move(pending.second));
+      _pending.clear();
+      _stats.deadline_flushes += batches.size();
+    }
+    for (Batch &batch : batches) dispatch(std::move(batch));
+  }
+
+  AsyncEvaluator::Stats AsyncEvaluator::stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+  }
+
+  // Evaluates the lanes together, then rebuilds the diagnostics of failed lanes one at a time, which evaluate_batch()
+  // does not keep.
+  void AsyncEvaluator::run(Batch &batch) {
+    const size_t n = batch.in.size();
+    std::vector<double> out(n);
+    std::vector<EvaluationErrorType> errors(n);
+    evaluate_batch(*batch.program, batch.in.data(), out.data(), n, errors.data());
+    for (size_t i = 0; i < n; ++i) {
+      if (errors[i] == EvaluationErrorType::NONE) {
+        batch.completions[i](Result(out[i]));
+      } else {
+        batch.completions[i](batch.program->evaluate(batch.in[i]));
+      }
+    }
+  }
+
+  void AsyncEvaluator::dispatch(Batch &&batch) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      ++_running;
+      ++_stats.batches;
+    }
+    std::shared_ptr<Batch> task = std::make_shared<Batch>(std::move(batch));
+    _pool->run([this, task] {
+      run(*task);
+      std::lock_guard<std::mutex> lock(_mutex);
+      --_running;
+      _finished.notify_all();
+    });
+  }
+
+  // Flushes batches as their deadlines pass, and everything left once stopping.
+  void AsyncEvaluator::flusher() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+      if (_pending.empty()) {
+        if (_stopping) return;
+        _changed.wait(lock);
+        continue;
+      }
+
+      Clock::time_point now = Clock::now();
+      Clock::time_point next = Clock::time_point::max();
+      std::vector<Batch> expired;
+      for (auto it = _pending.begin(); it != _pending.end(); ) {
+        if (_stopping || it->second.deadline <= now) {
+          expired.push_back(std::move(it->second));
+          it = _pending.erase(it);
+        } else {
+          next = std::min(next, it->second.deadline);
+          ++it;
+        }
+      }
+      if (expired.empty()) {
+        _changed.wait_until(lock, next);
+        continue;
+      }
+      _stats.deadline_flushes += expired.size();
+      lock.unlock();
+      for (Batch &batch : expired) dispatch(std::move(batch));
+      lock.lock();
+    }
+  }
+
+} // namespace MathParser
@@ -0,0 +1,92 @@
+#pragma once
+#ifndef MATH_PARSER_ASYNC_H_
+#define MATH_PARSER_ASYNC_H_
+
+#include "MathParser.h"
+#include "MathParserCache.h"
+#include "MathParserExecutor.h" // ThreadPool
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace MathParser {
+
+  struct AsyncOptions {
+    size_t max_batch = 256;                            // Lanes that flush a batch at once.
+    std::chrono::microseconds max_delay{ 200 };        // Longest a request waits for others to share its batch.
+    size_t cache_capacity = ExpressionCache::DEFAULT_CAPACITY;
+  };
+
+  // Evaluates independent requests asynchronously, trading a bounded delay for batching. Requests are compiled through
+  // an ExpressionCache, and requests for the same program are queued together and run as one evaluate_batch() once
+  // max_batch of them are waiting or the oldest has waited max_delay. Results are those of evaluate_expression(),
+  // error positions included; requests that fail to compile complete at once without queuing.
+  //
+  // Batches run on the pool, or on a pool of the evaluator's own if none is given. Completions are called on the
+  // thread running the batch, so they should be cheap and must not block on other requests.
+  // Thread safe. The destructor flushes every pending request and waits for its completion.
+  class AsyncEvaluator {
+  public:
+    typedef std::function<void(Result)> Completion;
+
+    struct Stats {
+      size_t requests = 0;
+      size_t batches = 0;
+      size_t full_flushes = 0;     // Batches flushed on reaching max_batch.
+      size_t deadline_flushes = 0; // Batches flushed on max_delay, or by flush() or the destructor.
+    };
+
+    explicit AsyncEvaluator(ThreadPool *pool = nullptr, const AsyncOptions &options = AsyncOptions());
+    ~AsyncEvaluator();
+    AsyncEvaluator(const AsyncEvaluator &) = delete;
+    AsyncEvaluator &operator=(const AsyncEvaluator &) = delete;
+
+    void submit(const std::string &expression, double current_value, const Config &config, Completion completion);
+    void submit(const std::string &expression, double current_value, Completion completion) { submit(expression, current_value, Config(), std::move(completion)); }
+
+    std::future<Result> submit(const std::string &expression, double current_value = std::numeric_limits<double>::quiet_NaN(), const Config &config = { });
+
+    // Starts every pending batch now. Completions may still be running when it returns.
+    void flush();
+
+    Stats stats() const;
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Batch {
+      std::shared_ptr<const Program> program;
+      Clock::time_point deadline;
+      std::vector<double> in;
+      std::vector<Completion> completions;
+    };
+
+    static void run(Batch &batch);
+    void dispatch(Batch &&batch);
+    void flusher();
+
+    AsyncOptions _options;
+    ExpressionCache _cache;
+    std::unique_ptr<StdThreadPool> _own_pool;
+    ThreadPool *_pool;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _changed;  // Pending batches or stopping changed.
+    std::condition_variable _finished; // A dispatched batch completed.
+    std::unordered_map<const Program *, Batch> _pending;
+    size_t _running = 0;
+    bool _stopping = false;
+    Stats _stats;
+    std::thread _flusher;
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_ASYNC_H_
@@ -0,0 +1,24 @@
+#pragma once
+#ifndef MATH_PARSER_BASELINE_H_
+#define MATH_PARSER_BASELINE_H_
+
+// Frozen copy of the original regex and shunting-yard evaluator, the reference of the differential tests. It differs
+// from the original in two ways: it shares the public types of MathParser.h, of which it reads Config::use_degrees
+// alone, and it converts degrees with common::math::degrees_to_radians(), which is pi / 180 as a double since the
+// static expressions were added, where the original rounded it to float. That is the one fix carried over, so trig in
+// degrees compares bit for bit. Do not optimize or fix it otherwise: its behaviour is what the rewritten parser is
+// checked against.
+
+#include "MathParser.h"
+
+#include <limits>
+#include <string>
+
+namespace MathParserBaseline {
+
+  MathParser::Result evaluate_expression(const std::string &expression, MathParser::Config config = { }, double current_value = std::numeric_limits<double>::quiet_NaN());
+  MathParser::Result evaluate_expression(const std::string &expression, double current_value, MathParser::Config config = { });
+
+} // namespace MathParserBaseline
+
+#endif // MATH_PARSER_BASELINE_H_
@@ -0,0 +1,165 @@
+#include "MathParser.h"
+#include "MathParserBatch.h"
+#include "MathParserFunctions.h"
+#include "MathParserInstrument.h"
+#include "MathParserSpecialized.h"
+
+#include "common/math.h" // common::math::e/pi/tau
+
+#include <algorithm> // std::copy, std::fill, std::min
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace MathParser {
+
+  // Returns the row holding the results. T is double, or float for Precision::SINGLE.
+  template<typename T>
+  static const T *evaluate_block(const Program &program, const T *current, const T *const *variables, uint8_t *errors, T *stack, size_t count) {
+    const bool use_degrees = program.config().use_degrees;
+    const bool strict_trig = program.config().strict_trig;
+    auto flag = [&](size_t i, bool condition, EvaluationErrorType type) { flag_error(errors[i], condition, type); };
+
+    // Rows of the value stack in use, so the top is row depth - 1. Kept as a count rather than a row pointer, which
+    // would point before the stack while it is empty.
+    size_t depth = 0;
+    auto row = [&](size_t index) { return stack + index * BATCH_BLOCK_SIZE; };
+
+    for (const Program::Instruction &instruction : program.instructions()) {
+      T *a = depth >= 2 ? row(depth - 2) : stack;
+      T *b = depth >= 1 ? row(depth - 1) : stack;
+      T *next = row(depth); // Row written by constants and variables, which push.
+      switch (instruction.type) {
+        case Operator::Type::NONE:
+        case Operator::Type::PAREN_L:
+        case Operator::Type::PAREN_R:
+          // Never emitted by compile().
+          for (size_t i = 0; i < count; ++i) flag_error(errors[i], true, EvaluationErrorType::UNEXPECTED_TOKEN);
+          break;
+
+          // Handle constants.
+        case Operator::Type::NUMBER: ++depth; std::fill(next, next + count, static_cast<T>(instruction.value)); break;
+        case Operator::Type::E:      ++depth; std::fill(next, next + count, common::math::e<T>()); break;
+        case Operator::Type::PI:     ++depth; std::fill(next, next + count, common::math::pi<T>()); break;
+        case Operator::Type::TAU:    ++depth; std::fill(next, next + count, common::math::tau<T>()); break;
+
+        case Operator::Type::VARIABLE:
+          ++depth;
+          if (variables) {
+            std::copy(variables[instruction.slot], variables[instruction.slot] + count, next);
+          } else {
+            for (size_t i = 0; i < count; ++i) flag_error(errors[i], true, EvaluationErrorType::EXPECTED_VARIABLE);
+            std::fill(next, next + count, std::numeric_limits<T>::quiet_NaN());
+          }
+          break;
+
+          // Handle unary operators.
+        case Operator::Type::COSECANT:
+        case Operator::Type::COSINE:
+        case Operator::Type::COTANGENT:
+        case Operator::Type::SECANT:
+        case Operator::Type::SINE:
+        case Operator::Type::TANGENT:
+        case Operator::Type::PERCENTAGE:
+        case Operator::Type::TIMES:
+        case Operator::Type::UNARY_MINUS:
+        case Operator::Type::UNARY_PLUS:
+          apply_unary(instruction.type, b, b, current, count, use_degrees, strict_trig, flag);
+          break;
+
+        case Operator::Type::FUNCTION: {
+          const Function &function = (*program.config().functions)[instruction.slot];
+          depth = depth + 1 - static_cast<size_t>(function.op.degree);
+          call_function_rows(function, row(depth - 1), BATCH_BLOCK_SIZE, count);
+          break;
+        }
+
+          // Handle binary operators.
+        case Operator::Type::ADD:
+        case Operator::Type::SUBTRACT:
+        case Operator::Type::MULTIPLY:
+        case Operator::Type::DIVIDE:
+        case Operator::Type::EXPONENT:
+          apply_binary(instruction.type, a, a, b, count, flag);
+          --depth;
+          break;
+      }
+    }
+
+    return row(depth - 1);
+  }
+
+  template<typename T>
+  static size_t interpret_batch(const Program &program, const T *const *variables, const T *in, T *out, size_t n, EvaluationErrorType *errors) {
+    if (!program.is_valid()) {
+      return fail_batch(program.compile_result(), out, n, errors);
+    }
+    return evaluate_blocks(program.max_stack_depth(), variables, program.variable_count(), in, out, n, errors, [&](const T *current, const T *const *block_variables, uint8_t *block_errors, T *stack, size_t count) {
+      return evaluate_block(program, current, block_variables, block_errors, stack, count);
+    });
+  }
+
+  size_t evaluate_batch_interpreted(const Program &program, const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors) {
+    MATH_PARSER_TIME_STAGE(batch_timer, Stage::BATCH);
+    return interpret_batch(program, variables, in, out, n, errors);
+  }
+
+  size_t evaluate_batch_interpreted(const Program &program, const double *in, double *out, size_t n, EvaluationErrorType *errors) {
+    return evaluate_batch_interpreted(program, nullptr, in, out, n, errors);
+  }
+
+  size_t evaluate_batch(const Program &program, const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors) {
+    MATH_PARSER_TIME_STAGE(batch_timer, Stage::BATCH);
+#if MATH_PARSER_SPECIALIZE
+    if (const SpecializedProgram *specialized = Program::Specialization::hot(program, n)) {
+      return specialized->evaluate_batch(variables, in, out, n, errors);
+    }
+#endif
+    return interpret_batch(program, variables, in, out, n, errors);
+  }
+
+  size_t evaluate_batch(const Program &program, const double *in, double *out, size_t n, EvaluationErrorType *errors) {
+    return evaluate_batch(program, nullptr, in, out, n, errors);
+  }
+
+  size_t evaluate_batch(const Program &program, const float *const *variables, const float *in, float *out, size_t n, EvaluationErrorType *errors) {
+    MATH_PARSER_TIME_STAGE(batch_timer, Stage::BATCH);
+    if (program.config().precision == Precision::SINGLE) {
+      return interpret_batch(program, variables, in, out, n, errors);
+    }
+
+    // Widened a chunk at a time for the double evaluators.
+    const size_t chunk = std::min(n, 16 * BATCH_BLOCK_SIZE);
+    const size_t columns = variables ? program.variable_count() : 0;
+    std::vector<double> buffer((2 + columns) * chunk);
+    double *wide_in = buffer.data();
+    double *wide_out = wide_in + chunk;
+    std::vector<const double *> wide_variables(columns);
+    for (size_t slot = 0; slot < columns; ++slot) wide_variables[slot] = wide_out + chunk * (1 + slot);
+
+    size_t failed = 0;
+    for (size_t offset = 0; offset < n; offset += chunk) {
+      const size_t count = std::min(chunk, n - offset);
+      std::copy(in + offset, in + offset + count, wide_in);
+      for (size_t slot = 0; slot < columns; ++slot) {
+        std::copy(variables[slot] + offset, variables[slot] + offset + count, wide_out + chunk * (1 + slot));
+      }
+      const double *const *block_variables = variables ? wide_variables.data() : nullptr;
+      EvaluationErrorType *block_errors = errors ? errors + offset : nullptr;
+#if MATH_PARSER_SPECIALIZE
+      const SpecializedProgram *specialized = Program::Specialization::hot(program, count);
+#else
+      const SpecializedProgram *specialized = nullptr;
+#endif
+      failed += specialized ? specialized->evaluate_batch(block_variables, wide_in, wide_out, count, block_errors)
+                            : interpret_batch(program, block_variables, wide_in, wide_out, count, block_errors);
+      std::copy(wide_out, wide_out + count, out + offset);
+    }
+    return failed;
+  }
+
+  size_t evaluate_batch(const Program &program, const float *in, float *out, size_t n, EvaluationErrorType *errors) {
+    return evaluate_batch(program, nullptr, in, out, n, errors);
+  }
+
+} // namespace MathParser
@@ -0,0 +1,170 @@
+#pragma once
+#ifndef MATH_PARSER_BATCH_H_
+#define MATH_PARSER_BATCH_H_
+
+// Helpers shared by the batch evaluators (the interpreter in MathParserBatch.cpp, SpecializedProgram and FusedProgram).
+
+#include "MathParser.h"
+#include "MathParserTrig.h"
+
+#include "common/math.h" // common::math::degrees_to_radians
+
+#include <algorithm> // std::copy, std::fill, std::min
+#include <cmath>     // std::pow, std::trunc, std::cos/sin/tan
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace MathParser {
+
+  // Number of lanes evaluated together by each instruction.
+  // Each stack slot is a contiguous row of lanes (structure of arrays) so the inner loops vectorize.
+  static constexpr size_t BATCH_BLOCK_SIZE = 256;
+
+  // Records the first error seen by a lane without branching, matching the scalar evaluator which stops at the first error.
+  static inline void flag_error(uint8_t &error, bool condition, EvaluationErrorType type) {
+    error = error != 0 ? error : static_cast<uint8_t>(condition ? static_cast<uint8_t>(type) : 0);
+  }
+
+  // Fails every lane of an invalid program with the error from compiling it. Returns n.
+  template<typename T>
+  static inline size_t fail_batch(const Result &compile_result, T *out, size_t n, EvaluationErrorType *errors) {
+    EvaluationErrorType error = compile_result.status == Status::EVALUATION_ERROR ? compile_result.evaluation_error : EvaluationErrorType::UNEXPECTED_TOKEN;
+    std::fill(out, out + n, std::numeric_limits<T>::quiet_NaN());
+    if (errors) std::fill(errors, errors + n, error);
+    return n;
+  }
+
+  template<typename T, typename Function>
+  static inline void map_unary(T *out, const T *a, size_t count, Function function) {
+    for (size_t i = 0; i < count; ++i) out[i] = function(a[i]);
+  }
+
+  // The vectorized kernels are double only; float programs always use the C library.
+  static inline TrigKernel fast_kernel(double *, bool strict_trig, Operator::Type type) {
+    return strict_trig ? nullptr : trig_kernel(type);
+  }
+
+  static inline TrigKernel fast_kernel(float *, bool, Operator::Type) {
+    return nullptr;
+  }
+
+  static inline void run_kernel(TrigKernel kernel, double *a, size_t count) { kernel(a, count); }
+  static inline void run_kernel(TrigKernel, float *, size_t) { }
+
+  // Runs the vectorized kernel instead of function when there is one, converting degrees in a pass of its own.
+  template<typename T, typename Function>
+  static inline void map_trig(T *out, const T *a, size_t count, bool use_degrees, TrigKernel kernel, Function function) {
+    static constexpr T DEG_TO_RAD = common::math::degrees_to_radians<T>();
+    if (kernel) {
+      if (use_degrees) {
+        map_unary(out, a, count, [](T value) { return value * DEG_TO_RAD; });
+      } else if (out != a) {
+        std::copy(a, a + count, out);
+      }
+      run_kernel(kernel, out, count);
+    } else if (use_degrees) {
+      map_unary(out, a, count, [&](T value) { return function(value * DEG_TO_RAD); });
+    } else {
+      map_unary(out, a, count, function);
+    }
+  }
+
+  // Kernels of the operators over rows of count lanes, writing out, which may be an operand row. Lanes that fail are
+  // reported through flag(i, condition, type), called with each lane's error condition before out is written.
+  // Unary operators include trig, x and %, which read the block's current values; returns false for other types.
+  template<typename T, typename Flag>
+  static inline bool apply_unary(Operator::Type type, T *out, const T *a, const T *current, size_t count, bool use_degrees, bool strict_trig, Flag flag) {
+    auto trig = [&](auto function) { map_trig(out, a, count, use_degrees, fast_kernel(out, strict_trig, type), function); };
+    switch (type) {
+      case Operator::Type::COSECANT:  trig([](T d) { return T(1) / std::sin(d); }); return true;
+      case Operator::Type::COSINE:    trig([](T d) { return std::cos(d); });       return true;
+      case Operator::Type::COTANGENT: trig([](T d) { return T(1) / std::tan(d); }); return true;
+      case Operator::Type::SECANT:    trig([](T d) { return T(1) / std::cos(d); }); return true;
+      case Operator::Type::SINE:      trig([](T d) { return std::sin(d); });       return true;
+      case Operator::Type::TANGENT:   trig([](T d) { return std::tan(d); });       return true;
+
+      case Operator::Type::PERCENTAGE:
+        for (size_t i = 0; i < count; ++i) {
+          flag(i, current[i] != current[i], EvaluationErrorType::EXPECTED_CURRENT_VALUE);
+          out[i] = a[i] * current[i] / T(100);
+        }
+        return true;
+
+      case Operator::Type::TIMES:
+        for (size_t i = 0; i < count; ++i) {
+          flag(i, current[i] != current[i], EvaluationErrorType::EXPECTED_CURRENT_VALUE);
+          out[i] = a[i] * current[i];
+        }
+        return true;
+
+      case Operator::Type::UNARY_MINUS: map_unary(out, a, count, [](T d) { return d * T(-1); }); return true;
+      case Operator::Type::UNARY_PLUS:  if (out != a) std::copy(a, a + count, out); return true;
+
+      default:
+        return false;
+    }
+  }
+
+  template<typename T, typename Flag>
+  static inline bool apply_binary(Operator::Type type, T *out, const T *a, const T *b, size_t count, Flag flag) {
+    switch (type) {
+      case Operator::Type::ADD:      for (size_t i = 0; i < count; ++i) out[i] = a[i] + b[i]; return true;
+      case Operator::Type::SUBTRACT: for (size_t i = 0; i < count; ++i) out[i] = a[i] - b[i]; return true;
+      case Operator::Type::MULTIPLY: for (size_t i = 0; i < count; ++i) out[i] = a[i] * b[i]; return true;
+
+      case Operator::Type::DIVIDE:
+        for (size_t i = 0; i < count; ++i) flag(i, b[i] == T(0), EvaluationErrorType::DIVIDE_BY_ZERO);
+        for (size_t i = 0; i < count; ++i) out[i] = a[i] / b[i];
+        return true;
+
+      case Operator::Type::EXPONENT:
+        for (size_t i = 0; i < count; ++i) {
+          // Same test as std::modf(b, &d) > 0, written so it does not need an out parameter.
+          flag(i, a[i] < 0 && b[i] - std::trunc(b[i]) > 0, EvaluationErrorType::IMAGINARY_NUMBER);
+        }
+        for (size_t i = 0; i < count; ++i) out[i] = std::pow(a[i], b[i]);
+        return true;
+
+      default:
+        return false;
+    }
+  }
+
+  // Splits [0, n) into blocks of BATCH_BLOCK_SIZE lanes and calls
+  //   const T *evaluate_block(const T *current, const T *const *variables, uint8_t *errors, T *stack, size_t count)
+  // for each, with stack_rows rows of stack and the block's lanes of each of the variable_count variable columns
+  // (null if variables is null). Blocks flag the first error of failing lanes and return the row holding their results,
+  // which is copied to out with failing lanes set to NaN. Returns the number of failed lanes.
+  template<typename T, typename BlockFunction>
+  static size_t evaluate_blocks(size_t stack_rows, const T *const *variables, size_t variable_count, const T *in, T *out, size_t n, EvaluationErrorType *errors, BlockFunction evaluate_block) {
+    std::vector<T> stack(stack_rows * BATCH_BLOCK_SIZE);
+    std::vector<const T *> block_variables(variables ? variable_count : 0);
+    uint8_t block_errors[BATCH_BLOCK_SIZE];
+
+    size_t failed = 0;
+    for (size_t offset = 0; offset < n; offset += BATCH_BLOCK_SIZE) {
+      size_t count = std::min(BATCH_BLOCK_SIZE, n - offset);
+      for (size_t slot = 0; slot < block_variables.size(); ++slot) block_variables[slot] = variables[slot] + offset;
+      std::fill(block_errors, block_errors + count, 0);
+      const T *result = evaluate_block(in + offset, variables ? block_variables.data() : nullptr, block_errors, stack.data(), count);
+
+      uint8_t any = 0;
+      for (size_t i = 0; i < count; ++i) any |= block_errors[i];
+      if (any == 0) {
+        std::copy(result, result + count, out + offset);
+        if (errors) std::fill(errors + offset, errors + offset + count, EvaluationErrorType::NONE);
+        continue;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        out[offset + i] = block_errors[i] != 0 ? std::numeric_limits<T>::quiet_NaN() : result[i];
+        failed += block_errors[i] != 0;
+        if (errors) errors[offset + i] = static_cast<EvaluationErrorType>(block_errors[i]);
+      }
+    }
+    return failed;
+  }
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_BATCH_H_
@@ -0,0 +1,169 @@
+#include "MathParserCache.h"
+
+#include <algorithm> // std::max
+
+namespace MathParser {
+
+  struct ExpressionCache::Entry {
+    Program program;
+    bool constant = false; // Does not use the current value, so constant_result is its only possible result.
+    Result constant_result = { ParsingErrorType::NONE };
+  };
+
+  // Shards are allocated separately so their locks and counters do not share cache lines.
+  struct ExpressionCache::Shard {
+    struct Slot {
+      std::string key;
+      std::shared_ptr<const Entry> entry;
+      bool referenced;
+    };
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, size_t> index; // Key to slot.
+    std::vector<Slot> slots;
+    size_t capacity;
+    size_t hand = 0;
+    Stats stats;
+
+    explicit Shard(size_t capacity_) : capacity(capacity_) { }
+
+    // Expects the lock to be held.
+    std::shared_ptr<const Entry> find(const std::string &key) {
+      auto it = index.find(key);
+      if (it == index.end()) {
+        return nullptr;
+      }
+      Slot &slot = slots[it->second];
+      slot.referenced = true;
+      return slot.entry;
+    }
+
+    // Expects the lock to be held.
+    void insert(const std::string &key, const std::shared_ptr<const Entry> &entry) {
+      if (slots.size() < capacity) {
+        index.emplace(key, slots.size());
+        slots.push_back({ key, entry, false });
+        return;
+      }
+
+      // Sweep the hand, clearing reference bits, until it reaches an entry not used since the last sweep.
+      while (slots[hand].referenced) {
+        slots[hand].referenced = false;
+        hand = (hand + 1) % capacity;
+      }
+      Slot &victim = slots[hand];
+      index.erase(victim.key);
+      index.emplace(key, hand);
+      victim = { key, entry, false };
+      hand = (hand + 1) % capacity;
+      ++stats.evictions;
+    }
+  };
+
+  static void append_sized(std::string &key, const std::string &text) {
+    size_t size = text.size();
+    key.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    key += text;
+  }
+
+  ExpressionCache::ExpressionCache(size_t capacity, size_t shards) {
+    shards = std::max<size_t>(shards, 1);
+    size_t shard_capacity = std::max<size_t>((capacity + shards - 1) / shards, 1);
+    for (size_t i = 0; i < shards; ++i) {
+      _shards.emplace_back(new Shard(shard_capacity));
+    }
+  }
+
+  ExpressionCache::~ExpressionCache() { }
+
+  std::shared_ptr<const ExpressionCache::Entry> ExpressionCache::lookup(const std::string &expression, Config config, bool evaluating) {
+    // Reused per thread so a hit does not allocate.
+    static thread_local std::string key;
+    static thread_local std::string normalized;
+    // The text and each variable name are length prefixed, so no expression can spell out another's flags or names.
+    normalize_expression(expression, normalized);
+    key.clear();
+    key.push_back(config.use_degrees ? 'd' : 'r');
+    key.push_back(config.optimize ? 'o' : 'n');
+    key.push_back(config.strict_trig ? 's' : 'f');
+    key.push_back(config.precision == Precision::SINGLE ? '1' : '2');
+    append_sized(key, normalized);
+    for (const std::string &variable : config.variables) {
+      append_sized(key, variable);
+    }
+    // Registries are immutable while programs compiled with them live, which cached entries keep alive.
+    if (const FunctionRegistry *functions = config.functions.get()) {
+      key.push_back('\1');
+      key.append(reinterpret_cast<const char *>(&functions), sizeof(functions));
+    }
+
+    Shard &shard = *_shards[std::hash<std::string>()(key) % _shards.size()];
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      std::shared_ptr<const Entry> entry = shard.find(key);
+      if (entry) {
+        ++shard.stats.hits;
+        if (evaluating && entry->constant) ++shard.stats.constant_hits;
+        return entry;
+      }
+      ++shard.stats.misses;
+    }
+
+    // Compile outside the lock so other expressions in the shard are not held up.
+    std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+    entry->program = MathParser::compile(expression, config);
+    if (!entry->program.is_valid() || (!entry->program.uses_current_value() && !entry->program.uses_variables() && !entry->program.uses_functions())) {
+      entry->constant = true;
+      entry->constant_result = entry->program.evaluate();
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    std::shared_ptr<const Entry> existing = shard.find(key);
+    if (existing) {
+      // Another thread compiled the same expression first.
+      return existing;
+    }
+    shard.insert(key, entry);
+    return entry;
+  }
+
+  std::shared_ptr<const Program> ExpressionCache::compile(const std::string &expression, Config config) {
+    std::shared_ptr<const Entry> entry = lookup(expression, config, false);
+    return std::shared_ptr<const Program>(entry, &entry->program);
+  }
+
+  Result ExpressionCache::evaluate_expression(const std::string &expression, double current_value, Config config) {
+    std::shared_ptr<const Entry> entry = lookup(expression, config, true);
+    if (entry->constant) {
+      return entry->constant_result;
+    }
+    return entry->program.evaluate(current_value);
+  }
+
+  Result ExpressionCache::evaluate_expression(const std::string &expression, Config config, double current_value) {
+    return evaluate_expression(expression, current_value, config);
+  }
+
+  ExpressionCache::Stats ExpressionCache::stats() const {
+    Stats total;
+    for (const std::unique_ptr<Shard> &shard : _shards) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      total.hits += shard->stats.hits;
+      total.misses += shard->stats.misses;
+      total.evictions += shard->stats.evictions;
+      total.constant_hits += shard->stats.constant_hits;
+      total.size += shard->slots.size();
+    }
+    return total;
+  }
+
+  void ExpressionCache::clear() {
+    for (const std::unique_ptr<Shard> &shard : _shards) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      shard->index.clear();
+      shard->slots.clear();
+      shard->hand = 0;
+    }
+  }
+
+} // namespace MathParser
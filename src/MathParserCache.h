@@ -0,0 +1,59 @@
+#pragma once
+#ifndef MATH_PARSER_CACHE_H_
+#define MATH_PARSER_CACHE_H_
+
+#include "MathParser.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace MathParser {
+
+  // Thread safe cache of compiled programs in front of evaluate_expression().
+  // Keyed by the normalized expression (see normalize_expression()), Config::use_degrees, Config::optimize,
+  // Config::strict_trig, Config::precision, Config::variables and Config::functions, so results,
+  // including error positions, are identical to the uncached path.
+  // Expressions that use neither the current value nor variables also memoize their result.
+  // Entries are spread over independently locked shards and each shard evicts with the CLOCK algorithm once full.
+  class ExpressionCache {
+  public:
+    struct Stats {
+      size_t hits = 0;
+      size_t misses = 0;
+      size_t evictions = 0;
+      size_t constant_hits = 0; // Hits answered from the memoized result without evaluating.
+      size_t size = 0;
+    };
+
+    static const size_t DEFAULT_CAPACITY = 4096;
+    static const size_t DEFAULT_SHARDS = 16;
+
+    // Capacity is the maximum number of cached programs, split evenly across shards.
+    explicit ExpressionCache(size_t capacity = DEFAULT_CAPACITY, size_t shards = DEFAULT_SHARDS);
+    ~ExpressionCache();
+
+    // Compiled program for the expression. Compiles and inserts it on a miss.
+    std::shared_ptr<const Program> compile(const std::string &expression, Config config = { });
+
+    Result evaluate_expression(const std::string &expression, Config config = { }, double current_value = std::numeric_limits<double>::quiet_NaN());
+    Result evaluate_expression(const std::string &expression, double current_value, Config config = { });
+
+    // Counters are cumulative and are not reset by clear().
+    Stats stats() const;
+    void clear();
+
+  private:
+    struct Entry;
+    struct Shard;
+
+    std::shared_ptr<const Entry> lookup(const std::string &expression, Config config, bool evaluating);
+
+    std::vector<std::unique_ptr<Shard>> _shards;
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_CACHE_H_
@@ -0,0 +1,215 @@
+#include "MathParserExecutor.h"
+
+#include <algorithm> // std::max, std::min, std::upper_bound
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+
+namespace MathParser {
+
+  StdThreadPool::StdThreadPool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+      _threads.emplace_back(&StdThreadPool::worker, this);
+    }
+  }
+
+  StdThreadPool::~StdThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _condition.notify_all();
+    for (std::thread &thread : _threads) {
+      thread.join();
+    }
+  }
+
+  size_t StdThreadPool::concurrency() const {
+    return _threads.size();
+  }
+
+  void StdThreadPool::run(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _tasks.push_back(std::move(task));
+    }
+    _condition.notify_one();
+  }
+
+  void StdThreadPool::worker() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+        if (_tasks.empty()) {
+          return;
+        }
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  // Shared between the calling thread and the pool tasks.
+  // Owned through a shared_ptr so pool tasks that start after the work is finished can still look at it safely.
+  struct Schedule {
+    // Range of chunk indices owned by a worker, packed as (begin << 32) | end so it can be updated with a single CAS.
+    // The owner takes chunks from the front and thieves take half of what is left from the back.
+    struct Range {
+      std::atomic<uint64_t> packed;
+      Range() : packed(0) { }
+    };
+
+    static uint64_t pack(uint64_t begin, uint64_t end) { return (begin << 32) | end; }
+    static uint64_t begin_of(uint64_t packed) { return packed >> 32; }
+    static uint64_t end_of(uint64_t packed) { return packed & 0xffffffffu; }
+
+    // Only called for chunks claimed by a worker, all of which run before wait() returns.
+    std::function<void(size_t)> task;
+    std::unique_ptr<Range[]> ranges;
+    size_t slots;
+
+    std::atomic<size_t> next_slot;
+    std::atomic<size_t> remaining;
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    Schedule(size_t total, const std::function<void(size_t)> &task_, size_t slots_)
+    : task(task_)
+    , ranges(new Range[slots_])
+    , slots(slots_)
+    , next_slot(0)
+    , remaining(total)
+    {
+      // Start each worker with a contiguous slice so neighbouring chunks stay on one thread.
+      for (size_t slot = 0; slot < slots; ++slot) {
+        ranges[slot].packed.store(pack(total * slot / slots, total * (slot + 1) / slots));
+      }
+    }
+
+    bool pop(size_t slot, size_t &chunk) {
+      std::atomic<uint64_t> &range = ranges[slot].packed;
+      uint64_t packed = range.load(std::memory_order_acquire);
+      while (begin_of(packed) < end_of(packed)) {
+        if (range.compare_exchange_weak(packed, pack(begin_of(packed) + 1, end_of(packed)), std::memory_order_acq_rel)) {
+          chunk = begin_of(packed);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Moves the back half of another worker's remaining chunks into this (empty) worker's range.
+    bool steal(size_t slot) {
+      for (size_t i = 1; i < slots; ++i) {
+        std::atomic<uint64_t> &victim = ranges[(slot + i) % slots].packed;
+        uint64_t packed = victim.load(std::memory_order_acquire);
+        while (begin_of(packed) < end_of(packed)) {
+          uint64_t begin = begin_of(packed);
+          uint64_t end = end_of(packed);
+          uint64_t split = end - (end - begin + 1) / 2;
+          if (victim.compare_exchange_weak(packed, pack(begin, split), std::memory_order_acq_rel)) {
+            ranges[slot].packed.store(pack(split, end), std::memory_order_release);
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    void evaluate(size_t chunk) {
+      task(chunk);
+      if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.notify_all();
+      }
+    }
+
+    void work() {
+      size_t slot = next_slot.fetch_add(1);
+      if (slot >= slots) {
+        return;
+      }
+      size_t chunk;
+      while (pop(slot, chunk) || (steal(slot) && pop(slot, chunk))) {
+        evaluate(chunk);
+      }
+    }
+
+    void wait() {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [this] { return remaining.load(std::memory_order_acquire) == 0; });
+    }
+  };
+
+  ParallelExecutor::ParallelExecutor(ThreadPool &pool, size_t chunk_size)
+  : _pool(pool)
+  , _chunk_size(std::max<size_t>(chunk_size, 1))
+  {
+  }
+
+  size_t ParallelExecutor::evaluate_batch(const Program &program, const double *in, double *out, size_t n, EvaluationErrorType *errors) {
+    BatchJob job(program, in, out, n, errors);
+    return evaluate_batches(&job, 1);
+  }
+
+  size_t ParallelExecutor::evaluate_batch(const Program &program, const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors) {
+    BatchJob job(program, variables, in, out, n, errors);
+    return evaluate_batches(&job, 1);
+  }
+
+  void ParallelExecutor::for_each(size_t count, const std::function<void(size_t)> &task) {
+    assert(count <= 0xffffffffu);
+
+    // Only wake as many pool threads as there are chunks to share with the calling thread.
+    size_t helpers = std::min(_pool.concurrency(), count > 0 ? count - 1 : 0);
+    std::shared_ptr<Schedule> schedule = std::make_shared<Schedule>(count, task, helpers + 1);
+    for (size_t i = 0; i < helpers; ++i) {
+      _pool.run([schedule] { schedule->work(); });
+    }
+    schedule->work();
+    schedule->wait();
+  }
+
+  size_t ParallelExecutor::evaluate_batches(BatchJob *jobs, size_t count) {
+    std::vector<size_t> first_chunk; // Index of each job's first chunk, plus the total chunk count.
+    first_chunk.reserve(count + 1);
+    size_t chunks = 0;
+    for (size_t i = 0; i < count; ++i) {
+      first_chunk.push_back(chunks);
+      chunks += (jobs[i].n + _chunk_size - 1) / _chunk_size;
+    }
+    first_chunk.push_back(chunks);
+
+    // Failed lanes per chunk, each written by exactly one worker.
+    std::vector<size_t> chunk_failed(chunks, 0);
+    for_each(chunks, [&](size_t chunk) {
+      size_t job_index = std::upper_bound(first_chunk.begin(), first_chunk.end(), chunk) - first_chunk.begin() - 1;
+      BatchJob &job = jobs[job_index];
+      size_t offset = (chunk - first_chunk[job_index]) * _chunk_size;
+      size_t n = std::min(_chunk_size, job.n - offset);
+      // Variable columns of the chunk, reused by each thread.
+      static thread_local std::vector<const double *> variables;
+      if (job.variables) {
+        variables.resize(job.program->variable_count());
+        for (size_t slot = 0; slot < variables.size(); ++slot) variables[slot] = job.variables[slot] + offset;
+      }
+      chunk_failed[chunk] = MathParser::evaluate_batch(*job.program, job.variables ? variables.data() : nullptr, job.in + offset, job.out + offset, n, job.errors ? job.errors + offset : nullptr);
+    });
+
+    size_t failed = 0;
+    for (size_t i = 0; i < count; ++i) {
+      jobs[i].failed = 0;
+      for (size_t chunk = first_chunk[i]; chunk < first_chunk[i + 1]; ++chunk) {
+        jobs[i].failed += chunk_failed[chunk];
+      }
+      failed += jobs[i].failed;
+    }
+    return failed;
+  }
+
+} // namespace MathParser
@@ -0,0 +1,94 @@
+#pragma once
+#ifndef MATH_PARSER_EXECUTOR_H_
+#define MATH_PARSER_EXECUTOR_H_
+
+#include "MathParser.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace MathParser {
+
+  // Interface to a thread pool owned by the caller.
+  // The executor only needs to hand off tasks; it never blocks a pool thread waiting on another task.
+  class ThreadPool {
+  public:
+    virtual ~ThreadPool() { }
+
+    // Number of tasks the pool can run at the same time.
+    virtual size_t concurrency() const = 0;
+
+    // Runs the task asynchronously on one of the pool's threads.
+    virtual void run(std::function<void()> task) = 0;
+  };
+
+  // Basic ThreadPool backed by std::thread, for callers that do not have a pool of their own.
+  class StdThreadPool : public ThreadPool {
+  public:
+    explicit StdThreadPool(size_t threads = std::thread::hardware_concurrency());
+    ~StdThreadPool();
+
+    size_t concurrency() const override;
+    void run(std::function<void()> task) override;
+
+  private:
+    void worker();
+
+    std::vector<std::thread> _threads;
+    std::deque<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _stopping = false;
+  };
+
+  // A program evaluated over one input column and its variable columns, as in evaluate_batch().
+  struct BatchJob {
+    const Program *program;
+    const double *in;
+    double *out;
+    size_t n;
+    EvaluationErrorType *errors = nullptr;
+    const double *const *variables = nullptr; // program->variable_count() columns of n values, or null.
+    size_t failed = 0; // Set by the executor to the number of failed lanes.
+
+    BatchJob(const Program &program_, const double *in_, double *out_, size_t n_, EvaluationErrorType *errors_ = nullptr)
+    : program(&program_), in(in_), out(out_), n(n_), errors(errors_) { }
+    BatchJob(const Program &program_, const double *const *variables_, const double *in_, double *out_, size_t n_, EvaluationErrorType *errors_ = nullptr)
+    : program(&program_), in(in_), out(out_), n(n_), errors(errors_), variables(variables_) { }
+  };
+
+  // Splits batch evaluations into cache sized chunks and schedules them across a thread pool with work stealing.
+  // Each worker starts with a contiguous range of chunks and steals half of the remaining range of another worker once its own runs out,
+  // so cheap and expensive (e.g. trig heavy) programs both keep every thread busy.
+  // The calling thread takes part in the work and the call returns once every chunk has been evaluated.
+  class ParallelExecutor {
+  public:
+    // Elements per chunk. Input, output and error columns for a chunk fit comfortably in L2.
+    static const size_t DEFAULT_CHUNK_SIZE = 8192;
+
+    explicit ParallelExecutor(ThreadPool &pool, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    // Same contract as MathParser::evaluate_batch().
+    size_t evaluate_batch(const Program &program, const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr);
+    size_t evaluate_batch(const Program &program, const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr);
+
+    // Evaluates many independent jobs together, filling in BatchJob::failed. Returns the total number of failed lanes.
+    size_t evaluate_batches(BatchJob *jobs, size_t count);
+    size_t evaluate_batches(std::vector<BatchJob> &jobs) { return evaluate_batches(jobs.data(), jobs.size()); }
+
+    // Runs task(i) exactly once for every i in [0, count) with the same scheduling, returning once all have run.
+    // Calls run concurrently on the pool and the calling thread.
+    void for_each(size_t count, const std::function<void(size_t)> &task);
+
+  private:
+    ThreadPool &_pool;
+    size_t _chunk_size;
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_EXECUTOR_H_
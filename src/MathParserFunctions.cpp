@@ -0,0 +1,43 @@
+#include "MathParserFunctions.h"
+#include "MathParserLexer.h" // is_identifier, to_lower
+
+namespace MathParser {
+
+  uint32_t FunctionRegistry::add(const std::string &name, size_t arity, Function::Scalar scalar, const FunctionOptions &options) {
+    if (name.empty() || is_digit(name[0]) || arity < 1 || arity > MAX_ARITY || !scalar || options.precedence < 1 || options.precedence > 200) {
+      return NO_FUNCTION;
+    }
+    std::string lower(name.size(), '\0');
+    for (size_t i = 0; i < name.size(); ++i) {
+      lower[i] = to_lower(name[i]);
+      if (!is_identifier(lower[i])) return NO_FUNCTION;
+    }
+    if (find(lower.data(), lower.size()) != NO_FUNCTION || _functions.size() >= NO_FUNCTION) {
+      return NO_FUNCTION;
+    }
+
+    Function function;
+    function.name = std::move(lower);
+    function.op = { Operator::Type::FUNCTION, Operator::Associativity::RIGHT, options.precedence, static_cast<int>(arity), nullptr };
+    function.pure = options.pure;
+    function.scalar = scalar;
+    function.batch = options.batch;
+    _functions.push_back(std::move(function));
+
+    // Growing the vector moves the names, so every operator's name is pointed at its string again.
+    for (Function &entry : _functions) entry.op.name = entry.name.c_str();
+    return static_cast<uint32_t>(_functions.size() - 1);
+  }
+
+  uint32_t FunctionRegistry::find(const char *name, size_t length) const {
+    for (size_t index = 0; index < _functions.size(); ++index) {
+      const std::string &candidate = _functions[index].name;
+      if (candidate.size() != length) continue;
+      size_t i = 0;
+      while (i < length && candidate[i] == to_lower(name[i])) ++i;
+      if (i == length) return static_cast<uint32_t>(index);
+    }
+    return NO_FUNCTION;
+  }
+
+} // namespace MathParser
@@ -0,0 +1,118 @@
+#pragma once
+#ifndef MATH_PARSER_FUNCTIONS_H_
+#define MATH_PARSER_FUNCTIONS_H_
+
+#include "MathParser.h"
+
+#include <cstdint>
+#include <string>
+#include <type_traits> // std::is_same
+#include <vector>
+
+namespace MathParser {
+
+  // Function registered for expressions to call by name, e.g. log(x), clamp(x, 0, 1) or a domain specific curve.
+  // Calls compile to one Operator::Type::FUNCTION instruction whose slot is the function's index in the registry, so
+  // evaluating one is an indexed load and a call through a plain function pointer, with no name lookup.
+  //
+  // Functions cannot fail: arguments outside their domain give NaN or an infinity, which are results like any other.
+  struct Function {
+    // Arguments in the order they are written.
+    typedef double (*Scalar)(const double *arguments);
+    // Column form for evaluate_batch(): arguments[j] holds count values of argument j, and lane i of the results is
+    // written to out[i]. out is arguments[0] itself, so each lane must be read before it is written.
+    typedef void (*Batch)(const double *const *arguments, double *out, size_t count);
+
+    std::string name;
+    Operator op; // Operator::Type::FUNCTION, with the arity as degree and the function's precedence.
+    bool pure;
+    Scalar scalar;
+    Batch batch;
+  };
+
+  struct FunctionOptions {
+    // Binding of the call, as for an operator. The default is that of the built in trig functions, which bind tighter
+    // than * and / but looser than ^, so f(2) ^ 2 is f(4); above 100 a call binds to its parens alone.
+    int precedence = 40;
+
+    // The result depends on the arguments alone, so calls with constant arguments are folded when compiling.
+    bool pure = true;
+
+    // Optional column form, used by evaluate_batch() instead of calling scalar once per lane. Must give the same
+    // results as scalar lane for lane.
+    Function::Batch batch = nullptr;
+  };
+
+  // Functions an expression may call, shared through Config::functions. Calls are written name(a, b, ...) with exactly
+  // the function's arity of comma separated arguments; functions of one argument may also be written without parens,
+  // as in sin 30. Names are identifiers ([a-z_][a-z0-9_]*) matched case insensitively against whole words, and take
+  // precedence over the built in keywords, so a registered sin replaces the built in one.
+  //
+  // Fill the registry before compiling with it; programs keep indexes into it, so it must not change while they are in
+  // use. Reading it from multiple threads is safe. Operators point at the registry's own names, so it is shared through
+  // Config::functions rather than copied or moved.
+  class FunctionRegistry {
+  public:
+    static constexpr size_t MAX_ARITY = 4;
+    static constexpr uint32_t NO_FUNCTION = 0xffffffffu;
+
+    FunctionRegistry() { }
+    FunctionRegistry(const FunctionRegistry &) = delete;
+    FunctionRegistry &operator=(const FunctionRegistry &) = delete;
+
+    // Registers a function of arity arguments, returning its index, or NO_FUNCTION, adding nothing, if name is not an
+    // identifier or is already registered, arity is not within [1, MAX_ARITY], the precedence is not within [1, 200]
+    // (that of literals) or scalar is null.
+    uint32_t add(const std::string &name, size_t arity, Function::Scalar scalar, const FunctionOptions &options = { });
+
+    // Index of the function named by [name, name + length), compared case insensitively, or NO_FUNCTION.
+    uint32_t find(const char *name, size_t length) const;
+
+    size_t size() const { return _functions.size(); }
+    const Function &operator[](uint32_t index) const { return _functions[index]; }
+
+    // Applies function index to the top of the value stack, which holds size values, in place, like Operator::eval().
+    EvaluationErrorType call(uint32_t index, double *values, size_t &size) const {
+      const Function &function = _functions[index];
+      const size_t arity = static_cast<size_t>(function.op.degree);
+      if (size < arity) {
+        return EvaluationErrorType::EXPECTED_MORE_ARGUMENTS;
+      }
+      values[size - arity] = function.scalar(values + size - arity);
+      size -= arity - 1;
+      return EvaluationErrorType::NONE;
+    }
+
+  private:
+    std::vector<Function> _functions;
+  };
+
+  // Operator of an instruction of a program compiled with config, which for calls is the registered function's.
+  inline const Operator &instruction_operator(const Program::Instruction &instruction, const Config &config) {
+    return instruction.type == Operator::Type::FUNCTION ? (*config.functions)[instruction.slot].op : Operator::from_type(instruction.type);
+  }
+
+  // Applies function to count lanes of its arguments, held in consecutive rows of stride values starting at first, and
+  // writes the results over the first row. Uses the function's column form for doubles, if it has one; float lanes are
+  // widened for the call and rounded once.
+  template<typename T>
+  inline void call_function_rows(const Function &function, T *first, size_t stride, size_t count) {
+    const size_t arity = static_cast<size_t>(function.op.degree);
+    if constexpr (std::is_same<T, double>::value) {
+      if (function.batch) {
+        const double *arguments[FunctionRegistry::MAX_ARITY];
+        for (size_t j = 0; j < arity; ++j) arguments[j] = first + j * stride;
+        function.batch(arguments, first, count);
+        return;
+      }
+    }
+    double arguments[FunctionRegistry::MAX_ARITY];
+    for (size_t i = 0; i < count; ++i) {
+      for (size_t j = 0; j < arity; ++j) arguments[j] = static_cast<double>(first[j * stride + i]);
+      first[i] = static_cast<T>(function.scalar(arguments));
+    }
+  }
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_FUNCTIONS_H_
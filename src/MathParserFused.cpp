@@ -0,0 +1,301 @@
+#include "MathParserFused.h"
+#include "MathParserBatch.h" // BATCH_BLOCK_SIZE, apply_unary, apply_binary, fail_batch
+
+#include "common/math.h" // common::math::e/pi/tau
+
+#include <algorithm> // std::copy, std::fill, std::max
+#include <cmath>     // NAN
+#include <cstring>   // std::memcpy
+#include <unordered_map>
+
+namespace MathParser {
+
+  struct FusedProgram::NodeKey {
+    Operator::Type type;
+    uint32_t slot;
+    uint64_t value; // Bits of the literal, so -0 and 0 stay apart.
+    uint32_t a;
+    uint32_t b;
+
+    bool operator==(const NodeKey &other) const {
+      return type == other.type && slot == other.slot && value == other.value && a == other.a && b == other.b;
+    }
+  };
+
+  struct FusedProgram::NodeKeyHash {
+    size_t operator()(const NodeKey &key) const {
+      uint64_t hash = static_cast<uint64_t>(key.type) * 0x9e3779b97f4a7c15ull;
+      for (uint64_t part : { static_cast<uint64_t>(key.slot), key.value, static_cast<uint64_t>(key.a), static_cast<uint64_t>(key.b) }) {
+        hash = (hash ^ part) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+      }
+      return static_cast<size_t>(hash);
+    }
+  };
+
+  // Operators that can fail whatever their operands.
+  static bool can_fail(Operator::Type type) {
+    switch (type) {
+      case Operator::Type::NONE:
+      case Operator::Type::PAREN_L:
+      case Operator::Type::PAREN_R:
+      case Operator::Type::DIVIDE:
+      case Operator::Type::EXPONENT:
+      case Operator::Type::PERCENTAGE:
+      case Operator::Type::TIMES:
+      case Operator::Type::VARIABLE:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  FusedProgram::FusedProgram(const std::vector<std::string> &expressions, const Config &config)
+  : _config(config)
+  {
+    std::unordered_map<NodeKey, uint32_t, NodeKeyHash> ids;
+    std::vector<uint32_t> stack;
+    _programs.reserve(expressions.size());
+    for (const std::string &expression : expressions) {
+      _programs.push_back(compile(expression, config));
+      const Program &program = _programs.back();
+      _instruction_count += program.instructions().size();
+      if (!program.is_valid() || program.uses_functions()) {
+        _roots.push_back(NO_NODE);
+        continue;
+      }
+
+      stack.clear();
+      for (const Program::Instruction &instruction : program.instructions()) {
+        if (instruction.type == Operator::Type::UNARY_PLUS) continue;
+
+        const int degree = Operator::from_type(instruction.type).degree;
+        NodeKey key = { instruction.type, 0, 0, NO_NODE, NO_NODE };
+        if (instruction.type == Operator::Type::NUMBER) std::memcpy(&key.value, &instruction.value, sizeof(key.value));
+        if (instruction.type == Operator::Type::VARIABLE) key.slot = instruction.slot;
+        if (degree == 2) {
+          key.b = stack.back();
+          stack.pop_back();
+        }
+        if (degree >= 1) {
+          key.a = stack.back();
+          stack.pop_back();
+        }
+
+        auto inserted = ids.emplace(key, static_cast<uint32_t>(_nodes.size()));
+        if (inserted.second) {
+          Node node;
+          node.type = key.type;
+          node.slot = key.slot;
+          node.value = instruction.value;
+          node.operands[0] = key.a;
+          node.operands[1] = key.b;
+          node.fallible = can_fail(key.type);
+          for (uint32_t operand : node.operands) {
+            if (operand != NO_NODE) node.fallible = node.fallible || _nodes[operand].fallible;
+          }
+          _nodes.push_back(node);
+        }
+        stack.push_back(inserted.first->second);
+      }
+      _roots.push_back(stack.back());
+    }
+    assign_outputs();
+    assign_rows();
+  }
+
+  void FusedProgram::assign_outputs() {
+    for (uint32_t root : _roots) {
+      if (root != NO_NODE) ++_nodes[root].output_count;
+    }
+    uint32_t first = 0;
+    for (Node &node : _nodes) {
+      node.first_output = first;
+      first += node.output_count;
+      node.output_count = 0;
+    }
+    _output_programs.resize(first);
+    for (size_t program = 0; program < _roots.size(); ++program) {
+      if (_roots[program] == NO_NODE) continue;
+      Node &node = _nodes[_roots[program]];
+      _output_programs[node.first_output + node.output_count++] = static_cast<uint32_t>(program);
+    }
+  }
+
+  // Linear scan over the nodes in order: a node's row is freed once its last reader has run, and a reader may take
+  // the row of an operand it is the last to read, since every kernel reads a lane before writing it.
+  void FusedProgram::assign_rows() {
+    std::vector<uint32_t> last_use(_nodes.size());
+    for (uint32_t id = 0; id < _nodes.size(); ++id) {
+      last_use[id] = id;
+      for (uint32_t operand : _nodes[id].operands) {
+        if (operand != NO_NODE) last_use[operand] = id;
+      }
+    }
+
+    std::vector<uint32_t> free_rows;
+    for (uint32_t id = 0; id < _nodes.size(); ++id) {
+      Node &node = _nodes[id];
+      for (size_t i = 0; i < 2; ++i) {
+        const uint32_t operand = node.operands[i];
+        if (operand == NO_NODE || last_use[operand] != id || (i == 1 && operand == node.operands[0])) continue;
+        free_rows.push_back(_nodes[operand].row);
+      }
+      if (free_rows.empty()) {
+        node.row = static_cast<uint32_t>(_row_count++);
+      } else {
+        node.row = free_rows.back();
+        free_rows.pop_back();
+      }
+      if (last_use[id] == id) free_rows.push_back(node.row);
+    }
+  }
+
+  void FusedProgram::evaluate(const double *variables, double current_value, CompactResult *results) const {
+    double inline_values[Program::INLINE_STACK_DEPTH];
+    uint8_t inline_failed[Program::INLINE_STACK_DEPTH];
+    std::vector<double> heap_values;
+    std::vector<uint8_t> heap_failed;
+    double *values = inline_values;
+    uint8_t *failed = inline_failed;
+    if (_row_count > Program::INLINE_STACK_DEPTH) {
+      heap_values.resize(_row_count);
+      heap_failed.resize(_row_count);
+      values = heap_values.data();
+      failed = heap_failed.data();
+    }
+
+    for (size_t program = 0; program < _roots.size(); ++program) {
+      if (_roots[program] == NO_NODE) results[program] = _programs[program].evaluate_compact(variables, current_value);
+    }
+
+    for (const Node &node : _nodes) {
+      double operands[2] = { 0.0, 0.0 };
+      uint8_t inherited = 0;
+      size_t size = 0;
+      for (uint32_t operand : node.operands) {
+        if (operand == NO_NODE) continue;
+        operands[size++] = values[_nodes[operand].row];
+        inherited |= failed[_nodes[operand].row];
+      }
+
+      double value = NAN;
+      bool error = false;
+      if (node.type == Operator::Type::NUMBER) {
+        value = node.value;
+      } else if (node.type == Operator::Type::VARIABLE) {
+        error = variables == nullptr;
+        if (variables) value = variables[node.slot];
+      } else {
+        error = Operator::from_type(node.type).eval(operands, size, _config, current_value) != EvaluationErrorType::NONE;
+        if (!error) value = operands[0];
+      }
+      values[node.row] = value;
+      failed[node.row] = inherited | static_cast<uint8_t>(error);
+
+      for (uint32_t i = 0; i < node.output_count; ++i) {
+        const uint32_t program = _output_programs[node.first_output + i];
+        // The first failing instruction is only known to the program itself.
+        results[program] = failed[node.row] ? _programs[program].evaluate_compact(variables, current_value) : CompactResult(value);
+      }
+    }
+  }
+
+  size_t FusedProgram::evaluate_batch(const double *const *variables, const double *in, double *const *out, size_t n, EvaluationErrorType *const *errors) const {
+    const bool use_degrees = _config.use_degrees;
+    const bool strict_trig = _config.strict_trig;
+
+    size_t total_failed = 0;
+    for (size_t program = 0; program < _roots.size(); ++program) {
+      if (_roots[program] != NO_NODE) continue;
+      EvaluationErrorType *program_errors = errors ? errors[program] : nullptr;
+      total_failed += _programs[program].is_valid() ? MathParser::evaluate_batch(_programs[program], variables, in, out[program], n, program_errors)
+                                                    : fail_batch(_programs[program].compile_result(), out[program], n, program_errors);
+    }
+    if (_nodes.empty()) {
+      return total_failed;
+    }
+
+    // One more row of flags, all clear, read for operands that cannot fail.
+    std::vector<double> values(_row_count * BATCH_BLOCK_SIZE);
+    std::vector<uint8_t> flags((_row_count + 1) * BATCH_BLOCK_SIZE);
+    const uint8_t *no_flags = flags.data() + _row_count * BATCH_BLOCK_SIZE;
+    std::vector<double> frame(_config.variables.size());
+
+    for (size_t offset = 0; offset < n; offset += BATCH_BLOCK_SIZE) {
+      const size_t count = std::min(BATCH_BLOCK_SIZE, n - offset);
+      const double *current = in + offset;
+
+      for (const Node &node : _nodes) {
+        double *t = values.data() + node.row * BATCH_BLOCK_SIZE;
+        uint8_t *tf = flags.data() + node.row * BATCH_BLOCK_SIZE;
+        const double *a = nullptr;
+        const double *b = nullptr;
+        const uint8_t *fa = no_flags;
+        const uint8_t *fb = no_flags;
+        if (node.operands[0] != NO_NODE) {
+          const Node &operand = _nodes[node.operands[0]];
+          a = values.data() + operand.row * BATCH_BLOCK_SIZE;
+          if (operand.fallible) fa = flags.data() + operand.row * BATCH_BLOCK_SIZE;
+        }
+        if (node.operands[1] != NO_NODE) {
+          const Node &operand = _nodes[node.operands[1]];
+          b = values.data() + operand.row * BATCH_BLOCK_SIZE;
+          if (operand.fallible) fb = flags.data() + operand.row * BATCH_BLOCK_SIZE;
+        }
+
+        // A node fails on the lanes where an operand failed and on those its own operator fails. Flags are written
+        // before values, which may overwrite an operand row.
+        if (node.fallible) {
+          for (size_t i = 0; i < count; ++i) tf[i] = static_cast<uint8_t>(fa[i] | fb[i]);
+        }
+        auto flag = [&](size_t i, bool condition, EvaluationErrorType) { tf[i] = static_cast<uint8_t>(tf[i] | static_cast<uint8_t>(condition)); };
+
+        switch (node.type) {
+          case Operator::Type::NUMBER: std::fill(t, t + count, node.value); break;
+          case Operator::Type::E:      std::fill(t, t + count, common::math::e<double>()); break;
+          case Operator::Type::PI:     std::fill(t, t + count, common::math::pi<double>()); break;
+          case Operator::Type::TAU:    std::fill(t, t + count, common::math::tau<double>()); break;
+
+          case Operator::Type::VARIABLE:
+            for (size_t i = 0; i < count; ++i) flag(i, variables == nullptr, EvaluationErrorType::EXPECTED_VARIABLE);
+            if (variables) {
+              std::copy(variables[node.slot] + offset, variables[node.slot] + offset + count, t);
+            } else {
+              std::fill(t, t + count, std::numeric_limits<double>::quiet_NaN());
+            }
+            break;
+
+          default:
+            if (!apply_unary(node.type, t, a, current, count, use_degrees, strict_trig, flag) && !apply_binary(node.type, t, a, b, count, flag)) {
+              // Never emitted by compile(), or left out while merging.
+              for (size_t i = 0; i < count; ++i) flag(i, true, EvaluationErrorType::UNEXPECTED_TOKEN);
+              std::fill(t, t + count, std::numeric_limits<double>::quiet_NaN());
+            }
+            break;
+        }
+
+        for (uint32_t k = 0; k < node.output_count; ++k) {
+          const uint32_t program = _output_programs[node.first_output + k];
+          double *program_out = out[program] + offset;
+          EvaluationErrorType *program_errors = errors ? errors[program] + offset : nullptr;
+          std::copy(t, t + count, program_out);
+          if (program_errors) std::fill(program_errors, program_errors + count, EvaluationErrorType::NONE);
+          if (!node.fallible) continue;
+
+          // Failing lanes are rare; the program finds which of its instructions failed first.
+          for (size_t i = 0; i < count; ++i) {
+            if (!tf[i]) continue;
+            for (size_t slot = 0; slot < frame.size() && variables; ++slot) frame[slot] = variables[slot][offset + i];
+            const CompactResult result = _programs[program].evaluate_compact(variables ? frame.data() : nullptr, current[i]);
+            program_out[i] = std::numeric_limits<double>::quiet_NaN();
+            if (program_errors) program_errors[i] = result.evaluation_error();
+            ++total_failed;
+          }
+        }
+      }
+    }
+    return total_failed;
+  }
+
+} // namespace MathParser
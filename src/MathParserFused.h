@@ -0,0 +1,86 @@
+#pragma once
+#ifndef MATH_PARSER_FUSED_H_
+#define MATH_PARSER_FUSED_H_
+
+#include "MathParser.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace MathParser {
+
+  // Set of expressions compiled together into one program with an output per expression, for families of formulas
+  // evaluated over the same inputs. The postfix programs are merged into a single expression DAG in which identical
+  // subtrees are one node, within and across expressions, so e.g. sin(2x) or (1 + (3x)) ^ 2 shared by many formulas
+  // is computed once per row. Subtrees are identical when they apply the same operators to the same literals, constants,
+  // variables and current value; operands are never reordered, so every output is bit for bit the result of evaluating
+  // its expression alone, errors included. Expressions calling registered functions are left out of the DAG and
+  // evaluated on their own.
+  //
+  // Immutable once built, so it can be evaluated from multiple threads.
+  class FusedProgram {
+  public:
+    // Compiles each expression with config; outputs are in the same order.
+    explicit FusedProgram(const std::vector<std::string> &expressions, const Config &config = { });
+
+    // Evaluates every expression for one row, writing size() results to results, with the same value and error as
+    // program(i).evaluate_compact(variables, current_value). program(i).diagnose() gives the full Result.
+    // Does not allocate unless row_count() exceeds Program::INLINE_STACK_DEPTH.
+    void evaluate(const double *variables, double current_value, CompactResult *results) const;
+    void evaluate(double current_value, CompactResult *results) const { evaluate(nullptr, current_value, results); }
+
+    // evaluate_batch() of every expression over the same n rows: out holds size() columns of n values, out[i] for
+    // expression i, and errors, if not null, size() columns of n errors. Returns the number of failed lanes, summed
+    // over the expressions. Lanes that fail are evaluated again on their own for their error, so programs with errors
+    // on many lanes are better evaluated apart.
+    size_t evaluate_batch(const double *const *variables, const double *in, double *const *out, size_t n, EvaluationErrorType *const *errors = nullptr) const;
+    size_t evaluate_batch(const double *in, double *const *out, size_t n, EvaluationErrorType *const *errors = nullptr) const {
+      return evaluate_batch(nullptr, in, out, n, errors);
+    }
+
+    size_t size() const { return _programs.size(); }
+    const Config &config() const { return _config; }
+
+    // Expression i compiled alone, e.g. for its compile_result() and diagnostics.
+    const Program &program(size_t i) const { return _programs[i]; }
+
+    // Operations evaluated per row, against the instructions of the programs evaluated one after the other.
+    size_t node_count() const { return _nodes.size(); }
+    size_t instruction_count() const { return _instruction_count; }
+
+    // Rows of values live at once, which is what evaluate() and each block of evaluate_batch() hold.
+    size_t row_count() const { return _row_count; }
+
+  private:
+    static constexpr uint32_t NO_NODE = 0xffffffffu;
+
+    struct Node {
+      Operator::Type type;
+      uint32_t slot;          // Variable read by Operator::Type::VARIABLE.
+      double value;           // Literal of Operator::Type::NUMBER.
+      uint32_t operands[2];   // Nodes of the operands, NO_NODE past the operator's degree.
+      uint32_t row = 0;       // Row holding the value, reused once every reader has run.
+      bool fallible = false;  // Whether the node or any node below it can fail.
+      uint32_t first_output = 0; // Programs whose value this node is: _output_programs[first_output, + output_count).
+      uint32_t output_count = 0;
+    };
+
+    struct NodeKey;
+    struct NodeKeyHash;
+
+    void assign_outputs();
+    void assign_rows();
+
+    Config _config;
+    std::vector<Program> _programs;
+    std::vector<Node> _nodes;               // Operands come before the nodes reading them.
+    std::vector<uint32_t> _roots;           // Node of each program's value, or NO_NODE if it is invalid or left out.
+    std::vector<uint32_t> _output_programs; // Valid programs grouped by root node.
+    size_t _instruction_count = 0;
+    size_t _row_count = 0;
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_FUSED_H_
@@ -0,0 +1,382 @@
+#include "MathParserGraph.h"
+#include "MathParserLexer.h"
+
+#include <algorithm> // std::find, std::max, std::min, std::sort, std::unique
+#include <cstring>   // std::memcmp
+
+namespace MathParser {
+
+  // Cells per task when a level is split across the executor's pool.
+  static const size_t GRAPH_CHUNK_SIZE = 256;
+
+  static std::string lower_case(const std::string &string) {
+    std::string lower(string);
+    for (char &c : lower) c = to_lower(c);
+    return lower;
+  }
+
+  static bool same_result(const CompactResult &a, const CompactResult &b) {
+    return std::memcmp(&a.value, &b.value, sizeof(double)) == 0 && a.status() == b.status() &&
+           a.parsing_error() == b.parsing_error() && a.evaluation_error() == b.evaluation_error() && a.instruction() == b.instruction();
+  }
+
+  FormulaGraph::FormulaGraph(ParallelExecutor *executor, const Config &config)
+  : _executor(executor)
+  , _config(config)
+  {
+    _config.variables.clear();
+  }
+
+  bool FormulaGraph::is_name(const std::string &name) {
+    if (name.empty() || is_digit(name[0])) {
+      return false;
+    }
+    for (char c : name) {
+      if (!is_identifier(to_lower(c))) return false;
+    }
+    return true;
+  }
+
+  uint32_t FormulaGraph::find(const std::string &name) const {
+    std::unordered_map<std::string, uint32_t>::const_iterator found = _ids.find(name);
+    return found == _ids.end() ? NO_CELL : found->second;
+  }
+
+  uint32_t FormulaGraph::find_or_add(const std::string &name) {
+    uint32_t id = find(name);
+    if (id != NO_CELL) {
+      return id;
+    }
+    id = static_cast<uint32_t>(_cells.size());
+    _cells.emplace_back();
+    _cells[id].name = name;
+    _ids.emplace(name, id);
+    _sorted = false;
+
+    // Formulas that named the cell before it existed read it from now on.
+    std::unordered_map<std::string, std::vector<uint32_t>>::iterator waiting = _waiting.find(name);
+    if (waiting != _waiting.end()) {
+      std::vector<uint32_t> formulas = std::move(waiting->second);
+      _waiting.erase(waiting);
+      _stats.waiting -= formulas.size();
+      for (uint32_t formula : formulas) {
+        if (_cells[formula].formula) {
+          compile(formula);
+          queue(formula);
+        }
+      }
+    }
+    return id;
+  }
+
+  bool FormulaGraph::set_value(const std::string &name, double value) {
+    if (!is_name(name)) {
+      return false;
+    }
+    uint32_t id = find_or_add(lower_case(name));
+    Cell &cell = _cells[id];
+    cell.formula = false;
+    cell.constant = value;
+    cell.expression.clear();
+    cell.program = Program();
+    cell.slots.clear();
+    unwait(id);
+    set_dependencies(id, { });
+    queue(id);
+    return true;
+  }
+
+  bool FormulaGraph::set_formula(const std::string &name, const std::string &expression) {
+    if (!is_name(name)) {
+      return false;
+    }
+    uint32_t id = find_or_add(lower_case(name));
+    _cells[id].formula = true;
+    _cells[id].expression = expression;
+    compile(id);
+    queue(id);
+    return true;
+  }
+
+  void FormulaGraph::compile(uint32_t id) {
+    Cell &cell = _cells[id];
+
+    // Names only match where a word starts (see Config::variables), so each run of identifier characters not starting
+    // with a digit is a candidate, e.g. "price" in "2 * price" but not in "2price" or "sinprice".
+    unwait(id);
+    const std::string lower = lower_case(cell.expression);
+    std::vector<std::string> names;
+    std::vector<uint32_t> slots;
+    for (size_t begin = 0; begin < lower.size(); ) {
+      if (!is_identifier(lower[begin])) {
+        ++begin;
+        continue;
+      }
+      size_t end = begin;
+      while (end < lower.size() && is_identifier(lower[end])) ++end;
+      if (!is_digit(lower[begin])) {
+        std::string candidate = lower.substr(begin, end - begin);
+        uint32_t found = find(candidate);
+        if (found == NO_CELL) {
+          if (std::find(cell.waiting.begin(), cell.waiting.end(), candidate) == cell.waiting.end()) {
+            _waiting[candidate].push_back(id);
+            cell.waiting.push_back(std::move(candidate));
+            ++_stats.waiting;
+          }
+        } else if (std::find(slots.begin(), slots.end(), found) == slots.end()) {
+          names.push_back(std::move(candidate));
+          slots.push_back(found);
+        }
+      }
+      begin = end;
+    }
+
+    Config config = _config;
+    config.variables = std::move(names);
+    cell.program = MathParser::compile(cell.expression, config);
+    ++_stats.compiled_cells;
+
+    // Only the names the program reads are dependencies; the rest were part of a number or a longer identifier.
+    std::vector<bool> read(slots.size(), false);
+    for (const Program::Instruction &instruction : cell.program.instructions()) {
+      if (instruction.type == Operator::Type::VARIABLE) read[instruction.slot] = true;
+    }
+    std::vector<uint32_t> dependencies;
+    for (size_t slot = 0; slot < slots.size(); ++slot) {
+      if (read[slot]) {
+        dependencies.push_back(slots[slot]);
+      } else {
+        slots[slot] = NO_CELL;
+      }
+    }
+    std::sort(dependencies.begin(), dependencies.end());
+    cell.slots = std::move(slots);
+    set_dependencies(id, std::move(dependencies));
+  }
+
+  void FormulaGraph::unwait(uint32_t id) {
+    Cell &cell = _cells[id];
+    for (const std::string &name : cell.waiting) {
+      std::unordered_map<std::string, std::vector<uint32_t>>::iterator waiting = _waiting.find(name);
+      if (waiting == _waiting.end()) {
+        continue; // Defined since, which took the whole entry; see find_or_add().
+      }
+      std::vector<uint32_t> &formulas = waiting->second;
+      formulas.erase(std::find(formulas.begin(), formulas.end(), id));
+      --_stats.waiting;
+      if (formulas.empty()) {
+        _waiting.erase(waiting);
+      }
+    }
+    cell.waiting.clear();
+  }
+
+  void FormulaGraph::set_dependencies(uint32_t id, std::vector<uint32_t> &&dependencies) {
+    Cell &cell = _cells[id];
+    if (dependencies == cell.dependencies) {
+      return;
+    }
+    for (uint32_t dependency : cell.dependencies) {
+      std::vector<uint32_t> &dependents = _cells[dependency].dependents;
+      dependents.erase(std::find(dependents.begin(), dependents.end(), id));
+    }
+    for (uint32_t dependency : dependencies) {
+      _cells[dependency].dependents.push_back(id);
+    }
+    cell.dependencies = std::move(dependencies);
+    _sorted = false;
+  }
+
+  void FormulaGraph::queue(uint32_t id) {
+    if (!_cells[id].queued) {
+      _cells[id].queued = true;
+      _pending.push_back(id);
+    }
+  }
+
+  // Finds the strongly connected components with Tarjan's algorithm, which completes every component after the
+  // components it reads, and assigns levels in that order. Cells joining or leaving a cycle are queued.
+  // https://en.wikipedia.org/wiki/Tarjan%27s_strongly_connected_components_algorithm
+  void FormulaGraph::sort() {
+    const size_t count = _cells.size();
+    std::vector<uint32_t> index(count, NO_CELL);
+    std::vector<uint32_t> low(count, 0);
+    std::vector<bool> on_stack(count, false);
+    std::vector<uint32_t> stack;
+    struct Visit {
+      uint32_t cell;
+      uint32_t edge;
+    };
+    std::vector<Visit> visits;
+    uint32_t next_index = 0;
+    uint32_t next_component = 0;
+    uint32_t levels = 0;
+
+    auto start = [&](uint32_t id) {
+      index[id] = low[id] = next_index++;
+      stack.push_back(id);
+      on_stack[id] = true;
+      visits.push_back({ id, 0 });
+    };
+
+    for (uint32_t root = 0; root < count; ++root) {
+      if (index[root] != NO_CELL) continue;
+      start(root);
+      while (!visits.empty()) {
+        const uint32_t id = visits.back().cell;
+        const std::vector<uint32_t> &dependencies = _cells[id].dependencies;
+        if (visits.back().edge < dependencies.size()) {
+          const uint32_t dependency = dependencies[visits.back().edge++];
+          if (index[dependency] == NO_CELL) {
+            start(dependency);
+          } else if (on_stack[dependency]) {
+            low[id] = std::min(low[id], index[dependency]);
+          }
+          continue;
+        }
+
+        visits.pop_back();
+        if (!visits.empty()) {
+          low[visits.back().cell] = std::min(low[visits.back().cell], low[id]);
+        }
+        if (low[id] != index[id]) {
+          continue;
+        }
+
+        // id is the root of a component made of the cells above it on the stack.
+        size_t begin = stack.size();
+        do {
+          --begin;
+          on_stack[stack[begin]] = false;
+          _cells[stack[begin]].component = next_component;
+        } while (stack[begin] != id);
+        uint32_t level = 0;
+        bool cyclic = stack.size() - begin > 1;
+        for (size_t i = begin; i < stack.size(); ++i) {
+          for (uint32_t dependency : _cells[stack[i]].dependencies) {
+            if (_cells[dependency].component != next_component) {
+              level = std::max(level, _cells[dependency].level + 1);
+            } else {
+              cyclic = true;
+            }
+          }
+        }
+        for (size_t i = begin; i < stack.size(); ++i) {
+          Cell &cell = _cells[stack[i]];
+          cell.level = level;
+          if (cyclic || cell.cyclic) queue(stack[i]);
+          cell.cyclic = cyclic;
+        }
+        levels = std::max(levels, level + 1);
+        stack.resize(begin);
+        ++next_component;
+      }
+    }
+
+    _levels.resize(levels);
+    _sorted = true;
+  }
+
+  void FormulaGraph::evaluate(Cell &cell) const {
+    const CompactResult previous = cell.result;
+    const Program &program = cell.program;
+    if (!cell.formula) {
+      cell.result = { cell.constant };
+    } else if (!program.is_valid()) {
+      cell.result = program.evaluate_compact();
+    } else {
+      // Report the first reference to a cell of the same cycle or to a failed cell.
+      cell.result = { 0.0 };
+      const std::vector<Program::Instruction> &instructions = program.instructions();
+      for (size_t i = 0; i < instructions.size() && cell.result.ok(); ++i) {
+        if (instructions[i].type != Operator::Type::VARIABLE) continue;
+        const Cell &dependency = _cells[cell.slots[instructions[i].slot]];
+        if (cell.cyclic && dependency.component == cell.component) {
+          cell.result = { EvaluationErrorType::CIRCULAR_REFERENCE, static_cast<uint32_t>(i) };
+        } else if (!dependency.result.ok()) {
+          cell.result = { EvaluationErrorType::EXPECTED_VARIABLE, static_cast<uint32_t>(i) };
+        }
+      }
+
+      if (cell.result.ok()) {
+        // Frame storage reused by each thread.
+        static thread_local std::vector<double> frame;
+        frame.resize(cell.slots.size());
+        for (size_t slot = 0; slot < cell.slots.size(); ++slot) {
+          frame[slot] = cell.slots[slot] == NO_CELL ? std::numeric_limits<double>::quiet_NaN() : _cells[cell.slots[slot]].result.value;
+        }
+        cell.result = program.evaluate_compact(frame.data());
+      }
+    }
+    cell.changed = !same_result(previous, cell.result);
+  }
+
+  size_t FormulaGraph::recalculate() {
+    ++_stats.recalculations;
+    if (!_sorted) {
+      sort();
+    }
+    for (uint32_t id : _pending) {
+      _levels[_cells[id].level].push_back(id);
+    }
+    _pending.clear();
+
+    size_t evaluated = 0;
+    for (std::vector<uint32_t> &level : _levels) {
+      // Cells reached from a cell of the same cycle join the level while it runs.
+      for (size_t done = 0; done < level.size(); ) {
+        const size_t begin = done;
+        const size_t count = level.size() - begin;
+        if (_executor && count > GRAPH_CHUNK_SIZE) {
+          _executor->for_each((count + GRAPH_CHUNK_SIZE - 1) / GRAPH_CHUNK_SIZE, [&](size_t chunk) {
+            const size_t end = std::min(count, (chunk + 1) * GRAPH_CHUNK_SIZE);
+            for (size_t i = chunk * GRAPH_CHUNK_SIZE; i < end; ++i) {
+              evaluate(_cells[level[begin + i]]);
+            }
+          });
+        } else {
+          for (size_t i = 0; i < count; ++i) {
+            evaluate(_cells[level[begin + i]]);
+          }
+        }
+
+        // Dependents always sit at a higher level, or at this one within a cycle.
+        done = level.size();
+        for (size_t i = begin; i < done; ++i) {
+          Cell &cell = _cells[level[i]];
+          cell.queued = false;
+          evaluated += cell.formula;
+          if (!cell.changed) continue;
+          for (uint32_t dependent : cell.dependents) {
+            Cell &next = _cells[dependent];
+            if (!next.queued) {
+              next.queued = true;
+              _levels[next.level].push_back(dependent);
+            }
+          }
+        }
+      }
+      level.clear();
+    }
+    _stats.evaluated_cells += evaluated;
+    return evaluated;
+  }
+
+  Result FormulaGraph::result(const std::string &name) const {
+    uint32_t id = find(lower_case(name));
+    if (id == NO_CELL) {
+      return { EvaluationErrorType::EXPECTED_VARIABLE };
+    }
+    return _cells[id].program.diagnose(_cells[id].result);
+  }
+
+  double FormulaGraph::value(const std::string &name) const {
+    uint32_t id = find(lower_case(name));
+    return id == NO_CELL ? std::numeric_limits<double>::quiet_NaN() : _cells[id].result.value;
+  }
+
+  bool FormulaGraph::contains(const std::string &name) const {
+    return find(lower_case(name)) != NO_CELL;
+  }
+
+} // namespace MathParser
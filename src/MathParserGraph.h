@@ -0,0 +1,109 @@
+#pragma once
+#ifndef MATH_PARSER_GRAPH_H_
+#define MATH_PARSER_GRAPH_H_
+
+#include "MathParser.h"
+#include "MathParserExecutor.h" // ParallelExecutor
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace MathParser {
+
+  // Named cells holding either a value or a formula that reads other cells by name, as in a spreadsheet.
+  // Each formula is compiled once with the cells it names as its variables (see Config::variables), and the cells form
+  // a dependency graph that recalculate() brings up to date by evaluating only the cells downstream of a change,
+  // level by level. A cell whose value comes out unchanged does not dirty the cells reading it.
+  // Cells of one level do not read each other, so with an executor large levels are split across its pool.
+  //
+  // Names are identifiers ([a-z_][a-z0-9_]*), compared case insensitively, and shadow the built in keywords in the
+  // formulas naming them. Formulas may name cells defined later.
+  // Cells in a cycle fail with EvaluationErrorType::CIRCULAR_REFERENCE, and cells reading a failed cell fail with
+  // EvaluationErrorType::EXPECTED_VARIABLE, both reported at the reference.
+  // Not thread safe; recalculate() does its own threading.
+  class FormulaGraph {
+  public:
+    struct Stats {
+      size_t recalculations = 0;
+      size_t evaluated_cells = 0; // Formulas evaluated by recalculate().
+      size_t compiled_cells = 0;  // Formulas compiled by set_formula() and by names being defined.
+      size_t waiting = 0;         // Names formulas read that are not cells yet, counted once per formula; not cumulative.
+    };
+
+    // Evaluates on the calling thread alone when executor is null. Formulas are compiled with config,
+    // whose variables are ignored.
+    explicit FormulaGraph(ParallelExecutor *executor = nullptr, const Config &config = { });
+
+    // Sets the cell to a constant value or to a formula, creating it if needed. Returns false, changing nothing,
+    // if name is not an identifier. Results are only updated by recalculate().
+    bool set_value(const std::string &name, double value);
+    bool set_formula(const std::string &name, const std::string &expression);
+
+    // Evaluates every cell affected by the changes since the last call. Returns the number of formulas evaluated.
+    size_t recalculate();
+
+    // Result of the cell as of the last recalculate(). Unknown cells fail with EvaluationErrorType::EXPECTED_VARIABLE.
+    Result result(const std::string &name) const;
+
+    // Value of the cell as of the last recalculate(), or NaN if it failed.
+    double value(const std::string &name) const;
+
+    bool contains(const std::string &name) const;
+    size_t size() const { return _cells.size(); }
+    const Stats &stats() const { return _stats; }
+
+  private:
+    static constexpr uint32_t NO_CELL = 0xffffffffu;
+
+    struct Cell {
+      std::string name;
+      bool formula = false;
+      double constant = 0.0;
+      std::string expression;
+      Program program;
+      std::vector<uint32_t> slots;        // Cell read by each variable slot of program, or NO_CELL for names it does not read.
+      std::vector<uint32_t> dependencies; // Distinct cells read, sorted.
+      std::vector<uint32_t> dependents;
+      std::vector<std::string> waiting;   // Names read that are not cells yet, each listing the cell in _waiting.
+
+      uint32_t level = 0;     // One more than the highest level read, outside the cell's own cycle.
+      uint32_t component = 0; // Strongly connected component; cells of a cycle share one.
+      bool cyclic = false;
+
+      CompactResult result = CompactResult(std::numeric_limits<double>::quiet_NaN());
+      bool queued = false;  // Waiting in _pending or in a level.
+      bool changed = false; // Set by evaluate() when result differs from the previous one.
+    };
+
+    static bool is_name(const std::string &name);
+
+    uint32_t find(const std::string &name) const;
+    uint32_t find_or_add(const std::string &name);
+    void compile(uint32_t id);
+    void unwait(uint32_t id);
+    void set_dependencies(uint32_t id, std::vector<uint32_t> &&dependencies);
+    void queue(uint32_t id);
+    void sort();
+    void evaluate(Cell &cell) const;
+
+    ParallelExecutor *_executor;
+    Config _config;
+    std::vector<Cell> _cells;
+    std::unordered_map<std::string, uint32_t> _ids;
+
+    // Formulas naming an identifier that was not a cell when they were compiled, compiled again once it is.
+    std::unordered_map<std::string, std::vector<uint32_t>> _waiting;
+
+    // Cells changed since the last recalculate(). Levels are recomputed first if dependencies changed.
+    std::vector<uint32_t> _pending;
+    bool _sorted = true;
+    std::vector<std::vector<uint32_t>> _levels;
+
+    Stats _stats;
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_GRAPH_H_
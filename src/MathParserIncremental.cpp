@@ -0,0 +1,333 @@
+#include "MathParserIncremental.h"
+#include "MathParserLexer.h"
+
+#include <algorithm> // std::copy, std::min, std::max, std::partition_point
+#include <cstring>   // std::memcmp
+
+namespace MathParser {
+
+  static const uint32_t NO_REUSE = 0xffffffffu;
+
+  IncrementalExpression::IncrementalExpression(const std::string &text, const Config &config)
+  : _config(config)
+  {
+    assign(text);
+  }
+
+  void IncrementalExpression::assign(const std::string &text) {
+    edit(0, _text.size(), text);
+  }
+
+  void IncrementalExpression::edit(size_t position, size_t length, const std::string &text) {
+    edit(position, length, text.data(), text.size());
+  }
+
+  void IncrementalExpression::edit(size_t position, size_t length, const char *text, size_t text_length) {
+    position = std::min(position, _text.size());
+    length = std::min(length, _text.size() - position);
+    const size_t old_end = position + length;
+    const size_t edit_end = position + text_length;
+    _text.replace(position, length, text, text_length);
+    ++_stats.edits;
+
+    // Pieces before the edit only change if scanning them read an edited character.
+    size_t restart = position > MATCH_LOOKAHEAD ? position - MATCH_LOOKAHEAD : 0;
+    // Identifiers are read to their end, however far that is, and only match where a word starts.
+    const bool words = !_config.variables.empty() || _config.functions;
+    if (words) {
+      while (restart > 0 && is_identifier(to_lower(_text[restart - 1]))) --restart;
+    }
+    const size_t first = static_cast<size_t>(std::partition_point(_pieces.begin(), _pieces.end(), [&](const Piece &piece) {
+      return piece.begin + piece.length < restart;
+    }) - _pieces.begin());
+
+    // Scan until reaching, past the edit, the start of an old piece: the text from there on is unchanged,
+    // so scanning it again would repeat the old pieces.
+    _scanned.clear();
+    size_t old = first;
+    size_t i = first > 0 ? _pieces[first - 1].begin + _pieces[first - 1].length : 0;
+    const size_t size = _text.size();
+    for (;;) {
+      while (i < size && is_space(_text[i])) ++i;
+      if (i >= edit_end) {
+        while (old < _pieces.size() && (_pieces[old].begin < old_end || _pieces[old].begin - length + text_length < i)) ++old;
+        // An old piece right after a word character may have been the start of a word before the edit.
+        if (old < _pieces.size() && _pieces[old].begin - length + text_length == i && !(words && i > 0 && is_identifier(to_lower(_text[i - 1])))) {
+          break;
+        }
+      }
+      if (i >= size) {
+        old = _pieces.size();
+        break;
+      }
+
+      Token::Id id = Token::Id::NONE;
+      uint32_t slot = 0;
+      size_t matched = match_token(_text.data(), size, i, _config.variables, _config.functions.get(), id, slot);
+      Piece piece = { };
+      piece.begin = i;
+      piece.length = static_cast<uint32_t>(matched > 0 ? matched : 1);
+      piece.matched = matched > 0;
+      piece.id = static_cast<uint8_t>(id);
+      piece.slot = slot;
+      if (piece.matched && id == Token::Id::NONE) {
+        piece.number = Token(_text.data() + i, matched, id, slot).value;
+      }
+      _scanned.push_back(piece);
+      i += piece.length;
+    }
+    _stats.scanned_tokens += _scanned.size();
+
+    // Splice the new pieces over [first, old) and move the rest by the change in length.
+    const size_t removed = old - first;
+    const size_t added = _scanned.size();
+
+    // The tree only depends on the kinds of the pieces, so it survives edits such as retyping the digits of a number.
+    bool same_kinds = added == removed;
+    for (size_t j = 0; j < added && same_kinds; ++j) {
+      const Piece &before = _pieces[first + j];
+      const Piece &after = _scanned[j];
+      same_kinds = before.matched == after.matched && before.id == after.id && before.slot == after.slot;
+    }
+    for (size_t j = first; j < old; ++j) {
+      _invalid_pieces -= !_pieces[j].matched;
+    }
+    for (const Piece &piece : _scanned) {
+      _invalid_pieces += !piece.matched;
+    }
+    if (added > removed) {
+      _pieces.insert(_pieces.begin() + static_cast<ptrdiff_t>(old), added - removed, Piece());
+    } else {
+      _pieces.erase(_pieces.begin() + static_cast<ptrdiff_t>(first + added), _pieces.begin() + static_cast<ptrdiff_t>(old));
+    }
+    std::copy(_scanned.begin(), _scanned.end(), _pieces.begin() + static_cast<ptrdiff_t>(first));
+    for (size_t j = first + added; j < _pieces.size(); ++j) {
+      _pieces[j].begin = _pieces[j].begin - length + text_length;
+    }
+
+    // Grow the dirty range to cover the new pieces, moving it along with the pieces after the edit.
+    if (_dirty) {
+      auto move = [&](size_t index, size_t inside) { return index < first ? index : index >= old ? index - removed + added : inside; };
+      _dirty_begin = std::min(move(_dirty_begin, first), first);
+      _dirty_end = std::max(move(_dirty_end, first + added), first + added);
+    } else {
+      _dirty = true;
+      _dirty_begin = first;
+      _dirty_end = first + added;
+    }
+    _parsed = _parsed && same_kinds;
+  }
+
+  // Builds the tree with the same shunting-yard pass as Compiler::compile(), so it accepts exactly the programs
+  // compile() does and evaluates their instructions in the same order. Spans of pieces are tracked for each node,
+  // and a node's span is extended over the parens around it.
+  void IncrementalExpression::parse() {
+    _parsed = true;
+    _valid = false;
+    _regular = true;
+    _nodes.clear();
+    _operators.clear();
+    _operands.clear();
+    _open_depths.clear();
+    if (_invalid_pieces > 0) {
+      return;
+    }
+
+    auto emit = [&](Operator::Type type, uint32_t piece) {
+      const size_t degree = static_cast<size_t>(Operator::from_type(type).degree);
+      if (_operands.size() < degree) {
+        return false;
+      }
+      const uint32_t index = static_cast<uint32_t>(_nodes.size());
+      Node node = { type, piece, index, piece, piece, type == Operator::Type::PERCENTAGE || type == Operator::Type::TIMES || type == Operator::Type::VARIABLE };
+      for (size_t j = _operands.size() - degree; j < _operands.size(); ++j) {
+        const Node &child = _nodes[_operands[j]];
+        node.begin = std::min(node.begin, child.begin);
+        node.first = std::min(node.first, child.first);
+        node.last = std::max(node.last, child.last);
+        node.dynamic = node.dynamic || child.dynamic;
+      }
+      _operands.resize(_operands.size() - degree);
+      // Subtrees of a regular tree cover disjoint runs of pieces, which the permissive grammar does not guarantee
+      // (e.g. "-1 2 +" negates 2).
+      if (!_operands.empty() && _nodes[_operands.back()].last >= node.first) {
+        _regular = false;
+      }
+      _nodes.push_back(node);
+      _operands.push_back(index);
+      return true;
+    };
+
+    bool left_is_edge = true;
+    for (uint32_t index = 0; index < _pieces.size(); ++index) {
+      const Piece &piece = _pieces[index];
+      const Token::Id id = static_cast<Token::Id>(piece.id);
+      if (id == Token::Id::FUNCTION || id == Token::Id::COMMA) {
+        // Calls are left to compile(), which checks their arguments.
+        return;
+      }
+      if (id == Token::Id::NONE || id == Token::Id::VARIABLE) {
+        emit(id == Token::Id::NONE ? Operator::Type::NUMBER : Operator::Type::VARIABLE, index);
+        left_is_edge = false;
+        continue;
+      }
+
+      const Operator &op = Token(_text.data() + piece.begin, piece.length, id, piece.slot, left_is_edge).op;
+      left_is_edge = op.type != Operator::Type::PAREN_R;
+      switch(op.type) {
+        default:
+          while (!_operators.empty()) {
+            const Operator &t = Operator::from_type(_operators.back().type);
+            if ((op.associativity == Operator::Associativity::LEFT && op.precedence <= t.precedence) ||
+                (op.associativity == Operator::Associativity::RIGHT && op.precedence < t.precedence)) {
+              if (!emit(t.type, _operators.back().piece)) {
+                return;
+              }
+              _operators.pop_back();
+            } else {
+              break;
+            }
+          }
+          _operators.push_back({ op.type, index });
+          break;
+
+        case Operator::Type::PAREN_L:
+          _operators.push_back({ op.type, index });
+          _open_depths.push_back(static_cast<uint32_t>(_operands.size()));
+          break;
+
+        case Operator::Type::PAREN_R:
+          if (_operators.empty()) {
+            return;
+          }
+          while (!_operators.empty()) {
+            if (_operators.back().type == Operator::Type::PAREN_L) {
+              // A group that leaves anything but one value is part of a larger irregular subtree.
+              if (_operands.size() == _open_depths.back() + 1) {
+                Node &group = _nodes[_operands.back()];
+                group.first = std::min(group.first, _operators.back().piece);
+                group.last = index;
+              } else {
+                _regular = false;
+              }
+              _open_depths.pop_back();
+              _operators.pop_back();
+              break;
+            }
+            if (!emit(_operators.back().type, _operators.back().piece)) {
+              return;
+            }
+            _operators.pop_back();
+            if (_operators.empty()) {
+              return;
+            }
+          }
+          break;
+      }
+    }
+
+    while (!_operators.empty()) {
+      if (_operators.back().type == Operator::Type::PAREN_L || !emit(_operators.back().type, _operators.back().piece)) {
+        return;
+      }
+      _operators.pop_back();
+    }
+    _valid = _operands.size() == 1;
+  }
+
+  // A node's cached value can be reused if it was computed for a subtree of the same shape over the same pieces.
+  bool IncrementalExpression::is_clean(const Node &node, bool inputs_changed) const {
+    const Piece &piece = _pieces[node.piece];
+    return piece.cached && piece.type == node.type && piece.left == node.piece - node.first && piece.right == node.last - node.piece &&
+           !(_dirty && node.first < _dirty_end && node.last >= _dirty_begin) &&
+           !(inputs_changed && node.dynamic);
+  }
+
+  Result IncrementalExpression::evaluate(double current_value) {
+    return evaluate(nullptr, current_value);
+  }
+
+  Result IncrementalExpression::evaluate(const double *variables, double current_value) {
+    if (!_parsed) {
+      parse();
+    }
+    if (!_valid) {
+      return evaluate_text(variables, current_value);
+    }
+
+    // Inputs are compared bit for bit, since results can tell 0 from -0.
+    const size_t variable_count = _config.variables.size();
+    const bool inputs_changed = !_has_inputs ||
+      std::memcmp(&current_value, &_current_value, sizeof(double)) != 0 ||
+      (variables != nullptr) != _has_variables ||
+      (variables && variable_count != 0 && std::memcmp(variables, _variables.data(), variable_count * sizeof(double)) != 0);
+
+    // Nodes are clean only if their subtrees are, so walking back from the root finds each largest clean subtree first.
+    const size_t count = _nodes.size();
+    _reuse.assign(count, NO_REUSE);
+    if (_regular) {
+      for (size_t p = count; p > 0; ) {
+        --p;
+        if (is_clean(_nodes[p], inputs_changed)) {
+          _reuse[_nodes[p].begin] = static_cast<uint32_t>(p);
+          p = _nodes[p].begin;
+        }
+      }
+    }
+
+    _values.clear();
+    for (size_t p = 0; p < count; ++p) {
+      if (_reuse[p] != NO_REUSE) {
+        p = _reuse[p];
+        _values.push_back(_pieces[_nodes[p].piece].value);
+        continue;
+      }
+
+      const Node &node = _nodes[p];
+      Piece &piece = _pieces[node.piece];
+      EvaluationErrorType error = EvaluationErrorType::NONE;
+      if (node.type == Operator::Type::NUMBER) {
+        _values.push_back(piece.number);
+      } else if (node.type == Operator::Type::VARIABLE) {
+        if (variables) {
+          _values.push_back(variables[piece.slot]);
+        } else {
+          error = EvaluationErrorType::EXPECTED_VARIABLE;
+        }
+      } else {
+        size_t size = _values.size();
+        _values.push_back(0.0); // Room for constants.
+        error = Operator::from_type(node.type).eval(_values.data(), size, _config, current_value);
+        _values.resize(size);
+      }
+      ++_stats.evaluated_nodes;
+
+      if (error != EvaluationErrorType::NONE) {
+        // Values computed here were for the new inputs, so none of the dynamic ones can be trusted next time.
+        _has_inputs = false;
+        return evaluate_text(variables, current_value);
+      }
+
+      // Irregular subtrees are not a function of their span alone.
+      piece.cached = _regular;
+      piece.type = node.type;
+      piece.left = node.piece - node.first;
+      piece.right = node.last - node.piece;
+      piece.value = _values.back();
+    }
+
+    _dirty = false;
+    _has_inputs = true;
+    _current_value = current_value;
+    _has_variables = variables != nullptr;
+    if (variables) {
+      _variables.assign(variables, variables + variable_count);
+    }
+    return { _values[0] };
+  }
+
+  Result IncrementalExpression::evaluate_text(const double *variables, double current_value) const {
+    return compile(_text, _config).evaluate(variables, current_value);
+  }
+
+} // namespace MathParser
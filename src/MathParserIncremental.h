@@ -0,0 +1,129 @@
+#pragma once
+#ifndef MATH_PARSER_INCREMENTAL_H_
+#define MATH_PARSER_INCREMENTAL_H_
+
+#include "MathParser.h"
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace MathParser {
+
+  // Expression that is edited in place and re-evaluated after each edit, for callers such as a calculator display or a
+  // spreadsheet cell that evaluate on every keystroke. Results are the same as evaluate_expression() on text().
+  //
+  // Tokens are kept across edits: an edit re-scans only from the token before it up to the first token after it that
+  // scans the same as before, so literals outside the edit are never converted again. The parse tree is kept while
+  // edits leave the kinds of the tokens alone (e.g. retyping a number) and is otherwise rebuilt from the kept tokens
+  // without scanning text. Every node caches its value on the token that produced it, so evaluation only runs the
+  // subtrees covering an edit (e.g. the chain of enclosing parens) and reuses the rest. A changed current value or
+  // variable frame only re-runs the subtrees that read it.
+  //
+  // Errors are reported by compiling the whole text, since their positions refer to the filtered expression, and so
+  // are texts calling functions of Config::functions.
+  // Not thread safe; use one per expression being edited.
+  class IncrementalExpression {
+  public:
+    struct Stats {
+      size_t edits = 0;
+      size_t scanned_tokens = 0;  // Tokens scanned by edits, including the ones that turned out unchanged.
+      size_t evaluated_nodes = 0; // Nodes run by evaluate(); reused subtrees are not counted.
+    };
+
+    explicit IncrementalExpression(const std::string &text = "", const Config &config = { });
+
+    // Replaces length characters of the text at position with [text, text + text_length), like std::string::replace()
+    // except that position and length are clamped to the text.
+    void edit(size_t position, size_t length, const char *text, size_t text_length);
+    void edit(size_t position, size_t length, const std::string &text);
+
+    // Replaces the whole text.
+    void assign(const std::string &text);
+
+    const std::string &text() const { return _text; }
+    const Config &config() const { return _config; }
+
+    // Evaluates text(), reading variables from the frame, which holds config().variables.size() values indexed by slot.
+    Result evaluate(double current_value = std::numeric_limits<double>::quiet_NaN());
+    Result evaluate(const double *variables, double current_value = std::numeric_limits<double>::quiet_NaN());
+
+    // Cumulative over every call.
+    const Stats &stats() const { return _stats; }
+
+  private:
+    // Token of the text, with the value of the parse tree node it produced when last evaluated.
+    struct Piece {
+      size_t begin;    // Offset into the text.
+      uint32_t length;
+      bool matched;    // False for a character that does not start a token, which makes the text invalid.
+      uint8_t id;      // Token::Id.
+      uint32_t slot;   // Variable slot.
+      double number;   // Literal value, for numbers.
+
+      // Node cache, valid until the piece is scanned again or a node with another shape is built from it.
+      bool cached;
+      Operator::Type type;
+      uint32_t left;  // Pieces the node's subtree spans before and after this one, parens included.
+      uint32_t right;
+      double value;
+    };
+
+    // Node of the parse tree, in postfix order so each subtree is the range [begin, index].
+    struct Node {
+      Operator::Type type;
+      uint32_t piece;
+      uint32_t begin;
+      uint32_t first; // Span of pieces, parens included.
+      uint32_t last;
+      bool dynamic;   // Reads the current value or a variable.
+    };
+
+    // Operator waiting on the shunting-yard stack.
+    struct Pending {
+      Operator::Type type;
+      uint32_t piece;
+    };
+
+    void parse();
+    bool is_clean(const Node &node, bool inputs_changed) const;
+    Result evaluate_text(const double *variables, double current_value) const;
+
+    Config _config;
+    std::string _text;
+    std::vector<Piece> _pieces;
+    size_t _invalid_pieces = 0;
+
+    // Pieces scanned since the last complete evaluation, as the range [_dirty_begin, _dirty_end) of _pieces.
+    bool _dirty = true;
+    size_t _dirty_begin = 0;
+    size_t _dirty_end = 0;
+
+    // Tree built from _pieces, or _parsed is false after an edit that changed their kinds. _valid is false if the pieces do not form a
+    // program, and _regular is false if subtrees do not cover disjoint runs of pieces, so values cannot be reused.
+    bool _parsed = false;
+    bool _valid = false;
+    bool _regular = false;
+    std::vector<Node> _nodes;
+
+    // Inputs of the last complete evaluation.
+    bool _has_inputs = false;
+    double _current_value = 0.0;
+    bool _has_variables = false;
+    std::vector<double> _variables;
+
+    // Buffers reused across edits and evaluations.
+    std::vector<Piece> _scanned;
+    std::vector<Pending> _operators;
+    std::vector<uint32_t> _operands;
+    std::vector<uint32_t> _open_depths;
+    std::vector<uint32_t> _reuse;
+    std::vector<double> _values;
+
+    Stats _stats;
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_INCREMENTAL_H_
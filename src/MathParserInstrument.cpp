@@ -0,0 +1,86 @@
+#include "MathParserInstrument.h"
+
+#include <algorithm> // std::max
+
+namespace MathParser {
+
+  static std::atomic<InstrumentationHook *> installed_hook{ nullptr };
+
+  void set_instrumentation_hook(InstrumentationHook *hook) {
+    installed_hook.store(hook, std::memory_order_release);
+  }
+
+  InstrumentationHook *instrumentation_hook() {
+    return installed_hook.load(std::memory_order_acquire);
+  }
+
+  InstrumentationStats &InstrumentationStats::operator+=(const InstrumentationStats &other) {
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+      calls[i] += other.calls[i];
+      nanoseconds[i] += other.nanoseconds[i];
+      max_nanoseconds[i] = std::max(max_nanoseconds[i], other.max_nanoseconds[i]);
+    }
+    compiles += other.compiles;
+    tokens += other.tokens;
+    max_stack_depth = std::max(max_stack_depth, other.max_stack_depth);
+    for (size_t i = 0; i < PARSING_ERROR_TYPE_COUNT; ++i) parsing_errors[i] += other.parsing_errors[i];
+    for (size_t i = 0; i < EVALUATION_ERROR_TYPE_COUNT; ++i) evaluation_errors[i] += other.evaluation_errors[i];
+    return *this;
+  }
+
+  static void store_max(std::atomic<uint64_t> &maximum, uint64_t value) {
+    uint64_t seen = maximum.load(std::memory_order_relaxed);
+    while (seen < value && !maximum.compare_exchange_weak(seen, value, std::memory_order_relaxed)) { }
+  }
+
+  void InstrumentationCounters::stage(Stage stage, uint64_t nanoseconds) {
+    const size_t i = static_cast<size_t>(stage);
+    _calls[i].fetch_add(1, std::memory_order_relaxed);
+    _nanoseconds[i].fetch_add(nanoseconds, std::memory_order_relaxed);
+    store_max(_max_nanoseconds[i], nanoseconds);
+  }
+
+  void InstrumentationCounters::compiled(size_t tokens, size_t max_stack_depth, const Result &result) {
+    _compiles.fetch_add(1, std::memory_order_relaxed);
+    _tokens.fetch_add(tokens, std::memory_order_relaxed);
+    store_max(_max_stack_depth, max_stack_depth);
+    if (result.status == Status::EVALUATION_ERROR) {
+      _evaluation_errors[static_cast<size_t>(result.evaluation_error)].fetch_add(1, std::memory_order_relaxed);
+    } else {
+      _parsing_errors[static_cast<size_t>(result.status == Status::SUCCESS ? ParsingErrorType::NONE : result.parsing_error)].fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void InstrumentationCounters::evaluation_failed(EvaluationErrorType error) {
+    _evaluation_errors[static_cast<size_t>(error)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  InstrumentationStats InstrumentationCounters::stats() const {
+    InstrumentationStats stats;
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+      stats.calls[i] = _calls[i].load(std::memory_order_relaxed);
+      stats.nanoseconds[i] = _nanoseconds[i].load(std::memory_order_relaxed);
+      stats.max_nanoseconds[i] = _max_nanoseconds[i].load(std::memory_order_relaxed);
+    }
+    stats.compiles = _compiles.load(std::memory_order_relaxed);
+    stats.tokens = _tokens.load(std::memory_order_relaxed);
+    stats.max_stack_depth = _max_stack_depth.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < PARSING_ERROR_TYPE_COUNT; ++i) stats.parsing_errors[i] = _parsing_errors[i].load(std::memory_order_relaxed);
+    for (size_t i = 0; i < EVALUATION_ERROR_TYPE_COUNT; ++i) stats.evaluation_errors[i] = _evaluation_errors[i].load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  void InstrumentationCounters::reset() {
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+      _calls[i].store(0, std::memory_order_relaxed);
+      _nanoseconds[i].store(0, std::memory_order_relaxed);
+      _max_nanoseconds[i].store(0, std::memory_order_relaxed);
+    }
+    _compiles.store(0, std::memory_order_relaxed);
+    _tokens.store(0, std::memory_order_relaxed);
+    _max_stack_depth.store(0, std::memory_order_relaxed);
+    for (std::atomic<uint64_t> &count : _parsing_errors) count.store(0, std::memory_order_relaxed);
+    for (std::atomic<uint64_t> &count : _evaluation_errors) count.store(0, std::memory_order_relaxed);
+  }
+
+} // namespace MathParser
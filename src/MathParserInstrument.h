@@ -0,0 +1,131 @@
+#pragma once
+#ifndef MATH_PARSER_INSTRUMENT_H_
+#define MATH_PARSER_INSTRUMENT_H_
+
+#include "MathParser.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Set to 1 to report each stage of compiling and evaluating to the installed InstrumentationHook. When 0 the hooks
+// are compiled out: set_instrumentation_hook() still links but nothing is ever reported.
+#ifndef MATH_PARSER_INSTRUMENT
+#define MATH_PARSER_INSTRUMENT 0
+#endif
+
+namespace MathParser {
+
+  enum class Stage {
+    SCAN = 0, // Tokenizing into the filtered expression.
+    PARSE,    // Shunting-yard pass emitting instructions.
+    OPTIMIZE, // Constant folding, for Config::optimize.
+    EVALUATE, // Running a program once, through Program::evaluate() or evaluate_expression().
+    BATCH,    // One call of evaluate_batch() or evaluate_batch_interpreted(), over all its lanes.
+  };
+
+  static constexpr size_t STAGE_COUNT = static_cast<size_t>(Stage::BATCH) + 1;
+  static constexpr size_t PARSING_ERROR_TYPE_COUNT = static_cast<size_t>(ParsingErrorType::SYNTAX_ERROR) + 1;
+  static constexpr size_t EVALUATION_ERROR_TYPE_COUNT = static_cast<size_t>(EvaluationErrorType::CIRCULAR_REFERENCE) + 1;
+
+  // Receives events from every thread compiling or evaluating, so implementations must be thread safe and should be cheap.
+  class InstrumentationHook {
+  public:
+    virtual ~InstrumentationHook() { }
+
+    // One call spent nanoseconds in stage.
+    virtual void stage(Stage, uint64_t nanoseconds) { (void)nanoseconds; }
+
+    // A compile finished, having scanned tokens into a program needing max_stack_depth values.
+    // result is the compile result: Status::SUCCESS or the error found while compiling.
+    virtual void compiled(size_t tokens, size_t max_stack_depth, const Result &result) { (void)tokens; (void)max_stack_depth; (void)result; }
+
+    // Running a valid program failed. Errors found while compiling are only reported by compiled().
+    virtual void evaluation_failed(EvaluationErrorType) { }
+  };
+
+  // Installs the hook receiving every event, or removes it if null. The hook must outlive its use; removing it does
+  // not wait for calls already in progress on other threads.
+  void set_instrumentation_hook(InstrumentationHook *hook);
+  InstrumentationHook *instrumentation_hook();
+
+  // Totals of the events, which add up across hooks, threads or processes.
+  struct InstrumentationStats {
+    uint64_t calls[STAGE_COUNT] = { };       // Indexed by Stage.
+    uint64_t nanoseconds[STAGE_COUNT] = { };
+    uint64_t max_nanoseconds[STAGE_COUNT] = { };
+
+    uint64_t compiles = 0;
+    uint64_t tokens = 0;
+    uint64_t max_stack_depth = 0;
+
+    // Indexed by the error type. The NONE entries count successful compiles and stay zero for evaluations.
+    uint64_t parsing_errors[PARSING_ERROR_TYPE_COUNT] = { };
+    uint64_t evaluation_errors[EVALUATION_ERROR_TYPE_COUNT] = { };
+
+    InstrumentationStats &operator+=(const InstrumentationStats &other);
+  };
+
+  // Hook counting every event into InstrumentationStats with relaxed atomics.
+  class InstrumentationCounters : public InstrumentationHook {
+  public:
+    void stage(Stage stage, uint64_t nanoseconds) override;
+    void compiled(size_t tokens, size_t max_stack_depth, const Result &result) override;
+    void evaluation_failed(EvaluationErrorType error) override;
+
+    // Totals so far. Events recorded while taking the snapshot may be partly included.
+    InstrumentationStats stats() const;
+    void reset();
+
+  private:
+    std::atomic<uint64_t> _calls[STAGE_COUNT] = { };
+    std::atomic<uint64_t> _nanoseconds[STAGE_COUNT] = { };
+    std::atomic<uint64_t> _max_nanoseconds[STAGE_COUNT] = { };
+    std::atomic<uint64_t> _compiles{ 0 };
+    std::atomic<uint64_t> _tokens{ 0 };
+    std::atomic<uint64_t> _max_stack_depth{ 0 };
+    std::atomic<uint64_t> _parsing_errors[PARSING_ERROR_TYPE_COUNT] = { };
+    std::atomic<uint64_t> _evaluation_errors[EVALUATION_ERROR_TYPE_COUNT] = { };
+  };
+
+  namespace detail {
+
+    // Reports the time from construction to destruction as one call of stage, if a hook was installed when it started.
+    class StageTimer {
+    public:
+      explicit StageTimer(Stage stage) : _stage(stage), _hook(instrumentation_hook()) {
+        if (_hook) _start = std::chrono::steady_clock::now();
+      }
+      ~StageTimer() {
+        if (_hook) {
+          const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - _start;
+          _hook->stage(_stage, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        }
+      }
+      StageTimer(const StageTimer &) = delete;
+      StageTimer &operator=(const StageTimer &) = delete;
+
+    private:
+      Stage _stage;
+      InstrumentationHook *_hook;
+      std::chrono::steady_clock::time_point _start;
+    };
+
+  } // namespace detail
+
+} // namespace MathParser
+
+// Used by the library to time the rest of the enclosing scope as stage, and to pass an event to the installed hook,
+// e.g. MATH_PARSER_REPORT(evaluation_failed(error)). Both compile to nothing unless MATH_PARSER_INSTRUMENT is set.
+#if MATH_PARSER_INSTRUMENT
+#define MATH_PARSER_TIME_STAGE(name, stage) ::MathParser::detail::StageTimer name(stage)
+#define MATH_PARSER_REPORT(event) do { \
+    if (::MathParser::InstrumentationHook *instrumentation_hook_ = ::MathParser::instrumentation_hook()) instrumentation_hook_->event; \
+  } while (0)
+#else
+#define MATH_PARSER_TIME_STAGE(name, stage) ((void)0)
+#define MATH_PARSER_REPORT(event) ((void)0)
+#endif
+
+#endif // MATH_PARSER_INSTRUMENT_H_
@@ -0,0 +1,213 @@
+#include "MathParserLexer.h"
+
+#include <algorithm> // std::min
+#include <cstring>   // std::memcpy, std::memset
+
+// Set to 0 to classify with the portable table instead of SSE2.
+#ifndef MATH_PARSER_LEXER_SSE2
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MATH_PARSER_LEXER_SSE2 1
+#else
+#define MATH_PARSER_LEXER_SSE2 0
+#endif
+#endif
+
+#if MATH_PARSER_LEXER_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h> // _BitScanForward64
+#endif
+
+namespace MathParser {
+
+  static inline size_t trailing_zeros(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<size_t>(__builtin_ctzll(bits));
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return index;
+#else
+    size_t count = 0;
+    while (!(bits & 1)) {
+      bits >>= 1;
+      ++count;
+    }
+    return count;
+#endif
+  }
+
+  static constexpr size_t SHORT_EXPRESSION = 16;
+
+  static inline bool is_valid_character(char c) {
+    return is_space(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c) || c == '_'
+      || (c >= '(' && c <= '/') || c == '%' || c == '^';
+  }
+
+  static inline size_t population_count(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<size_t>(__builtin_popcountll(bits));
+#else
+    size_t count = 0;
+    for (; bits; bits &= bits - 1) ++count;
+    return count;
+#endif
+  }
+
+  // Bits 0 to length - 1 set.
+  static inline uint64_t low_bits(size_t length) {
+    return length >= 64 ? ~uint64_t(0) : (uint64_t(1) << length) - 1;
+  }
+
+#if MATH_PARSER_LEXER_SSE2
+  // Bytes of v in [lo, hi], as 0xff, unsigned.
+  static inline __m128i in_range(__m128i v, char lo, char hi) {
+    const __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(static_cast<char>(hi - lo))), offset);
+  }
+
+  // Classifies up to 64 bytes as 16 byte vectors, each reduced to 16 bits of each mask. A partial last vector is
+  // padded with spaces, whose bits are then cleared.
+  static inline CharacterMasks classify_block(const char *s, size_t length, char *lower) {
+    CharacterMasks masks = { 0, 0, 0 };
+    for (size_t part = 0; part < length; part += 16) {
+      __m128i v;
+      if (part + 16 <= length) {
+        v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + part));
+      } else {
+        char padded[16];
+        std::memset(padded, ' ', sizeof(padded));
+        std::memcpy(padded, s + part, length - part);
+        v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(padded));
+      }
+      const __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range(v, '\t', '\r'));
+      const __m128i upper = in_range(v, 'A', 'Z');
+      __m128i valid = _mm_or_si128(space, upper);
+      valid = _mm_or_si128(valid, in_range(v, 'a', 'z'));
+      valid = _mm_or_si128(valid, in_range(v, '0', '9'));
+      valid = _mm_or_si128(valid, in_range(v, '(', '/'));
+      valid = _mm_or_si128(valid, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+      valid = _mm_or_si128(valid, _mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+      valid = _mm_or_si128(valid, _mm_cmpeq_epi8(v, _mm_set1_epi8('^')));
+      const __m128i folded = _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(lower + part), _mm_or_si128(_mm_andnot_si128(space, folded), _mm_and_si128(space, _mm_set1_epi8(' '))));
+      masks.space |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(space))) << part;
+      masks.upper |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(upper))) << part;
+      masks.invalid |= static_cast<uint64_t>(static_cast<uint16_t>(~_mm_movemask_epi8(valid))) << part;
+    }
+    const uint64_t in_block = low_bits(length);
+    masks.space &= in_block;
+    masks.upper &= in_block;
+    masks.invalid &= in_block;
+    return masks;
+  }
+#else
+  // Bits of the byte classes, for the portable classifier.
+  enum : uint8_t {
+    CLASS_SPACE = 1,
+    CLASS_UPPER = 2,
+    CLASS_VALID = 4, // Can be part of a token or of whitespace.
+  };
+
+  struct ClassTable {
+    uint8_t classes[256];
+
+    constexpr ClassTable() : classes() {
+      for (int c = 0; c < 256; ++c) {
+        uint8_t bits = 0;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) bits |= CLASS_SPACE | CLASS_VALID;
+        if (c >= 'A' && c <= 'Z') bits |= CLASS_UPPER | CLASS_VALID;
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_') bits |= CLASS_VALID;
+        if ((c >= '(' && c <= '/') || c == '%' || c == '^') bits |= CLASS_VALID;
+        classes[c] = bits;
+      }
+    }
+  };
+
+  static constexpr ClassTable CLASS_TABLE;
+
+  static inline CharacterMasks classify_block(const char *s, size_t length, char *lower) {
+    CharacterMasks masks = { 0, 0, 0 };
+    for (size_t i = 0; i < length; ++i) {
+      const uint8_t bits = CLASS_TABLE.classes[static_cast<unsigned char>(s[i])];
+      masks.space |= static_cast<uint64_t>((bits & CLASS_SPACE) != 0) << i;
+      masks.upper |= static_cast<uint64_t>((bits & CLASS_UPPER) != 0) << i;
+      masks.invalid |= static_cast<uint64_t>((bits & CLASS_VALID) == 0) << i;
+      lower[i] = (bits & CLASS_SPACE) ? ' ' : (bits & CLASS_UPPER) ? static_cast<char>(s[i] | 0x20) : s[i];
+    }
+    return masks;
+  }
+#endif
+
+  CharacterMasks classify(const char *s, size_t length, char *lower) {
+    return classify_block(s, std::min(length, CLASSIFY_BLOCK), lower);
+  }
+
+  size_t find_invalid(const char *s, size_t size) {
+    if (size < SHORT_EXPRESSION) {
+      for (size_t i = 0; i < size; ++i) {
+        if (!is_valid_character(s[i])) return i;
+      }
+      return std::string::npos;
+    }
+    char lower[CLASSIFY_BLOCK];
+    for (size_t block = 0; block < size; block += CLASSIFY_BLOCK) {
+      const CharacterMasks masks = classify(s + block, size - block, lower);
+      if (masks.invalid) return block + trailing_zeros(masks.invalid);
+    }
+    return std::string::npos;
+  }
+
+  // Keeps every byte of a block but the spaces that follow a space. Blocks without such spaces, the common case, are
+  // copied whole; the others are compacted without branches.
+  size_t filter_expression(const char *s, size_t size, std::string &filtered) {
+    filtered.resize(size);
+    char *out = size ? &filtered[0] : nullptr;
+    size_t n = 0;
+    size_t invalid = std::string::npos;
+
+    // Expressions shorter than a vector are filtered faster than a vector is set up.
+    if (size < SHORT_EXPRESSION) {
+      bool in_space = false;
+      for (size_t i = 0; i < size; ++i) {
+        const char c = s[i];
+        if (is_space(c)) {
+          if (!in_space) out[n++] = ' ';
+          in_space = true;
+          continue;
+        }
+        if (invalid == std::string::npos && !is_valid_character(c)) invalid = n;
+        out[n++] = to_lower(c);
+        in_space = false;
+      }
+      filtered.resize(n);
+      return invalid;
+    }
+
+    uint64_t previous_space = 0; // Whether the byte before the block is whitespace, as bit 0.
+    char lower[CLASSIFY_BLOCK];
+    for (size_t block = 0; block < size; block += CLASSIFY_BLOCK) {
+      const size_t length = std::min(CLASSIFY_BLOCK, size - block);
+      const CharacterMasks masks = classify(s + block, length, lower);
+      const uint64_t keep = ~(masks.space & ((masks.space << 1) | previous_space)) & low_bits(length);
+      previous_space = (masks.space >> (length - 1)) & 1;
+      if (invalid == std::string::npos && masks.invalid) {
+        invalid = n + population_count(keep & low_bits(trailing_zeros(masks.invalid)));
+      }
+      if (keep == low_bits(length)) {
+        std::memcpy(out + n, lower, length);
+        n += length;
+      } else {
+        for (size_t i = 0; i < length; ++i) {
+          out[n] = lower[i];
+          n += (keep >> i) & 1;
+        }
+      }
+    }
+    filtered.resize(n);
+    return invalid;
+  }
+
+} // namespace MathParser
@@ -0,0 +1,115 @@
+#pragma once
+#ifndef MATH_PARSER_LEXER_H_
+#define MATH_PARSER_LEXER_H_
+
+// Tokens and the character level scanner, shared by the compiler in MathParser.cpp and IncrementalExpression.
+
+#include "MathParser.h"
+
+#include <cmath> // NAN
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace MathParser {
+
+  struct Token {
+    enum class Type {
+      NONE = 0,
+      NUMBER,
+      OPERATOR,
+      VARIABLE,
+      SEPARATOR, // Comma between the arguments of a call.
+    };
+
+    enum class Id {
+      NONE = 0,
+      ASTERISK,
+      CARET,
+      COMMA,
+      COS,
+      COT,
+      CSC,
+      E,
+      FUNCTION,
+      MINUS,
+      PAREN_L,
+      PAREN_R,
+      PERCENT,
+      PI,
+      PLUS,
+      SEC,
+      SIN,
+      SLASH,
+      TAN,
+      TAU,
+      VARIABLE,
+      X,
+    };
+
+    // Token for the slice [string, string + length) of the filtered expression, as classified by the scanner.
+    // Calls take their operator from functions, which must be given for Id::FUNCTION.
+    Token(const char *string, size_t length, Id id, uint32_t slot, bool left_is_edge = false, const FunctionRegistry *functions = nullptr);
+
+    size_t position = 0;
+    size_t length = 0;
+    Id id = {};
+    Type type = {};
+    const Operator &op;
+    double value = NAN;
+    uint32_t slot = 0; // Variable slot, for Id::VARIABLE, or function index, for Id::FUNCTION.
+
+    // Operator of the identifier; minus and plus are unary when the token to their left is an edge. Calls map to the
+    // generic Operator::Type::FUNCTION entry, without their arity.
+    static const Operator &id_to_operator(Id id, bool left_is_edge = false);
+  };
+
+  static inline bool is_space(char c) {
+    return c == ' ' || c == '\f' || c == '\n' || c == '\r' || c == '\t' || c == '\v';
+  }
+
+  static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+  }
+
+  static inline char to_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+  }
+
+  static inline bool is_identifier(char c) {
+    return (c >= 'a' && c <= 'z') || is_digit(c) || c == '_';
+  }
+
+  // Returns the length of the token starting at index of [s, s + size), or 0 if no token starts there.
+  // Sets id to the token's identifier, which is NONE for numbers, and slot for variables and functions, which may be null.
+  // Only reads characters at or after index, at most MATCH_LOOKAHEAD past the end of the token unless it reads an
+  // identifier, which it reads to its end.
+  size_t match_token(const char *s, size_t size, size_t index, const std::vector<std::string> &variables, const FunctionRegistry *functions, Token::Id &id, uint32_t &slot);
+
+  // Characters past the end of a token match_token() may read: a number followed by "e+" is checked for an exponent digit.
+  static constexpr size_t MATCH_LOOKAHEAD = 3;
+
+  // Classes of the bytes of a block, one bit per byte, in the style of simdjson: bytes are classified a vector at a
+  // time, SSE2 where available, and the scanner then walks runs of the masks instead of bytes.
+  struct CharacterMasks {
+    uint64_t space;
+    uint64_t upper;
+    uint64_t invalid; // Bytes that can be neither part of a token nor whitespace, e.g. '#' or non ASCII.
+  };
+
+  static constexpr size_t CLASSIFY_BLOCK = 64;
+
+  // Classifies the first min(length, CLASSIFY_BLOCK) bytes of s, writing them lower cased to lower, which holds
+  // CLASSIFY_BLOCK bytes. Bits past length are clear.
+  CharacterMasks classify(const char *s, size_t length, char *lower);
+
+  // Offset of the first invalid byte of [s, s + size), or std::string::npos.
+  size_t find_invalid(const char *s, size_t size);
+
+  // Writes the filtered expression of [s, s + size): runs of whitespace compressed to one space and lower cased.
+  // Returns the offset into filtered of the first invalid byte, or std::string::npos.
+  size_t filter_expression(const char *s, size_t size, std::string &filtered);
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_LEXER_H_
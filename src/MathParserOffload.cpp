@@ -0,0 +1,228 @@
+#include "MathParserOffload.h"
+
+#include "common/math.h" // common::math::e/pi/tau/degrees_to_radians
+
+#include <algorithm> // std::max, std::min
+#include <cmath>     // std::isinf, std::isnan, NAN
+#include <cstdio>    // std::snprintf
+
+namespace MathParser {
+
+  // Writes kernel statements for a program, in the C subset OpenCL C and CUDA share.
+  class KernelWriter {
+  public:
+    KernelWriter(const Program &program, std::string &out)
+    : _program(program)
+    , _out(out)
+    , _single(program.config().precision == Precision::SINGLE)
+    {
+    }
+
+    const char *type() const { return _single ? "float" : "double"; }
+
+    // Exact literal of value, rounded to float for single precision programs.
+    std::string literal(double value) const;
+
+    void body();
+
+  private:
+    std::string slot(size_t depth) const { return "s" + std::to_string(depth); }
+    void flag(const std::string &condition, EvaluationErrorType error);
+    void unary(size_t depth, const std::string &expression);
+
+    const Program &_program;
+    std::string &_out;
+    bool _single;
+  };
+
+  std::string KernelWriter::literal(double value) const {
+    if (_single) value = static_cast<float>(value);
+    const char *suffix = _single ? "f" : "";
+    const std::string cast = std::string("(") + type() + ")";
+    if (std::isnan(value)) return cast + "MATH_PARSER_NAN";
+    if (std::isinf(value)) return (value < 0 ? "-" : "") + cast + "MATH_PARSER_INFINITY";
+    char buffer[64];
+    std::snprintf(buffer, sizeof(buffer), "%a%s", value, suffix);
+    return buffer;
+  }
+
+  void KernelWriter::flag(const std::string &condition, EvaluationErrorType error) {
+    _out += "  if (error == 0 && (" + condition + ")) error = " + std::to_string(static_cast<int>(error)) + ";\n";
+  }
+
+  void KernelWriter::unary(size_t depth, const std::string &expression) {
+    _out += "  " + slot(depth) + " = " + expression + ";\n";
+  }
+
+  // Mirrors evaluate_block() in MathParserBatch.cpp, with one register per stack row.
+  void KernelWriter::body() {
+    const bool use_degrees = _program.config().use_degrees;
+    const std::string degrees = literal(common::math::degrees_to_radians<double>());
+    const std::string one = literal(1.0);
+
+    _out += std::string("  const ") + type() + " current = (" + type() + ")in[i];\n";
+    _out += "  unsigned char error = 0;\n";
+    for (size_t depth = 0; depth < _program.max_stack_depth(); ++depth) {
+      _out += std::string("  ") + type() + " " + slot(depth) + " = 0;\n";
+    }
+
+    // Depth of the stack after each instruction; the top is slot(depth - 1).
+    size_t depth = 0;
+    for (const Program::Instruction &instruction : _program.instructions()) {
+      const std::string a = depth >= 2 ? slot(depth - 2) : std::string();
+      const std::string b = depth >= 1 ? slot(depth - 1) : std::string();
+      const std::string angle = use_degrees ? b + " * " + degrees : b;
+      switch (instruction.type) {
+        case Operator::Type::NONE:
+        case Operator::Type::PAREN_L:
+        case Operator::Type::PAREN_R:
+        case Operator::Type::FUNCTION: // Never emitted by compile(), or not written by kernel_source().
+          flag("1", EvaluationErrorType::UNEXPECTED_TOKEN);
+          break;
+
+        case Operator::Type::NUMBER: unary(depth++, literal(instruction.value)); break;
+        case Operator::Type::E:      unary(depth++, literal(common::math::e<double>())); break;
+        case Operator::Type::PI:     unary(depth++, literal(common::math::pi<double>())); break;
+        case Operator::Type::TAU:    unary(depth++, literal(common::math::tau<double>())); break;
+        case Operator::Type::VARIABLE:
+          flag("variables == 0", EvaluationErrorType::EXPECTED_VARIABLE);
+          unary(depth++, std::string("variables != 0 ? (") + type() + ")variables[(MATH_PARSER_INDEX)" + std::to_string(instruction.slot) + " * n + i] : " + literal(NAN));
+          break;
+
+        case Operator::Type::COSECANT:  unary(depth - 1, one + " / sin(" + angle + ")"); break;
+        case Operator::Type::COSINE:    unary(depth - 1, "cos(" + angle + ")"); break;
+        case Operator::Type::COTANGENT: unary(depth - 1, one + " / tan(" + angle + ")"); break;
+        case Operator::Type::SECANT:    unary(depth - 1, one + " / cos(" + angle + ")"); break;
+        case Operator::Type::SINE:      unary(depth - 1, "sin(" + angle + ")"); break;
+        case Operator::Type::TANGENT:   unary(depth - 1, "tan(" + angle + ")"); break;
+
+        case Operator::Type::PERCENTAGE:
+          flag("current != current", EvaluationErrorType::EXPECTED_CURRENT_VALUE);
+          unary(depth - 1, b + " * current / " + literal(100.0));
+          break;
+        case Operator::Type::TIMES:
+          flag("current != current", EvaluationErrorType::EXPECTED_CURRENT_VALUE);
+          unary(depth - 1, b + " * current");
+          break;
+
+        case Operator::Type::UNARY_MINUS: unary(depth - 1, b + " * " + literal(-1.0)); break;
+        case Operator::Type::UNARY_PLUS:  break;
+
+        case Operator::Type::ADD:      unary(depth - 2, a + " + " + b); --depth; break;
+        case Operator::Type::SUBTRACT: unary(depth - 2, a + " - " + b); --depth; break;
+        case Operator::Type::MULTIPLY: unary(depth - 2, a + " * " + b); --depth; break;
+        case Operator::Type::DIVIDE:
+          flag(b + " == 0", EvaluationErrorType::DIVIDE_BY_ZERO);
+          unary(depth - 2, a + " / " + b);
+          --depth;
+          break;
+        case Operator::Type::EXPONENT:
+          flag(a + " < 0 && " + b + " - trunc(" + b + ") > 0", EvaluationErrorType::IMAGINARY_NUMBER);
+          unary(depth - 2, "pow(" + a + ", " + b + ")");
+          --depth;
+          break;
+      }
+    }
+
+    _out += "  out[i] = error != 0 ? (double)MATH_PARSER_NAN : (double)s0;\n";
+    _out += "  errors[i] = error;\n";
+  }
+
+  std::string kernel_source(const Program &program, KernelDialect dialect) {
+    std::string out;
+    if (!program.is_valid() || program.uses_functions()) {
+      return out;
+    }
+    switch (dialect) {
+      case KernelDialect::OPENCL:
+        out += "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+        out += "#pragma OPENCL FP_CONTRACT OFF\n";
+        out += "#define MATH_PARSER_INDEX unsigned long\n";
+        out += "#define MATH_PARSER_NAN NAN\n";
+        out += "#define MATH_PARSER_INFINITY INFINITY\n";
+        out += "__kernel void math_parser_program(__global const double *in, __global const double *variables, __global double *out, __global unsigned char *errors, MATH_PARSER_INDEX n) {\n";
+        out += "  const MATH_PARSER_INDEX i = get_global_id(0);\n";
+        break;
+      case KernelDialect::CUDA:
+        out += "#define MATH_PARSER_INDEX unsigned long long\n";
+        out += "#define MATH_PARSER_NAN __longlong_as_double(0x7ff8000000000000LL)\n";
+        out += "#define MATH_PARSER_INFINITY __longlong_as_double(0x7ff0000000000000LL)\n";
+        out += "extern \"C\" __global__ void math_parser_program(const double *in, const double *variables, double *out, unsigned char *errors, MATH_PARSER_INDEX n) {\n";
+        out += "  const MATH_PARSER_INDEX i = (MATH_PARSER_INDEX)blockIdx.x * blockDim.x + threadIdx.x;\n";
+        break;
+    }
+    out += "  if (i >= n) return;\n";
+    KernelWriter(program, out).body();
+    out += "}\n";
+    return out;
+  }
+
+  OffloadEvaluator::OffloadEvaluator(OffloadDevice &device, const OffloadOptions &options)
+  : _device(device)
+  , _options(options)
+  {
+    _options.chunk_lanes = std::max<size_t>(1, _options.chunk_lanes);
+  }
+
+  size_t OffloadEvaluator::evaluate_batch(const Program &program, const double *in, double *out, size_t n, EvaluationErrorType *errors) {
+    return evaluate_batch(program, nullptr, in, out, n, errors);
+  }
+
+  size_t OffloadEvaluator::evaluate_batch(const Program &program, const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors) {
+    const size_t queues = _device.queues();
+    std::string source;
+    if (n >= _options.min_lanes && queues > 0) {
+      source = kernel_source(program, _options.dialect);
+    }
+    if (source.empty() || !_device.prepare(source, _options.dialect)) {
+      _stats.cpu_lanes += n;
+      return MathParser::evaluate_batch(program, variables, in, out, n, errors);
+    }
+
+    _chunks.resize(queues);
+    const size_t columns = variables ? program.variable_count() : 0;
+    size_t failed = 0;
+    size_t queue = 0;
+    for (size_t offset = 0; offset < n; offset += _options.chunk_lanes) {
+      Chunk &chunk = _chunks[queue];
+      if (chunk.busy) {
+        failed += finish(chunk, queue, program, variables, in, out, errors);
+      }
+      chunk.offset = offset;
+      chunk.count = std::min(_options.chunk_lanes, n - offset);
+      chunk.busy = true;
+      chunk.errors.resize(chunk.count);
+      chunk.variables.resize(columns);
+      for (size_t slot = 0; slot < columns; ++slot) chunk.variables[slot] = variables[slot] + offset;
+      _device.enqueue(queue, in + offset, variables ? chunk.variables.data() : nullptr, columns, out + offset, chunk.errors.data(), chunk.count);
+      queue = (queue + 1) % queues;
+    }
+
+    // Oldest first.
+    for (size_t i = 0; i < queues; ++i, queue = (queue + 1) % queues) {
+      if (_chunks[queue].busy) {
+        failed += finish(_chunks[queue], queue, program, variables, in, out, errors);
+      }
+    }
+    return failed;
+  }
+
+  // Waits for the chunk on queue, copying out its errors, or evaluates it on the CPU if the device failed.
+  // Returns its number of failed lanes.
+  size_t OffloadEvaluator::finish(Chunk &chunk, size_t queue, const Program &program, const double *const *variables, const double *in, double *out, EvaluationErrorType *errors) {
+    chunk.busy = false;
+    EvaluationErrorType *chunk_errors = errors ? errors + chunk.offset : nullptr;
+    if (!_device.wait(queue)) {
+      _stats.cpu_lanes += chunk.count;
+      return MathParser::evaluate_batch(program, variables ? chunk.variables.data() : nullptr, in + chunk.offset, out + chunk.offset, chunk.count, chunk_errors);
+    }
+    _stats.offloaded_lanes += chunk.count;
+    size_t failed = 0;
+    for (size_t i = 0; i < chunk.count; ++i) {
+      failed += chunk.errors[i] != 0;
+      if (chunk_errors) chunk_errors[i] = static_cast<EvaluationErrorType>(chunk.errors[i]);
+    }
+    return failed;
+  }
+
+} // namespace MathParser
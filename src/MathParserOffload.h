@@ -0,0 +1,99 @@
+#pragma once
+#ifndef MATH_PARSER_OFFLOAD_H_
+#define MATH_PARSER_OFFLOAD_H_
+
+#include "MathParser.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace MathParser {
+
+  enum class KernelDialect {
+    OPENCL = 0,
+    CUDA,
+  };
+
+  // Source of a compute kernel evaluating the program one lane per work item, with the same semantics and error
+  // codes as evaluate_batch(), including degrees, x and %. The kernel is named math_parser_program and takes
+  //   (const double *in, const double *variables, double *out, uint8_t *errors, uint64_t n)
+  // in the dialect's address space syntax, where variables holds variable_count() columns of n values one after
+  // the other (or may be null for programs without variables), and errors receives an EvaluationErrorType per lane.
+  // Lanes that fail are set to NaN. Programs with Config::precision set to Precision::SINGLE compute in float.
+  //
+  // Results are within the accuracy of the device's math library rather than bit for bit those of the CPU. The
+  // OpenCL source turns off contraction of multiplies and adds; CUDA kernels should be built with --fmad=false for
+  // the same. Empty for invalid programs, and for programs calling registered functions, which only exist on the host.
+  std::string kernel_source(const Program &program, KernelDialect dialect);
+
+  // Interface to a compute device owned by the caller, e.g. an OpenCL context or a CUDA stream set, which keeps the
+  // library free of any GPU dependency. Work is submitted to a fixed number of queues; work on different queues may
+  // overlap, so while one chunk computes the next can be copied in and the previous copied out.
+  class OffloadDevice {
+  public:
+    virtual ~OffloadDevice() { }
+
+    // Number of independent queues. Two are enough to overlap transfers with compute.
+    virtual size_t queues() const = 0;
+
+    // Builds the kernel source for the chunks that follow, returning false if the device cannot run it. Called
+    // once per evaluate_batch(), so devices should cache built kernels by source.
+    virtual bool prepare(const std::string &source, KernelDialect dialect) = 0;
+
+    // Starts evaluating count lanes on queue and returns without waiting: copies in and each variable column
+    // (of which there are variable_count, or none if variables is null) to the device, runs the kernel and copies
+    // its results back to out and errors. The pointers stay valid until wait(queue) returns; they are the caller's
+    // own buffers, so pinned or device resident memory can be passed straight through.
+    virtual void enqueue(size_t queue, const double *in, const double *const *variables, size_t variable_count, double *out, uint8_t *errors, size_t count) = 0;
+
+    // Blocks until the work enqueued on queue has finished. Returns false if it failed.
+    virtual bool wait(size_t queue) = 0;
+  };
+
+  struct OffloadOptions {
+    KernelDialect dialect = KernelDialect::OPENCL;
+    size_t min_lanes = 1 << 20;   // Smaller batches run on the CPU, where they finish before a transfer would.
+    size_t chunk_lanes = 1 << 22; // Lanes per enqueue().
+  };
+
+  // Evaluates large batches on an OffloadDevice, with the contract of MathParser::evaluate_batch(). Chunks are spread
+  // round robin over the device's queues, waiting for a queue's previous chunk before reusing it. Falls back to the CPU
+  // for small batches, invalid programs and devices that cannot prepare the kernel, and fails over the lanes of a chunk
+  // the device reports as failed to the CPU too.
+  // Not thread safe; use one per device.
+  class OffloadEvaluator {
+  public:
+    struct Stats {
+      size_t offloaded_lanes = 0;
+      size_t cpu_lanes = 0;
+    };
+
+    explicit OffloadEvaluator(OffloadDevice &device, const OffloadOptions &options = OffloadOptions());
+
+    size_t evaluate_batch(const Program &program, const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr);
+    size_t evaluate_batch(const Program &program, const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr);
+
+    // Cumulative over every call.
+    const Stats &stats() const { return _stats; }
+
+  private:
+    struct Chunk {
+      size_t offset = 0;
+      size_t count = 0;
+      bool busy = false;
+      std::vector<const double *> variables;
+      std::vector<uint8_t> errors;
+    };
+
+    size_t finish(Chunk &chunk, size_t queue, const Program &program, const double *const *variables, const double *in, double *out, EvaluationErrorType *errors);
+
+    OffloadDevice &_device;
+    OffloadOptions _options;
+    std::vector<Chunk> _chunks; // One per queue.
+    Stats _stats;
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_OFFLOAD_H_
@@ -0,0 +1,50 @@
+#pragma once
+#ifndef MATH_PARSER_OPERATORS_H_
+#define MATH_PARSER_OPERATORS_H_
+
+#include "MathParser.h"
+
+namespace MathParser {
+
+  // Operator definitions indexed by Operator::Type, shared by the runtime parser and static_expr.
+  // Constant initialized, so lookups are a single load and the table is safe to read from any thread.
+  inline constexpr Operator OPERATORS[] = {
+    { Operator::Type::NONE,        Operator::Associativity::NONE,   -1, 0, nullptr },
+    { Operator::Type::ADD,         Operator::Associativity::LEFT,   10, 2, "add" },
+    { Operator::Type::COSINE,      Operator::Associativity::RIGHT,  40, 1, "cos" },
+    { Operator::Type::COSECANT,    Operator::Associativity::RIGHT,  40, 1, "csc" },
+    { Operator::Type::COTANGENT,   Operator::Associativity::RIGHT,  40, 1, "cot" },
+    { Operator::Type::DIVIDE,      Operator::Associativity::LEFT,   20, 2, "div" },
+    { Operator::Type::E,           Operator::Associativity::LEFT,  200, 0, "e"   },
+    { Operator::Type::EXPONENT,    Operator::Associativity::RIGHT,  90, 2, "exp" },
+    { Operator::Type::MULTIPLY,    Operator::Associativity::LEFT,   20, 2, "mul" },
+    { Operator::Type::NUMBER,      Operator::Associativity::LEFT,  200, 0, "num" },
+    { Operator::Type::PAREN_L,     Operator::Associativity::NONE,    0, 0, "("   },
+    { Operator::Type::PAREN_R,     Operator::Associativity::NONE,    0, 0, ")"   },
+    { Operator::Type::PERCENTAGE,  Operator::Associativity::LEFT,   30, 1, "%"   },
+    { Operator::Type::PI,          Operator::Associativity::LEFT,  200, 0, "pi"  },
+    { Operator::Type::SECANT,      Operator::Associativity::RIGHT,  40, 1, "sec" },
+    { Operator::Type::SINE,        Operator::Associativity::RIGHT,  40, 1, "sin" },
+    { Operator::Type::SUBTRACT,    Operator::Associativity::LEFT,   10, 2, "sub" },
+    { Operator::Type::TANGENT,     Operator::Associativity::RIGHT,  40, 1, "tan" },
+    { Operator::Type::TAU,         Operator::Associativity::LEFT,  200, 0, "tau" },
+    { Operator::Type::TIMES,       Operator::Associativity::LEFT,   30, 1, "x"   },
+    { Operator::Type::UNARY_MINUS, Operator::Associativity::RIGHT, 100, 1, "neg" },
+    { Operator::Type::UNARY_PLUS,  Operator::Associativity::RIGHT, 100, 1, "pos" },
+    { Operator::Type::VARIABLE,    Operator::Associativity::LEFT,  200, 0, "var" },
+    { Operator::Type::FUNCTION,    Operator::Associativity::RIGHT,  40, 0, "fn"  }, // Calls use the registry's Operator.
+  };
+
+  inline constexpr size_t OPERATOR_COUNT = sizeof(OPERATORS) / sizeof(OPERATORS[0]);
+
+  // Checks that entry i of OPERATORS describes Operator::Type i, for every entry from i on.
+  constexpr bool operators_are_indexed_by_type(size_t i = 0) {
+    return i == OPERATOR_COUNT || (static_cast<size_t>(OPERATORS[i].type) == i && operators_are_indexed_by_type(i + 1));
+  }
+
+  static_assert(operators_are_indexed_by_type(), "OPERATORS must be ordered by Operator::Type");
+  static_assert(static_cast<size_t>(Operator::Type::FUNCTION) + 1 == OPERATOR_COUNT, "OPERATORS must cover every Operator::Type");
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_OPERATORS_H_
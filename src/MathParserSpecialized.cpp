@@ -0,0 +1,338 @@
+#include "MathParserSpecialized.h"
+#include "MathParserBatch.h"
+#include "MathParserFunctions.h"
+#include "MathParserTrig.h"
+
+#include "common/math.h" // common::math::degrees_to_radians/e/pi/tau
+
+#include <algorithm> // std::copy, std::fill
+#include <cmath> // std::pow, std::trunc, std::cos/sin/tan
+#include <limits>
+
+namespace MathParser {
+
+  typedef SpecializedProgram::Step Step;
+
+  static inline double *row(double *stack, size_t index) {
+    return stack + index * BATCH_BLOCK_SIZE;
+  }
+
+  // Binary operators. Each computes exactly what the interpreter does for the same Operator::Type.
+  struct Add {
+    static constexpr EvaluationErrorType ERROR = EvaluationErrorType::NONE;
+    static double apply(double a, double b) { return a + b; }
+    static bool fails(double, double) { return false; }
+  };
+
+  struct Subtract {
+    static constexpr EvaluationErrorType ERROR = EvaluationErrorType::NONE;
+    static double apply(double a, double b) { return a - b; }
+    static bool fails(double, double) { return false; }
+  };
+
+  struct Multiply {
+    static constexpr EvaluationErrorType ERROR = EvaluationErrorType::NONE;
+    static double apply(double a, double b) { return a * b; }
+    static bool fails(double, double) { return false; }
+  };
+
+  struct Divide {
+    static constexpr EvaluationErrorType ERROR = EvaluationErrorType::DIVIDE_BY_ZERO;
+    static double apply(double a, double b) { return a / b; }
+    static bool fails(double, double b) { return b == 0.0; }
+  };
+
+  struct Exponent {
+    static constexpr EvaluationErrorType ERROR = EvaluationErrorType::IMAGINARY_NUMBER;
+    static double apply(double a, double b) { return std::pow(a, b); }
+    static bool fails(double a, double b) { return a < 0 && b - std::trunc(b) > 0; }
+  };
+
+  static double cosecant(double d) { return 1.0 / std::sin(d); }
+  static double cosine(double d) { return std::cos(d); }
+  static double cotangent(double d) { return 1.0 / std::tan(d); }
+  static double secant(double d) { return 1.0 / std::cos(d); }
+  static double sine(double d) { return std::sin(d); }
+  static double tangent(double d) { return std::tan(d); }
+
+  // Kernels. Each runs one instruction over count lanes.
+
+  static void fill_literal(const Step &step, double *stack, const double *, const double *const *, uint8_t *, size_t count) {
+    double *a = row(stack, step.target);
+    std::fill(a, a + count, step.value);
+  }
+
+  static void load_variable(const Step &step, double *stack, const double *, const double *const *variables, uint8_t *errors, size_t count) {
+    double *a = row(stack, step.target);
+    if (variables) {
+      std::copy(variables[step.operand], variables[step.operand] + count, a);
+    } else {
+      for (size_t i = 0; i < count; ++i) flag_error(errors[i], true, EvaluationErrorType::EXPECTED_VARIABLE);
+      std::fill(a, a + count, std::numeric_limits<double>::quiet_NaN());
+    }
+  }
+
+  static void unexpected_token(const Step &, double *, const double *, const double *const *, uint8_t *errors, size_t count) {
+    for (size_t i = 0; i < count; ++i) flag_error(errors[i], true, EvaluationErrorType::UNEXPECTED_TOKEN);
+  }
+
+  // a = a op b
+  template<typename Op>
+  static void binary(const Step &step, double *stack, const double *, const double *const *, uint8_t *errors, size_t count) {
+    double *a = row(stack, step.target);
+    const double *b = row(stack, step.operand);
+    if (Op::ERROR != EvaluationErrorType::NONE) {
+      for (size_t i = 0; i < count; ++i) flag_error(errors[i], Op::fails(a[i], b[i]), Op::ERROR);
+    }
+    for (size_t i = 0; i < count; ++i) a[i] = Op::apply(a[i], b[i]);
+  }
+
+  // a = a op literal
+  template<typename Op>
+  static void binary_literal_right(const Step &step, double *stack, const double *, const double *const *, uint8_t *errors, size_t count) {
+    double *a = row(stack, step.target);
+    const double b = step.value;
+    if (Op::ERROR != EvaluationErrorType::NONE) {
+      for (size_t i = 0; i < count; ++i) flag_error(errors[i], Op::fails(a[i], b), Op::ERROR);
+    }
+    for (size_t i = 0; i < count; ++i) a[i] = Op::apply(a[i], b);
+  }
+
+  // a = literal op b, where a is the row the literal would have been pushed to.
+  template<typename Op>
+  static void binary_literal_left(const Step &step, double *stack, const double *, const double *const *, uint8_t *errors, size_t count) {
+    double *a = row(stack, step.target);
+    const double *b = row(stack, step.operand);
+    const double literal = step.value;
+    if (Op::ERROR != EvaluationErrorType::NONE) {
+      for (size_t i = 0; i < count; ++i) flag_error(errors[i], Op::fails(literal, b[i]), Op::ERROR);
+    }
+    for (size_t i = 0; i < count; ++i) a[i] = Op::apply(literal, b[i]);
+  }
+
+  template<double (*Function)(double)>
+  static void trig_radians(const Step &step, double *stack, const double *, const double *const *, uint8_t *, size_t count) {
+    double *a = row(stack, step.target);
+    for (size_t i = 0; i < count; ++i) a[i] = Function(a[i]);
+  }
+
+  template<double (*Function)(double)>
+  static void trig_degrees(const Step &step, double *stack, const double *, const double *const *, uint8_t *, size_t count) {
+    static constexpr double DEG_TO_RAD = common::math::degrees_to_radians<double>();
+    double *a = row(stack, step.target);
+    for (size_t i = 0; i < count; ++i) a[i] = Function(a[i] * DEG_TO_RAD);
+  }
+
+  // Vectorized kernels, for programs compiled without Config::strict_trig.
+  template<Operator::Type TYPE, bool DEGREES>
+  static void fast_trig(const Step &step, double *stack, const double *, const double *const *, uint8_t *, size_t count) {
+    static constexpr double DEG_TO_RAD = common::math::degrees_to_radians<double>();
+    static const TrigKernel kernel = trig_kernel(TYPE);
+    double *a = row(stack, step.target);
+    if (DEGREES) {
+      for (size_t i = 0; i < count; ++i) a[i] = a[i] * DEG_TO_RAD;
+    }
+    kernel(a, count);
+  }
+
+  static void call_function(const Step &step, double *stack, const double *, const double *const *, uint8_t *, size_t count) {
+    call_function_rows(*step.function, row(stack, step.target), BATCH_BLOCK_SIZE, count);
+  }
+
+  static void negate(const Step &step, double *stack, const double *, const double *const *, uint8_t *, size_t count) {
+    double *a = row(stack, step.target);
+    for (size_t i = 0; i < count; ++i) a[i] = a[i] * -1.0;
+  }
+
+  // a = a x or a = a%
+  template<bool PERCENTAGE>
+  static void times(const Step &step, double *stack, const double *current, const double *const *, uint8_t *errors, size_t count) {
+    double *a = row(stack, step.target);
+    for (size_t i = 0; i < count; ++i) {
+      flag_error(errors[i], current[i] != current[i], EvaluationErrorType::EXPECTED_CURRENT_VALUE);
+      a[i] = PERCENTAGE ? a[i] * current[i] / 100.0 : a[i] * current[i];
+    }
+  }
+
+  // a = literal x or a = literal%
+  template<bool PERCENTAGE>
+  static void times_literal(const Step &step, double *stack, const double *current, const double *const *, uint8_t *errors, size_t count) {
+    double *a = row(stack, step.target);
+    const double literal = step.value;
+    for (size_t i = 0; i < count; ++i) {
+      flag_error(errors[i], current[i] != current[i], EvaluationErrorType::EXPECTED_CURRENT_VALUE);
+      a[i] = PERCENTAGE ? literal * current[i] / 100.0 : literal * current[i];
+    }
+  }
+
+  template<typename Op>
+  static SpecializedProgram::Kernel binary_kernel(bool left_literal, bool right_literal) {
+    return left_literal ? &binary_literal_left<Op> : right_literal ? &binary_literal_right<Op> : &binary<Op>;
+  }
+
+  SpecializedProgram::SpecializedProgram(const Program &program)
+  : _compile_result(program.compile_result())
+  , _functions(program.config().functions)
+  , _rows(program.max_stack_depth())
+  , _variable_count(program.variable_count())
+  {
+    if (!program.is_valid()) {
+      return;
+    }
+
+    // Value stack of the program while lowering. Literals stay here until an instruction consumes them,
+    // and are only written to their row when the consuming kernel has no form that takes a literal.
+    struct Operand {
+      bool literal;
+      double value;
+    };
+    std::vector<Operand> operands;
+    operands.reserve(_rows);
+
+    auto emit = [&](Kernel kernel, size_t target, size_t operand, double value) {
+      _steps.push_back({ kernel, target, operand, value });
+    };
+    auto materialize = [&](size_t index) {
+      if (operands[index].literal) {
+        emit(&fill_literal, index, 0, operands[index].value);
+        operands[index].literal = false;
+      }
+    };
+    auto unary = [&](Kernel kernel) {
+      size_t top = operands.size() - 1;
+      materialize(top);
+      emit(kernel, top, 0, 0.0);
+    };
+
+    const bool degrees = program.config().use_degrees;
+    const bool strict = program.config().strict_trig;
+    auto trig = [&](Operator::Type type) -> Kernel {
+      switch (type) {
+        case Operator::Type::COSECANT:  return strict ? (degrees ? &trig_degrees<cosecant>  : &trig_radians<cosecant>)  : degrees ? &fast_trig<Operator::Type::COSECANT, true>  : &fast_trig<Operator::Type::COSECANT, false>;
+        case Operator::Type::COSINE:    return strict ? (degrees ? &trig_degrees<cosine>    : &trig_radians<cosine>)    : degrees ? &fast_trig<Operator::Type::COSINE, true>    : &fast_trig<Operator::Type::COSINE, false>;
+        case Operator::Type::COTANGENT: return strict ? (degrees ? &trig_degrees<cotangent> : &trig_radians<cotangent>) : degrees ? &fast_trig<Operator::Type::COTANGENT, true> : &fast_trig<Operator::Type::COTANGENT, false>;
+        case Operator::Type::SECANT:    return strict ? (degrees ? &trig_degrees<secant>    : &trig_radians<secant>)    : degrees ? &fast_trig<Operator::Type::SECANT, true>    : &fast_trig<Operator::Type::SECANT, false>;
+        case Operator::Type::SINE:      return strict ? (degrees ? &trig_degrees<sine>      : &trig_radians<sine>)      : degrees ? &fast_trig<Operator::Type::SINE, true>      : &fast_trig<Operator::Type::SINE, false>;
+        default:                        return strict ? (degrees ? &trig_degrees<tangent>   : &trig_radians<tangent>)   : degrees ? &fast_trig<Operator::Type::TANGENT, true>   : &fast_trig<Operator::Type::TANGENT, false>;
+      }
+    };
+    for (const Program::Instruction &instruction : program.instructions()) {
+      switch (instruction.type) {
+        case Operator::Type::NONE:
+        case Operator::Type::PAREN_L:
+        case Operator::Type::PAREN_R:
+          // Never emitted by compile().
+          emit(&unexpected_token, 0, 0, 0.0);
+          break;
+
+        case Operator::Type::NUMBER: operands.push_back({ true, instruction.value }); break;
+        case Operator::Type::E:      operands.push_back({ true, common::math::e<double>() }); break;
+        case Operator::Type::PI:     operands.push_back({ true, common::math::pi<double>() }); break;
+        case Operator::Type::TAU:    operands.push_back({ true, common::math::tau<double>() }); break;
+
+        case Operator::Type::VARIABLE:
+          operands.push_back({ false, 0.0 });
+          emit(&load_variable, operands.size() - 1, instruction.slot, 0.0);
+          break;
+
+        case Operator::Type::COSECANT:
+        case Operator::Type::COSINE:
+        case Operator::Type::COTANGENT:
+        case Operator::Type::SECANT:
+        case Operator::Type::SINE:
+        case Operator::Type::TANGENT:
+          unary(trig(instruction.type));
+          break;
+
+        case Operator::Type::UNARY_MINUS: unary(&negate); break;
+        case Operator::Type::UNARY_PLUS:  /* no-op */ break;
+
+        case Operator::Type::FUNCTION: {
+          const Function &function = (*_functions)[instruction.slot];
+          const size_t first = operands.size() - static_cast<size_t>(function.op.degree);
+          for (size_t j = first; j < operands.size(); ++j) materialize(j);
+          operands.resize(first + 1);
+          _steps.push_back({ &call_function, first, 0, 0.0, &function });
+          break;
+        }
+
+        case Operator::Type::PERCENTAGE:
+        case Operator::Type::TIMES: {
+          const bool percentage = instruction.type == Operator::Type::PERCENTAGE;
+          Operand &top = operands.back();
+          if (top.literal) {
+            emit(percentage ? &times_literal<true> : &times_literal<false>, operands.size() - 1, 0, top.value);
+            top.literal = false;
+          } else {
+            emit(percentage ? &times<true> : &times<false>, operands.size() - 1, 0, 0.0);
+          }
+          break;
+        }
+
+        case Operator::Type::ADD:
+        case Operator::Type::DIVIDE:
+        case Operator::Type::EXPONENT:
+        case Operator::Type::MULTIPLY:
+        case Operator::Type::SUBTRACT: {
+          size_t a = operands.size() - 2;
+          size_t b = operands.size() - 1;
+          // Two literals only survive when the program was compiled without optimizing.
+          if (operands[a].literal && operands[b].literal) {
+            materialize(a);
+          }
+          const bool left_literal = operands[a].literal;
+          const bool right_literal = operands[b].literal;
+          Kernel kernel = nullptr;
+          switch (instruction.type) {
+            default:
+            case Operator::Type::ADD:      kernel = binary_kernel<Add>(left_literal, right_literal);      break;
+            case Operator::Type::DIVIDE:   kernel = binary_kernel<Divide>(left_literal, right_literal);   break;
+            case Operator::Type::EXPONENT: kernel = binary_kernel<Exponent>(left_literal, right_literal); break;
+            case Operator::Type::MULTIPLY: kernel = binary_kernel<Multiply>(left_literal, right_literal); break;
+            case Operator::Type::SUBTRACT: kernel = binary_kernel<Subtract>(left_literal, right_literal); break;
+          }
+          double value = left_literal ? operands[a].value : right_literal ? operands[b].value : 0.0;
+          emit(kernel, a, b, value);
+          operands.pop_back();
+          operands[a].literal = false;
+          break;
+        }
+      }
+    }
+
+    // The result of a constant program is still a literal.
+    materialize(0);
+    _result_row = 0;
+  }
+
+  size_t SpecializedProgram::evaluate_batch(const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors) const {
+    if (_compile_result.status != Status::SUCCESS) {
+      return fail_batch(_compile_result, out, n, errors);
+    }
+    return evaluate_blocks(_rows, variables, _variable_count, in, out, n, errors, [&](const double *current, const double *const *block_variables, uint8_t *block_errors, double *stack, size_t count) -> const double * {
+      for (const Step &step : _steps) {
+        step.kernel(step, stack, current, block_variables, block_errors, count);
+      }
+      return row(stack, _result_row);
+    });
+  }
+
+  const SpecializedProgram *Program::Specialization::hot(const Program &program, size_t n) {
+    Specialization *specialization = program._specialization.get();
+    if (!specialization) {
+      return nullptr;
+    }
+    if (const SpecializedProgram *code = specialization->ready.load(std::memory_order_acquire)) {
+      return code;
+    }
+    if (specialization->lanes.fetch_add(n, std::memory_order_relaxed) + n < SpecializedProgram::THRESHOLD) {
+      return nullptr;
+    }
+    std::call_once(specialization->once, [&] {
+      specialization->code.reset(new SpecializedProgram(program));
+      specialization->ready.store(specialization->code.get(), std::memory_order_release);
+    });
+    return specialization->ready.load(std::memory_order_acquire);
+  }
+
+} // namespace MathParser
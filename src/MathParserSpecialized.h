@@ -0,0 +1,80 @@
+#pragma once
+#ifndef MATH_PARSER_SPECIALIZED_H_
+#define MATH_PARSER_SPECIALIZED_H_
+
+#include "MathParser.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex> // std::once_flag
+#include <vector>
+
+// Set to 0 to keep evaluate_batch() on the interpreter for every program.
+#ifndef MATH_PARSER_SPECIALIZE
+#define MATH_PARSER_SPECIALIZE 1
+#endif
+
+// Lanes a program runs through the interpreter before evaluate_batch() specializes it.
+#ifndef MATH_PARSER_SPECIALIZE_THRESHOLD
+#define MATH_PARSER_SPECIALIZE_THRESHOLD (1 << 16)
+#endif
+
+namespace MathParser {
+
+  struct Function;
+
+  // Program lowered for batch evaluation into a straight line of kernels, one per instruction, each a loop over a block
+  // of lanes specialized for its operator and the shape of its operands. Dispatch happens once per instruction and block
+  // instead of switching on Operator::Type, and literals and constants are passed to the kernel that consumes them
+  // instead of being broadcast into a stack row first, e.g. (1.5x) + 3 runs as two passes: 1.5 * x, then + 3.
+  // Results and errors are bit for bit those of evaluate_batch_interpreted().
+  class SpecializedProgram {
+  public:
+    static const uint64_t THRESHOLD = MATH_PARSER_SPECIALIZE_THRESHOLD;
+
+    struct Step;
+    typedef void (*Kernel)(const Step &step, double *stack, const double *current, const double *const *variables, uint8_t *errors, size_t count);
+
+    struct Step {
+      Kernel kernel;
+      size_t target;  // Row the kernel writes, which is also its left (or only) operand.
+      size_t operand; // Right operand row of binary kernels, or the slot of a variable.
+      double value;   // Literal operand, for kernels that take one.
+      const Function *function = nullptr; // Registered function, for calls, whose arguments are the rows from target on.
+    };
+
+    explicit SpecializedProgram(const Program &program);
+
+    // Same contracts as MathParser::evaluate_batch().
+    size_t evaluate_batch(const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr) const {
+      return evaluate_batch(nullptr, in, out, n, errors);
+    }
+    size_t evaluate_batch(const double *const *variables, const double *in, double *out, size_t n, EvaluationErrorType *errors = nullptr) const;
+
+    // Number of kernels run per block.
+    size_t step_count() const { return _steps.size(); }
+
+  private:
+    Result _compile_result;
+    std::shared_ptr<const FunctionRegistry> _functions; // Owns the functions steps point at, however long the program lives.
+    std::vector<Step> _steps;
+    size_t _rows = 0;       // Stack rows needed per block.
+    size_t _variable_count = 0;
+    size_t _result_row = 0; // Row holding the value of the program.
+  };
+
+  struct Program::Specialization {
+    std::atomic<uint64_t> lanes{ 0 };
+    std::once_flag once;
+    std::unique_ptr<const SpecializedProgram> code;
+    std::atomic<const SpecializedProgram *> ready{ nullptr };
+
+    // Counts n lanes of program, returning its specialized form once the threshold has been passed, or null before then
+    // and for programs that are never specialized. Safe to call concurrently; the first caller past the threshold builds it.
+    static const SpecializedProgram *hot(const Program &program, size_t n);
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_SPECIALIZED_H_
@@ -0,0 +1,394 @@
+#pragma once
+#ifndef MATH_PARSER_STATIC_H_
+#define MATH_PARSER_STATIC_H_
+
+// Compile time front end for expressions known when building, e.g.
+//   constexpr auto circumference = MathParser::static_expr<"2 * pi x">;  // C++20
+//   constexpr auto circumference = MATH_PARSER_STATIC_EXPR("2 * pi x");  // C++17
+//   double c = circumference(radius);
+// The compiler parses the expression with the grammar, operator table and unary/binary rules of compile(), and turns it
+// into a tree of types whose evaluation is straight line code. Syntax errors fail the build.
+// Results match evaluate_expression() bit for bit; where it would report an evaluation error the result is NaN.
+// Expressions without x or % are constant expressions, unless they use ^ or use trig without STATIC_CONSTEXPR_TRIG.
+
+#include "MathParser.h"
+#include "MathParserOperators.h"
+
+#include "common/math.h" // common::math::e/pi/tau/degrees_to_radians, constexpr sin/cos/tan
+
+#include <cmath> // std::pow, std::trunc, std::cos/sin/tan
+#include <cstddef>
+#include <limits>
+
+namespace MathParser {
+
+  enum StaticOptions : unsigned {
+    STATIC_DEGREES = 0,             // Trig functions take degrees, like Config::use_degrees.
+    STATIC_RADIANS = 1u << 0,       // Trig functions take radians.
+    STATIC_CONSTEXPR_TRIG = 1u << 1, // Use common::math trig, which folds at compile time; see common/math.h for accuracy and range.
+  };
+
+  namespace detail {
+
+    // Parse failures. None of these are constexpr, so reaching one while parsing stops the build and names the problem.
+    inline void static_expr_syntax_error() { }
+    inline void static_expr_mismatched_parens() { }
+    inline void static_expr_expected_more_arguments() { }
+    inline void static_expr_empty() { }
+    // Literals must convert exactly without strtod: digits below 2^53 once the point is removed, decimal exponent within 22.
+    inline void static_expr_inexact_number() { }
+
+    struct StaticNode {
+      Operator::Type type = Operator::Type::NONE;
+      double value = 0.0;
+      size_t left = 0;  // Operand of unary operators and left operand of binary ones.
+      size_t right = 0;
+    };
+
+    template<size_t N>
+    struct StaticTree {
+      StaticNode nodes[N] = { };
+      size_t size = 0;
+      size_t root = 0;
+      bool uses_current_value = false;
+    };
+
+    constexpr bool static_is_space(char c) {
+      return c == ' ' || c == '\f' || c == '\n' || c == '\r' || c == '\t' || c == '\v';
+    }
+
+    constexpr bool static_is_digit(char c) {
+      return c >= '0' && c <= '9';
+    }
+
+    constexpr char static_to_lower(char c) {
+      return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+
+    constexpr size_t static_length(const char *source) {
+      size_t length = 0;
+      while (source[length] != '\0') ++length;
+      return length;
+    }
+
+    // Converts a number matched by the scanner, \d*[.]?\d+(e[+\-]?\d+)?, exactly as atof would.
+    // Uses the exact case of decimal conversion: an integer significand below 2^53 scaled by a power of ten up to 1e22.
+    constexpr double static_number(const char *s, size_t begin, size_t end) {
+      double significand = 0.0;
+      bool exact = true;
+      int exponent = 0;
+      bool fraction = false;
+      size_t i = begin;
+      for (; i < end && static_to_lower(s[i]) != 'e'; ++i) {
+        if (s[i] == '.') {
+          fraction = true;
+          continue;
+        }
+        significand = significand * 10.0 + (s[i] - '0');
+        exact = exact && significand < 9007199254740992.0;
+        if (fraction) --exponent;
+      }
+      if (i < end) {
+        ++i;
+        bool negative = s[i] == '-';
+        if (s[i] == '+' || s[i] == '-') ++i;
+        int written = 0;
+        for (; i < end; ++i) {
+          written = written * 10 + (s[i] - '0');
+          if (written > 1000) break;
+        }
+        exponent += negative ? -written : written;
+      }
+      if (!exact || exponent > 22 || exponent < -22) {
+        if (significand != 0.0) static_expr_inexact_number();
+        return 0.0;
+      }
+      double scale = 1.0;
+      for (int e = exponent < 0 ? -exponent : exponent; e > 0; --e) scale *= 10.0;
+      return exponent < 0 ? significand / scale : significand * scale;
+    }
+
+    // Shunting-yard parse of source into a tree, following Compiler::compile() in MathParser.cpp.
+    template<size_t N>
+    constexpr StaticTree<N> static_parse(const char *source) {
+      StaticTree<N> tree;
+      Operator::Type operators[N] = { };
+      size_t operator_count = 0;
+      size_t values[N] = { };
+      size_t depth = 0;
+
+      auto emit = [&](Operator::Type type, double value) {
+        const Operator &op = OPERATORS[static_cast<size_t>(type)];
+        if (depth < static_cast<size_t>(op.degree)) {
+          static_expr_expected_more_arguments();
+        }
+        StaticNode &node = tree.nodes[tree.size];
+        node.type = type;
+        node.value = value;
+        if (op.degree == 2) node.right = values[--depth];
+        if (op.degree >= 1) node.left = values[--depth];
+        if (type == Operator::Type::TIMES || type == Operator::Type::PERCENTAGE) tree.uses_current_value = true;
+        values[depth++] = tree.size++;
+      };
+
+      // If the token to the left is the edge of a statement (i.e. left paren, operator, or no token).
+      bool left_is_edge = true;
+      const size_t size = static_length(source);
+      size_t i = 0;
+      while (i < size) {
+        char c = static_to_lower(source[i]);
+        if (static_is_space(c)) {
+          ++i;
+          continue;
+        }
+
+        auto at = [&](size_t index) { return index < size ? static_to_lower(source[index]) : '\0'; };
+        auto keyword = [&](const char *word) {
+          for (size_t k = 0; word[k] != '\0'; ++k) {
+            if (at(i + k) != word[k]) return false;
+          }
+          return true;
+        };
+
+        if (static_is_digit(c) || (c == '.' && static_is_digit(at(i + 1)))) {
+          size_t end = i;
+          while (static_is_digit(at(end))) ++end;
+          if (at(end) == '.' && static_is_digit(at(end + 1))) {
+            ++end;
+            while (static_is_digit(at(end))) ++end;
+          }
+          if (at(end) == 'e') {
+            size_t j = end + 1;
+            if (at(j) == '+' || at(j) == '-') ++j;
+            if (static_is_digit(at(j))) {
+              while (static_is_digit(at(j))) ++j;
+              end = j;
+            }
+          }
+          emit(Operator::Type::NUMBER, static_number(source, i, end));
+          left_is_edge = false;
+          i = end;
+          continue;
+        }
+
+        Operator::Type type = Operator::Type::NONE;
+        size_t length = 1;
+        switch (c) {
+          case '(': type = Operator::Type::PAREN_L; break;
+          case ')': type = Operator::Type::PAREN_R; break;
+          case '+': type = left_is_edge ? Operator::Type::UNARY_PLUS : Operator::Type::ADD; break;
+          case '-': type = left_is_edge ? Operator::Type::UNARY_MINUS : Operator::Type::SUBTRACT; break;
+          case '*': type = Operator::Type::MULTIPLY; break;
+          case '/': type = Operator::Type::DIVIDE; break;
+          case '^': type = Operator::Type::EXPONENT; break;
+          case '%': type = Operator::Type::PERCENTAGE; break;
+          case 'x': type = Operator::Type::TIMES; break;
+          case 'e': type = Operator::Type::E; break;
+          default:
+            length = 3;
+            if (keyword("cos")) type = Operator::Type::COSINE;
+            else if (keyword("sin")) type = Operator::Type::SINE;
+            else if (keyword("tan")) type = Operator::Type::TANGENT;
+            else if (keyword("cot")) type = Operator::Type::COTANGENT;
+            else if (keyword("csc")) type = Operator::Type::COSECANT;
+            else if (keyword("sec")) type = Operator::Type::SECANT;
+            else if (keyword("tau")) type = Operator::Type::TAU;
+            else if (keyword("pi")) { type = Operator::Type::PI; length = 2; }
+            else static_expr_syntax_error();
+            break;
+        }
+        i += length;
+        left_is_edge = type != Operator::Type::PAREN_R;
+
+        const Operator &op = OPERATORS[static_cast<size_t>(type)];
+        switch (type) {
+          case Operator::Type::PAREN_L:
+            operators[operator_count++] = type;
+            break;
+
+          case Operator::Type::PAREN_R:
+            while (true) {
+              if (operator_count == 0) static_expr_mismatched_parens();
+              Operator::Type top = operators[--operator_count];
+              if (top == Operator::Type::PAREN_L) break;
+              emit(top, 0.0);
+            }
+            break;
+
+          default:
+            while (operator_count > 0) {
+              const Operator &t = OPERATORS[static_cast<size_t>(operators[operator_count - 1])];
+              if ((op.associativity == Operator::Associativity::LEFT && op.precedence <= t.precedence) ||
+                  (op.associativity == Operator::Associativity::RIGHT && op.precedence < t.precedence)) {
+                emit(t.type, 0.0);
+                --operator_count;
+              } else {
+                break;
+              }
+            }
+            operators[operator_count++] = type;
+            break;
+        }
+      }
+
+      while (operator_count > 0) {
+        Operator::Type top = operators[--operator_count];
+        if (top == Operator::Type::PAREN_L) static_expr_mismatched_parens();
+        emit(top, 0.0);
+      }
+
+      if (depth == 0) static_expr_empty();
+      if (depth > 1) static_expr_syntax_error();
+      tree.root = values[0];
+      return tree;
+    }
+
+    // Parsed form of Source::value(), a string with static storage.
+    template<typename Source>
+    struct StaticParse {
+      static constexpr size_t length = static_length(Source::value());
+      static constexpr StaticTree<length + 1> tree = static_parse<length + 1>(Source::value());
+    };
+
+    template<unsigned Options, typename Function>
+    constexpr double static_trig(double value, Function function) {
+      constexpr double DEG_TO_RAD = common::math::degrees_to_radians<double>();
+      return (Options & STATIC_RADIANS) ? function(value) : function(value * DEG_TO_RAD);
+    }
+
+    template<unsigned Options> constexpr double static_sin(double d) {
+      if constexpr ((Options & STATIC_CONSTEXPR_TRIG) != 0) return common::math::sin(d); else return std::sin(d);
+    }
+
+    template<unsigned Options> constexpr double static_cos(double d) {
+      if constexpr ((Options & STATIC_CONSTEXPR_TRIG) != 0) return common::math::cos(d); else return std::cos(d);
+    }
+
+    template<unsigned Options> constexpr double static_tan(double d) {
+      if constexpr ((Options & STATIC_CONSTEXPR_TRIG) != 0) return common::math::tan(d); else return std::tan(d);
+    }
+
+    // Node Index of the parsed tree. Each operation matches Operator::eval(); failures set failed instead of returning an error.
+    template<typename Parse, unsigned Options, size_t Index>
+    struct StaticEvaluator {
+      static constexpr StaticNode node = Parse::tree.nodes[Index];
+      typedef StaticEvaluator<Parse, Options, node.left> Left;
+      typedef StaticEvaluator<Parse, Options, node.right> Right;
+
+      static constexpr double evaluate(double x, bool &failed) {
+        using Type = Operator::Type;
+        constexpr Type type = node.type;
+        if constexpr (type == Type::NUMBER) {
+          return node.value;
+        } else if constexpr (type == Type::E) {
+          return common::math::e<double>();
+        } else if constexpr (type == Type::PI) {
+          return common::math::pi<double>();
+        } else if constexpr (type == Type::TAU) {
+          return common::math::tau<double>();
+        } else if constexpr (type == Type::COSECANT) {
+          return static_trig<Options>(Left::evaluate(x, failed), [](double d) { return 1.0 / static_sin<Options>(d); });
+        } else if constexpr (type == Type::COSINE) {
+          return static_trig<Options>(Left::evaluate(x, failed), [](double d) { return static_cos<Options>(d); });
+        } else if constexpr (type == Type::COTANGENT) {
+          return static_trig<Options>(Left::evaluate(x, failed), [](double d) { return 1.0 / static_tan<Options>(d); });
+        } else if constexpr (type == Type::SECANT) {
+          return static_trig<Options>(Left::evaluate(x, failed), [](double d) { return 1.0 / static_cos<Options>(d); });
+        } else if constexpr (type == Type::SINE) {
+          return static_trig<Options>(Left::evaluate(x, failed), [](double d) { return static_sin<Options>(d); });
+        } else if constexpr (type == Type::TANGENT) {
+          return static_trig<Options>(Left::evaluate(x, failed), [](double d) { return static_tan<Options>(d); });
+        } else if constexpr (type == Type::PERCENTAGE || type == Type::TIMES) {
+          double value = Left::evaluate(x, failed);
+          if (x != x) failed = true;
+          return type == Type::PERCENTAGE ? value * x / 100.0 : value * x;
+        } else if constexpr (type == Type::UNARY_MINUS) {
+          return Left::evaluate(x, failed) * -1.0;
+        } else if constexpr (type == Type::UNARY_PLUS) {
+          return Left::evaluate(x, failed);
+        } else if constexpr (type == Type::ADD) {
+          double a = Left::evaluate(x, failed);
+          return a + Right::evaluate(x, failed);
+        } else if constexpr (type == Type::SUBTRACT) {
+          double a = Left::evaluate(x, failed);
+          return a - Right::evaluate(x, failed);
+        } else if constexpr (type == Type::MULTIPLY) {
+          double a = Left::evaluate(x, failed);
+          return a * Right::evaluate(x, failed);
+        } else if constexpr (type == Type::DIVIDE) {
+          double a = Left::evaluate(x, failed);
+          double b = Right::evaluate(x, failed);
+          if (b == 0.0) {
+            failed = true;
+            return 0.0;
+          }
+          return a / b;
+        } else if constexpr (type == Type::EXPONENT) {
+          double a = Left::evaluate(x, failed);
+          double b = Right::evaluate(x, failed);
+          if (a < 0 && b - std::trunc(b) > 0) {
+            failed = true;
+            return 0.0;
+          }
+          return std::pow(a, b);
+        } else {
+          static_assert(type == Type::NUMBER, "static_parse() only emits evaluable operators");
+          return 0.0;
+        }
+      }
+    };
+
+  } // namespace detail
+
+  // Expression parsed at compile time from Source::value(), a string with static storage.
+  // Normally created through static_expr or MATH_PARSER_STATIC_EXPR rather than named directly.
+  template<typename Source, unsigned Options = STATIC_DEGREES>
+  struct StaticExpression {
+    typedef detail::StaticParse<Source> Parse;
+
+    // True if the expression reads the current value (i.e. uses x or %).
+    static constexpr bool uses_current_value = Parse::tree.uses_current_value;
+
+    // Number of operations, for comparison with Program::instructions().
+    static constexpr size_t size = Parse::tree.size;
+
+    constexpr double operator()(double current_value = std::numeric_limits<double>::quiet_NaN()) const {
+      bool failed = false;
+      double value = detail::StaticEvaluator<Parse, Options, Parse::tree.root>::evaluate(current_value, failed);
+      return failed ? std::numeric_limits<double>::quiet_NaN() : value;
+    }
+  };
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+  // String literal usable as a template argument.
+  template<size_t N>
+  struct StaticString {
+    char text[N] = { };
+    constexpr StaticString(const char (&string)[N]) {
+      for (size_t i = 0; i < N; ++i) text[i] = string[i];
+    }
+  };
+
+  namespace detail {
+    template<StaticString String>
+    struct StaticLiteral {
+      static constexpr const char *value() { return String.text; }
+    };
+  }
+
+  // static_expr<"2 * pi x">(radius). Requires C++20; see MATH_PARSER_STATIC_EXPR for C++17.
+  template<StaticString Source, unsigned Options = STATIC_DEGREES>
+  inline constexpr StaticExpression<detail::StaticLiteral<Source>, Options> static_expr { };
+#endif
+
+} // namespace MathParser
+
+// C++17 spelling of static_expr: MATH_PARSER_STATIC_EXPR("2 * pi x")(radius).
+#define MATH_PARSER_STATIC_EXPR(source) MATH_PARSER_STATIC_EXPR_WITH(source, ::MathParser::STATIC_DEGREES)
+#define MATH_PARSER_STATIC_EXPR_WITH(source, options) \
+  ([] { \
+    struct Source { static constexpr const char *value() { return source; } }; \
+    return ::MathParser::StaticExpression<Source, options> { }; \
+  }())
+
+#endif // MATH_PARSER_STATIC_H_
@@ -0,0 +1,283 @@
+#include "MathParserStream.h"
+
+#include <algorithm> // std::max, std::min
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring> // std::memchr, std::memmove
+#include <memory>
+#include <mutex>
+
+#if MATH_PARSER_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace MathParser {
+
+  void format_result(const Result &result, const char *expression, size_t length, std::string &out, int precision) {
+    // Appends the quoted span of the expression the error refers to, if any.
+    auto append_position = [&]() {
+      if (result.error_length == 0) {
+        return;
+      }
+      size_t position = std::min(length, result.error_position);
+      size_t span = std::min(length - position, result.error_length);
+      char buffer[48];
+      int written = std::snprintf(buffer, sizeof(buffer), " at position %zu: \"", result.error_position);
+      out.append(buffer, static_cast<size_t>(written));
+      out.append(expression + position, span);
+      out.push_back('"');
+    };
+
+    switch(result.status) {
+      case Status::SUCCESS: {
+        char buffer[64];
+        int written = std::snprintf(buffer, sizeof(buffer), "= %.*g", std::min(std::max(precision, 1), 40), result.result);
+        out.append(buffer, static_cast<size_t>(written));
+        break;
+      }
+
+      case Status::PARSING_ERROR: {
+        switch(result.parsing_error) {
+          case ParsingErrorType::NONE:              out += "<parsing error>";                   break;
+          case ParsingErrorType::EMPTY:             out += "<parsing error: empty>";            break;
+          case ParsingErrorType::MISMATCHED_PARENS: out += "<parsing error: mismatched parens>"; break;
+          case ParsingErrorType::SYNTAX_ERROR:
+            out += "<parsing error: syntax error>";
+            append_position();
+            break;
+        }
+        break;
+      }
+
+      case Status::EVALUATION_ERROR: {
+        switch(result.evaluation_error) {
+          case EvaluationErrorType::NONE:                    out += "<evaluation error>";                          break;
+          case EvaluationErrorType::CIRCULAR_REFERENCE:      out += "<evaluation error: circular reference>";      break;
+          case EvaluationErrorType::DIVIDE_BY_ZERO:          out += "<evaluation error: divide by zero>";          break;
+          case EvaluationErrorType::EXPECTED_CURRENT_VALUE:  out += "<evaluation error: expected current value>";  break;
+          case EvaluationErrorType::EXPECTED_MORE_ARGUMENTS: out += "<evaluation error: expected more arguments>"; break;
+          case EvaluationErrorType::EXPECTED_VARIABLE:       out += "<evaluation error: expected variable>";       break;
+          case EvaluationErrorType::IMAGINARY_NUMBER:        out += "<evaluation error: imaginary number>";        break;
+          case EvaluationErrorType::UNEXPECTED_TOKEN:        out += "<evaluation error: unexpected token>";        break;
+        }
+        append_position();
+        break;
+      }
+    }
+  }
+
+  // Chunks of one window shared with the pool, claimed in order. Tasks that start after every chunk has been claimed
+  // return without touching the chunks, so the chunks only have to outlive the window.
+  struct StreamEvaluator::Schedule {
+    Chunk *chunks;
+    size_t count;
+    const StreamOptions *options;
+    std::atomic<size_t> next{ 0 };
+    std::atomic<size_t> remaining;
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    Schedule(Chunk *chunks_, size_t count_, const StreamOptions &options_)
+    : chunks(chunks_), count(count_), options(&options_), remaining(count_) { }
+
+    void work() {
+      for (size_t chunk = next.fetch_add(1); chunk < count; chunk = next.fetch_add(1)) {
+        evaluate_chunk(chunks[chunk], *options);
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          std::lock_guard<std::mutex> lock(mutex);
+          finished.notify_all();
+        }
+      }
+    }
+
+    void wait() {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [this] { return remaining.load(std::memory_order_acquire) == 0; });
+    }
+  };
+
+  void StreamEvaluator::evaluate_chunk(Chunk &chunk, const StreamOptions &options) {
+    // Pool threads outlive windows, so each keeps its scratch storage and steady state lines do not allocate.
+    static thread_local Scratch scratch;
+    chunk.out.clear();
+    chunk.lines = 0;
+    chunk.failed = 0;
+    for (const char *line = chunk.begin; line < chunk.end; ) {
+      const char *newline = static_cast<const char *>(std::memchr(line, '\n', static_cast<size_t>(chunk.end - line)));
+      size_t length = static_cast<size_t>((newline ? newline : chunk.end) - line);
+      if (length > 0 && line[length - 1] == '\r') {
+        --length;
+      }
+      // Diagnostics are only built for the lines that fail.
+      CompactResult result = evaluate_compact(line, length, scratch, std::numeric_limits<double>::quiet_NaN(), options.config);
+      format_result(result.ok() ? Result(result.value) : scratch.program().diagnose(result, false), line, length, chunk.out, options.precision);
+      chunk.out.push_back('\n');
+      ++chunk.lines;
+      chunk.failed += !result.ok();
+      line = newline ? newline + 1 : chunk.end;
+    }
+  }
+
+  StreamEvaluator::StreamEvaluator(ThreadPool *pool, const StreamOptions &options)
+  : _pool(pool)
+  , _options(options)
+  {
+    _options.chunk_size = std::max<size_t>(_options.chunk_size, 1);
+    _options.window_size = std::max<size_t>(_options.window_size, 1);
+  }
+
+  void StreamEvaluator::evaluate(const char *data, size_t size, std::string &out) {
+    evaluate_window(data, size);
+    for (size_t i = 0; i < _chunk_count; ++i) {
+      out += _chunks[i].out;
+    }
+  }
+
+  void StreamEvaluator::evaluate_window(const char *data, size_t size) {
+    // Split into chunks of about chunk_size bytes, each ending just after a newline or at the end of the window.
+    _chunk_count = 0;
+    const char *end = data + size;
+    for (const char *begin = data; begin < end; ) {
+      const char *stop = begin + std::min(_options.chunk_size, static_cast<size_t>(end - begin));
+      if (stop < end) {
+        const void *newline = std::memchr(stop - 1, '\n', static_cast<size_t>(end - stop + 1));
+        stop = newline ? static_cast<const char *>(newline) + 1 : end;
+      }
+      if (_chunk_count == _chunks.size()) {
+        _chunks.emplace_back();
+      }
+      Chunk &chunk = _chunks[_chunk_count++];
+      chunk.begin = begin;
+      chunk.end = stop;
+      begin = stop;
+    }
+
+    size_t helpers = _pool ? std::min(_pool->concurrency(), _chunk_count > 0 ? _chunk_count - 1 : 0) : 0;
+    std::shared_ptr<Schedule> schedule = std::make_shared<Schedule>(_chunks.data(), _chunk_count, _options);
+    for (size_t i = 0; i < helpers; ++i) {
+      _pool->run([schedule] { schedule->work(); });
+    }
+    schedule->work();
+    schedule->wait();
+
+    for (size_t i = 0; i < _chunk_count; ++i) {
+      _stats.lines += _chunks[i].lines;
+      _stats.failed += _chunks[i].failed;
+    }
+    _stats.bytes += size;
+  }
+
+  bool StreamEvaluator::write_window(std::FILE *output) {
+    for (size_t i = 0; i < _chunk_count; ++i) {
+      const std::string &out = _chunks[i].out;
+      if (std::fwrite(out.data(), 1, out.size(), output) != out.size()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool StreamEvaluator::evaluate_stream(std::FILE *input, std::FILE *output) {
+    std::vector<char> buffer(_options.window_size);
+    size_t filled = 0;
+    for (;;) {
+      filled += std::fread(buffer.data() + filled, 1, buffer.size() - filled, input);
+      if (std::ferror(input)) {
+        return false;
+      }
+      const bool at_end = std::feof(input) != 0;
+
+      // Evaluate up to the last complete line, carrying the partial line over to the next block.
+      size_t end = filled;
+      if (!at_end) {
+        while (end > 0 && buffer[end - 1] != '\n') --end;
+        if (end == 0) {
+          // A single line fills the buffer.
+          buffer.resize(buffer.size() * 2);
+          continue;
+        }
+      }
+
+      evaluate_window(buffer.data(), end);
+      if (!write_window(output)) {
+        return false;
+      }
+      std::memmove(buffer.data(), buffer.data() + end, filled - end);
+      filled -= end;
+      if (at_end) {
+        return true;
+      }
+    }
+  }
+
+  bool StreamEvaluator::evaluate_file(const char *path, std::FILE *output) {
+    if (std::strcmp(path, "-") == 0) {
+      return evaluate_stream(stdin, output);
+    }
+
+#if MATH_PARSER_USE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      return false;
+    }
+    if (!S_ISREG(info.st_mode)) {
+      // Pipes and devices cannot be mapped.
+      std::FILE *input = fdopen(fd, "rb");
+      if (!input) {
+        close(fd);
+        return false;
+      }
+      bool success = evaluate_stream(input, output);
+      std::fclose(input);
+      return success;
+    }
+
+    const size_t size = static_cast<size_t>(info.st_size);
+    if (size == 0) {
+      close(fd);
+      return true;
+    }
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int map_error = errno;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      errno = map_error;
+      return false;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    const char *data = static_cast<const char *>(mapping);
+    bool success = true;
+    for (size_t offset = 0; offset < size && success; ) {
+      size_t end = std::min(size, offset + _options.window_size);
+      if (end < size) {
+        const void *newline = std::memchr(data + end - 1, '\n', size - end + 1);
+        end = newline ? static_cast<size_t>(static_cast<const char *>(newline) - data) + 1 : size;
+      }
+      evaluate_window(data + offset, end - offset);
+      success = write_window(output);
+      offset = end;
+    }
+    munmap(mapping, size);
+    return success;
+#else
+    std::FILE *input = std::fopen(path, "rb");
+    if (!input) {
+      return false;
+    }
+    bool success = evaluate_stream(input, output);
+    std::fclose(input);
+    return success;
+#endif
+  }
+
+} // namespace MathParser
@@ -0,0 +1,93 @@
+#pragma once
+#ifndef MATH_PARSER_STREAM_H_
+#define MATH_PARSER_STREAM_H_
+
+#include "MathParser.h"
+#include "MathParserExecutor.h" // ThreadPool
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Set to 0 to read files through stdio instead of memory mapping them.
+#ifndef MATH_PARSER_USE_MMAP
+#if defined(_WIN32)
+#define MATH_PARSER_USE_MMAP 0
+#else
+#define MATH_PARSER_USE_MMAP 1
+#endif
+#endif
+
+namespace MathParser {
+
+  // Appends the report for result to out, without a trailing newline:
+  //   = 3
+  //   <parsing error: mismatched parens>
+  //   <evaluation error: divide by zero> at position 2: "/"
+  // Error spans are quoted from [expression, expression + length). Results are printed with precision significant digits.
+  void format_result(const Result &result, const char *expression, size_t length, std::string &out, int precision = 10);
+
+  struct StreamOptions {
+    Config config;
+    int precision = 17;                    // Significant digits of results, enough to round trip a double.
+    size_t chunk_size = 256 * 1024;        // Bytes of input per task.
+    size_t window_size = 64 * 1024 * 1024; // Bytes of input evaluated before reports are written.
+  };
+
+  // Evaluates newline delimited expressions, one per line, writing one report per line (see format_result()) in input order.
+  // Input is processed in windows: each window is split into chunks at line boundaries, chunks are evaluated in parallel
+  // on the pool and by the calling thread, and their reports are written out in order before the next window starts.
+  // Lines are evaluated in place. Files are memory mapped and stdin is read in window sized blocks, so neither costs a
+  // system call or a copy per line. A trailing '\r' is ignored, so CRLF input works.
+  // Not thread safe; use one per stream.
+  class StreamEvaluator {
+  public:
+    struct Stats {
+      size_t lines = 0;
+      size_t failed = 0; // Lines that did not evaluate to a number.
+      size_t bytes = 0;
+    };
+
+    // Runs only on the calling thread when pool is null.
+    explicit StreamEvaluator(ThreadPool *pool = nullptr, const StreamOptions &options = StreamOptions());
+
+    // Evaluates every line of [data, data + size), appending the reports to out. A final line need not end in a newline.
+    void evaluate(const char *data, size_t size, std::string &out);
+
+    // Evaluates the file at path, which is memory mapped, or stdin if path is "-". Returns false on I/O errors,
+    // with errno set; reports for lines before the error have been written.
+    bool evaluate_file(const char *path, std::FILE *output);
+
+    // Evaluates input until EOF, reading it in window sized blocks.
+    bool evaluate_stream(std::FILE *input, std::FILE *output);
+
+    // Cumulative over every call.
+    const Stats &stats() const { return _stats; }
+
+  private:
+    struct Chunk {
+      const char *begin;
+      const char *end;
+      std::string out;
+      size_t lines;
+      size_t failed;
+    };
+
+    struct Schedule;
+
+    static void evaluate_chunk(Chunk &chunk, const StreamOptions &options);
+
+    // Evaluates one window of whole lines into _chunks.
+    void evaluate_window(const char *data, size_t size);
+    bool write_window(std::FILE *output);
+
+    ThreadPool *_pool;
+    StreamOptions _options;
+    Stats _stats;
+    std::vector<Chunk> _chunks;
+    size_t _chunk_count = 0;
+  };
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_STREAM_H_
@@ -3,6 +3,7 @@
 #include "common/math.h" // common::math::degrees_to_radians
 #include "common/utils.h" // IMPLEMENT_STD_HASH_FOR_ENUM_CLASS
 
+#include <cmath> // std::pow
 #include <unordered_map>
 
 static MathParser::Config config_degrees = { true };
@@ -40,12 +41,12 @@ IMPLEMENT_STD_HASH_FOR_ENUM_CLASS(TrigFunctionType);
 typedef double (*unary_function_pointer)(double);
 
 static unary_function_pointer trig_function(TrigFunctionType type) {
-  static std::unordered_map<TrigFunctionType, unary_function_pointer> unary_functions = {
+  static const std::unordered_map<TrigFunctionType, unary_function_pointer> unary_functions = {
     { TrigFunctionType::SIN, &sin },
     { TrigFunctionType::COS, &cos },
     { TrigFunctionType::TAN, &tan },
   };
-  return unary_functions[type];
+  return unary_functions.at(type);
 }
 
 MathParserTestCase trig_test_case(const std::string &expression, TrigFunctionType function_type, double angle, TrigAngleUnits units) {
@@ -56,3 +57,205 @@ MathParserTestCase trig_test_case(const std::string &expression, TrigFunctionTyp
     case TrigAngleUnits::RADIANS: return { expression, trig(angle), config_radians };
   }
 }
+
+const std::vector<MathParserTestCase> &test_cases() {
+  static const double E = common::math::e<double>();
+  static const double PI = common::math::pi<double>();
+  static const double TAU = common::math::tau<double>();
+
+  static const std::vector<MathParserTestCase> test_cases = {
+    { "",                            ParsingErrorType::EMPTY },
+    { " \f\n\r\t\v",                 ParsingErrorType::EMPTY },
+    { "()",                          ParsingErrorType::EMPTY },
+    { "1(1+",                        ParsingErrorType::MISMATCHED_PARENS },
+    { "((1)",                        ParsingErrorType::MISMATCHED_PARENS },
+    { "(1))",                        ParsingErrorType::MISMATCHED_PARENS },
+    { "1 + (2 - (3 * (4 / (5)))))",  ParsingErrorType::MISMATCHED_PARENS },
+    { "(1)1",                        ParsingErrorType::SYNTAX_ERROR },
+    { "1a",                          ParsingErrorType::SYNTAX_ERROR },
+    { "abc",                         ParsingErrorType::SYNTAX_ERROR },
+    { "a + b * c",                   ParsingErrorType::SYNTAX_ERROR },
+    { "1 2 3",                       ParsingErrorType::SYNTAX_ERROR },
+    { "12.",                         ParsingErrorType::SYNTAX_ERROR },
+    { "1 + 2 # 3",                   ParsingErrorType::SYNTAX_ERROR },
+
+    { "1 / (1 - 1)",                 EvaluationErrorType::DIVIDE_BY_ZERO },
+    { "50%",                         EvaluationErrorType::EXPECTED_CURRENT_VALUE },
+    { "+",                           EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
+    { "1 *",                         EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
+    { "(1 + ) + 1",                  EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
+    { "-",                           EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
+    { "--",                          EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
+    { "-1 ^ 2 ^ 3.4",                EvaluationErrorType::IMAGINARY_NUMBER },
+
+    { "1",                           1 },
+    { "123",                         123 },
+    { "1.23",                        1.23 },
+    { ".12",                         .12 },
+    { "1e2",                         1e2 },
+    { "1e+2 + 3",                    1e+2 + 3 },
+    { "1e-2 - 3",                    1e-2 - 3 },
+    { "1E2",                         1e2 },
+    { "0.000123",                    0.000123 },
+    { "9007199254740993",            9007199254740993.0 },
+    { "123456789012345678901234567", 123456789012345678901234567.0 },
+    { "3.14159265358979323846264",   3.14159265358979323846264 },
+    { "1.7976931348623157e308",      1.7976931348623157e308 },
+    { "4.9e-324",                    4.9e-324 },
+    { "1e400",                       HUGE_VAL },
+    { "1e-400",                      0 },
+    { "0e999999999999",              0 },
+    { "+1",                          1 },
+    { "++1",                         1 },
+    { "+++1",                        1 },
+    { "-1",                          -1 },
+    { "--1",                         1 },
+    { "---1",                        -1 },
+    { "((1))",                       1 },
+    { "1 + 2",                       1 + 2 },
+    { "1 + (2)",                     1 + (2) },
+    { "(1) + 2",                     (1) + 2 },
+    { "+(1 + 2)",                    +(1 + 2)},
+    { "-(1 - 2)",                    -(1 - 2)},
+    { "1 + 2 * 3",                   1 + 2 * 3 },
+    { "1 + (2 * 3)",                 1 + (2 * 3) },
+    { "(1 + 2) * 3",                 (1 + 2) * 3 },
+    { "-1 ^ 2",                      std::pow(-1, 2) },
+    { "(-1) ^ 2",                    std::pow(-1, 2) },
+    { "-(1 ^ 2)",                    -std::pow(1, 2) },
+    { "4 ^ -2",                      std::pow(4, -2) },
+    { "(-4 ^ 2)",                    std::pow(-4, 2) },
+    { "2 * 2 ^ 3",                   2 * std::pow(2, 3) },
+    { "2 * (2 ^ 3)",                 2 * std::pow(2, 3) },
+    { "(2 * 2) ^ 3",                 std::pow(2 * 2, 3) },
+    { "2 ^ 2 ^ 3",                   std::pow(2, std::pow(2, 3)) },
+    { "2 ^ (2 ^ 3)",                 std::pow(2, std::pow(2, 3)) },
+    { "(2 ^ 2) ^ 3",                 std::pow(std::pow(2, 2), 3) },
+    { "1 + .2 * -3 / +4 ^ 5",        1 + .2 * -3 / std::pow(+4, 5) },
+    { "+-+-1++--++--++--+2-3+4",     1+2-3+4 },
+    { "50%",                         0.5 * 1.0, 1.0 },
+    { "2x",                          2.0 * 1.0, 1.0 },
+    { "3X",                          3.0 * 1.0, 1.0 },
+    { "E",                           E },
+    { "e",                           E },
+    { "pi",                          PI },
+    { "Pi",                          PI },
+    { "PI",                          PI },
+    { "tau",                         TAU },
+    { "Tau",                         TAU },
+    { "TAU",                         TAU },
+    trig_test_case("cos 180",        TrigFunctionType::COS, 180.0),
+    trig_test_case("cos(TAU)",       TrigFunctionType::COS, TAU, TrigAngleUnits::RADIANS),
+    trig_test_case("sin90.0",        TrigFunctionType::SIN, 90.0),
+    trig_test_case("sin(pi / 2)",    TrigFunctionType::SIN, PI / 2.0, TrigAngleUnits::RADIANS),
+    trig_test_case("tan45",          TrigFunctionType::TAN, 45.0),
+    trig_test_case("tan(e)",         TrigFunctionType::TAN, E, TrigAngleUnits::RADIANS),
+  };
+  return test_cases;
+}
+
+std::string ExpressionGenerator::next() {
+  std::string out;
+  expression(out, 0);
+  if (below(4) == 0) mutate(out);
+  return out;
+}
+
+double ExpressionGenerator::next_current_value() {
+  if (below(8) == 0) return std::numeric_limits<double>::quiet_NaN();
+  return (static_cast<double>(below(2001)) - 1000.0) / 8.0;
+}
+
+void ExpressionGenerator::number(std::string &out) {
+  static const char *const EXPONENTS[] = { "e", "E", "e+", "e-" };
+  const uint32_t form = below(6);
+  if (form == 0) {
+    out += '.';
+  } else {
+    out += std::to_string(below(form == 1 ? 10 : 100000));
+    if (form >= 3) out += '.';
+  }
+  if (form == 0 || form >= 3) out += std::to_string(below(1000));
+  if (form >= 4) {
+    out += EXPONENTS[below(4)];
+    out += std::to_string(below(form == 5 ? 400 : 20));
+  }
+}
+
+void ExpressionGenerator::expression(std::string &out, int depth) {
+  static const char *const CONSTANTS[] = { "e", "pi", "tau", "PI", "Tau" };
+  static const char *const FUNCTIONS[] = { "sin", "cos", "tan", "sec", "csc", "cot", "SIN", "Cos" };
+  static const char *const BINARY[] = { "+", "-", "*", "/", "^" };
+  static const char *const SPACES[] = { "", "", "", " ", "  ", "\t" };
+  auto space = [&] { out += SPACES[below(6)]; };
+
+  // Leaves become more likely the deeper the expression, which keeps it finite.
+  const uint32_t choice = depth >= 5 ? below(2) : below(10);
+  switch (choice) {
+    case 0:
+      number(out);
+      break;
+    case 1:
+      out += CONSTANTS[below(5)];
+      break;
+    case 2:
+    case 3:
+      expression(out, depth + 1);
+      space();
+      out += BINARY[below(5)];
+      space();
+      expression(out, depth + 1);
+      break;
+    case 4:
+      out += below(2) ? '-' : '+';
+      expression(out, depth + 1);
+      break;
+    case 5:
+      out += FUNCTIONS[below(8)];
+      if (below(3) == 0) {
+        space();
+        number(out);
+      } else {
+        out += '(';
+        expression(out, depth + 1);
+        out += ')';
+      }
+      break;
+    case 6:
+      out += '(';
+      expression(out, depth + 1);
+      out += below(2) ? "x)" : "%)";
+      break;
+    default:
+      out += '(';
+      space();
+      expression(out, depth + 1);
+      space();
+      out += ')';
+      break;
+  }
+}
+
+void ExpressionGenerator::mutate(std::string &out) {
+  static const char INSERTED[] = "()+-*/^%x.e# 9";
+  const size_t at = out.empty() ? 0 : below(static_cast<uint32_t>(out.size()));
+  switch (below(3)) {
+    case 0:
+      if (!out.empty()) out.erase(at, 1);
+      break;
+    case 1:
+      out.insert(at, 1, INSERTED[below(sizeof(INSERTED) - 1)]);
+      break;
+    default:
+      out.insert(at, out.substr(at, below(4) + 1));
+      break;
+  }
+}
+
+std::vector<std::string> generated_expressions(uint32_t seed, size_t count) {
+  ExpressionGenerator generator(seed);
+  std::vector<std::string> expressions;
+  expressions.reserve(count);
+  for (size_t i = 0; i < count; ++i) expressions.push_back(generator.next());
+  return expressions;
+}
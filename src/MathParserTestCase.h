@@ -4,6 +4,11 @@
 
 #include "MathParser.h"
 
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
 using MathParser::EvaluationErrorType;
 using MathParser::ParsingErrorType;
 
@@ -35,4 +40,32 @@ enum class TrigAngleUnits {
 
 MathParserTestCase trig_test_case(const std::string &expression, TrigFunctionType trig_function, double angle, TrigAngleUnits units = TrigAngleUnits::DEGREES);
 
+// Shared corpus for the tests and benchmarks.
+const std::vector<MathParserTestCase> &test_cases();
+
+// Reproducible stream of random expressions over the scanner's grammar: numbers in every literal form, the constants,
+// x and %, unary and binary operators, functions with and without parens, and mixed case and spacing. About one in
+// four is then mutated by deleting, inserting or duplicating characters, which mostly makes it a parsing or
+// evaluation error. Draws only raw values from the engine, so the stream is the same with every standard library.
+class ExpressionGenerator {
+public:
+  explicit ExpressionGenerator(uint32_t seed) : _engine(seed) { }
+
+  std::string next();
+
+  // Current value to evaluate an expression with: NaN one time in eight, otherwise a small number.
+  double next_current_value();
+
+private:
+  uint32_t below(uint32_t bound) { return static_cast<uint32_t>(_engine() % bound); }
+  void expression(std::string &out, int depth);
+  void number(std::string &out);
+  void mutate(std::string &out);
+
+  std::mt19937 _engine;
+};
+
+// The first count expressions of ExpressionGenerator(seed).
+std::vector<std::string> generated_expressions(uint32_t seed, size_t count);
+
 #endif // MATH_PARSER_TEST_CASE_H_
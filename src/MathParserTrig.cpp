@@ -0,0 +1,177 @@
+#include "MathParserTrig.h"
+
+#include "common/math.h" // common::math::pi, common::math::detail::PIO2_*
+
+#include <cmath>   // std::fabs, std::cos/sin/tan
+#include <cstdint>
+#include <cstring> // std::memcpy
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MATH_PARSER_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define MATH_PARSER_ALWAYS_INLINE inline
+#endif
+
+namespace MathParser {
+
+  // Largest argument reduced exactly enough: k * PIO2_1 and k * PIO2_2 are exact for |k| < 2^20.
+  static constexpr double TRIG_LIMIT = 1048576.0 * (common::math::pi<double>() / 2.0);
+
+  // Adding 1.5 * 2^52 rounds a double below 2^51 to an integer and leaves that integer in the low bits of the sum.
+  static constexpr double ROUND_SHIFT = 6755399441055744.0;
+
+  // fdlibm __kernel_sin and __kernel_cos coefficients on [-pi/4, pi/4].
+  static constexpr double S1 = -1.66666666666666324348e-01;
+  static constexpr double S2 = 8.33333333332248946124e-03;
+  static constexpr double S3 = -1.98412698298579493134e-04;
+  static constexpr double S4 = 2.75573137070700676789e-06;
+  static constexpr double S5 = -2.50507602534068634195e-08;
+  static constexpr double S6 = 1.58969099521155010221e-10;
+
+  static constexpr double C1 = 4.16666666666666019037e-02;
+  static constexpr double C2 = -1.38888888888741095749e-03;
+  static constexpr double C3 = 2.48015872894767294178e-05;
+  static constexpr double C4 = -2.75573143513906633035e-07;
+  static constexpr double C5 = 2.08757232129817482790e-09;
+  static constexpr double C6 = -1.13596475577881948265e-11;
+
+  static MATH_PARSER_ALWAYS_INLINE uint64_t to_bits(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+  }
+
+  static MATH_PARSER_ALWAYS_INLINE double from_bits(uint64_t bits) {
+    double value;
+    std::memcpy(&value, &bits, sizeof(bits));
+    return value;
+  }
+
+  // One lane of the kernel for type. Selections are done on the bits so the loop running it has no branches.
+  template<Operator::Type TYPE>
+  static MATH_PARSER_ALWAYS_INLINE double trig_lane(double x) {
+    using namespace common::math::detail;
+    const double shifted = x * (2.0 / common::math::pi<double>()) + ROUND_SHIFT;
+    const double k = shifted - ROUND_SHIFT;
+    const uint64_t quadrant = to_bits(shifted);
+
+    // r + r_tail = x - k * pi/2. The first two products are exact and so is the first subtraction; the error of the
+    // second is carried along with the last two parts. Subtracting them last keeps the sign of -0.
+    const double t = x - k * PIO2_1;
+    const double u = k * PIO2_2;
+    const double hi = t - u;
+    const double low = k * PIO2_3T + (k * PIO2_3 - ((t - hi) - u));
+    const double r = hi - low;
+    const double r_tail = (hi - r) - low;
+
+    // sin(r + r_tail) ~ sin r + r_tail * cos r and cos(r + r_tail) ~ cos r - r_tail * sin r, to first order.
+    const double z = r * r;
+    const double hz = 0.5 * z;
+    const double s = r + (z * r * (S1 + z * (S2 + z * (S3 + z * (S4 + z * (S5 + z * S6))))) + r_tail * (1.0 - hz));
+    const double w = 1.0 - hz;
+    const double c = w + (((1.0 - w) - hz) + (z * z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6))))) - r * r_tail));
+
+    // sin x is s, c, -s, -c and cos x is c, -s, -c, s in quadrants 0 to 3.
+    const uint64_t odd = 0 - (quadrant & 1);
+    // sin r has the sign of r on [-pi/4, pi/4], which also turns sin(-0) back into -0.
+    const uint64_t sign = uint64_t(1) << 63;
+    const uint64_t s_bits = (to_bits(s) & ~sign) | (to_bits(r) & sign);
+    const uint64_t c_bits = to_bits(c);
+    const double sine = from_bits(((s_bits & ~odd) | (c_bits & odd)) ^ ((quadrant & 2) << 62));
+    const double cosine = from_bits(((c_bits & ~odd) | (s_bits & odd)) ^ (((quadrant + 1) & 2) << 62));
+    switch (TYPE) {
+      case Operator::Type::COSECANT:  return 1.0 / sine;
+      case Operator::Type::COSINE:    return cosine;
+      case Operator::Type::COTANGENT: return cosine / sine;
+      case Operator::Type::SECANT:    return 1.0 / cosine;
+      case Operator::Type::SINE:      return sine;
+      default:                        return sine / cosine;
+    }
+  }
+
+  // Same formulas as the scalar evaluator.
+  template<Operator::Type TYPE>
+  static double trig_libm(double x) {
+    switch (TYPE) {
+      case Operator::Type::COSECANT:  return 1.0 / std::sin(x);
+      case Operator::Type::COSINE:    return std::cos(x);
+      case Operator::Type::COTANGENT: return 1.0 / std::tan(x);
+      case Operator::Type::SECANT:    return 1.0 / std::cos(x);
+      case Operator::Type::SINE:      return std::sin(x);
+      default:                        return std::tan(x);
+    }
+  }
+
+  // Lanes per inner loop. A fixed trip count lets compilers vectorize it fully even at their cheapest settings.
+  static const size_t TRIG_LANES = 8;
+
+  template<Operator::Type TYPE>
+  static MATH_PARSER_ALWAYS_INLINE void trig_block(double *a, size_t count) {
+    // False for NaN and infinities too.
+    bool in_range = true;
+    for (size_t i = 0; i < count; ++i) in_range &= std::fabs(a[i]) <= TRIG_LIMIT;
+    if (!in_range) {
+      for (size_t i = 0; i < count; ++i) a[i] = trig_libm<TYPE>(a[i]);
+      return;
+    }
+    size_t i = 0;
+    for (; i + TRIG_LANES <= count; i += TRIG_LANES) {
+      for (size_t j = 0; j < TRIG_LANES; ++j) a[i + j] = trig_lane<TYPE>(a[i + j]);
+    }
+    for (; i < count; ++i) a[i] = trig_lane<TYPE>(a[i]);
+  }
+
+  // Kernels of every trig type for one instruction set, in the order of KERNEL_TYPES.
+  static const Operator::Type KERNEL_TYPES[] = {
+    Operator::Type::COSECANT, Operator::Type::COSINE, Operator::Type::COTANGENT,
+    Operator::Type::SECANT,   Operator::Type::SINE,   Operator::Type::TANGENT,
+  };
+  static const size_t KERNEL_COUNT = sizeof(KERNEL_TYPES) / sizeof(KERNEL_TYPES[0]);
+
+  struct TrigKernels {
+    const char *isa;
+    TrigKernel kernels[KERNEL_COUNT];
+  };
+
+#define MATH_PARSER_TRIG_KERNELS(ATTRIBUTES, SUFFIX) \
+  template<Operator::Type TYPE> ATTRIBUTES static void trig_##SUFFIX(double *a, size_t count) { trig_block<TYPE>(a, count); } \
+  static const TrigKernels TRIG_##SUFFIX = { #SUFFIX, { \
+    &trig_##SUFFIX<Operator::Type::COSECANT>, &trig_##SUFFIX<Operator::Type::COSINE>, &trig_##SUFFIX<Operator::Type::COTANGENT>, \
+    &trig_##SUFFIX<Operator::Type::SECANT>,   &trig_##SUFFIX<Operator::Type::SINE>,   &trig_##SUFFIX<Operator::Type::TANGENT>, \
+  } };
+
+  MATH_PARSER_TRIG_KERNELS(, baseline)
+#if MATH_PARSER_TRIG_DISPATCH
+  MATH_PARSER_TRIG_KERNELS(__attribute__((target("avx2,fma"))), avx2)
+  MATH_PARSER_TRIG_KERNELS(__attribute__((target("avx512f"))), avx512)
+#endif
+
+#undef MATH_PARSER_TRIG_KERNELS
+
+  static const TrigKernels &select_kernels() {
+#if MATH_PARSER_TRIG_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return TRIG_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return TRIG_avx2;
+#endif
+    return TRIG_baseline;
+  }
+
+  // Picked on first use; thread safe as a function local static.
+  static const TrigKernels &kernels() {
+    static const TrigKernels &selected = select_kernels();
+    return selected;
+  }
+
+  TrigKernel trig_kernel(Operator::Type type) {
+    for (size_t i = 0; i < KERNEL_COUNT; ++i) {
+      if (KERNEL_TYPES[i] == type) return kernels().kernels[i];
+    }
+    return nullptr;
+  }
+
+  const char *trig_kernel_isa() {
+    return kernels().isa;
+  }
+
+} // namespace MathParser
@@ -0,0 +1,45 @@
+#pragma once
+#ifndef MATH_PARSER_TRIG_H_
+#define MATH_PARSER_TRIG_H_
+
+// Vectorized trigonometry for the batch evaluators, used when Config::strict_trig is false.
+
+#include "MathParser.h"
+
+#include <cstddef>
+
+// Set to 0 to build the kernels for the baseline instruction set only. Otherwise, on x86 with GCC or Clang, AVX2 and
+// AVX-512 builds of the kernels are compiled alongside and picked once at run time from what the CPU supports.
+// Other targets, such as ARM with NEON, vectorize the baseline build.
+#ifndef MATH_PARSER_TRIG_DISPATCH
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define MATH_PARSER_TRIG_DISPATCH 1
+#else
+#define MATH_PARSER_TRIG_DISPATCH 0
+#endif
+#endif
+
+namespace MathParser {
+
+  // Replaces each of the count values of a, in radians, with the function of it. Arguments are reduced to
+  // [-pi/4, pi/4] by a three part Cody-Waite subtraction of the nearest multiple of pi/2 and evaluated with the
+  // minimax polynomials of fdlibm, without branches or calls so every lane runs the same straight line.
+  //
+  // Error against the correctly rounded result, for |x| <= 2^20 * pi/2:
+  //   sin, cos    1 ulp
+  //   sec, csc    2 ulp
+  //   tan, cot    3 ulp
+  // Blocks holding a larger or non-finite argument are evaluated with the C library instead, lane by lane.
+  // Builds for different instruction sets may contract multiplies and adds, so the last bits of a result can differ
+  // between machines, within the same bounds.
+  typedef void (*TrigKernel)(double *a, size_t count);
+
+  // Kernel for a trig Operator::Type, for the instruction set of this CPU. Null for any other type.
+  TrigKernel trig_kernel(Operator::Type type);
+
+  // Name of the instruction set trig_kernel() picked: "avx512", "avx2" or "baseline".
+  const char *trig_kernel_isa();
+
+} // namespace MathParser
+
+#endif // MATH_PARSER_TRIG_H_
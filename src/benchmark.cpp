@@ -0,0 +1,485 @@
+// Performance suite for the parser and evaluator.
+// Usage: benchmark [filter] [--min-time=seconds] [--save-baseline=path] [--baseline=path] [--max-regression=fraction]
+// Runs every benchmark whose name contains filter, reporting time and heap allocations per expression and input throughput.
+//
+// --save-baseline writes the time per expression of each benchmark run, e.g. to a file named after the commit measured.
+// --baseline compares against such a file and exits with status 1 if any benchmark in both got slower by more than
+// --max-regression (0.1, i.e. 10%, by default). Compare runs from the same machine and build settings.
+
+#include "MathParser.h"
+#include "MathParserArchive.h"
+#include "MathParserFunctions.h"
+#include "MathParserFused.h"
+#include "MathParserIncremental.h"
+#include "MathParserStatic.h"
+#include "MathParserTestCase.h"
+
+#include <algorithm> // std::max
+#include <atomic>
+#include <chrono>
+#include <cstdio>  // std::printf
+#include <cstdlib> // std::atof, std::malloc, std::free
+#include <cstring> // std::memcpy, std::strncmp, std::strstr
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counts heap allocations made while a benchmark runs.
+static std::atomic<size_t> allocation_count(0);
+
+void *operator new(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void *pointer = std::malloc(size ? size : 1)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+  std::free(pointer);
+}
+
+// Sized deallocation must be replaced too, or sanitizers see memory from this operator new freed by their own.
+void operator delete(void *pointer, size_t) noexcept {
+  std::free(pointer);
+}
+
+// Keeps results alive so evaluation is not optimized away.
+static volatile double sink;
+
+typedef std::chrono::steady_clock Clock;
+
+static double min_time = 0.5;
+static const char *filter = nullptr;
+
+// Time per expression of each benchmark run, in nanoseconds, for the baseline.
+struct Measurement {
+  std::string name;
+  double ns;
+};
+static std::vector<Measurement> measurements;
+
+static void print_header() {
+  std::printf("%-36s %14s %14s %14s %12s\n", "Benchmark", "Time/expr", "Allocs/expr", "Throughput", "Iterations");
+  std::printf("%s\n", std::string(94, '-').c_str());
+}
+
+static void report(const char *name, double seconds, size_t iterations, size_t expressions, size_t bytes, size_t allocations) {
+  double total_expressions = static_cast<double>(iterations) * expressions;
+  double ns = seconds * 1e9 / total_expressions;
+  double allocs = allocations / total_expressions;
+  double megabytes_per_second = static_cast<double>(iterations) * bytes / seconds / (1024.0 * 1024.0);
+  std::printf("%-36s %11.1f ns %14.2f %9.1f MB/s %12zu\n", name, ns, allocs, megabytes_per_second, iterations);
+  measurements.push_back({ name, ns });
+}
+
+static bool save_baseline(const char *path) {
+  std::FILE *file = std::fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+  for (const Measurement &measurement : measurements) {
+    std::fprintf(file, "%s %.3f\n", measurement.name.c_str(), measurement.ns);
+  }
+  return std::fclose(file) == 0;
+}
+
+// Prints each benchmark slower than in the baseline by more than max_regression, returning how many there were,
+// or -1 if the baseline cannot be read. Benchmarks missing from either side are skipped.
+static int compare_baseline(const char *path, double max_regression) {
+  std::FILE *file = std::fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  int regressions = 0;
+  char name[256];
+  double baseline_ns;
+  while (std::fscanf(file, "%255s %lf", name, &baseline_ns) == 2) {
+    for (const Measurement &measurement : measurements) {
+      if (measurement.name != name || baseline_ns <= 0.0) continue;
+      const double change = measurement.ns / baseline_ns - 1.0;
+      if (change > max_regression) {
+        std::printf("REGRESSION %-25s %11.1f ns -> %.1f ns (+%.1f%%)\n", name, baseline_ns, measurement.ns, change * 100.0);
+        ++regressions;
+      }
+    }
+  }
+  std::fclose(file);
+  return regressions;
+}
+
+// Runs function, which evaluates expressions covering bytes of input per call, until min_time has passed.
+template<typename Function>
+static void run(const char *name, size_t expressions, size_t bytes, Function function) {
+  if (filter && !std::strstr(name, filter)) {
+    return;
+  }
+
+  // Warm up so the measurement reflects steady state.
+  function();
+
+  size_t iterations = 0;
+  size_t batch = 1;
+  size_t allocations = allocation_count.load();
+  Clock::time_point start = Clock::now();
+  double seconds = 0.0;
+  while (seconds < min_time) {
+    for (size_t i = 0; i < batch; ++i) {
+      function();
+    }
+    iterations += batch;
+    batch *= 2;
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  }
+  allocations = allocation_count.load() - allocations;
+  report(name, seconds, iterations, expressions, bytes, allocations);
+}
+
+static std::string repeat(const std::string &string, size_t count) {
+  std::string result;
+  for (size_t i = 0; i < count; ++i) {
+    result += string;
+  }
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  const char *save_path = nullptr;
+  const char *baseline_path = nullptr;
+  double max_regression = 0.1;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strncmp(argv[i], "--min-time=", 11) == 0) {
+      min_time = std::atof(argv[i] + 11);
+    } else if (std::strncmp(argv[i], "--save-baseline=", 16) == 0) {
+      save_path = argv[i] + 16;
+    } else if (std::strncmp(argv[i], "--baseline=", 11) == 0) {
+      baseline_path = argv[i] + 11;
+    } else if (std::strncmp(argv[i], "--max-regression=", 17) == 0) {
+      max_regression = std::atof(argv[i] + 17);
+    } else {
+      filter = argv[i];
+    }
+  }
+
+  print_header();
+
+  // First call pays for one time initialization of the static tables, so it can only be measured once per process.
+  if (!filter || std::strstr("cold_first_call", filter)) {
+    const std::string expression = "1 + 2 * sin(30)";
+    size_t allocations = allocation_count.load();
+    Clock::time_point start = Clock::now();
+    sink = MathParser::evaluate_expression(expression).result;
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    report("cold_first_call", seconds, 1, 1, expression.size(), allocation_count.load() - allocations);
+  }
+
+  const std::string short_expression = "1 + 2";
+  const std::string long_expression = "1" + repeat(" + 2.5 * (3 - 4 / 5) ^ 2 - 6e-1", 100);
+  const std::string deep_parens = repeat("(", 500) + "1" + repeat(" + 1)", 500);
+  const std::string unary_chain = repeat("+-", 500) + "1";
+  const std::string numbers = repeat("3.14159 + 2.5e-3 * 1234567 - .5 / 6.02214076e23 + ", 100) + "0";
+  const std::string trig = repeat("sin(30) * cos(60) + tan(45) - sec(10) * csc(20) + cot(70) + ", 20) + "0";
+  const std::string generated_text = repeat("SIN(30)   *\t2.5E-3  +  COS(X)  -  ", 1000) + "0";
+
+  const std::vector<MathParserTestCase> &corpus = test_cases();
+  size_t corpus_bytes = 0;
+  for (const MathParserTestCase &test_case : corpus) {
+    corpus_bytes += test_case.expression.size();
+  }
+
+  struct Case {
+    const char *name;
+    const std::string &expression;
+    MathParser::Config config;
+  };
+  const Case cases[] = {
+    { "short",           short_expression, { } },
+    { "long",            long_expression,  { } },
+    { "deep_parens",     deep_parens,      { } },
+    { "unary_chain",     unary_chain,      { } },
+    { "numbers",         numbers,          { } },
+    { "trig_degrees",    trig,             { true } },
+    { "trig_radians",    trig,             { false } },
+    { "generated_text",  generated_text,   { } },
+  };
+
+  for (const Case &c : cases) {
+    std::string name = std::string("evaluate_expression/") + c.name;
+    run(name.c_str(), 1, c.expression.size(), [&] {
+      sink = MathParser::evaluate_expression(c.expression, c.config).result;
+    });
+  }
+
+  run("evaluate_expression/corpus", corpus.size(), corpus_bytes, [&] {
+    for (const MathParserTestCase &test_case : corpus) {
+      sink = MathParser::evaluate_expression(test_case.expression, test_case.config, test_case.current).result;
+    }
+  });
+
+  MathParser::Scratch scratch;
+  for (const Case &c : cases) {
+    std::string name = std::string("scratch/") + c.name;
+    run(name.c_str(), 1, c.expression.size(), [&] {
+      sink = MathParser::evaluate_expression(c.expression, scratch, 1.0, c.config).result;
+    });
+  }
+
+  run("scratch/corpus", corpus.size(), corpus_bytes, [&] {
+    for (const MathParserTestCase &test_case : corpus) {
+      sink = MathParser::evaluate_expression(test_case.expression, scratch, test_case.current, test_case.config).result;
+    }
+  });
+
+  run("scratch_compact/corpus", corpus.size(), corpus_bytes, [&] {
+    for (const MathParserTestCase &test_case : corpus) {
+      sink = MathParser::evaluate_compact(test_case.expression, scratch, test_case.current, test_case.config).value;
+    }
+  });
+
+  // Random expressions of the differential test, a quarter of them malformed, so regressions on error paths show too.
+  const std::vector<std::string> generated = generated_expressions(2024, 10000);
+  size_t generated_bytes = 0;
+  for (const std::string &expression : generated) {
+    generated_bytes += expression.size();
+  }
+  run("generated/scratch", generated.size(), generated_bytes, [&] {
+    for (const std::string &expression : generated) {
+      sink = MathParser::evaluate_compact(expression, scratch, 1.0).value;
+    }
+  });
+  run("generated/compile", generated.size(), generated_bytes, [&] {
+    for (const std::string &expression : generated) {
+      sink = static_cast<double>(MathParser::compile(expression).max_stack_depth());
+    }
+  });
+
+  // Parse-only validation, against compiling.
+  for (const Case &c : cases) {
+    std::string name = std::string("validate/") + c.name;
+    run(name.c_str(), 1, c.expression.size(), [&] {
+      sink = static_cast<double>(MathParser::validate(c.expression, c.config).status());
+    });
+  }
+  run("validate/generated", generated.size(), generated_bytes, [&] {
+    for (const std::string &expression : generated) {
+      sink = static_cast<double>(MathParser::validate(expression).status());
+    }
+  });
+
+  // Retyping one digit deep inside a long formula, against evaluating the whole formula after each keystroke.
+  std::string formula_text = repeat("sin(2) * cos(3) + ", 50) + repeat("(1 + ", 50) + "7" + repeat(")", 50);
+  const size_t digit = formula_text.find('7');
+  MathParser::IncrementalExpression editor(formula_text);
+  size_t keystroke = 0;
+  run("keystroke/scratch", 1, formula_text.size(), [&] {
+    formula_text[digit] = static_cast<char>('0' + keystroke++ % 10);
+    sink = MathParser::evaluate_expression(formula_text, scratch).result;
+  });
+  run("keystroke/incremental", 1, formula_text.size(), [&] {
+    const char typed = static_cast<char>('0' + keystroke++ % 10);
+    editor.edit(digit, 1, &typed, 1);
+    sink = editor.evaluate().result;
+  });
+
+  // Starting up from an archive of the compiled corpus, against compiling it again.
+  MathParser::ProgramArchiveWriter writer;
+  for (const MathParserTestCase &test_case : corpus) writer.add(MathParser::compile(test_case.expression, test_case.config));
+  const std::string archived = writer.data();
+  std::vector<uint64_t> archive_bytes((archived.size() + 7) / 8);
+  std::memcpy(archive_bytes.data(), archived.data(), archived.size());
+  run("startup/compile", corpus.size(), corpus_bytes, [&] {
+    for (const MathParserTestCase &test_case : corpus) {
+      sink = MathParser::compile(test_case.expression, test_case.config).evaluate_compact(test_case.current).value;
+    }
+  });
+  run("startup/archive", corpus.size(), corpus_bytes, [&] {
+    MathParser::ProgramArchive archive;
+    archive.load(archive_bytes.data(), archived.size());
+    for (size_t i = 0; i < archive.size(); ++i) {
+      sink = archive[i].evaluate_compact(nullptr, corpus[i].current).value;
+    }
+  });
+
+  // Compiled programs measure evaluation alone, so throughput is reported against the source expression.
+  // Constant folding is turned off since it would reduce these cases to a single literal.
+  for (const Case &c : cases) {
+    std::string name = std::string("program/") + c.name;
+    MathParser::Program program = MathParser::compile(c.expression, MathParser::Config(c.config.use_degrees, false));
+    run(name.c_str(), 1, c.expression.size(), [&] {
+      sink = program.evaluate(1.0).result;
+    });
+  }
+
+  const std::string formula = "(1.5x) + (20%) - 3";
+  std::vector<double> in(1 << 16), out(in.size());
+  for (size_t i = 0; i < in.size(); ++i) {
+    in[i] = static_cast<double>(i) * 0.5;
+  }
+  MathParser::Program program = MathParser::compile(formula);
+  run("program/formula_scalar", in.size(), in.size() * sizeof(double), [&] {
+    for (size_t i = 0; i < in.size(); ++i) {
+      out[i] = program.evaluate(in[i]).result;
+    }
+    sink = out[0];
+  });
+  auto static_formula = MATH_PARSER_STATIC_EXPR("(1.5x) + (20%) - 3");
+  run("static_expr/formula_scalar", in.size(), in.size() * sizeof(double), [&] {
+    for (size_t i = 0; i < in.size(); ++i) {
+      out[i] = static_formula(in[i]);
+    }
+    sink = out[0];
+  });
+  run("evaluate_batch_interpreted/formula", in.size(), in.size() * sizeof(double), [&] {
+    MathParser::evaluate_batch_interpreted(program, in.data(), out.data(), in.size());
+    sink = out[0];
+  });
+  // Crosses the specialization threshold while warming up.
+  run("evaluate_batch/formula", in.size(), in.size() * sizeof(double), [&] {
+    MathParser::evaluate_batch(program, in.data(), out.data(), in.size());
+    sink = out[0];
+  });
+
+  MathParser::Program trig_program = MathParser::compile("sin(1x) * cos(2x) + (3x) / 7 - 1");
+  run("evaluate_batch_interpreted/trig", in.size(), in.size() * sizeof(double), [&] {
+    MathParser::evaluate_batch_interpreted(trig_program, in.data(), out.data(), in.size());
+    sink = out[0];
+  });
+  run("evaluate_batch/trig", in.size(), in.size() * sizeof(double), [&] {
+    MathParser::evaluate_batch(trig_program, in.data(), out.data(), in.size());
+    sink = out[0];
+  });
+  // Float columns, widened for the double evaluator or evaluated in single precision.
+  std::vector<float> float_in(in.begin(), in.end()), float_out(in.size());
+  MathParser::Config single;
+  single.precision = MathParser::Precision::SINGLE;
+  MathParser::Program single_program = MathParser::compile(formula, single);
+  MathParser::Program single_trig_program = MathParser::compile("sin(1x) * cos(2x) + (3x) / 7 - 1", single);
+  run("evaluate_batch_float/formula", in.size(), in.size() * sizeof(float), [&] {
+    MathParser::evaluate_batch(program, float_in.data(), float_out.data(), in.size());
+    sink = float_out[0];
+  });
+  run("evaluate_batch_float/formula_single", in.size(), in.size() * sizeof(float), [&] {
+    MathParser::evaluate_batch(single_program, float_in.data(), float_out.data(), in.size());
+    sink = float_out[0];
+  });
+  run("evaluate_batch_float/trig_single", in.size(), in.size() * sizeof(float), [&] {
+    MathParser::evaluate_batch(single_trig_program, float_in.data(), float_out.data(), in.size());
+    sink = float_out[0];
+  });
+
+  MathParser::Config fast_trig;
+  fast_trig.strict_trig = false;
+  MathParser::Program fast_trig_program = MathParser::compile("sin(1x) * cos(2x) + (3x) / 7 - 1", fast_trig);
+  run("evaluate_batch_interpreted/trig_fast", in.size(), in.size() * sizeof(double), [&] {
+    MathParser::evaluate_batch_interpreted(fast_trig_program, in.data(), out.data(), in.size());
+    sink = out[0];
+  });
+  run("evaluate_batch/trig_fast", in.size(), in.size() * sizeof(double), [&] {
+    MathParser::evaluate_batch(fast_trig_program, in.data(), out.data(), in.size());
+    sink = out[0];
+  });
+
+  // Two variable columns alongside the current value.
+  MathParser::Config variables_config;
+  variables_config.variables = { "price", "qty" };
+  MathParser::Program variables_program = MathParser::compile("price * qty - (5%)", variables_config);
+  std::vector<double> qty(in.size(), 3.0);
+  const double *columns[] = { in.data(), qty.data() };
+  run("evaluate_batch/variables", in.size(), in.size() * sizeof(double) * 3, [&] {
+    MathParser::evaluate_batch(variables_program, columns, in.data(), out.data(), in.size());
+    sink = out[0];
+  });
+
+  // Registered functions, called per lane through their scalar form or a block at a time through their column form.
+  auto hypot_scalar = [](const double *arguments) { return std::sqrt(arguments[0] * arguments[0] + arguments[1] * arguments[1]); };
+  MathParser::FunctionOptions column_options;
+  column_options.batch = [](const double *const *arguments, double *out, size_t count) {
+    for (size_t i = 0; i < count; ++i) out[i] = std::sqrt(arguments[0][i] * arguments[0][i] + arguments[1][i] * arguments[1][i]);
+  };
+  std::shared_ptr<MathParser::FunctionRegistry> functions = std::make_shared<MathParser::FunctionRegistry>();
+  functions->add("hypot", 2, hypot_scalar);
+  functions->add("hypot_columns", 2, hypot_scalar, column_options);
+  MathParser::Config functions_config;
+  functions_config.functions = functions;
+  MathParser::Program function_program = MathParser::compile("hypot(1x, 3) - 1", functions_config);
+  MathParser::Program column_function_program = MathParser::compile("hypot_columns(1x, 3) - 1", functions_config);
+  run("functions/scalar", in.size(), in.size() * sizeof(double), [&] {
+    for (size_t i = 0; i < in.size(); ++i) {
+      out[i] = function_program.evaluate_compact(in[i]).value;
+    }
+    sink = out[0];
+  });
+  run("functions/evaluate_batch", in.size(), in.size() * sizeof(double), [&] {
+    MathParser::evaluate_batch(function_program, in.data(), out.data(), in.size());
+    sink = out[0];
+  });
+  run("functions/evaluate_batch_columns", in.size(), in.size() * sizeof(double), [&] {
+    MathParser::evaluate_batch(column_function_program, in.data(), out.data(), in.size());
+    sink = out[0];
+  });
+
+  // A family of formulas sharing trig and pow terms, fused against evaluated one after the other.
+  std::vector<std::string> family;
+  for (int i = 0; i < 32; ++i) {
+    family.push_back("sin(2x) * " + std::to_string(i) + " + (1 + (3%)) ^ 2.5 - cos((1x) / 3)");
+  }
+  MathParser::FusedProgram fused(family);
+  std::vector<MathParser::Program> family_programs;
+  std::vector<std::vector<double>> family_out(family.size(), std::vector<double>(in.size()));
+  std::vector<double *> family_columns;
+  for (size_t k = 0; k < family.size(); ++k) {
+    family_programs.push_back(MathParser::compile(family[k]));
+    family_columns.push_back(family_out[k].data());
+  }
+  run("fused/separate", in.size() * family.size(), in.size() * sizeof(double), [&] {
+    for (size_t k = 0; k < family.size(); ++k) MathParser::evaluate_batch_interpreted(family_programs[k], in.data(), family_columns[k], in.size());
+    sink = family_out[0][0];
+  });
+  run("fused/fused", in.size() * family.size(), in.size() * sizeof(double), [&] {
+    fused.evaluate_batch(in.data(), family_columns.data(), in.size());
+    sink = family_out[0][0];
+  });
+
+  // Concurrent callers share only constant tables, so throughput should grow linearly with the thread count.
+  // Time per expression is wall time divided by the expressions evaluated across all threads.
+  const size_t passes = 100;
+  size_t hardware_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  for (size_t thread_count = 1; thread_count <= hardware_threads; thread_count *= 2) {
+    std::string name = "threads/" + std::to_string(thread_count) + "/corpus";
+    run(name.c_str(), corpus.size() * passes * thread_count, corpus_bytes * passes * thread_count, [&] {
+      std::vector<std::thread> threads;
+      for (size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&] {
+          MathParser::Scratch thread_scratch;
+          double sum = 0.0;
+          for (size_t pass = 0; pass < passes; ++pass) {
+            for (const MathParserTestCase &test_case : corpus) {
+              sum += MathParser::evaluate_expression(test_case.expression, thread_scratch, test_case.current, test_case.config).result;
+            }
+          }
+          sink = sum;
+        });
+      }
+      for (std::thread &thread : threads) {
+        thread.join();
+      }
+    });
+  }
+
+  if (save_path && !save_baseline(save_path)) {
+    std::printf("cannot write baseline %s\n", save_path);
+    return 2;
+  }
+  if (baseline_path) {
+    const int regressions = compare_baseline(baseline_path, max_regression);
+    if (regressions < 0) {
+      std::printf("cannot read baseline %s\n", baseline_path);
+      return 2;
+    }
+    if (regressions > 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
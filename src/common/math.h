@@ -23,9 +23,75 @@ namespace common { namespace math {
 
   // Degrees to radians conversion multiplier.
   template<typename T> constexpr T degrees_to_radians();
-  template<> constexpr double degrees_to_radians() { return static_cast<float>(pi<double>() / 180.0); }
+  template<> constexpr double degrees_to_radians() { return pi<double>() / 180.0; }
   template<> constexpr float degrees_to_radians() { return static_cast<float>(degrees_to_radians<double>()); }
 
+  // constexpr sine, cosine and tangent, for evaluating trigonometry at compile time.
+  // sin and cos are within 2 ulp of the C library for |x| < 2^20 and tan() within 4 ulp; larger arguments lose accuracy,
+  // and past |x| = MAX_ARGUMENT, where the quadrant no longer fits the integer reduce() rounds it through, give NaN.
+  namespace detail {
+    constexpr double MAX_ARGUMENT = 4503599627370496.0; // 2^52, past which every double is an integer.
+
+    // pi / 2 split into parts of 33 significant bits, so k * part is exact for |k| < 2^20, plus the remaining tail.
+    constexpr double PIO2_1 = 1.57079632673412561417e+00;
+    constexpr double PIO2_2 = 6.07710050630396597660e-11;
+    constexpr double PIO2_3 = 2.02226624871116645580e-21;
+    constexpr double PIO2_3T = 8.47842766036889956997e-32;
+
+    // Taylor series on [-pi/4, pi/4], where the first omitted term is below half an ulp.
+    constexpr double sin_kernel(double x) {
+      double x2 = x * x;
+      return x + x * x2 * (-1.0 / 6 + x2 * (1.0 / 120 + x2 * (-1.0 / 5040 + x2 * (1.0 / 362880 + x2 * (-1.0 / 39916800 + x2 * (1.0 / 6227020800 + x2 * (-1.0 / 1307674368000)))))));
+    }
+
+    constexpr double cos_kernel(double x) {
+      double x2 = x * x;
+      return 1.0 + x2 * (-1.0 / 2 + x2 * (1.0 / 24 + x2 * (-1.0 / 720 + x2 * (1.0 / 40320 + x2 * (-1.0 / 3628800 + x2 * (1.0 / 479001600 + x2 * (-1.0 / 87178291200 + x2 * (1.0 / 20922789888000))))))));
+    }
+
+    // Reduces x to r in [-pi/4, pi/4] with x = r + quadrant * pi / 2, returning quadrant mod 4. |x| <= MAX_ARGUMENT.
+    constexpr int reduce(double x, double &r) {
+      double k = x * (2.0 / pi<double>());
+      k = static_cast<double>(static_cast<long long>(k < 0 ? k - 0.5 : k + 0.5));
+      r = (((x - k * PIO2_1) - k * PIO2_2) - k * PIO2_3) - k * PIO2_3T;
+      return static_cast<int>(static_cast<long long>(k) & 3);
+    }
+
+    // False for NaN and infinities too.
+    constexpr bool in_range(double x) {
+      return x >= -MAX_ARGUMENT && x <= MAX_ARGUMENT;
+    }
+  }
+
+  constexpr double sin(double x) {
+    if (!detail::in_range(x)) return std::numeric_limits<double>::quiet_NaN();
+    double r = 0.0;
+    switch (detail::reduce(x, r)) {
+      case 0:  return detail::sin_kernel(r);
+      case 1:  return detail::cos_kernel(r);
+      case 2:  return -detail::sin_kernel(r);
+      default: return -detail::cos_kernel(r);
+    }
+  }
+
+  constexpr double cos(double x) {
+    if (!detail::in_range(x)) return std::numeric_limits<double>::quiet_NaN();
+    double r = 0.0;
+    switch (detail::reduce(x, r)) {
+      case 0:  return detail::cos_kernel(r);
+      case 1:  return -detail::sin_kernel(r);
+      case 2:  return -detail::cos_kernel(r);
+      default: return detail::sin_kernel(r);
+    }
+  }
+
+  constexpr double tan(double x) {
+    if (!detail::in_range(x)) return std::numeric_limits<double>::quiet_NaN();
+    double r = 0.0;
+    int quadrant = detail::reduce(x, r);
+    return (quadrant & 1) ? -detail::cos_kernel(r) / detail::sin_kernel(r) : detail::sin_kernel(r) / detail::cos_kernel(r);
+  }
+
 } } // namespace common::math
 
 #endif // COMMON_MATH_H_
@@ -2,182 +2,1829 @@
 #include "catch.hpp"
 
 #include "MathParser.h"
+#include "MathParserArchive.h"
+#include "MathParserAsync.h"
+#include "MathParserBaseline.h"
+#include "MathParserCache.h"
+#include "MathParserExecutor.h"
+#include "MathParserFunctions.h"
+#include "MathParserFused.h"
+#include "MathParserGraph.h"
+#include "MathParserIncremental.h"
+#include "MathParserInstrument.h"
+#include "MathParserOffload.h"
+#include "MathParserSpecialized.h"
+#include "MathParserStatic.h"
+#include "MathParserStream.h"
+#include "MathParserTrig.h"
 #include "MathParserTestCase.h"
 
-#include "common/math.h" // common::math::e/pi/tau
+#include "common/math.h" // common::math::e/pi/tau, constexpr trig
 
+#include <algorithm> // std::max
+#include <atomic>
 #include <cassert> // std::assert
+#include <cctype>  // std::isspace, std::tolower
 #include <climits> // std::numerical_limis::quiet_NaN()
 #include <cmath>   // std::pow
+#include <cstdint>
 #include <cstdio>  // std::printf
+#include <cstdlib> // std::malloc, std::free
+#include <cstring> // std::memcmp
+#include <new>
+#include <random>
 #include <string>
+#include <thread>
+#include <type_traits> // std::is_copy_constructible
 #include <vector>
 
-TEST_CASE("MathParser", "evaluate_expression") {
-  static const double E = common::math::e<double>();
-  static const double PI = common::math::pi<double>();
-  static const double TAU = common::math::tau<double>();
-
-  static std::vector<MathParserTestCase> test_cases = {
-    { "",                            ParsingErrorType::EMPTY },
-    { " \f\n\r\t\v",                 ParsingErrorType::EMPTY },
-    { "()",                          ParsingErrorType::EMPTY },
-    { "1(1+",                        ParsingErrorType::MISMATCHED_PARENS },
-    { "((1)",                        ParsingErrorType::MISMATCHED_PARENS },
-    { "(1))",                        ParsingErrorType::MISMATCHED_PARENS },
-    { "1 + (2 - (3 * (4 / (5)))))",  ParsingErrorType::MISMATCHED_PARENS },
-    { "(1)1",                        ParsingErrorType::SYNTAX_ERROR },
-    { "1a",                          ParsingErrorType::SYNTAX_ERROR },
-    { "abc",                         ParsingErrorType::SYNTAX_ERROR },
-    { "a + b * c",                   ParsingErrorType::SYNTAX_ERROR },
-    { "1 2 3",                       ParsingErrorType::SYNTAX_ERROR },
-    { "12.",                         ParsingErrorType::SYNTAX_ERROR },
-    { "1 + 2 # 3",                   ParsingErrorType::SYNTAX_ERROR },
-
-    { "1 / (1 - 1)",                 EvaluationErrorType::DIVIDE_BY_ZERO },
-    { "50%",                         EvaluationErrorType::EXPECTED_CURRENT_VALUE },
-    { "+",                           EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
-    { "1 *",                         EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
-    { "(1 + ) + 1",                  EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
-    { "-",                           EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
-    { "--",                          EvaluationErrorType::EXPECTED_MORE_ARGUMENTS },
-    { "-1 ^ 2 ^ 3.4",                EvaluationErrorType::IMAGINARY_NUMBER },
-
-    { "1",                           1 },
-    { "123",                         123 },
-    { "1.23",                        1.23 },
-    { ".12",                         .12 },
-    { "1e2",                         1e2 },
-    { "1e+2 + 3",                    1e+2 + 3 },
-    { "1e-2 - 3",                    1e-2 - 3 },
-    { "+1",                          1 },
-    { "++1",                         1 },
-    { "+++1",                        1 },
-    { "-1",                          -1 },
-    { "--1",                         1 },
-    { "---1",                        -1 },
-    { "((1))",                       1 },
-    { "1 + 2",                       1 + 2 },
-    { "1 + (2)",                     1 + (2) },
-    { "(1) + 2",                     (1) + 2 },
-    { "+(1 + 2)",                    +(1 + 2)},
-    { "-(1 - 2)",                    -(1 - 2)},
-    { "1 + 2 * 3",                   1 + 2 * 3 },
-    { "1 + (2 * 3)",                 1 + (2 * 3) },
-    { "(1 + 2) * 3",                 (1 + 2) * 3 },
-    { "-1 ^ 2",                      std::pow(-1, 2) },
-    { "(-1) ^ 2",                    std::pow(-1, 2) },
-    { "-(1 ^ 2)",                    -std::pow(1, 2) },
-    { "4 ^ -2",                      std::pow(4, -2) },
-    { "(-4 ^ 2)",                    std::pow(-4, 2) },
-    { "2 * 2 ^ 3",                   2 * std::pow(2, 3) },
-    { "2 * (2 ^ 3)",                 2 * std::pow(2, 3) },
-    { "(2 * 2) ^ 3",                 std::pow(2 * 2, 3) },
-    { "2 ^ 2 ^ 3",                   std::pow(2, std::pow(2, 3)) },
-    { "2 ^ (2 ^ 3)",                 std::pow(2, std::pow(2, 3)) },
-    { "(2 ^ 2) ^ 3",                 std::pow(std::pow(2, 2), 3) },
-    { "1 + .2 * -3 / +4 ^ 5",        1 + .2 * -3 / std::pow(+4, 5) },
-    { "+-+-1++--++--++--+2-3+4",     1+2-3+4 },
-    { "50%",                         0.5 * 1.0, 1.0 },
-    { "2x",                          2.0 * 1.0, 1.0 },
-    { "3X",                          3.0 * 1.0, 1.0 },
-    { "E",                           E },
-    { "e",                           E },
-    { "pi",                          PI },
-    { "Pi",                          PI },
-    { "PI",                          PI },
-    { "tau",                         TAU },
-    { "Tau",                         TAU },
-    { "TAU",                         TAU },
-    trig_test_case("cos 180",        TrigFunctionType::COS, 180.0),
-    trig_test_case("cos(TAU)",       TrigFunctionType::COS, TAU, TrigAngleUnits::RADIANS),
-    trig_test_case("sin90.0",        TrigFunctionType::SIN, 90.0),
-    trig_test_case("sin(pi / 2)",    TrigFunctionType::SIN, PI / 2.0, TrigAngleUnits::RADIANS),
-    trig_test_case("tan45",          TrigFunctionType::TAN, 45.0),
-    trig_test_case("tan(e)",         TrigFunctionType::TAN, E, TrigAngleUnits::RADIANS),
-  };
+// Counts heap allocations so tests can verify the allocation free paths.
+static std::atomic<size_t> allocation_count(0);
+
+void *operator new(size_t size) {
+  ++allocation_count;
+  if (void *pointer = std::malloc(size ? size : 1)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+  std::free(pointer);
+}
+
+// Sized deallocation must be replaced too, or sanitizers see memory from this operator new freed by their own.
+void operator delete(void *pointer, size_t) noexcept {
+  std::free(pointer);
+}
 
-  for (const MathParserTestCase &test_case : test_cases) {
+TEST_CASE("MathParser", "evaluate_expression") {
+  for (const MathParserTestCase &test_case : test_cases()) {
     const std::string &expression = test_case.expression;
     std::printf("\"%s\"\n", expression.c_str());
 
     MathParser::Result result = MathParser::evaluate_expression(expression, test_case.config, test_case.current);
 
+    std::string report;
+    MathParser::format_result(result, expression.data(), expression.size(), report);
+    std::printf("%s\n\n", report.c_str());
+
+    REQUIRE(result.status == test_case.status);
     switch(result.status) {
-      case MathParser::Status::SUCCESS: {
-        std::printf("= %-10.10g\n\n", result.result);
+      case MathParser::Status::SUCCESS:
+        REQUIRE(result.result == test_case.result);
+        break;
+
+      case MathParser::Status::PARSING_ERROR:
+        REQUIRE( result.parsing_error == test_case.parsing_error);
         break;
+        
+      case MathParser::Status::EVALUATION_ERROR:
+        REQUIRE( result.evaluation_error == test_case.evaluation_error);
+        break;
+    }
+  }
+}
+
+TEST_CASE("MathParser compile", "compile") {
+  for (const MathParserTestCase &test_case : test_cases()) {
+    MathParser::Program program = MathParser::compile(test_case.expression, test_case.config);
+    MathParser::Result expected = MathParser::evaluate_expression(test_case.expression, test_case.config, test_case.current);
+    MathParser::Result result = program.evaluate(test_case.current);
+
+    REQUIRE(result.status == expected.status);
+    REQUIRE(result.parsing_error == expected.parsing_error);
+    REQUIRE(result.evaluation_error == expected.evaluation_error);
+    REQUIRE(result.error_position == expected.error_position);
+    REQUIRE(result.error_length == expected.error_length);
+    if (result.status == MathParser::Status::SUCCESS) {
+      REQUIRE(result.result == expected.result);
+    }
+
+    // Parsing errors are known before evaluation.
+    if (test_case.status == MathParser::Status::PARSING_ERROR) {
+      REQUIRE(!program.is_valid());
+      REQUIRE(program.compile_result().parsing_error == test_case.parsing_error);
+    }
+  }
+
+  // A program is reusable across current values.
+  MathParser::Program program = MathParser::compile("(2x) + 50%");
+  REQUIRE(program.is_valid());
+  for (double current = -10.0; current <= 10.0; current += 0.5) {
+    MathParser::Result result = program.evaluate(current);
+    REQUIRE(result.status == MathParser::Status::SUCCESS);
+    REQUIRE(result.result == 2.0 * current + 0.5 * current);
+  }
+  REQUIRE(program.evaluate().evaluation_error == MathParser::EvaluationErrorType::EXPECTED_CURRENT_VALUE);
+
+  // Syntax errors report the offending span of the filtered expression.
+  MathParser::Program invalid = MathParser::compile("1  +  2 # 3");
+  REQUIRE(invalid.compile_result().parsing_error == MathParser::ParsingErrorType::SYNTAX_ERROR);
+  REQUIRE(invalid.compile_result().filtered_expression == "1 + 2 # 3");
+  REQUIRE(invalid.compile_result().error_position == 6);
+  REQUIRE(invalid.compile_result().error_length == 1);
+
+  // Without registered functions commas are not tokens, so they run into the span of the characters around them.
+  const struct { const char *expression; size_t position; size_t length; } commas[] = {
+    { ",S+", 0, 2 }, { "1,2", 1, 1 }, { "1 ,, 2", 2, 2 }, { "(1,2)", 2, 1 },
+  };
+  for (const auto &comma : commas) {
+    const MathParser::Program program = MathParser::compile(comma.expression);
+    const MathParser::Result &result = program.compile_result();
+    REQUIRE(result.parsing_error == MathParser::ParsingErrorType::SYNTAX_ERROR);
+    REQUIRE(result.error_position == comma.position);
+    REQUIRE(result.error_length == comma.length);
+  }
+}
+
+// Config with the named variables, degrees and optimization.
+static MathParser::Config variables_config(std::vector<std::string> variables, bool optimize = true) {
+  MathParser::Config config(true, optimize);
+  config.variables = std::move(variables);
+  return config;
+}
+
+TEST_CASE("MathParser variables", "compile") {
+  MathParser::Config config = variables_config({ "price", "qty", "rate" });
+  const double frame[] = { 12.5, 4.0, 0.2 };
+
+  // Variables read their slot of the frame, are matched case insensitively and mix with x and %.
+  MathParser::Program program = MathParser::compile("Price * QTY * (1 + rate) - (price x)", config);
+  REQUIRE(program.is_valid());
+  REQUIRE(program.variable_count() == 3);
+  REQUIRE(program.uses_variables());
+  REQUIRE(program.evaluate(frame, 2.0).result == 12.5 * 4.0 * (1 + 0.2) - (12.5 * 2.0));
+  REQUIRE(program.evaluate(frame).evaluation_error == MathParser::EvaluationErrorType::EXPECTED_CURRENT_VALUE);
+
+  // Without a frame the first variable read fails at its location.
+  MathParser::Result missing = program.evaluate(2.0);
+  REQUIRE(missing.evaluation_error == MathParser::EvaluationErrorType::EXPECTED_VARIABLE);
+  REQUIRE(missing.error_position == 0);
+  REQUIRE(missing.error_length == 5);
+
+  // Variables are whole identifiers; keywords and constants keep working around them.
+  REQUIRE(!MathParser::compile("prices", config).is_valid());
+  REQUIRE(!MathParser::compile("price2", config).is_valid());
+  REQUIRE(MathParser::compile("rate - sin(90) * pi", config).evaluate(frame).result == 0.2 - 1.0 * common::math::pi<double>());
+  REQUIRE(MathParser::compile("-qty ^ 2", config).evaluate(frame).result == MathParser::evaluate_expression("-4 ^ 2").result);
+  REQUIRE(!MathParser::compile("price").is_valid());
+
+  // Names only match where a word starts, so they are not split off the end of other words.
+  const struct { const char *expression; size_t position; size_t length; } words[] = {
+    { "sina", 3, 1 }, { "xprice", 1, 4 }, { "aprice", 0, 5 },
+  };
+  for (const auto &word : words) {
+    const MathParser::Program program = MathParser::compile(word.expression, variables_config({ "a", "price" }));
+    REQUIRE(program.compile_result().parsing_error == MathParser::ParsingErrorType::SYNTAX_ERROR);
+    REQUIRE(program.compile_result().error_position == word.position);
+    REQUIRE(program.compile_result().error_length == word.length);
+  }
+  REQUIRE(MathParser::compile("sin a + 2x * price", variables_config({ "a", "price" })).is_valid());
+
+  // Names take precedence over keywords.
+  const double e = 3.0;
+  REQUIRE(MathParser::compile("2 * e", variables_config({ "e" })).evaluate(&e).result == 6.0);
+
+  // Variables are never folded, but constants around them are.
+  MathParser::Program folded = MathParser::compile("qty * (2 + 3)", config);
+  REQUIRE(folded.instructions().size() == 3);
+  REQUIRE(folded.instructions()[0].type == MathParser::Operator::Type::VARIABLE);
+  REQUIRE(folded.instructions()[0].slot == 1);
+  REQUIRE(folded.evaluate(frame).result == 20.0);
+
+  // Batch evaluation reads one column per variable and matches the scalar evaluator lane for lane.
+  std::vector<double> in, price, qty, rate;
+  for (int i = -600; i <= 600; ++i) {
+    in.push_back(i * 0.25);
+    price.push_back(i * 1.5);
+    qty.push_back(i % 7);
+    rate.push_back(i % 3 - 1);
+  }
+  in[7] = std::numeric_limits<double>::quiet_NaN();
+  const double *columns[] = { price.data(), qty.data(), rate.data() };
+
+  MathParser::StdThreadPool pool(2);
+  MathParser::ParallelExecutor executor(pool, 100);
+  for (const char *expression : { "price * qty * (1 + rate) - (price x)", "price / qty", "rate ^ .5 + 1", "sin(price) * qty%" }) {
+    for (bool optimize : { true, false }) {
+      MathParser::Program batch_program = MathParser::compile(expression, variables_config(config.variables, optimize));
+      std::vector<double> out(in.size()), specialized_out(in.size()), parallel_out(in.size());
+      std::vector<MathParser::EvaluationErrorType> errors(in.size()), specialized_errors(in.size()), parallel_errors(in.size());
+      size_t failed = MathParser::evaluate_batch_interpreted(batch_program, columns, in.data(), out.data(), in.size(), errors.data());
+
+      size_t expected_failed = 0;
+      for (size_t i = 0; i < in.size(); ++i) {
+        const double lane[] = { price[i], qty[i], rate[i] };
+        MathParser::Result expected = batch_program.evaluate(lane, in[i]);
+        if (expected.status == MathParser::Status::SUCCESS) {
+          REQUIRE(errors[i] == MathParser::EvaluationErrorType::NONE);
+          REQUIRE((out[i] == expected.result || (std::isnan(out[i]) && std::isnan(expected.result))));
+        } else {
+          ++expected_failed;
+          REQUIRE(std::isnan(out[i]));
+          REQUIRE(errors[i] == expected.evaluation_error);
+        }
       }
+      REQUIRE(failed == expected_failed);
 
-      case MathParser::Status::PARSING_ERROR: {
-        switch(result.parsing_error) {
-          case MathParser::ParsingErrorType::NONE:
-            assert(false);
-            break;
-
-          case MathParser::ParsingErrorType::EMPTY:
-            std::printf("<parsing error: empty>\n\n");
-            break;
-
-          case MathParser::ParsingErrorType::MISMATCHED_PARENS:
-            std::printf("<parsing error: mismatched parens>\n\n");
-            break;
-
-          case MathParser::ParsingErrorType::SYNTAX_ERROR: {
-            if (result.error_length == 0 || result.filtered_expression.length() == 0) {
-              std::printf("<parsing error: syntax error>\n\n");
-            } else {
-              std::printf("<parsing error: syntax error> at position %zu: \"%s\"\n\n",
-                          result.error_position,
-                          expression.substr(std::min(expression.length(), result.error_position), result.error_length).c_str());
-            }
-            break;
-          }
+      MathParser::SpecializedProgram specialized(batch_program);
+      REQUIRE(specialized.evaluate_batch(columns, in.data(), specialized_out.data(), in.size(), specialized_errors.data()) == failed);
+      REQUIRE(std::memcmp(specialized_out.data(), out.data(), out.size() * sizeof(double)) == 0);
+      REQUIRE(specialized_errors == errors);
+
+      REQUIRE(executor.evaluate_batch(batch_program, columns, in.data(), parallel_out.data(), in.size(), parallel_errors.data()) == failed);
+      REQUIRE(std::memcmp(parallel_out.data(), out.data(), out.size() * sizeof(double)) == 0);
+      REQUIRE(parallel_errors == errors);
+
+      // Without columns every lane fails.
+      REQUIRE(MathParser::evaluate_batch(batch_program, in.data(), out.data(), in.size(), errors.data()) == in.size());
+      REQUIRE(specialized.evaluate_batch(in.data(), out.data(), in.size()) == in.size());
+    }
+  }
+
+  // The cache keeps programs compiled with different variables apart.
+  MathParser::ExpressionCache cache;
+  REQUIRE(cache.compile("a + b", variables_config({ "a", "b" }))->is_valid());
+  REQUIRE(!cache.compile("a + b", variables_config({ "a" }))->is_valid());
+  REQUIRE(cache.evaluate_expression("a + 1", variables_config({ "a" })).evaluation_error == MathParser::EvaluationErrorType::EXPECTED_VARIABLE);
+
+  // Text cannot spell out the flags and names of another key.
+  REQUIRE(!cache.compile(std::string("1ds2\0b", 6), variables_config({ }))->is_valid());
+  REQUIRE(cache.compile("1", variables_config({ "bds2" }))->is_valid());
+}
+
+static double hypot_function(const double *arguments) { return std::sqrt(arguments[0] * arguments[0] + arguments[1] * arguments[1]); }
+static double clamp_function(const double *arguments) { return std::min(std::max(arguments[0], arguments[1]), arguments[2]); }
+static double half_function(const double *arguments) { return arguments[0] / 2; }
+
+static std::atomic<size_t> hypot_batch_calls(0);
+static void hypot_batch(const double *const *arguments, double *out, size_t count) {
+  ++hypot_batch_calls;
+  for (size_t i = 0; i < count; ++i) out[i] = std::sqrt(arguments[0][i] * arguments[0][i] + arguments[1][i] * arguments[1][i]);
+}
+
+static std::atomic<size_t> tick_calls(0);
+static double tick_function(const double *arguments) { return arguments[0] + static_cast<double>(tick_calls++); }
+
+TEST_CASE("MathParser functions", "compile") {
+  // Operators point at the registry's names, so copies and moves would dangle.
+  static_assert(!std::is_copy_constructible<MathParser::FunctionRegistry>::value, "not copyable");
+  static_assert(!std::is_move_constructible<MathParser::FunctionRegistry>::value, "not movable");
+  std::shared_ptr<MathParser::FunctionRegistry> functions = std::make_shared<MathParser::FunctionRegistry>();
+  MathParser::FunctionOptions hypot_options;
+  hypot_options.batch = &hypot_batch;
+  REQUIRE(functions->add("hypot", 2, &hypot_function, hypot_options) == 0);
+  REQUIRE(functions->add("Clamp", 3, &clamp_function) == 1);
+  MathParser::FunctionOptions tight;
+  tight.precedence = 150;
+  REQUIRE(functions->add("half", 1, &half_function, tight) == 2);
+  MathParser::FunctionOptions impure;
+  impure.pure = false;
+  REQUIRE(functions->add("tick", 1, &tick_function, impure) == 3);
+
+  // Names must be new identifiers, and arities and precedences within their bounds.
+  REQUIRE(functions->add("HYPOT", 2, &hypot_function) == MathParser::FunctionRegistry::NO_FUNCTION);
+  REQUIRE(functions->add("2x", 1, &half_function) == MathParser::FunctionRegistry::NO_FUNCTION);
+  REQUIRE(functions->add("half-life", 1, &half_function) == MathParser::FunctionRegistry::NO_FUNCTION);
+  REQUIRE(functions->add("f", 0, &half_function) == MathParser::FunctionRegistry::NO_FUNCTION);
+  REQUIRE(functions->add("f", MathParser::FunctionRegistry::MAX_ARITY + 1, &half_function) == MathParser::FunctionRegistry::NO_FUNCTION);
+  REQUIRE(functions->add("f", 1, nullptr) == MathParser::FunctionRegistry::NO_FUNCTION);
+  MathParser::FunctionOptions loose;
+  loose.precedence = 0;
+  REQUIRE(functions->add("f", 1, &half_function, loose) == MathParser::FunctionRegistry::NO_FUNCTION);
+  REQUIRE(functions->size() == 4);
+  REQUIRE(functions->find("CLAMP", 5) == 1);
+  REQUIRE(std::string((*functions)[1].op.name) == "clamp");
+
+  MathParser::Config config;
+  config.functions = functions;
+  auto evaluate = [&](const std::string &expression, double current_value = 2.0) {
+    return MathParser::compile(expression, config).evaluate(current_value);
+  };
+
+  // Calls take exactly their arguments, which are full expressions, and nest.
+  REQUIRE(evaluate("hypot(3, 4)").result == 5.0);
+  REQUIRE(evaluate("HYPOT(1 + 2, 2 * 2) + clamp(-(3x), -5, 5)").result == 5.0 - 5.0);
+  REQUIRE(evaluate("clamp(hypot(3, 4), 0, 10) * 2").result == 10.0);
+  REQUIRE(evaluate("2 - half 6").result == -1.0);
+  REQUIRE(evaluate("hypot(3, 4)", NAN).result == 5.0);
+
+  // Precedence is that of an operator: by default a call spans up to the next * or lower, so the ^ is an argument.
+  // Above the unary operators a call binds to its parens alone.
+  REQUIRE(evaluate("hypot(3, 4) ^ 2").result == hypot_function(std::vector<double>{ 3.0, 16.0 }.data()));
+  REQUIRE(evaluate("half(4) ^ 2").result == 4.0);
+
+  for (const char *invalid : { "hypot(3)", "hypot(3, 4, 5)", "hypot 3 4", "hypot", "3 4 hypot", "hypot(, 4)", "hypot(3 4, 5)", "(1, 2)", "1, 2", "half(1, 2)", "half()", "hypot(3, 4" }) {
+    INFO(invalid);
+    const MathParser::Result result = MathParser::compile(invalid, config).compile_result();
+    REQUIRE(result.status == MathParser::Status::PARSING_ERROR);
+    const MathParser::CompactResult validated = MathParser::validate(invalid, config);
+    REQUIRE(validated.parsing_error() == result.parsing_error);
+  }
+  // Misplaced commas and calls missing their parens report their own span.
+  const MathParser::Result stray = MathParser::compile("1, 2", config).compile_result();
+  REQUIRE(stray.error_position == 1);
+  REQUIRE(stray.error_length == 1);
+  const MathParser::Result bare = MathParser::compile("1 + hypot", config).compile_result();
+  REQUIRE(bare.error_position == 4);
+  REQUIRE(bare.error_length == 5);
+
+  // validate() agrees with compile() on random sequences of calls.
+  std::mt19937 random(5);
+  const char *const pieces[] = { "hypot", "clamp", "half", "(", "(", ")", ")", ",", "1", "2x", "+", "-", "^" };
+  for (int i = 0; i < 20000; ++i) {
+    std::string expression;
+    for (size_t j = random() % 14; j > 0; --j) {
+      expression += pieces[random() % (sizeof(pieces) / sizeof(pieces[0]))];
+      expression += ' ';
+    }
+    INFO(expression);
+    const MathParser::Result expected = MathParser::compile(expression, config).compile_result();
+    const MathParser::CompactResult result = MathParser::validate(expression, config);
+    REQUIRE(result.status() == expected.status);
+    REQUIRE(result.parsing_error() == expected.parsing_error);
+    REQUIRE(result.evaluation_error() == expected.evaluation_error);
+  }
+  REQUIRE(MathParser::compile("hypot(3, 4)").compile_result().parsing_error == MathParser::ParsingErrorType::SYNTAX_ERROR);
+  REQUIRE(MathParser::validate("clamp(1x, 0, 1)", config).status() == MathParser::Status::SUCCESS);
+
+  // Variables take precedence over functions, and functions over the built in keywords.
+  MathParser::Config shadowed = config;
+  shadowed.variables = { "half" };
+  const double half = 10.0;
+  REQUIRE(MathParser::compile("half * 2", shadowed).evaluate(&half).result == 20.0);
+  std::shared_ptr<MathParser::FunctionRegistry> trig = std::make_shared<MathParser::FunctionRegistry>();
+  trig->add("sin", 1, &half_function);
+  MathParser::Config replaced;
+  replaced.functions = trig;
+  REQUIRE(MathParser::evaluate_expression("sin(30)", replaced).result == 15.0);
+
+  // Pure calls of constants are folded; impure ones run on every evaluation.
+  MathParser::Program folded = MathParser::compile("hypot(3, 4) * (2x)", config);
+  REQUIRE(folded.instructions().size() == 4);
+  REQUIRE(!folded.uses_functions());
+  REQUIRE(folded.evaluate(1.0).result == 10.0);
+  MathParser::Program ticking = MathParser::compile("tick(1 + 1)", config);
+  REQUIRE(ticking.uses_functions());
+  const size_t ticks = tick_calls;
+  REQUIRE(ticking.evaluate().result == 2.0 + ticks);
+  REQUIRE(ticking.evaluate().result == 3.0 + ticks);
+
+  // Batch evaluation, interpreted and specialized, matches the scalar evaluator and uses the column form.
+  std::vector<double> in;
+  for (int i = -300; i <= 300; ++i) in.push_back(i * 0.5);
+  in[3] = NAN;
+  for (const char *expression : { "hypot(1x, 3) + clamp(100 / (1x), -1, 1)", "half(1x) ^ 2 - hypot(1, 1x)", "clamp(sin(1x), hypot(0.5x, 0), 0.9)" }) {
+    for (bool optimize : { true, false }) {
+      INFO(expression);
+      MathParser::Config batch_config = config;
+      batch_config.optimize = optimize;
+      const MathParser::Program program = MathParser::compile(expression, batch_config);
+      REQUIRE(program.is_valid());
+      std::vector<double> out(in.size()), specialized_out(in.size());
+      std::vector<MathParser::EvaluationErrorType> errors(in.size()), specialized_errors(in.size());
+      const size_t before = hypot_batch_calls;
+      const size_t failed = MathParser::evaluate_batch_interpreted(program, in.data(), out.data(), in.size(), errors.data());
+      REQUIRE(hypot_batch_calls > before);
+      size_t expected_failed = 0;
+      for (size_t i = 0; i < in.size(); ++i) {
+        const MathParser::Result expected = program.evaluate(in[i]);
+        REQUIRE(errors[i] == expected.evaluation_error);
+        if (expected.status == MathParser::Status::SUCCESS) {
+          REQUIRE(out[i] == expected.result);
+        } else {
+          ++expected_failed;
         }
-        break;
       }
+      REQUIRE(failed == expected_failed);
+
+      MathParser::SpecializedProgram specialized(program);
+      REQUIRE(specialized.evaluate_batch(in.data(), specialized_out.data(), in.size(), specialized_errors.data()) == failed);
+      REQUIRE(std::memcmp(specialized_out.data(), out.data(), out.size() * sizeof(double)) == 0);
+      REQUIRE(specialized_errors == errors);
+    }
+  }
 
-      case MathParser::Status::EVALUATION_ERROR: {
-        std::string error_string = "";
+  // A specialized program keeps the registry alive after the program and every other owner are gone.
+  std::unique_ptr<MathParser::SpecializedProgram> orphan;
+  {
+    std::shared_ptr<MathParser::FunctionRegistry> scoped = std::make_shared<MathParser::FunctionRegistry>();
+    REQUIRE(scoped->add("half", 1, &half_function) == 0);
+    MathParser::Config scoped_config;
+    scoped_config.functions = scoped;
+    orphan.reset(new MathParser::SpecializedProgram(MathParser::compile("half(4x)", scoped_config)));
+  }
+  double orphan_in[] = { 1.0, -3.0 }, orphan_out[2];
+  REQUIRE(orphan->evaluate_batch(orphan_in, orphan_out, 2) == 0);
+  REQUIRE(orphan_out[0] == 2.0);
+  REQUIRE(orphan_out[1] == -6.0);
 
-        switch(result.evaluation_error) {
-          case MathParser::EvaluationErrorType::NONE: {
-            assert(false);
-            break;
-          }
+  // Modules that cannot run registered functions fall back to the interpreter or decline them.
+  const MathParser::Program program = MathParser::compile("hypot(3x, 4) - half 2", config);
+  MathParser::ProgramArchiveWriter writer;
+  REQUIRE(!writer.add(program));
+  REQUIRE(MathParser::kernel_source(program, MathParser::KernelDialect::OPENCL).empty());
+
+  MathParser::FusedProgram fused({ "hypot(3x, 4) - half 2", "(3x) + 1", "hypot(3" }, config);
+  MathParser::CompactResult results[3] = { 0.0, 0.0, 0.0 };
+  fused.evaluate(1.0, results);
+  REQUIRE(results[0].value == 4.0);
+  REQUIRE(results[1].value == 4.0);
+  REQUIRE(results[2].parsing_error() == MathParser::ParsingErrorType::MISMATCHED_PARENS);
+  std::vector<std::vector<double>> columns(3, std::vector<double>(in.size()));
+  double *fused_out[] = { columns[0].data(), columns[1].data(), columns[2].data() };
+  fused.evaluate_batch(in.data(), fused_out, in.size());
+  for (size_t i = 0; i < in.size(); ++i) {
+    const MathParser::Result expected = program.evaluate(in[i]);
+    REQUIRE((expected.status == MathParser::Status::SUCCESS ? columns[0][i] == expected.result : std::isnan(columns[0][i])));
+  }
+
+  MathParser::IncrementalExpression incremental("hypot(3x, 4)", config);
+  REQUIRE(incremental.evaluate(1.0).result == 5.0);
+  incremental.edit(11, 0, " - 1");
+  REQUIRE(incremental.text() == "hypot(3x, 4 - 1)");
+  REQUIRE(incremental.evaluate(1.0).result == hypot_function(std::vector<double>{ 3.0, 3.0 }.data()));
+
+  // The cache keeps programs compiled with different registries apart.
+  MathParser::ExpressionCache cache;
+  REQUIRE(cache.evaluate_expression("sin(30)", replaced).result == 15.0);
+  REQUIRE(cache.evaluate_expression("sin(30)", MathParser::Config()).result == MathParser::evaluate_expression("sin(30)").result);
+  const MathParser::Result first = cache.evaluate_expression("tick(0)", config);
+  REQUIRE(cache.evaluate_expression("tick(0)", config).result == first.result + 1.0);
+}
 
-          case MathParser::EvaluationErrorType::DIVIDE_BY_ZERO:          error_string = ": divide by zero";          break;
-          case MathParser::EvaluationErrorType::EXPECTED_CURRENT_VALUE:  error_string = ": expected current value";  break;
-          case MathParser::EvaluationErrorType::EXPECTED_MORE_ARGUMENTS: error_string = ": expected more arguments"; break;
-          case MathParser::EvaluationErrorType::IMAGINARY_NUMBER:        error_string = ": imaginary number";        break;
-          case MathParser::EvaluationErrorType::UNEXPECTED_TOKEN:        error_string = ": unexpected token";        break;
+TEST_CASE("MathParser evaluate_batch", "evaluate_batch") {
+  std::vector<double> in;
+  for (int i = -600; i <= 600; ++i) {
+    in.push_back(i * 0.25);
+  }
+  in[7] = std::numeric_limits<double>::quiet_NaN();
+
+  std::vector<std::string> expressions = { "(2x) + 50%", "1 / (x - 3)", "(x - 2) ^ .5", "sin(x) * cos x - tan(45 + x)", "-x ^ 2 ^ -x" };
+  for (const MathParserTestCase &test_case : test_cases()) {
+    expressions.push_back(test_case.expression);
+  }
+
+  for (const std::string &expression : expressions) {
+    for (bool use_degrees : { true, false }) {
+      MathParser::Program program = MathParser::compile(expression, use_degrees);
+      std::vector<double> out(in.size());
+      std::vector<MathParser::EvaluationErrorType> errors(in.size());
+      size_t failed = MathParser::evaluate_batch(program, in.data(), out.data(), in.size(), errors.data());
+
+      size_t expected_failed = 0;
+      for (size_t i = 0; i < in.size(); ++i) {
+        MathParser::Result expected = program.evaluate(in[i]);
+        if (expected.status == MathParser::Status::SUCCESS) {
+          REQUIRE(errors[i] == MathParser::EvaluationErrorType::NONE);
+          REQUIRE((out[i] == expected.result || (std::isnan(out[i]) && std::isnan(expected.result))));
+        } else {
+          ++expected_failed;
+          REQUIRE(std::isnan(out[i]));
+          if (expected.status == MathParser::Status::EVALUATION_ERROR) {
+            REQUIRE(errors[i] == expected.evaluation_error);
+          }
         }
+      }
+      REQUIRE(failed == expected_failed);
+    }
+  }
+}
 
-        if (result.error_length == 0 || result.filtered_expression.length() == 0) {
-          std::printf("<evaluation error%s>\n\n", error_string.c_str());
+// Distance between two finite doubles of the same sign in units in the last place.
+static uint64_t ulp_distance(double a, double b) {
+  int64_t x, y;
+  std::memcpy(&x, &a, sizeof(x));
+  std::memcpy(&y, &b, sizeof(y));
+  return x > y ? static_cast<uint64_t>(x - y) : static_cast<uint64_t>(y - x);
+}
+
+TEST_CASE("MathParser vectorized trig", "evaluate_batch") {
+  std::mt19937_64 random(19);
+  std::vector<double> in;
+  for (int i = -720; i <= 720; ++i) {
+    in.push_back(i * 0.5);
+  }
+  for (int i = 0; i < 4000; ++i) {
+    in.push_back(std::uniform_real_distribution<double>(-1e5, 1e5)(random));
+  }
+  for (int i = 0; i < 4000; ++i) {
+    in.push_back(std::uniform_real_distribution<double>(-4.0, 4.0)(random));
+  }
+  // A block with an argument out of the kernels' range, which falls back to the C library.
+  in.push_back(1e300);
+  in.push_back(std::numeric_limits<double>::infinity());
+  in.push_back(std::numeric_limits<double>::quiet_NaN());
+
+  // Documented bound plus the C library's own error, which is within 1 ulp, and 2 for reciprocals taken of it.
+  struct Case {
+    const char *expression;
+    uint64_t tolerance;
+  };
+  const Case cases[] = { { "sin(1x)", 2 }, { "cos(1x)", 2 }, { "tan(1x)", 4 }, { "sec(1x)", 4 }, { "csc(1x)", 4 }, { "cot(1x)", 5 } };
+  for (const Case &c : cases) {
+    for (bool use_degrees : { true, false }) {
+      MathParser::Config fast(use_degrees);
+      fast.strict_trig = false;
+      MathParser::Program strict_program = MathParser::compile(c.expression, use_degrees);
+      MathParser::Program fast_program = MathParser::compile(c.expression, fast);
+      std::vector<double> expected(in.size()), out(in.size());
+      MathParser::evaluate_batch_interpreted(strict_program, in.data(), expected.data(), in.size());
+      MathParser::evaluate_batch_interpreted(fast_program, in.data(), out.data(), in.size());
+      for (size_t i = 0; i < in.size(); ++i) {
+        if (std::isnan(expected[i]) || std::isinf(expected[i])) {
+          REQUIRE(std::memcmp(&out[i], &expected[i], sizeof(double)) == 0);
+        } else if (std::fabs(expected[i]) < 1e-12 || std::fabs(expected[i]) > 1e12) {
+          // Near a zero or a pole the result is only as good as the argument, whose rounding dominates.
+          REQUIRE(std::fabs(out[i] - expected[i]) <= 1e-9 * std::max(1.0, std::fabs(expected[i])));
         } else {
-          std::printf("<evaluation error%s> at position %zu: \"%s\"\n\n",
-                      error_string.c_str(),
-                      result.error_position,
-                      expression.substr(std::min(expression.length(), result.error_position), result.error_length).c_str());
+          REQUIRE((out[i] < 0) == (expected[i] < 0));
+          REQUIRE(ulp_distance(out[i], expected[i]) <= c.tolerance);
         }
-        break;
       }
+
+      // The specialized backend runs the same kernels.
+      std::vector<double> specialized(in.size());
+      MathParser::SpecializedProgram(fast_program).evaluate_batch(in.data(), specialized.data(), in.size());
+      REQUIRE(std::memcmp(specialized.data(), out.data(), out.size() * sizeof(double)) == 0);
     }
+  }
 
-    REQUIRE(result.status == test_case.status);
-    switch(result.status) {
-      case MathParser::Status::SUCCESS:
-        REQUIRE(result.result == test_case.result);
-        break;
+  // Exact where the C library is: zeros keep their sign and sin(0) is 0.
+  double values[] = { 0.0, -0.0, 1e-300 };
+  MathParser::trig_kernel(MathParser::Operator::Type::SINE)(values, 3);
+  REQUIRE(values[0] == 0.0);
+  REQUIRE(std::signbit(values[1]));
+  REQUIRE(values[2] == 1e-300);
+  REQUIRE(MathParser::trig_kernel(MathParser::Operator::Type::ADD) == nullptr);
+  REQUIRE(std::string(MathParser::trig_kernel_isa()).size() > 0);
+}
 
-      case MathParser::Status::PARSING_ERROR:
-        REQUIRE( result.parsing_error == test_case.parsing_error);
-        break;
-        
-      case MathParser::Status::EVALUATION_ERROR:
-        REQUIRE( result.evaluation_error == test_case.evaluation_error);
-        break;
+TEST_CASE("MathParser float evaluate_batch", "evaluate_batch") {
+  std::vector<float> in;
+  for (int i = -600; i <= 600; ++i) {
+    in.push_back(i * 0.25f);
+  }
+  in[7] = std::numeric_limits<float>::quiet_NaN();
+  std::vector<double> wide(in.begin(), in.end());
+
+  std::vector<std::string> expressions = { "(2x) + 50%", "1 / (x - 3)", "(x - 2) ^ .5", "sin(x) * cos x - tan(45 + x)" };
+  for (const MathParserTestCase &test_case : test_cases()) {
+    expressions.push_back(test_case.expression);
+  }
+
+  for (const std::string &expression : expressions) {
+    for (bool use_degrees : { true, false }) {
+      MathParser::Program program = MathParser::compile(expression, use_degrees);
+      std::vector<double> expected(in.size());
+      std::vector<MathParser::EvaluationErrorType> expected_errors(in.size());
+      size_t expected_failed = MathParser::evaluate_batch(program, wide.data(), expected.data(), wide.size(), expected_errors.data());
+
+      // Double precision is the double evaluator rounded once.
+      std::vector<float> out(in.size());
+      std::vector<MathParser::EvaluationErrorType> errors(in.size());
+      REQUIRE(MathParser::evaluate_batch(program, in.data(), out.data(), in.size(), errors.data()) == expected_failed);
+      REQUIRE(errors == expected_errors);
+      for (size_t i = 0; i < in.size(); ++i) {
+        const float rounded = static_cast<float>(expected[i]);
+        REQUIRE(std::memcmp(&out[i], &rounded, sizeof(float)) == 0);
+      }
+
+      // Single precision fails the same lanes, here where no step overflows float.
+      MathParser::Config single(use_degrees);
+      single.precision = MathParser::Precision::SINGLE;
+      MathParser::Program single_program = MathParser::compile(expression, single);
+      REQUIRE(MathParser::evaluate_batch(single_program, in.data(), out.data(), in.size(), errors.data()) == expected_failed);
+      REQUIRE(errors == expected_errors);
+      for (size_t i = 0; i < in.size(); ++i) {
+        if (std::fabs(expected[i]) < 1e30) {
+          REQUIRE(std::fabs(out[i] - expected[i]) <= 1e-4 * std::max(1.0, std::fabs(expected[i])));
+        }
+      }
+    }
+  }
+
+  // Single precision rounds literals and every step to float, with variables too.
+  MathParser::Config config = variables_config({ "price" });
+  config.precision = MathParser::Precision::SINGLE;
+  MathParser::Program program = MathParser::compile("price * 1.1 + (0.3x)", config);
+  const float prices[] = { 1.0f, 19.99f, 1e7f };
+  const float *columns[] = { prices };
+  const float current[] = { 3.0f, 0.5f, -2.0f };
+  float out[3];
+  REQUIRE(MathParser::evaluate_batch(program, columns, current, out, 3) == 0);
+  for (size_t i = 0; i < 3; ++i) {
+    REQUIRE(out[i] == prices[i] * 1.1f + 0.3f * current[i]);
+  }
+  REQUIRE(MathParser::evaluate_batch(program, current, out, 3) == 3);
+  REQUIRE(std::isnan(out[0]));
+}
+
+// Stands in for a GPU: runs each chunk on a thread of its own with the CPU evaluator, so chunks on different queues overlap.
+class ThreadOffloadDevice : public MathParser::OffloadDevice {
+public:
+  explicit ThreadOffloadDevice(size_t queues) : _threads(queues) { }
+
+  size_t queues() const override { return _threads.size(); }
+
+  bool prepare(const std::string &source, MathParser::KernelDialect) override {
+    sources.push_back(source);
+    return accept;
+  }
+
+  void enqueue(size_t queue, const double *in, const double *const *variables, size_t variable_count, double *out, uint8_t *errors, size_t count) override {
+    REQUIRE(!_threads[queue].joinable());
+    const size_t running = ++in_flight;
+    max_in_flight = std::max(max_in_flight.load(), running);
+    ++enqueued;
+    std::vector<const double *> columns(variables, variables + variable_count);
+    _threads[queue] = std::thread([=] {
+      std::vector<MathParser::EvaluationErrorType> lane_errors(count);
+      MathParser::evaluate_batch(*program, variables ? columns.data() : nullptr, in, out, count, lane_errors.data());
+      for (size_t i = 0; i < count; ++i) errors[i] = static_cast<uint8_t>(lane_errors[i]);
+    });
+  }
+
+  bool wait(size_t queue) override {
+    _threads[queue].join();
+    --in_flight;
+    return queue != failing_queue;
+  }
+
+  const MathParser::Program *program = nullptr;
+  bool accept = true;
+  size_t failing_queue = static_cast<size_t>(-1);
+  std::vector<std::string> sources;
+  std::atomic<size_t> in_flight{ 0 };
+  std::atomic<size_t> max_in_flight{ 0 };
+  size_t enqueued = 0;
+
+private:
+  std::vector<std::thread> _threads;
+};
+
+TEST_CASE("MathParser OffloadEvaluator", "evaluate_batch") {
+  std::vector<double> in, prices;
+  for (int i = 0; i < 10000; ++i) {
+    in.push_back((i % 200) * 0.5 - 50.0);
+    prices.push_back(i * 0.01);
+  }
+  in[123] = std::numeric_limits<double>::quiet_NaN();
+  const double *columns[] = { prices.data() };
+
+  MathParser::Program program = MathParser::compile("price / ((1x) - 3) + (50%) - sin(1x)", variables_config({ "price" }));
+  REQUIRE(program.is_valid());
+  std::vector<double> expected(in.size());
+  std::vector<MathParser::EvaluationErrorType> expected_errors(in.size());
+  const size_t expected_failed = MathParser::evaluate_batch(program, columns, in.data(), expected.data(), in.size(), expected_errors.data());
+  REQUIRE(expected_failed > 0);
+
+  // Batches split into chunks across the device's queues, at most one chunk per queue in flight.
+  ThreadOffloadDevice device(3);
+  device.program = &program;
+  MathParser::OffloadOptions options;
+  options.min_lanes = 1000;
+  options.chunk_lanes = 700;
+  MathParser::OffloadEvaluator evaluator(device, options);
+  std::vector<double> out(in.size());
+  std::vector<MathParser::EvaluationErrorType> errors(in.size());
+  REQUIRE(evaluator.evaluate_batch(program, columns, in.data(), out.data(), in.size(), errors.data()) == expected_failed);
+  REQUIRE(std::memcmp(out.data(), expected.data(), out.size() * sizeof(double)) == 0);
+  REQUIRE(errors == expected_errors);
+  REQUIRE(device.enqueued == (in.size() + 699) / 700);
+  REQUIRE(device.max_in_flight <= 3);
+  REQUIRE(device.sources.size() == 1);
+  REQUIRE(device.sources[0] == MathParser::kernel_source(program, MathParser::KernelDialect::OPENCL));
+  REQUIRE(evaluator.stats().offloaded_lanes == in.size());
+
+  // Chunks the device fails are evaluated on the CPU instead.
+  device.failing_queue = 1;
+  std::fill(out.begin(), out.end(), 0.0);
+  REQUIRE(evaluator.evaluate_batch(program, columns, in.data(), out.data(), in.size(), errors.data()) == expected_failed);
+  REQUIRE(std::memcmp(out.data(), expected.data(), out.size() * sizeof(double)) == 0);
+  REQUIRE(errors == expected_errors);
+  REQUIRE(evaluator.stats().cpu_lanes > 0);
+
+  // Small batches, invalid programs and kernels the device rejects stay on the CPU.
+  const size_t enqueued = device.enqueued;
+  REQUIRE(evaluator.evaluate_batch(program, columns, in.data(), out.data(), 999) == MathParser::evaluate_batch(program, columns, in.data(), expected.data(), 999));
+  MathParser::Program invalid = MathParser::compile("1 +");
+  REQUIRE(evaluator.evaluate_batch(invalid, in.data(), out.data(), in.size()) == in.size());
+  device.accept = false;
+  REQUIRE(evaluator.evaluate_batch(program, columns, in.data(), out.data(), in.size()) == expected_failed);
+  REQUIRE(device.enqueued == enqueued);
+
+  // Kernels compute in the program's precision and read and write doubles in either dialect.
+  REQUIRE(MathParser::kernel_source(invalid, MathParser::KernelDialect::CUDA).empty());
+  MathParser::Config single;
+  single.precision = MathParser::Precision::SINGLE;
+  const std::string cuda = MathParser::kernel_source(MathParser::compile("2 ^ (0.5x)", single), MathParser::KernelDialect::CUDA);
+  REQUIRE(cuda.find("__global__ void math_parser_program(const double *in") != std::string::npos);
+  REQUIRE(cuda.find("float s0") != std::string::npos);
+  REQUIRE(cuda.find("pow(s0, s1)") != std::string::npos);
+}
+
+TEST_CASE("MathParser SpecializedProgram", "evaluate_batch") {
+  std::vector<double> in;
+  for (int i = -600; i <= 600; ++i) {
+    in.push_back(i * 0.25);
+  }
+  in[7] = std::numeric_limits<double>::quiet_NaN();
+
+  std::vector<std::string> expressions = { "(1.5x) + (20%) - 3", "2 / (3x)", "2 ^ (1x)", "(1x) ^ .5", "-(3x) ^ 2", "(2 + 3) * sin(1x)", "cos 0", "pi / 0" };
+  for (const MathParserTestCase &test_case : test_cases()) {
+    expressions.push_back(test_case.expression);
+  }
+
+  // The interpreter is the reference; the specialized backend must match it bit for bit, optimized or not.
+  for (const std::string &expression : expressions) {
+    for (bool use_degrees : { true, false }) {
+      for (bool optimize : { true, false }) {
+        MathParser::Program program = MathParser::compile(expression, MathParser::Config(use_degrees, optimize));
+        MathParser::SpecializedProgram specialized(program);
+        std::vector<double> expected(in.size()), out(in.size());
+        std::vector<MathParser::EvaluationErrorType> expected_errors(in.size()), errors(in.size());
+        size_t expected_failed = MathParser::evaluate_batch_interpreted(program, in.data(), expected.data(), in.size(), expected_errors.data());
+        REQUIRE(specialized.evaluate_batch(in.data(), out.data(), in.size(), errors.data()) == expected_failed);
+        REQUIRE(std::memcmp(out.data(), expected.data(), out.size() * sizeof(double)) == 0);
+        REQUIRE(errors == expected_errors);
+      }
+    }
+  }
+
+  // Literals are consumed by the kernel that uses them.
+  REQUIRE(MathParser::SpecializedProgram(MathParser::compile("(1.5x) + 3")).step_count() == 2);
+  REQUIRE(MathParser::SpecializedProgram(MathParser::compile("1 / (2x) - 1")).step_count() == 3);
+
+  // evaluate_batch switches hot programs over once they pass the threshold, and copies share the switch.
+  MathParser::Program program = MathParser::compile("(1.5x) + (20%) - 3");
+  MathParser::Program copy = program;
+  std::vector<double> column(MathParser::SpecializedProgram::THRESHOLD / 4, 2.0), out(column.size());
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE(!program.is_specialized());
+    REQUIRE(MathParser::evaluate_batch(program, column.data(), out.data(), column.size()) == 0);
+  }
+  REQUIRE(copy.is_specialized());
+  REQUIRE(MathParser::evaluate_batch(copy, column.data(), out.data(), column.size()) == 0);
+  REQUIRE(out.back() == program.evaluate(2.0).result);
+
+  // Programs compiled through Scratch are never specialized.
+  MathParser::Scratch scratch;
+  MathParser::evaluate_expression("(1.5x) + 3", scratch, 1.0);
+  REQUIRE(!scratch.program().is_specialized());
+}
+
+// Checks every output of the fused program against its expression evaluated alone, one row at a time and in batches.
+static void check_fused_program(const MathParser::FusedProgram &fused, const std::vector<double> &in, const std::vector<std::vector<double>> &columns) {
+  std::vector<const double *> variables;
+  for (const std::vector<double> &column : columns) variables.push_back(column.data());
+  const double *const *frames = columns.empty() ? nullptr : variables.data();
+
+  std::vector<MathParser::CompactResult> results(fused.size(), MathParser::CompactResult(0.0));
+  std::vector<double> frame(columns.size());
+  for (size_t i = 0; i < in.size(); i += 97) {
+    for (size_t slot = 0; slot < columns.size(); ++slot) frame[slot] = columns[slot][i];
+    const double *row = columns.empty() ? nullptr : frame.data();
+    fused.evaluate(row, in[i], results.data());
+    for (size_t k = 0; k < fused.size(); ++k) {
+      const MathParser::CompactResult expected = fused.program(k).evaluate_compact(row, in[i]);
+      REQUIRE(results[k].status() == expected.status());
+      REQUIRE(results[k].parsing_error() == expected.parsing_error());
+      REQUIRE(results[k].evaluation_error() == expected.evaluation_error());
+      REQUIRE(results[k].instruction() == expected.instruction());
+      if (expected.ok()) REQUIRE(std::memcmp(&results[k].value, &expected.value, sizeof(double)) == 0);
+    }
+  }
+
+  std::vector<std::vector<double>> out(fused.size(), std::vector<double>(in.size()));
+  std::vector<std::vector<MathParser::EvaluationErrorType>> errors(fused.size(), std::vector<MathParser::EvaluationErrorType>(in.size()));
+  std::vector<double *> out_columns;
+  std::vector<MathParser::EvaluationErrorType *> error_columns;
+  for (size_t k = 0; k < fused.size(); ++k) {
+    out_columns.push_back(out[k].data());
+    error_columns.push_back(errors[k].data());
+  }
+  size_t failed = fused.evaluate_batch(frames, in.data(), out_columns.data(), in.size(), error_columns.data());
+
+  size_t expected_failed = 0;
+  for (size_t k = 0; k < fused.size(); ++k) {
+    std::vector<double> expected(in.size());
+    std::vector<MathParser::EvaluationErrorType> expected_errors(in.size());
+    expected_failed += MathParser::evaluate_batch_interpreted(fused.program(k), frames, in.data(), expected.data(), in.size(), expected_errors.data());
+    REQUIRE(std::memcmp(out[k].data(), expected.data(), in.size() * sizeof(double)) == 0);
+    REQUIRE(errors[k] == expected_errors);
+  }
+  REQUIRE(failed == expected_failed);
+}
+
+TEST_CASE("MathParser FusedProgram", "evaluate_batch") {
+  std::vector<double> in(1000);
+  for (size_t i = 0; i < in.size(); ++i) {
+    in[i] = i % 13 == 0 ? std::numeric_limits<double>::quiet_NaN() : static_cast<double>(i % 37) - 18.0;
+  }
+
+  // A family sharing trig and pow terms, with lanes that divide by zero, need x, or fail to compile.
+  const std::vector<std::string> family = {
+    "sin(2x) + (1 + (50%)) ^ 2",
+    "sin(2x) * 3 - (1 + (50%)) ^ 2",
+    "(1 + (50%)) ^ 2 / (1x)",
+    "cos(sin(2x)) + sin(2x)",
+    "1 / (sin(2x) - (1x))",
+    "(-2) ^ (1 / 2) + sin(2x)",
+    "sin(2x) +",
+    "(e) ^ 2 + tau * pi",
+    "sin(2x) + (1 + (50%)) ^ 2",
+  };
+  for (bool strict_trig : { true, false }) {
+    MathParser::Config config;
+    config.strict_trig = strict_trig;
+    MathParser::FusedProgram fused(family, config);
+    REQUIRE(fused.size() == family.size());
+    for (size_t k = 0; k < family.size(); ++k) {
+      REQUIRE(fused.program(k).is_valid() == (k != 6));
     }
+    REQUIRE(fused.node_count() < fused.instruction_count() / 2);
+    check_fused_program(fused, in, { });
   }
+
+  // Variables, and reading them without a frame.
+  MathParser::Config config;
+  config.variables = { "a", "b" };
+  MathParser::FusedProgram with_variables({ "a * b + sin(a)", "sin(a) / b", "(a * b) ^ 2 + (1x)" }, config);
+  std::vector<std::vector<double>> columns(2, std::vector<double>(in.size()));
+  for (size_t i = 0; i < in.size(); ++i) {
+    columns[0][i] = static_cast<double>(i % 7) - 3.0;
+    columns[1][i] = static_cast<double>(i % 5) - 2.0;
+  }
+  check_fused_program(with_variables, in, columns);
+  check_fused_program(with_variables, in, { });
+
+  // Generated expressions, well formed or not, fused together.
+  ExpressionGenerator generator(31);
+  std::vector<std::string> generated;
+  for (int i = 0; i < 300; ++i) {
+    generated.push_back(generator.next());
+  }
+  check_fused_program(MathParser::FusedProgram(generated), in, { });
+}
+
+TEST_CASE("MathParser ParallelExecutor", "evaluate_batches") {
+  MathParser::StdThreadPool pool(4);
+  MathParser::ParallelExecutor executor(pool, 1000);
+
+  std::vector<double> in(100003);
+  for (size_t i = 0; i < in.size(); ++i) {
+    in[i] = static_cast<double>(i % 721) - 360.0;
+  }
+
+  // Cheap and trig heavy programs over a large column.
+  for (const char *expression : { "(2x) + 50%", "sin(x) * cos(x) + tan(x / 2) - sec x + csc(x) * cot(x)", "1 / x" }) {
+    MathParser::Program program = MathParser::compile(expression);
+    std::vector<double> expected(in.size()), out(in.size());
+    std::vector<MathParser::EvaluationErrorType> expected_errors(in.size()), errors(in.size());
+    size_t expected_failed = MathParser::evaluate_batch(program, in.data(), expected.data(), in.size(), expected_errors.data());
+    REQUIRE(executor.evaluate_batch(program, in.data(), out.data(), in.size(), errors.data()) == expected_failed);
+    REQUIRE(std::memcmp(out.data(), expected.data(), out.size() * sizeof(double)) == 0);
+    REQUIRE(errors == expected_errors);
+  }
+
+  // Many small independent jobs.
+  std::vector<MathParser::Program> programs;
+  for (int i = 0; i < 500; ++i) {
+    programs.push_back(MathParser::compile(std::to_string(i % 7) + " / x + sin(" + std::to_string(i) + "x)"));
+  }
+  std::vector<std::vector<double>> outputs(programs.size());
+  std::vector<MathParser::BatchJob> jobs;
+  for (size_t i = 0; i < programs.size(); ++i) {
+    outputs[i].resize(i * 13 % 2500);
+    jobs.emplace_back(programs[i], in.data(), outputs[i].data(), outputs[i].size());
+  }
+  size_t failed = executor.evaluate_batches(jobs);
+
+  size_t expected_failed = 0;
+  for (size_t i = 0; i < programs.size(); ++i) {
+    std::vector<double> expected(outputs[i].size());
+    size_t job_failed = MathParser::evaluate_batch(programs[i], in.data(), expected.data(), expected.size());
+    REQUIRE(jobs[i].failed == job_failed);
+    REQUIRE((expected.empty() || std::memcmp(outputs[i].data(), expected.data(), expected.size() * sizeof(double)) == 0));
+    expected_failed += job_failed;
+  }
+  REQUIRE(failed == expected_failed);
+}
+
+TEST_CASE("MathParser Scratch", "evaluate_expression") {
+  MathParser::Scratch scratch;
+  for (const MathParserTestCase &test_case : test_cases()) {
+    MathParser::Result expected = MathParser::evaluate_expression(test_case.expression, test_case.config, test_case.current);
+    MathParser::Result result = MathParser::evaluate_expression(test_case.expression, scratch, test_case.current, test_case.config);
+    REQUIRE(result.status == expected.status);
+    REQUIRE(result.parsing_error == expected.parsing_error);
+    REQUIRE(result.evaluation_error == expected.evaluation_error);
+    REQUIRE(result.error_position == expected.error_position);
+    REQUIRE(result.error_length == expected.error_length);
+    REQUIRE(result.filtered_expression.empty());
+    if (expected.status == MathParser::Status::SUCCESS) {
+      REQUIRE(result.result == expected.result);
+    } else if (!expected.filtered_expression.empty()) {
+      REQUIRE(scratch.filtered_expression() == expected.filtered_expression);
+    }
+  }
+
+  // Once warmed up on the corpus, evaluating it again does not touch the heap.
+  // Counts are read before REQUIRE since the assertion itself allocates.
+  size_t allocations = allocation_count.load();
+  for (const MathParserTestCase &test_case : test_cases()) {
+    MathParser::evaluate_expression(test_case.expression, scratch, test_case.current, test_case.config);
+  }
+  size_t scratch_allocations = allocation_count.load() - allocations;
+  REQUIRE(scratch_allocations == 0);
+
+  // Neither does evaluating a compiled program.
+  MathParser::Program program = MathParser::compile("(1 + .2 * -3 / +4 ^ 5) * (2x) - sin(e * 50%)");
+  REQUIRE(program.is_valid());
+  allocations = allocation_count.load();
+  double sum = 0.0;
+  for (int i = 0; i < 100; ++i) {
+    sum += program.evaluate(i).result;
+  }
+  size_t program_allocations = allocation_count.load() - allocations;
+  REQUIRE(program_allocations == 0);
+  REQUIRE(!std::isnan(sum));
+
+  // A one off evaluation does not set up batch specialization for the program it throws away.
+  const std::string one_off = "(1 + .2 * -3 / +4 ^ 5) * (2x)";
+  allocations = allocation_count.load();
+  sum = MathParser::evaluate_expression(one_off, 2.0).result;
+  const size_t one_off_allocations = allocation_count.load() - allocations;
+  allocations = allocation_count.load();
+  sum += MathParser::compile(one_off).evaluate(2.0).result;
+  const size_t compiled_allocations = allocation_count.load() - allocations;
+  REQUIRE(one_off_allocations < compiled_allocations);
+  REQUIRE(!std::isnan(sum));
+}
+
+TEST_CASE("MathParser CompactResult", "evaluate_expression") {
+  REQUIRE(sizeof(MathParser::CompactResult) == 16);
+
+  // The fast path reports the same value and error kind, and diagnose() recovers the rest of the Result.
+  MathParser::Scratch scratch;
+  for (const MathParserTestCase &test_case : test_cases()) {
+    MathParser::Program program = MathParser::compile(test_case.expression, test_case.config);
+    MathParser::Result expected = program.evaluate(test_case.current);
+    MathParser::CompactResult compact = program.evaluate_compact(test_case.current);
+    REQUIRE(compact.status() == expected.status);
+    REQUIRE(compact.parsing_error() == expected.parsing_error);
+    REQUIRE(compact.evaluation_error() == expected.evaluation_error);
+    if (compact.ok()) {
+      REQUIRE(compact.value == expected.result);
+    } else {
+      REQUIRE(std::isnan(compact.value));
+    }
+
+    MathParser::Result diagnosed = program.diagnose(compact);
+    REQUIRE(diagnosed.status == expected.status);
+    REQUIRE(diagnosed.error_position == expected.error_position);
+    REQUIRE(diagnosed.error_length == expected.error_length);
+    REQUIRE(diagnosed.filtered_expression == expected.filtered_expression);
+
+    MathParser::CompactResult scratch_compact = MathParser::evaluate_compact(test_case.expression, scratch, test_case.current, test_case.config);
+    MathParser::Result scratch_diagnosed = scratch.program().diagnose(scratch_compact);
+    REQUIRE(scratch_compact.status() == expected.status);
+    REQUIRE(scratch_diagnosed.error_position == expected.error_position);
+    REQUIRE(scratch_diagnosed.error_length == expected.error_length);
+  }
+
+  // Failures cost no allocation until they are diagnosed.
+  MathParser::Program program = MathParser::compile("1 / ((1x) - 1) + sin(1x) * cos(1x)");
+  size_t allocations = allocation_count.load();
+  size_t failed = 0;
+  for (int i = 0; i < 100; ++i) {
+    failed += !program.evaluate_compact(1.0).ok();
+  }
+  size_t compact_allocations = allocation_count.load() - allocations;
+  REQUIRE(compact_allocations == 0);
+  REQUIRE(failed == 100);
+  MathParser::Result diagnosed = program.diagnose(program.evaluate_compact(1.0));
+  REQUIRE(diagnosed.evaluation_error == MathParser::EvaluationErrorType::DIVIDE_BY_ZERO);
+  REQUIRE(diagnosed.error_position == program.evaluate(1.0).error_position);
+  REQUIRE(diagnosed.filtered_expression == "1 / ((1x) - 1) + sin(1x) * cos(1x)");
+}
+
+TEST_CASE("MathParser ExpressionCache", "evaluate_expression") {
+  MathParser::ExpressionCache cache(64, 4);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (const MathParserTestCase &test_case : test_cases()) {
+      MathParser::Result expected = MathParser::evaluate_expression(test_case.expression, test_case.config, test_case.current);
+      MathParser::Result result = cache.evaluate_expression(test_case.expression, test_case.config, test_case.current);
+      REQUIRE(result.status == expected.status);
+      REQUIRE(result.parsing_error == expected.parsing_error);
+      REQUIRE(result.evaluation_error == expected.evaluation_error);
+      REQUIRE(result.error_position == expected.error_position);
+      REQUIRE(result.error_length == expected.error_length);
+      REQUIRE(result.filtered_expression == expected.filtered_expression);
+      if (expected.status == MathParser::Status::SUCCESS) {
+        REQUIRE(result.result == expected.result);
+      }
+    }
+  }
+  MathParser::ExpressionCache::Stats stats = cache.stats();
+  REQUIRE(stats.hits + stats.misses == test_cases().size() * 2);
+  REQUIRE(stats.evictions > 0);
+  REQUIRE(stats.size <= 64);
+
+  // Normalized text and units form the key.
+  cache.clear();
+  cache.evaluate_expression("(2X)  +  1", 3.0);
+  cache.evaluate_expression("(2x) +\t1", 4.0);
+  cache.evaluate_expression("(2x) + 1", 4.0, MathParser::Config(false));
+  cache.evaluate_expression("COS 180");
+  cache.evaluate_expression("cos 180");
+  MathParser::ExpressionCache::Stats after = cache.stats();
+  REQUIRE(after.misses - stats.misses == 3);
+  REQUIRE(after.hits - stats.hits == 2);
+  REQUIRE(after.constant_hits - stats.constant_hits == 1);
+  REQUIRE(cache.compile("(2x) + 1")->evaluate(4.0).result == 9.0);
+
+  // Folded and unfolded programs are cached apart.
+  std::shared_ptr<const MathParser::Program> folded = cache.compile("2 * 3 + 1x", MathParser::Config(true, true));
+  std::shared_ptr<const MathParser::Program> unfolded = cache.compile("2 * 3 + 1x", MathParser::Config(true, false));
+  REQUIRE(folded != unfolded);
+  REQUIRE(folded->instructions().size() < unfolded->instructions().size());
+
+  // Concurrent readers and writers.
+  std::vector<std::thread> threads;
+  std::atomic<size_t> mismatches(0);
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&cache, &mismatches, t] {
+      for (int i = 0; i < 2000; ++i) {
+        std::string expression = "(" + std::to_string((i * 7 + t) % 100) + "x) + sin " + std::to_string(i % 13);
+        double current = i % 17;
+        MathParser::Result expected = MathParser::evaluate_expression(expression, current);
+        MathParser::Result result = cache.evaluate_expression(expression, current);
+        if (result.status != MathParser::Status::SUCCESS || result.result != expected.result) ++mismatches;
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(mismatches.load() == 0);
+}
+
+TEST_CASE("MathParser optimize", "compile") {
+  std::vector<std::string> expressions = { "2 * pi / 360 * 3x", "cos(180) + 3x", "+-+-1++--++--++--+2-3+4", "-(-(-(-(3x))))", "1 / 0 + 2x", "(2x) ^ (1 / 2)", "-+-+(5%)" };
+  for (const MathParserTestCase &test_case : test_cases()) {
+    expressions.push_back(test_case.expression);
+  }
+
+  for (const std::string &expression : expressions) {
+    for (bool use_degrees : { true, false }) {
+      MathParser::Program plain = MathParser::compile(expression, MathParser::Config(use_degrees, false));
+      MathParser::Program optimized = MathParser::compile(expression, MathParser::Config(use_degrees, true));
+      REQUIRE(optimized.instructions().size() <= plain.instructions().size());
+      REQUIRE(optimized.max_stack_depth() <= plain.max_stack_depth());
+      for (double current : { std::numeric_limits<double>::quiet_NaN(), 0.0, 2.5, -7.0 }) {
+        MathParser::Result expected = plain.evaluate(current);
+        MathParser::Result result = optimized.evaluate(current);
+        REQUIRE(result.status == expected.status);
+        REQUIRE(result.evaluation_error == expected.evaluation_error);
+        REQUIRE(result.error_position == expected.error_position);
+        REQUIRE(result.error_length == expected.error_length);
+        if (expected.status == MathParser::Status::SUCCESS) {
+          REQUIRE(std::memcmp(&result.result, &expected.result, sizeof(double)) == 0);
+        }
+      }
+    }
+  }
+
+  // Constant subtrees collapse to a single literal.
+  REQUIRE(MathParser::compile("2 * pi / 360 * 3x").instructions().size() == 4);
+  REQUIRE(MathParser::compile("+-+-1++--++--++--+2-3+4").instructions().size() == 1);
+  REQUIRE(MathParser::compile("-(-(-(-(3x))))").instructions().size() == 2);
+  REQUIRE(MathParser::compile("-(-(-(3x)))").instructions().size() == 3);
+
+  // Failing constant subtrees are kept so the error is still reported where it happens.
+  MathParser::Result divide_by_zero = MathParser::compile("1 / 0 + 2x").evaluate(1.0);
+  REQUIRE(divide_by_zero.evaluation_error == MathParser::EvaluationErrorType::DIVIDE_BY_ZERO);
+}
+
+TEST_CASE("MathParser StreamEvaluator", "evaluate_expression") {
+  // One expression per line, with CRLF and LF endings, an empty line, a line longer than the window and no final newline.
+  std::vector<std::string> lines;
+  for (const MathParserTestCase &test_case : test_cases()) {
+    if (test_case.expression.find_first_of("\r\n") == std::string::npos) {
+      lines.push_back(test_case.expression);
+    }
+  }
+  lines.push_back("");
+  lines.push_back("1" + std::string(3000, ' ') + "+ 1");
+  lines.push_back("sin(90)");
+
+  std::string input, expected;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    input += lines[i];
+    if (i + 1 < lines.size()) input += i % 3 == 0 ? "\r\n" : "\n";
+    MathParser::format_result(MathParser::evaluate_expression(lines[i]), lines[i].data(), lines[i].size(), expected, 17);
+    expected += "\n";
+  }
+
+  MathParser::StdThreadPool pool(3);
+  MathParser::StreamOptions options;
+  options.chunk_size = 64;
+  options.window_size = 1024;
+
+  // From memory, with and without a pool.
+  for (MathParser::ThreadPool *thread_pool : { static_cast<MathParser::ThreadPool *>(&pool), static_cast<MathParser::ThreadPool *>(nullptr) }) {
+    MathParser::StreamEvaluator evaluator(thread_pool, options);
+    std::string out;
+    evaluator.evaluate(input.data(), input.size(), out);
+    REQUIRE(out == expected);
+    REQUIRE(evaluator.stats().lines == lines.size());
+    REQUIRE(evaluator.stats().bytes == input.size());
+  }
+
+  // Reads the whole of file back.
+  auto read_all = [](std::FILE *file) {
+    std::string contents;
+    std::rewind(file);
+    char buffer[4096];
+    for (size_t read; (read = std::fread(buffer, 1, sizeof(buffer), file)) > 0; ) contents.append(buffer, read);
+    return contents;
+  };
+
+  // From a stream, in window sized blocks.
+  std::FILE *in = std::tmpfile();
+  std::FILE *out = std::tmpfile();
+  REQUIRE((in && out));
+  std::fwrite(input.data(), 1, input.size(), in);
+  std::rewind(in);
+  MathParser::StreamEvaluator stream_evaluator(&pool, options);
+  REQUIRE(stream_evaluator.evaluate_stream(in, out));
+  REQUIRE(read_all(out) == expected);
+  std::fclose(in);
+  std::fclose(out);
+
+  // From a memory mapped file.
+  const char *path = "math_parser_stream_test.txt";
+  std::FILE *file = std::fopen(path, "wb");
+  REQUIRE(file);
+  std::fwrite(input.data(), 1, input.size(), file);
+  std::fclose(file);
+  out = std::tmpfile();
+  MathParser::StreamEvaluator file_evaluator(&pool, options);
+  REQUIRE(file_evaluator.evaluate_file(path, out));
+  REQUIRE(read_all(out) == expected);
+  std::fclose(out);
+  std::remove(path);
+  REQUIRE(!file_evaluator.evaluate_file(path, stdout));
+
+  // Error reports quote the span of the line at fault.
+  std::string report;
+  const std::string line = "1 + 2 # 3";
+  MathParser::format_result(MathParser::evaluate_expression(line), line.data(), line.size(), report);
+  REQUIRE(report == "<parsing error: syntax error> at position 6: \"#\"");
+}
+
+static void check_same_result(const MathParser::Result &result, const MathParser::Result &expected) {
+  REQUIRE(result.status == expected.status);
+  REQUIRE(result.parsing_error == expected.parsing_error);
+  REQUIRE(result.evaluation_error == expected.evaluation_error);
+  REQUIRE(result.error_position == expected.error_position);
+  REQUIRE(result.error_length == expected.error_length);
+  REQUIRE(result.filtered_expression == expected.filtered_expression);
+  if (expected.status == MathParser::Status::SUCCESS) {
+    REQUIRE(std::memcmp(&result.result, &expected.result, sizeof(double)) == 0);
+  }
+}
+
+TEST_CASE("MathParser IncrementalExpression", "evaluate_expression") {
+  // Typing each expression of the corpus one character at a time matches evaluating every prefix from scratch.
+  for (const MathParserTestCase &test_case : test_cases()) {
+    MathParser::IncrementalExpression expression("", test_case.config);
+    for (size_t i = 0; i < test_case.expression.size(); ++i) {
+      expression.edit(i, 0, test_case.expression.substr(i, 1));
+      check_same_result(expression.evaluate(test_case.current), MathParser::evaluate_expression(expression.text(), test_case.config, test_case.current));
+    }
+    REQUIRE(expression.text() == test_case.expression);
+  }
+
+  // So do random edits, which join and split numbers, keywords and parens.
+  const char *snippets[] = { "1", "2.5", "e", "e-", "3", "+", "-", "*", "/", "^", "(", ")", "x", "%", " ", "sin", "co", "s", "pi", "0", ".", "ta", "u", "price", "#" };
+  std::mt19937 random(16);
+  MathParser::Config config = variables_config({ "price", "pie" });
+  const double frame[] = { 4.5, -0.25 };
+  MathParser::IncrementalExpression expression("(1 + 2) * sin(30) - price / (2x)", config);
+  for (int step = 0; step < 20000; ++step) {
+    const std::string &text = expression.text();
+    size_t position = random() % (text.size() + 1);
+    size_t length = text.empty() ? 0 : random() % 3;
+    std::string inserted = random() % 4 == 0 ? "" : snippets[random() % (sizeof(snippets) / sizeof(snippets[0]))];
+    if (text.size() > 60) {
+      inserted.clear();
+      length += 4;
+    }
+    expression.edit(position, length, inserted);
+    double current = random() % 8 == 0 ? 3.0 : 2.0;
+    check_same_result(expression.evaluate(frame, current), MathParser::compile(expression.text(), config).evaluate(frame, current));
+    if (step % 16 == 0) {
+      check_same_result(expression.evaluate(current), MathParser::compile(expression.text(), config).evaluate(current));
+    }
+  }
+
+  // Joining a name onto the word before it rescans the name, which no longer starts a word.
+  MathParser::IncrementalExpression joined("sin price", config);
+  check_same_result(joined.evaluate(frame), MathParser::compile(joined.text(), config).evaluate(frame));
+  joined.edit(3, 1, "");
+  REQUIRE(joined.evaluate(frame).parsing_error == MathParser::ParsingErrorType::SYNTAX_ERROR);
+  check_same_result(joined.evaluate(frame), MathParser::compile(joined.text(), config).evaluate(frame));
+
+  // Editing the innermost of deeply nested parens scans a few tokens and runs only the enclosing chain,
+  // leaving the long sum alongside untouched.
+  std::string nested = "1";
+  for (int i = 0; i < 200; ++i) nested += " + cos(2) * 3";
+  nested += " + ";
+  for (int i = 0; i < 50; ++i) nested += "sin(";
+  nested += "10";
+  for (int i = 0; i < 50; ++i) nested += ")";
+  MathParser::IncrementalExpression editor(nested);
+  check_same_result(editor.evaluate(), MathParser::evaluate_expression(nested));
+  MathParser::IncrementalExpression::Stats before = editor.stats();
+  editor.edit(nested.find("10") + 1, 1, "5");
+  check_same_result(editor.evaluate(), MathParser::evaluate_expression(editor.text()));
+  REQUIRE(editor.stats().scanned_tokens - before.scanned_tokens <= 4);
+  REQUIRE(editor.stats().evaluated_nodes - before.evaluated_nodes <= 52);
+
+  // Evaluating again without changes reuses the root.
+  before = editor.stats();
+  check_same_result(editor.evaluate(), MathParser::evaluate_expression(editor.text()));
+  REQUIRE(editor.stats().evaluated_nodes == before.evaluated_nodes);
+
+  // A new current value only re-runs the subtrees reading it.
+  MathParser::IncrementalExpression percent("sin(30) * cos(60) + (5x) - 10%");
+  check_same_result(percent.evaluate(2.0), MathParser::evaluate_expression(percent.text(), 2.0));
+  before = percent.stats();
+  check_same_result(percent.evaluate(4.0), MathParser::evaluate_expression(percent.text(), 4.0));
+  REQUIRE(percent.stats().evaluated_nodes - before.evaluated_nodes == 4);
+
+  // Errors are those of the whole text, and evaluation recovers once they are fixed.
+  percent.edit(0, 3, "sn");
+  check_same_result(percent.evaluate(4.0), MathParser::evaluate_expression(percent.text(), 4.0));
+  REQUIRE(percent.evaluate(4.0).parsing_error == MathParser::ParsingErrorType::SYNTAX_ERROR);
+  percent.edit(1, 0, "i");
+  check_same_result(percent.evaluate(4.0), MathParser::evaluate_expression(percent.text(), 4.0));
+  REQUIRE(percent.evaluate(4.0).status == MathParser::Status::SUCCESS);
+}
+
+TEST_CASE("MathParser FormulaGraph", "evaluate_expression") {
+  MathParser::FormulaGraph graph;
+  REQUIRE(graph.set_value("price", 20.0));
+  REQUIRE(graph.set_value("Qty", 3.0));
+  REQUIRE(graph.set_formula("subtotal", "price * qty"));
+  REQUIRE(graph.set_formula("total", "subtotal + tax")); // Named before it exists.
+  REQUIRE(graph.set_formula("tax", "subtotal * 10 / 100"));
+  REQUIRE(graph.set_formula("label", "2 ^ 3 - 1"));
+  REQUIRE_FALSE(graph.set_value("2x", 1.0));
+  REQUIRE(graph.recalculate() == 4);
+  REQUIRE(graph.value("total") == 66.0);
+  REQUIRE(graph.value("TAX") == 6.0);
+  REQUIRE(graph.result("label").result == 7.0);
+  REQUIRE(graph.result("missing").evaluation_error == MathParser::EvaluationErrorType::EXPECTED_VARIABLE);
+  REQUIRE(graph.recalculate() == 0);
+
+  // Only the cells downstream of a change are evaluated.
+  graph.set_value("qty", 4.0);
+  REQUIRE(graph.recalculate() == 3);
+  REQUIRE(graph.value("total") == 88.0);
+
+  // A formula whose value comes out the same stops the change from spreading.
+  graph.set_formula("tax", "0 * subtotal + 8");
+  REQUIRE(graph.recalculate() == 1);
+  graph.set_value("price", 25.0);
+  REQUIRE(graph.recalculate() == 3);
+  graph.set_value("qty", 4.0);
+  REQUIRE(graph.recalculate() == 0);
+  REQUIRE(graph.value("total") == 108.0);
+
+  // Cycles fail at the reference, and so do the cells reading them, until the cycle is broken.
+  graph.set_formula("tax", "total / 10");
+  graph.recalculate();
+  MathParser::Result cycle = graph.result("tax");
+  REQUIRE(cycle.evaluation_error == MathParser::EvaluationErrorType::CIRCULAR_REFERENCE);
+  REQUIRE(cycle.error_position == 0);
+  REQUIRE(graph.result("total").evaluation_error == MathParser::EvaluationErrorType::CIRCULAR_REFERENCE);
+  graph.set_formula("due", "1 + total");
+  graph.recalculate();
+  REQUIRE(graph.result("due").evaluation_error == MathParser::EvaluationErrorType::EXPECTED_VARIABLE);
+  REQUIRE(graph.result("due").error_position == 4);
+  graph.set_formula("self", "self + 1");
+  graph.recalculate();
+  REQUIRE(graph.result("self").evaluation_error == MathParser::EvaluationErrorType::CIRCULAR_REFERENCE);
+  graph.set_value("tax", 2.0);
+  graph.recalculate();
+  REQUIRE(graph.value("total") == 102.0);
+  REQUIRE(graph.value("due") == 103.0);
+
+  // Errors of a formula are reported as evaluate_expression() would.
+  graph.set_formula("ratio", "subtotal / (price - 25)");
+  graph.set_formula("typo", "2 + pri#ce");
+  graph.recalculate();
+  REQUIRE(graph.result("ratio").evaluation_error == MathParser::EvaluationErrorType::DIVIDE_BY_ZERO);
+  REQUIRE(graph.result("typo").status == MathParser::Status::PARSING_ERROR);
+  REQUIRE(std::isnan(graph.value("ratio")));
+
+  // Editing a formula forgets the names it no longer reads, so the names waiting to be defined stay bounded.
+  REQUIRE(graph.stats().waiting == 2); // pri and ce, from "typo".
+  for (int i = 0; i < 1000; ++i) {
+    graph.set_formula("draft", "later" + std::to_string(i % 10) + " + later + later + subtotal");
+    graph.set_formula("typo", i % 2 ? "later * 2" : "2 + pri#ce");
+  }
+  REQUIRE(graph.stats().waiting == 3); // later9 and later, from "draft", and later, from "typo".
+  graph.set_value("later", 3.0);
+  graph.set_value("draft", 0.0);
+  graph.recalculate();
+  REQUIRE(graph.stats().waiting == 0);
+  REQUIRE(graph.value("typo") == 6.0);
+
+  // Wide levels split across a pool give the same results as the calling thread alone.
+  MathParser::StdThreadPool pool(4);
+  MathParser::ParallelExecutor executor(pool, 1000);
+  MathParser::FormulaGraph serial, parallel(&executor);
+  for (MathParser::FormulaGraph *g : { &serial, &parallel }) {
+    g->set_value("c0", 1.5);
+    for (int i = 1; i < 5000; ++i) {
+      g->set_formula("c" + std::to_string(i), "c" + std::to_string(i / 2) + " * 0.75 + sin(" + std::to_string(i) + ") - c" + std::to_string(i / 3));
+    }
+    REQUIRE(g->recalculate() == 4999);
+    g->set_value("c0", -2.0);
+    REQUIRE(g->recalculate() == 4999);
+  }
+  for (int i = 0; i < 5000; ++i) {
+    const std::string name = "c" + std::to_string(i);
+    double expected = serial.value(name), value = parallel.value(name);
+    REQUIRE(std::memcmp(&value, &expected, sizeof(double)) == 0);
+  }
+}
+
+TEST_CASE("MathParser instrumentation", "evaluate_expression") {
+  MathParser::InstrumentationCounters counters;
+  MathParser::set_instrumentation_hook(&counters);
+  MathParser::Scratch scratch;
+  MathParser::evaluate_expression("1 + 2 * sin(30)", scratch);
+  MathParser::evaluate_expression("(1 + 2", scratch);
+  MathParser::evaluate_expression("1 / (2x)", scratch, 0.0);
+  MathParser::Program program = MathParser::compile("1 *", MathParser::Config(true, false));
+  std::vector<double> in(10, 1.0), out(in.size());
+  MathParser::evaluate_batch(MathParser::compile("(2x) + 1"), in.data(), out.data(), in.size());
+  MathParser::set_instrumentation_hook(nullptr);
+  MathParser::evaluate_expression("1 + 1", scratch);
+  MathParser::InstrumentationStats stats = counters.stats();
+
+#if MATH_PARSER_INSTRUMENT
+  auto calls = [&](MathParser::Stage stage) { return stats.calls[static_cast<size_t>(stage)]; };
+  REQUIRE(stats.compiles == 5);
+  REQUIRE(calls(MathParser::Stage::SCAN) == 5);
+  REQUIRE(calls(MathParser::Stage::PARSE) == 5);
+  REQUIRE(calls(MathParser::Stage::OPTIMIZE) == 3); // Only valid programs compiled with Config::optimize.
+  REQUIRE(calls(MathParser::Stage::EVALUATE) == 3);
+  REQUIRE(calls(MathParser::Stage::BATCH) == 1);
+  REQUIRE(stats.tokens == 8 + 4 + 6 + 2 + 6);
+  REQUIRE(stats.max_stack_depth == 2); // 1 / (2x), since the first expression folds to a literal.
+  REQUIRE(stats.parsing_errors[static_cast<size_t>(MathParser::ParsingErrorType::NONE)] == 3);
+  REQUIRE(stats.parsing_errors[static_cast<size_t>(MathParser::ParsingErrorType::MISMATCHED_PARENS)] == 1);
+  REQUIRE(stats.evaluation_errors[static_cast<size_t>(MathParser::EvaluationErrorType::EXPECTED_MORE_ARGUMENTS)] == 1);
+  REQUIRE(stats.evaluation_errors[static_cast<size_t>(MathParser::EvaluationErrorType::DIVIDE_BY_ZERO)] == 1);
+
+  // Stats from several sources add up.
+  MathParser::InstrumentationStats total = stats;
+  total += stats;
+  REQUIRE(total.compiles == 10);
+  REQUIRE(total.nanoseconds[0] == 2 * stats.nanoseconds[0]);
+  REQUIRE(total.max_stack_depth == 2);
+  counters.reset();
+  REQUIRE(counters.stats().compiles == 0);
+#else
+  // Compiled out: nothing reaches the hook.
+  REQUIRE(stats.compiles == 0);
+  REQUIRE(stats.calls[static_cast<size_t>(MathParser::Stage::EVALUATE)] == 0);
+#endif
+}
+
+TEST_CASE("MathParser ProgramArchive", "compile") {
+  // The corpus, a program reading variables and one deeper than the inline stack.
+  std::vector<MathParser::Program> programs;
+  std::vector<double> currents;
+  for (const MathParserTestCase &test_case : test_cases()) {
+    programs.push_back(MathParser::compile(test_case.expression, test_case.config));
+    currents.push_back(test_case.current);
+  }
+  programs.push_back(MathParser::compile("price * qty * (1 + rate) - (price x)", variables_config({ "price", "qty", "rate" })));
+  currents.push_back(2.0);
+  const size_t variables = programs.size() - 1;
+  std::string deep = "1";
+  for (int i = 0; i < 100; ++i) deep = "1-(" + deep + ")";
+  programs.push_back(MathParser::compile(deep, MathParser::Config(true, false)));
+  currents.push_back(NAN);
+  REQUIRE(programs.back().max_stack_depth() > static_cast<size_t>(MathParser::Program::INLINE_STACK_DEPTH));
+
+  MathParser::ProgramArchiveWriter writer;
+  for (const MathParser::Program &program : programs) REQUIRE(writer.add(program));
+  const std::string encoded = writer.data();
+  std::vector<uint64_t> aligned((encoded.size() + 7) / 8);
+  std::memcpy(aligned.data(), encoded.data(), encoded.size());
+
+  // Archived programs evaluate exactly as the programs they were written from, errors included, as do their copies.
+  const double frame[] = { 12.5, 4.0, 0.2 };
+  auto check_archive = [&](const MathParser::ProgramArchive &archive) {
+    REQUIRE(archive.size() == programs.size());
+    for (size_t i = 0; i < programs.size(); ++i) {
+      const MathParser::ArchivedProgram archived = archive[i];
+      const double *vars = i == variables ? frame : nullptr;
+      REQUIRE(archived.is_valid() == programs[i].is_valid());
+      check_same_result(archived.evaluate(vars, currents[i]), programs[i].evaluate(vars, currents[i]));
+      check_same_result(archived.to_program().evaluate(vars, currents[i]), programs[i].evaluate(vars, currents[i]));
+      check_same_result(archived.to_program().compile_result(), programs[i].compile_result());
+    }
+  };
+  MathParser::ProgramArchive archive;
+  REQUIRE(archive.load(aligned.data(), encoded.size()));
+  check_archive(archive);
+  const MathParser::ArchivedProgram archived = archive[variables];
+  REQUIRE(archived.variable_count() == 3);
+  REQUIRE(archived.variable_name(1) == "qty");
+  REQUIRE(archived.evaluate(nullptr, 2.0).evaluation_error == MathParser::EvaluationErrorType::EXPECTED_VARIABLE);
+  REQUIRE(archived.to_program().config().variables == programs[variables].config().variables);
+
+  // Evaluating in place does not allocate.
+  size_t allocations = allocation_count.load();
+  for (size_t i = 0; i < variables; ++i) archive[i].evaluate_compact(nullptr, currents[i]);
+  const size_t archive_allocations = allocation_count.load() - allocations;
+  REQUIRE(archive_allocations == 0);
+
+  // Through a file.
+  const char *path = "math_parser_archive_test.bin";
+  REQUIRE(writer.write(path));
+  MathParser::ProgramArchive mapped;
+  REQUIRE(mapped.open(path));
+  check_archive(mapped);
+  MathParser::ProgramArchive moved(std::move(mapped));
+  REQUIRE(mapped.size() == 0);
+  check_archive(moved);
+  std::remove(path);
+  REQUIRE(!mapped.open(path));
+
+  // Truncated, misaligned or of another version.
+  for (size_t size = 0; size < encoded.size(); size += 7) {
+    REQUIRE(!archive.load(aligned.data(), size));
+  }
+  REQUIRE(!archive.load(reinterpret_cast<const char *>(aligned.data()) + 1, encoded.size() - 1));
+  std::vector<uint64_t> versioned = aligned;
+  reinterpret_cast<uint32_t *>(versioned.data())[2] = MathParser::archive::VERSION + 1;
+  REQUIRE(!archive.load(versioned.data(), encoded.size()));
+
+  // Any corrupted byte of a small archive is rejected, or leaves a program that still evaluates safely.
+  MathParser::ProgramArchiveWriter small;
+  REQUIRE(small.add(programs[variables]));
+  const std::string small_encoded = small.data();
+  std::vector<uint64_t> corrupted((small_encoded.size() + 7) / 8);
+  size_t rejected = 0;
+  for (size_t i = 0; i < small_encoded.size(); ++i) {
+    std::memcpy(corrupted.data(), small_encoded.data(), small_encoded.size());
+    reinterpret_cast<unsigned char *>(corrupted.data())[i] ^= 0xff;
+    if (!archive.load(corrupted.data(), small_encoded.size())) {
+      ++rejected;
+      continue;
+    }
+    archive[0].evaluate(frame, 2.0);
+    archive[0].evaluate(nullptr, 2.0);
+  }
+  REQUIRE(rejected > small_encoded.size() / 4);
+}
+
+// Errors that depend on the values, which the original evaluator reported as soon as it reached them.
+static bool is_value_error(MathParser::EvaluationErrorType error) {
+  return error == MathParser::EvaluationErrorType::DIVIDE_BY_ZERO
+    || error == MathParser::EvaluationErrorType::EXPECTED_CURRENT_VALUE
+    || error == MathParser::EvaluationErrorType::IMAGINARY_NUMBER;
+}
+
+TEST_CASE("MathParser differential", "evaluate_expression") {
+  // The original evaluator's result, but for the one intended difference: structural errors, found when compiling,
+  // take precedence over value errors the original evaluator met earlier in the expression.
+  size_t structural_first = 0;
+  auto reference = [&](const std::string &expression, const MathParser::Config &config, double current, const MathParser::Program &program) {
+    MathParser::Result expected = MathParserBaseline::evaluate_expression(expression, config, current);
+    if (expected.status == MathParser::Status::EVALUATION_ERROR && is_value_error(expected.evaluation_error) && !program.is_valid()) {
+      expected = program.compile_result();
+      REQUIRE(!is_value_error(expected.evaluation_error));
+      ++structural_first;
+    }
+    return expected;
+  };
+
+  // Every evaluation path agrees with it on generated expressions, well formed or not.
+  ExpressionGenerator generator(2024);
+  MathParser::Scratch scratch;
+  const size_t count = 20000;
+  size_t valid = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const std::string expression = generator.next();
+    const double current = generator.next_current_value();
+    const MathParser::Config config(i % 2 == 0);
+    INFO(expression);
+    const MathParser::Program program = MathParser::compile(expression, config);
+    const MathParser::Result expected = reference(expression, config, current, program);
+    if (expected.status == MathParser::Status::SUCCESS) ++valid;
+
+    check_same_result(MathParser::evaluate_expression(expression, config, current), expected);
+    check_same_result(program.evaluate(current), expected);
+    check_same_result(MathParser::compile(expression, MathParser::Config(config.use_degrees, false)).evaluate(current), expected);
+
+    MathParser::Result unfiltered = expected;
+    unfiltered.filtered_expression.clear();
+    check_same_result(MathParser::evaluate_expression(expression, scratch, current, config), unfiltered);
+
+    const MathParser::CompactResult compact = MathParser::evaluate_compact(expression, scratch, current, config);
+    REQUIRE(compact.status() == expected.status);
+    REQUIRE(compact.parsing_error() == expected.parsing_error);
+    REQUIRE(compact.evaluation_error() == expected.evaluation_error);
+    if (expected.status == MathParser::Status::SUCCESS) {
+      REQUIRE(std::memcmp(&compact.value, &expected.result, sizeof(double)) == 0);
+    }
+
+    double out = 0.0;
+    MathParser::EvaluationErrorType error = MathParser::EvaluationErrorType::NONE;
+    MathParser::evaluate_batch_interpreted(program, &current, &out, 1, &error);
+    if (expected.status == MathParser::Status::SUCCESS) {
+      REQUIRE(error == MathParser::EvaluationErrorType::NONE);
+      REQUIRE(std::memcmp(&out, &expected.result, sizeof(double)) == 0);
+    } else {
+      REQUIRE(std::isnan(out));
+      if (expected.status == MathParser::Status::EVALUATION_ERROR) REQUIRE(error == expected.evaluation_error);
+    }
+  }
+
+  // Both well formed expressions and errors are well represented, and the difference stays the exception.
+  REQUIRE(valid > count / 4);
+  REQUIRE(valid < count - count / 10);
+  REQUIRE(structural_first < count / 20);
+
+  // Strings of raw characters, mostly outside the grammar, report the same error spans.
+  const std::string alphabet = "0123456789.e+-*/^%()x sincostanpi,S#";
+  std::mt19937 random(2025);
+  for (size_t i = 0; i < count; ++i) {
+    std::string expression;
+    for (size_t j = random() % 12; j > 0; --j) expression += alphabet[random() % alphabet.size()];
+    INFO(expression);
+    check_same_result(MathParser::evaluate_expression(expression, 2.0), reference(expression, { }, 2.0, MathParser::compile(expression)));
+  }
+}
+
+TEST_CASE("MathParser scanner", "compile") {
+  // Filtering a block at a time matches filtering byte by byte, across block boundaries and long runs.
+  const std::string alphabet = "0123456789.e+-*/^%()xXsinCOSTanpi \t\n\r\v\f#,_\xc3";
+  std::mt19937 random(11);
+  for (int i = 0; i < 5000; ++i) {
+    std::string expression;
+    const size_t length = random() % 300;
+    for (size_t j = 0; j < length; ++j) {
+      const char c = alphabet[random() % alphabet.size()];
+      expression.append(random() % 8 == 0 ? random() % 70 : 1, c);
+    }
+
+    std::string expected;
+    size_t expected_invalid = std::string::npos;
+    for (size_t j = 0; j < expression.size(); ++j) {
+      const char c = expression[j];
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        if (j == 0 || !std::isspace(static_cast<unsigned char>(expression[j - 1]))) expected.push_back(' ');
+        continue;
+      }
+      if (expected_invalid == std::string::npos && (c == '#' || c == '\xc3')) expected_invalid = expected.size();
+      expected.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(c))));
+    }
+
+    std::string normalized;
+    MathParser::normalize_expression(expression, normalized);
+    REQUIRE(normalized == expected);
+
+    const MathParser::Result result = MathParser::compile(expression).compile_result();
+    if (expected_invalid != std::string::npos) {
+      REQUIRE(result.parsing_error == MathParser::ParsingErrorType::SYNTAX_ERROR);
+      REQUIRE(result.error_position <= expected_invalid);
+      REQUIRE(MathParser::validate(expression).parsing_error() == MathParser::ParsingErrorType::SYNTAX_ERROR);
+    }
+  }
+}
+
+TEST_CASE("MathParser validate", "compile") {
+  auto check = [](const std::string &expression, const MathParser::Config &config) {
+    const MathParser::Result expected = MathParser::compile(expression, config).compile_result();
+    const MathParser::CompactResult result = MathParser::validate(expression, config);
+    INFO(expression);
+    REQUIRE(result.status() == expected.status);
+    REQUIRE(result.parsing_error() == expected.parsing_error);
+    REQUIRE(result.evaluation_error() == expected.evaluation_error);
+  };
+
+  for (const MathParserTestCase &test_case : test_cases()) {
+    check(test_case.expression, test_case.config);
+  }
+  ExpressionGenerator generator(7);
+  for (int i = 0; i < 20000; ++i) {
+    check(generator.next(), { });
+  }
+
+  // Parens nesting past the inline operator stack, balanced or not.
+  const std::string deep = std::string(300, '(') + "1" + std::string(300, ')');
+  check(deep, { });
+  check(deep + ")", { });
+  check("(" + deep, { });
+
+  // Syntax errors anywhere win over paren and arity errors earlier in the expression, as in compile().
+  REQUIRE(MathParser::validate(") + #").parsing_error() == MathParser::ParsingErrorType::SYNTAX_ERROR);
+  REQUIRE(MathParser::validate("* 1 #").parsing_error() == MathParser::ParsingErrorType::SYNTAX_ERROR);
+  REQUIRE(MathParser::validate(")").parsing_error() == MathParser::ParsingErrorType::MISMATCHED_PARENS);
+  REQUIRE(MathParser::validate("1 +").evaluation_error() == MathParser::EvaluationErrorType::EXPECTED_MORE_ARGUMENTS);
+  REQUIRE(MathParser::validate("  ").parsing_error() == MathParser::ParsingErrorType::EMPTY);
+  REQUIRE(MathParser::validate("1 / 0").ok());
+}
+
+TEST_CASE("MathParser concurrent evaluation", "evaluate_expression") {
+  // Expected results are computed on one thread, then every thread must reproduce them exactly.
+  const std::vector<MathParserTestCase> &corpus = test_cases();
+  std::vector<MathParser::Result> expected;
+  std::vector<MathParser::Program> programs;
+  for (const MathParserTestCase &test_case : corpus) {
+    expected.push_back(MathParser::evaluate_expression(test_case.expression, test_case.config, test_case.current));
+    programs.push_back(MathParser::compile(test_case.expression, test_case.config));
+  }
+
+  auto same = [](const MathParser::Result &a, const MathParser::Result &b) {
+    return a.status == b.status
+      && a.parsing_error == b.parsing_error
+      && a.evaluation_error == b.evaluation_error
+      && a.error_position == b.error_position
+      && a.error_length == b.error_length
+      && (a.status != MathParser::Status::SUCCESS || std::memcmp(&a.result, &b.result, sizeof(double)) == 0);
+  };
+
+  // Catch assertions are not thread safe, so threads only count mismatches.
+  MathParser::ExpressionCache cache(256, 8);
+  std::atomic<size_t> mismatches(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 64; ++t) {
+    threads.emplace_back([&, t] {
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+      MathParser::Scratch scratch;
+      for (int pass = 0; pass < 4; ++pass) {
+        // Each thread starts at a different offset so all of them hit different expressions at once.
+        for (size_t n = 0; n < corpus.size(); ++n) {
+          size_t i = (n + t * 17) % corpus.size();
+          const MathParserTestCase &test_case = corpus[i];
+          size_t failures = 0;
+          switch ((pass + t) % 4) {
+            case 0: failures += !same(MathParser::evaluate_expression(test_case.expression, test_case.config, test_case.current), expected[i]); break;
+            case 1: failures += !same(MathParser::evaluate_expression(test_case.expression, scratch, test_case.current, test_case.config), expected[i]); break;
+            case 2: failures += !same(programs[i].evaluate(test_case.current), expected[i]); break;
+            case 3: failures += !same(cache.evaluate_expression(test_case.expression, test_case.config, test_case.current), expected[i]); break;
+          }
+          if (failures) mismatches += failures;
+        }
+      }
+    });
+  }
+  go = true;
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(mismatches.load() == 0);
+}
+
+TEST_CASE("MathParser AsyncEvaluator", "evaluate_expression") {
+  MathParser::StdThreadPool pool(4);
+  const std::vector<const char *> expressions = { "(2x) + 50%", "sin(x) * cos(x)", "1 / x", "sqrt(", "(x)%" };
+  {
+    // Requests for the same program share batches, and completes like evaluate_expression().
+    MathParser::AsyncOptions options;
+    options.max_batch = 64;
+    options.max_delay = std::chrono::hours(1);
+    MathParser::AsyncEvaluator evaluator(&pool, options);
+    std::vector<std::future<MathParser::Result>> futures;
+    std::vector<double> currents;
+    for (int i = 0; i < 2000; ++i) {
+      double current = i % 3 == 0 ? std::numeric_limits<double>::quiet_NaN() : static_cast<double>(i % 11) - 5.0;
+      futures.push_back(evaluator.submit(expressions[i % expressions.size()], current));
+      currents.push_back(current);
+    }
+    evaluator.flush();
+    for (size_t i = 0; i < futures.size(); ++i) {
+      check_same_result(futures[i].get(), MathParser::evaluate_expression(expressions[i % expressions.size()], currents[i]));
+    }
+    MathParser::AsyncEvaluator::Stats stats = evaluator.stats();
+    REQUIRE(stats.requests == 2000);
+    REQUIRE(stats.full_flushes > 0);
+    REQUIRE(stats.batches == stats.full_flushes + stats.deadline_flushes);
+    REQUIRE(stats.batches < 2000);
+  }
+  {
+    // A lone request is flushed by its deadline.
+    MathParser::AsyncOptions options;
+    options.max_delay = std::chrono::microseconds(50);
+    MathParser::AsyncEvaluator evaluator(&pool, options);
+    REQUIRE(evaluator.submit("2 * 3").get().result == 6.0);
+    REQUIRE(evaluator.stats().deadline_flushes == 1);
+  }
+  {
+    // The destructor completes every pending request.
+    MathParser::AsyncOptions options;
+    options.max_delay = std::chrono::hours(1);
+    std::atomic<size_t> completed(0);
+    {
+      MathParser::AsyncEvaluator evaluator(nullptr, options);
+      for (int i = 0; i < 100; ++i) {
+        evaluator.submit(expressions[i % 3], i, [&](MathParser::Result) { ++completed; });
+      }
+    }
+    REQUIRE(completed.load() == 100);
+  }
+}
+
+// Compares a static expression with the runtime parser for the same source and options.
+template<typename Expression>
+static void check_static_expression(Expression expression, const char *source, MathParser::Config config = { }) {
+  for (double current : { std::numeric_limits<double>::quiet_NaN(), 0.0, 2.5, -7.0, 90.0 }) {
+    MathParser::Result expected = MathParser::evaluate_expression(source, current, config);
+    double result = expression(current);
+    INFO(source << " with x = " << current);
+    if (expected.status == MathParser::Status::SUCCESS) {
+      REQUIRE(std::memcmp(&result, &expected.result, sizeof(double)) == 0);
+    } else {
+      REQUIRE(std::isnan(result));
+    }
+  }
+}
+
+#define CHECK_STATIC_EXPRESSION(source) check_static_expression(MATH_PARSER_STATIC_EXPR(source), source)
+
+TEST_CASE("MathParser static expressions", "static_expr") {
+  CHECK_STATIC_EXPRESSION("2 * pi x");
+  CHECK_STATIC_EXPRESSION("(1.5x) + (20%) - 3");
+  CHECK_STATIC_EXPRESSION("1 + 2 * 3 - 4 / 5 ^ 2 ^ .5");
+  CHECK_STATIC_EXPRESSION("-+-(2 - -3) * +4");
+  CHECK_STATIC_EXPRESSION("sin 30 + cos(60) * tan(45 x) - sec 10 + csc(20) * cot 70");
+  CHECK_STATIC_EXPRESSION("E ^ (2 * tau / (1x))");
+  CHECK_STATIC_EXPRESSION("(-8) ^ (1 / 3)");
+  CHECK_STATIC_EXPRESSION("1 / (0x)");
+  CHECK_STATIC_EXPRESSION("(1 / 0) ^ 0");
+  CHECK_STATIC_EXPRESSION("3.141592653589793 * .5e2 - 1E-3");
+  check_static_expression(MATH_PARSER_STATIC_EXPR_WITH("sin(pi / 6) + cos(2x)", MathParser::STATIC_RADIANS), "sin(pi / 6) + cos(2x)", MathParser::Config(false));
+
+  // Without x, %, ^ or runtime trig the value is a constant expression.
+  constexpr auto radians_per_degree = MATH_PARSER_STATIC_EXPR("tau / 360");
+  static_assert(radians_per_degree() == common::math::tau<double>() / 360, "folded at compile time");
+  static_assert(!radians_per_degree.uses_current_value, "no current value");
+  static_assert(MATH_PARSER_STATIC_EXPR("(2x) + 1").uses_current_value, "uses current value");
+  constexpr double half = MATH_PARSER_STATIC_EXPR_WITH("sin 30", MathParser::STATIC_CONSTEXPR_TRIG)();
+  static_assert(half > 0.4999999999999999 && half < 0.5000000000000001, "constexpr trig");
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+  REQUIRE(MathParser::static_expr<"2 * pi x">(3.0) == MathParser::evaluate_expression("2 * pi x", 3.0).result);
+#endif
+
+  // Degrees convert through double precision.
+  REQUIRE(common::math::degrees_to_radians<double>() == common::math::pi<double>() / 180.0);
+
+  // constexpr trig stays within its documented bounds of the C library.
+  auto ulps = [](double a, double b) {
+    int64_t i = 0, j = 0;
+    std::memcpy(&i, &a, sizeof(double));
+    std::memcpy(&j, &b, sizeof(double));
+    i = i < 0 ? INT64_MIN - i : i;
+    j = j < 0 ? INT64_MIN - j : j;
+    return i > j ? i - j : j - i;
+  };
+  std::mt19937_64 random(20);
+  std::uniform_real_distribution<double> angles(-1048576.0, 1048576.0);
+  int64_t sin_ulps = 0, cos_ulps = 0, tan_ulps = 0;
+  for (int i = 0; i < 100000; ++i) {
+    double angle = i % 2 ? angles(random) : (i - 50000) * common::math::degrees_to_radians<double>();
+    sin_ulps = std::max(sin_ulps, ulps(common::math::sin(angle), std::sin(angle)));
+    cos_ulps = std::max(cos_ulps, ulps(common::math::cos(angle), std::cos(angle)));
+    tan_ulps = std::max(tan_ulps, ulps(common::math::tan(angle), std::tan(angle)));
+  }
+  REQUIRE(sin_ulps <= 2);
+  REQUIRE(cos_ulps <= 2);
+  REQUIRE(tan_ulps <= 4);
+
+  // Arguments past the supported range give NaN rather than overflowing the reduction, also at compile time.
+  constexpr double huge = common::math::sin(1e300);
+  static_assert(huge != huge, "NaN past the range");
+  REQUIRE(std::isnan(common::math::cos(-1e19)));
+  REQUIRE(std::isnan(common::math::tan(std::numeric_limits<double>::infinity())));
+  REQUIRE(std::isfinite(common::math::sin(4503599627370496.0)));
+  REQUIRE(std::isnan(common::math::sin(4503599627370498.0)));
 }
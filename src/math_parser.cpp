@@ -0,0 +1,81 @@
+// Command line evaluator for newline delimited expressions.
+// Usage: math_parser [--radians] [--threads=N] [--precision=N] [--stats] [file ...]
+// Evaluates every line of each file, or of stdin if no file or "-" is given, and writes one result per line to stdout.
+
+#include "MathParser.h"
+#include "MathParserExecutor.h"
+#include "MathParserStream.h"
+
+#include <algorithm> // std::max
+#include <cerrno>
+#include <chrono>
+#include <cstdio>  // std::fprintf, std::setvbuf
+#include <cstdlib> // std::atoi
+#include <cstring> // std::strcmp, std::strerror, std::strncmp
+#include <memory>
+#include <thread>
+#include <vector>
+
+static void print_usage() {
+  std::fprintf(stderr, "usage: math_parser [--radians] [--threads=N] [--precision=N] [--stats] [file ...]\n");
+}
+
+int main(int argc, char *argv[]) {
+  MathParser::StreamOptions options;
+  size_t threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  bool print_stats = false;
+  std::vector<const char *> paths;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--radians") == 0) {
+      options.config.use_degrees = false;
+    } else if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = static_cast<size_t>(std::max(1, std::atoi(argv[i] + 10)));
+    } else if (std::strncmp(argv[i], "--precision=", 12) == 0) {
+      options.precision = std::atoi(argv[i] + 12);
+    } else if (std::strcmp(argv[i], "--stats") == 0) {
+      print_stats = true;
+    } else if (std::strcmp(argv[i], "-") != 0 && argv[i][0] == '-') {
+      print_usage();
+      return 2;
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.empty()) {
+    paths.push_back("-");
+  }
+
+  // The calling thread evaluates alongside the pool.
+  std::unique_ptr<MathParser::StdThreadPool> pool;
+  if (threads > 1) {
+    pool.reset(new MathParser::StdThreadPool(threads - 1));
+  }
+  MathParser::StreamEvaluator evaluator(pool.get(), options);
+
+  // Reports are written a window at a time, so a large buffer keeps writes few and large.
+  static char output_buffer[1 << 20];
+  std::setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int status = 0;
+  for (const char *path : paths) {
+    if (!evaluator.evaluate_file(path, stdout)) {
+      std::fprintf(stderr, "math_parser: %s: %s\n", path, std::strerror(errno));
+      status = 1;
+      break;
+    }
+  }
+  if (std::fflush(stdout) != 0) {
+    std::fprintf(stderr, "math_parser: <stdout>: %s\n", std::strerror(errno));
+    status = 1;
+  }
+
+  if (print_stats) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const MathParser::StreamEvaluator::Stats &stats = evaluator.stats();
+    std::fprintf(stderr, "%zu lines, %zu failed, %.1f MB in %.3f s (%.1f MB/s, %.1f ns/line)\n",
+                 stats.lines, stats.failed, stats.bytes / (1024.0 * 1024.0), seconds,
+                 stats.bytes / (1024.0 * 1024.0) / seconds, seconds * 1e9 / std::max<size_t>(stats.lines, 1));
+  }
+  return status;
+}